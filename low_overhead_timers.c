@@ -167,7 +167,7 @@ unsigned long corrected_pmc_delta(unsigned long end, unsigned long start, int pm
 			result = end - start;
 		} else {
 			// I think this works independent of ordering, but this makes the most intuitive sense
-			result = (end + 1UL<<pmc_width) - start;
+			result = (end + (1UL<<pmc_width)) - start;
 		}
 		return (result);
 	}
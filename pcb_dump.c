@@ -0,0 +1,67 @@
+// pcb_dump -- print the contents of a binary perf_counters file (see perfcounts_binary.h)
+//
+//   pcb_dump file.pcb                          header, topology summary, and the list of series
+//   pcb_dump file.pcb name [first [count]]     one series over a range of samples, as Lua assignments
+//                                               (scaled the same way as the Lua text output)
+//
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "perfcounts_binary.h"
+
+int main(int argc, char *argv[])
+{
+	struct pcb_file file;
+	const struct pcb_header *header;
+	uint64_t *values;
+	uint64_t total_bytes;
+	long first, count, n, i;
+	int s, b;
+
+	if ((argc < 2) || (argc > 5)) {
+		fprintf(stderr,"Usage: %s file.pcb [series_name [first_sample [num_samples]]]\n",argv[0]);
+		exit(1);
+	}
+	if (pcb_open(&file, argv[1]) != 0) exit(1);
+	header = file.header;
+
+	if (argc == 2) {
+		printf("-- %s: %lu samples of %u series in blocks of %u samples\n",argv[1],header->num_samples,header->num_series,header->block_samples);
+		printf("-- %u sockets, %u logical processors, TSC %lu Hz, temp_target %d\n",header->num_sockets,header->num_lprocs,header->tsc_hz,header->temp_target);
+		printf("RAPL_POWER_UNIT = %.9f\n",header->power_unit);
+		printf("RAPL_PKG_ENERGY_UNIT = %.12e\n",header->pkg_energy_unit);
+		printf("RAPL_DRAM_ENERGY_UNIT = %.12e\n",header->dram_energy_unit);
+		printf("RAPL_TIME_UNIT = %.9f\n",header->time_unit);
+		printf("PACKAGE_TDP = %.6f\n",header->package_tdp);
+		for (s=0; s<(int)header->num_series; s++) {
+			total_bytes = 0;
+			for (b=0; b<(int)header->num_blocks; b++) total_bytes += file.index[(size_t)s*header->num_blocks + b].bytes;
+			printf("-- series %d %s scale %u width %u, %lu bytes\n",s,pcb_series_name(&file,s),
+				file.series[s].scale,file.series[s].width,total_bytes);
+		}
+		pcb_close(&file);
+		exit(0);
+	}
+
+	s = pcb_find_series(&file, argv[2]);
+	if (s < 0) {
+		fprintf(stderr,"ERROR: series %s is not in %s\n",argv[2],argv[1]);
+		exit(1);
+	}
+	first = (argc > 3) ? atol(argv[3]) : 0;
+	count = (argc > 4) ? atol(argv[4]) : (long)header->num_samples;
+	if (count > (long)header->num_samples) count = header->num_samples;
+	values = malloc((count > 0 ? count : 1) * sizeof(uint64_t));
+	if (values == NULL) {
+		fprintf(stderr,"ERROR: unable to allocate %ld values\n",count);
+		exit(1);
+	}
+	n = pcb_read_series(&file, s, first, count, values);
+	for (i=0; i<n; i++) {
+		printf("%s[%ld] = %lu\n",argv[2],first+i,values[i]*file.series[s].scale);
+	}
+	free(values);
+	pcb_close(&file);
+	return (0);
+}
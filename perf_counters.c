@@ -3,6 +3,7 @@
 static char const rcsid[] = "$Id: perf_counters.c,v 1.33 2018/05/02 17:29:20 mccalpin Exp mccalpin $";
 
 // include files
+#define _GNU_SOURCE						// for CPU_SET() and pthread_setaffinity_np()
 #include <stdio.h>				// printf, etc
 #include <stdint.h>				// standard integer types, e.g., uint32_t
 #include <signal.h>				// for signal handler
@@ -16,12 +17,27 @@ static char const rcsid[] = "$Id: perf_counters.c,v 1.33 2018/05/02 17:29:20 mcc
 #include <math.h>				// for pow() function used in RAPL computations
 #include <time.h>
 #include <sys/time.h>			// for gettimeofday
+#include <pthread.h>			// per-socket reader threads
+#include <sched.h>				// cpu_set_t for pinning threads
+#include <sys/ioctl.h>			// perf_event group enable
+#include <sys/syscall.h>		// perf_event_open() has no glibc wrapper
+#include <linux/perf_event.h>	// perf_event backend
+#include <semaphore.h>			// streaming results writer wakeup
+#include <stdarg.h>				// text output item names
+#include <sys/stat.h>			// mkdir() for the NumPy output directory
 
 #include "MSR_defs.h"		// Performance-Related MSR names for Xeon E5 v3
 #include "low_overhead_timers.h"
+#include "perfcounts_binary.h"	// compact binary output format ("-b" option)
+#include "perfcounts_store.h"	// crash-safe store file ("-M" option)
+#include "perfcounts_metrics.h"	// online derived metrics ("-e" option)
+#include "perfcounts_stats.h"	// streaming statistics ("-s" option)
+#include "perfcounts_phases.h"	// phase detection ("-P" option)
+#include "perfcounts_shm.h"		// live shared-memory segment ("-L" option)
 
 // constant value defines
-# define MAX_SAMPLES 10000			// 10,000 is enough for 1-second sampling for almost 3 hours.
+# define STORE_CHUNK_SAMPLES 1024	// the sample store grows by this many samples at a time -- there is no fixed limit
+# define STORE_PACKED_CHUNK_SAMPLES 256		// chunk size when the full chunks are packed ("-Z" option)
 # define NUM_SOCKETS 2				// 
 # define NUM_IMC_CHANNELS 6			// includes channels on all IMCs in a socket
 # define NUM_IMC_COUNTERS 5			// 0-3 are the 4 programmable counters, 4 is the fixed-function DCLK counter
@@ -36,8 +52,10 @@ static char const rcsid[] = "$Id: perf_counters.c,v 1.33 2018/05/02 17:29:20 mcc
 
 // Global declarations
 // 		lots of stuff is global here so the function call interfaces are easier
-//		timeline arrays are statically allocated -- fixed limit to the number of samples
-//			quit (call cleanup/analysis/output) after last sample if the code gets that far.
+//		timeline values are kept in the sample store, which is allocated at runtime (see "Sample store" below).
+//			The arrays of ints below hold the column number of each series in the store, indexed the same
+//			way the series are named in the output file, and SAMPLE(column,i) is the value of a series in
+//			sample i.  Only the series of the detected logical processors and the configured events get columns.
 // NOTES ON ORGANIZATION!
 //   The job of this program is not to think -- thinking will be done in post-processing.
 //   The job of this program is to dump everything in a format that does not lose information
@@ -50,42 +68,42 @@ static char const rcsid[] = "$Id: perf_counters.c,v 1.33 2018/05/02 17:29:20 mcc
 //   consistent with the current implementation!!!!
 
 // completed implementations
-uint64_t tsc_start[MAX_SAMPLES];										// TSC measured on local core at beginning of "read_all_counters()" function
-long walltime[2][MAX_SAMPLES];												// seconds and microseconds from gettimeofday()
-uint64_t ubox_uclk[NUM_SOCKETS][MAX_SAMPLES];							// 1 UBox/socket, fixed-function counter increments at Uncore Clock Frequency when not in Package C3 or higher
-uint64_t imc_counts[NUM_SOCKETS][NUM_IMC_CHANNELS][NUM_IMC_COUNTERS][MAX_SAMPLES];	// including the fixed-function (DCLK) counter as the final entry
+int tsc_start;										// TSC measured on local core at beginning of "read_all_counters()" function
+int walltime[2];												// seconds and microseconds from gettimeofday()
+int ubox_uclk[NUM_SOCKETS];							// 1 UBox/socket, fixed-function counter increments at Uncore Clock Frequency when not in Package C3 or higher
+int imc_counts[NUM_SOCKETS][NUM_IMC_CHANNELS][NUM_IMC_COUNTERS];	// including the fixed-function (DCLK) counter as the final entry
 char imc_event_name[NUM_SOCKETS][NUM_IMC_CHANNELS][NUM_IMC_COUNTERS][80];		// reserve 32 characters for the IMC event names for each socket, channel, counter
-uint64_t core_counts[NUM_LPROCS][NUM_CORE_COUNTERS][MAX_SAMPLES];		// New storage/indexing approach.... 
+int core_counts[NUM_LPROCS][NUM_CORE_COUNTERS];		// New storage/indexing approach.... 
 char core_event_name[NUM_LPROCS][NUM_CORE_COUNTERS][80];		// reserve 80 characters for the core event names for each logical processor and counter
-uint64_t core_fixed[NUM_LPROCS][3][MAX_SAMPLES];						// OK to use 3 since all systems have at most 3 fixed-function core counters with fixed names
+int core_fixed[NUM_LPROCS][3];						// OK to use 3 since all systems have at most 3 fixed-function core counters with fixed names
 #if 0
-uint64_t ha_counts[NUM_SOCKETS][NUM_HOME_AGENTS][NUM_HA_COUNTERS][MAX_SAMPLES];		// 2 Home Agents: 4 programmable counters each
+int ha_counts[NUM_SOCKETS][NUM_HOME_AGENTS][NUM_HA_COUNTERS];		// 2 Home Agents: 4 programmable counters each
 char ha_event_name[NUM_SOCKETS][NUM_HOME_AGENTS][NUM_HA_COUNTERS][80];			// reserve 32 characters for the HA event names for each socket, Home Agent, counter
 #endif
 #ifdef INFINIBAND
-uint64_t ib_recv[MAX_SAMPLES],ib_xmit[MAX_SAMPLES];						// only one of these per node for TACC systems
+int ib_recv,ib_xmit;						// only one of these per node for TACC systems
 #endif
-uint64_t pkg_temperature[NUM_SOCKETS][MAX_SAMPLES];			        // Degrees C computed using degrees below PROCHOT
-uint64_t rapl_pkg_energy[NUM_SOCKETS][MAX_SAMPLES];					// Unscaled values -- only low-order 32 bits will be set -- rolls after 2^32-1
-uint64_t rapl_pkg_throttled[NUM_SOCKETS][MAX_SAMPLES];				// Unscaled values -- only low-order 32 bits will be set -- rolls after 2^32-1
-uint64_t rapl_dram_energy[NUM_SOCKETS][MAX_SAMPLES];				// Unscaled values -- only low-order 32 bits will be set -- rolls after 2^32-1
-uint64_t pcu_counts[NUM_SOCKETS][4][MAX_SAMPLES];						// 1 PCU: 4 programmable counters (maybe add residency counters later?)
+int pkg_temperature[NUM_SOCKETS];			        // Degrees C computed using degrees below PROCHOT
+int rapl_pkg_energy[NUM_SOCKETS];					// Unscaled values -- only low-order 32 bits will be set -- rolls after 2^32-1
+int rapl_pkg_throttled[NUM_SOCKETS];				// Unscaled values -- only low-order 32 bits will be set -- rolls after 2^32-1
+int rapl_dram_energy[NUM_SOCKETS];				// Unscaled values -- only low-order 32 bits will be set -- rolls after 2^32-1
+int pcu_counts[NUM_SOCKETS][4];						// 1 PCU: 4 programmable counters (maybe add residency counters later?)
 char pcu_event_name[NUM_SOCKETS][4][80];								// reserve 80 characters for each PCI event name
-uint64_t pkg_therm_status[NUM_SOCKETS][MAX_SAMPLES];					// IA32_PKG_THERM_STATUS (MSR 0x1b1) -- 13 fields packed into lower 22 bits, including temperature
-uint64_t pkg_core_perf_limit_reasons[NUM_SOCKETS][MAX_SAMPLES];			// MSR_CORE_PERF_LIMIT_REASONS (MSR 0x64f) -- new for Skylake -- pkg scope reasons for core freq limits
-uint64_t pkg_ring_perf_limit_reasons[NUM_SOCKETS][MAX_SAMPLES];			// MSR_RING_PERF_LIMIT_REASONS (MSR 0x6b1) -- new for Skylake -- pkg scope reasons for ring freq limits
-uint64_t aperf[NUM_LPROCS][MAX_SAMPLES];								// 64-bit actual cycles not halted
-uint64_t mperf[NUM_LPROCS][MAX_SAMPLES];								// 64-bit reference cycles not halted
-uint64_t smi_count[NUM_SOCKETS][MAX_SAMPLES];							// 32-bit count of System Management Interrupts (SMIs) since last reset
+int pkg_therm_status[NUM_SOCKETS];					// IA32_PKG_THERM_STATUS (MSR 0x1b1) -- 13 fields packed into lower 22 bits, including temperature
+int pkg_core_perf_limit_reasons[NUM_SOCKETS];			// MSR_CORE_PERF_LIMIT_REASONS (MSR 0x64f) -- new for Skylake -- pkg scope reasons for core freq limits
+int pkg_ring_perf_limit_reasons[NUM_SOCKETS];			// MSR_RING_PERF_LIMIT_REASONS (MSR 0x6b1) -- new for Skylake -- pkg scope reasons for ring freq limits
+int aperf[NUM_LPROCS];								// 64-bit actual cycles not halted
+int mperf[NUM_LPROCS];								// 64-bit reference cycles not halted
+int smi_count[NUM_SOCKETS];							// 32-bit count of System Management Interrupts (SMIs) since last reset
 
 #if 1
 // 36-bit free-running IO data traffic counters -- count 4 Bytes per increment -- no setup required (or allowed)
-uint64_t iio_CBDMA_port1_in[NUM_SOCKETS][MAX_SAMPLES];				// 0xb01 local filesystem in plus (test2 only) Ethernet in
-uint64_t iio_CBDMA_port1_out[NUM_SOCKETS][MAX_SAMPLES];				// 0xb05 local filesystem out plus (test2 only) Ethernet out
-uint64_t iio_PCIe0_port1_in[NUM_SOCKETS][MAX_SAMPLES];				// 0xb11 (test1 only) Ethernet in
-uint64_t iio_PCIe0_port1_out[NUM_SOCKETS][MAX_SAMPLES];				// 0xb15 (test1 only) Ethernet out
-uint64_t iio_PCIe2_port0_in[NUM_SOCKETS][MAX_SAMPLES];				// 0xb30 OPA inbound
-uint64_t iio_PCIe2_port0_out[NUM_SOCKETS][MAX_SAMPLES];				// 0xb34 OPA outbound
+int iio_CBDMA_port1_in[NUM_SOCKETS];				// 0xb01 local filesystem in plus (test2 only) Ethernet in
+int iio_CBDMA_port1_out[NUM_SOCKETS];				// 0xb05 local filesystem out plus (test2 only) Ethernet out
+int iio_PCIe0_port1_in[NUM_SOCKETS];				// 0xb11 (test1 only) Ethernet in
+int iio_PCIe0_port1_out[NUM_SOCKETS];				// 0xb15 (test1 only) Ethernet out
+int iio_PCIe2_port0_in[NUM_SOCKETS];				// 0xb30 OPA inbound
+int iio_PCIe2_port0_out[NUM_SOCKETS];				// 0xb34 OPA outbound
 #define CBDMA_p1_in  0xb01
 #define CBDMA_p1_out 0xb05
 #define PCIE0_p1_in  0xb11
@@ -97,21 +115,235 @@ uint64_t iio_PCIe2_port0_out[NUM_SOCKETS][MAX_SAMPLES];				// 0xb34 OPA outbound
 // implementations waiting for a working program to test....
 
 // implementations being worked on now	
-uint64_t cha_counts[NUM_SOCKETS][NUM_CHA_BOXES][NUM_CHA_COUNTERS][MAX_SAMPLES];		// SKX (and KNL) Coherence and Home Agent - used for both mesh and LLC events
+int cha_counts[NUM_SOCKETS][NUM_CHA_BOXES][NUM_CHA_COUNTERS];		// SKX (and KNL) Coherence and Home Agent - used for both mesh and LLC events
 char cha_event_name[NUM_SOCKETS][NUM_CHA_BOXES][NUM_CHA_CONTROLS][80];				// counters 0-3 are programmable counters, 4 and 5 are filters
 
-// incomplete and/or untested implementations
-
-uint64_t uncore_qpi[NUM_SOCKETS][2][4][MAX_SAMPLES];					// 2 QPI lanes: 4 programmable counters each
-uint64_t uncore_cbo[NUM_SOCKETS][18][4][MAX_SAMPLES];					// up to 18 CBo's: 4 programmable counters each
-uint64_t uncore_sbo[NUM_SOCKETS][4][4][MAX_SAMPLES];					// 4 SBo's: 4 programmable counters each --> must write control registers twice!
-uint64_t uncore_r2pcie[NUM_SOCKETS][4][MAX_SAMPLES];					// 1 R2PCIe box: 4 programmable counters
-uint64_t uncore_r3qpi[NUM_SOCKETS][3][MAX_SAMPLES];						// 1 R3QPI box: 3 programmable counters
-
+// Sample store -- every series is a column; the store grows in chunks of STORE_CHUNK_SAMPLES samples
+#define STORE_SERIES_MAJOR 0		// within a chunk, the values of each series are contiguous (default)
+#define STORE_SAMPLE_MAJOR 1		// within a chunk, each sample is one packed, cache-line-aligned record ("-R" option)
+struct series_desc {
+	char name[200];					// name in the output file, e.g., core_counts[3]["INST_RETIRED.KERNEL"]
+	char *group;					// group name for the burst-mode subset selection
+	char *event;					// event name (or "") for the burst-mode subset selection
+	int scale;						// multiplier applied in the output file
+	int width;						// counter width in bits (64 for anything that is not a wrapping counter)
+};
+struct sample_store {
+	int num_series, max_series;
+	struct series_desc *desc;		// num_series entries
+	int layout;						// STORE_SERIES_MAJOR or STORE_SAMPLE_MAJOR
+	int record_len;					// values per record -- num_series rounded up to a whole number of cache lines
+	long chunk_samples;				// samples per chunk
+	long num_chunks, max_chunks;
+	uint64_t **chunk;				// num_chunks chunks of record_len*chunk_samples values, 64-byte aligned
+									// (NULL once a chunk has been packed and released)
+	int pack_chunks;				// pack each chunk once it is full ("-Z" option) -- see store_pack_chunk()
+	uint64_t **packed;				// per chunk: the packed series of a full chunk, or NULL
+	long num_packed, num_released;	// chunks below num_packed are packed, below num_released have no raw values
+	int *consumer;					// if not NULL, another thread may still read the samples from *consumer on
+	uint64_t *spare;				// a released raw chunk, reused for the next one
+	uint64_t *pack_buf;				// room to pack one chunk
+	uint64_t *scratch;				// decoded values of packed chunks, chunk_samples values per series
+	long *scratch_chunk;			// the chunk held by each series' part of scratch (-1 for none)
+	size_t packed_bytes;
+	struct pcs_header *map;			// if not NULL, the chunks are mapped from the store file (see create_store_file())
+	int map_fd;
+	int drop_old;					// keep only the last two samples ("-D" option) -- see store_drop_chunks()
+};
+struct sample_store samples;
+#define SAMPLE(column, index) (*store_value(&samples, (column), (index)))
 
 int sample;							// number of samples processed (excludes initial performance counter reads)
 int	valid;					// set to zero while counters are being read, set to 1 when complete -- use to detect interrupt during a counter read
-int dummycounter[MAX_SAMPLES];
+volatile sig_atomic_t shutdown_requested;	// set by the SIGCONT handler, checked by the main sampling loop
+
+int use_socket_readers;				// set by "-S" -- read each socket with its own pinned thread
+pthread_t socket_reader[NUM_SOCKETS];
+pthread_barrier_t reader_start;		// main thread + NUM_SOCKETS readers: start of a sample
+pthread_barrier_t reader_done;		// main thread + NUM_SOCKETS readers: end of a sample
+volatile int reader_exit;			// set before the final release of the "start" barrier to shut the readers down
+uint64_t socket_read_cycles[NUM_SOCKETS];	// TSC cycles of the last read of each socket (logged by the main thread)
+
+// read plan -- one flat, sorted array of read operations per socket, built by build_read_plan()
+#define PLAN_MSR 0					// pread() on an msr device driver file
+#define PLAN_MMCONFIG 1				// two 32-bit loads from the mmap'ed PCI configuration space
+#define PLAN_PERF 2					// read() of a whole perf_event group into its buffer
+#define PLAN_SLOT 3					// copy of a value already collected into memory (RDPMC helpers, perf_event groups)
+#define NUM_PLAN_BACKENDS 4			// (PLAN_SLOT must be last, since it copies values read by the other backends)
+struct read_op {
+	int backend;					// PLAN_MSR, PLAN_MMCONFIG, PLAN_PERF, or PLAN_SLOT
+	int fd;							// msr device driver or perf_event group leader file descriptor
+	int lproc;						// logical processor owning fd (for error messages)
+	uint32_t reg;					// MSR number, mmconfig_ptr[] index of the low 32 bits, or byte count of a group read
+	uint64_t *src;					// source value (PLAN_SLOT) or group read buffer (PLAN_PERF)
+	int dest;						// destination column in the sample store (-1 for PLAN_PERF)
+};
+struct read_plan {
+	struct read_op *ops;
+	int num_ops, max_ops;
+	int first[NUM_PLAN_BACKENDS+1];		// entries for backend b are ops[first[b]] .. ops[first[b+1]-1]
+};
+struct read_plan read_plan[NUM_SOCKETS];
+
+// RDPMC core counter acquisition (optional, enabled with the "-r" command-line option)
+//		one helper thread pinned to each logical processor reads its own core counters with RDPMC
+//		(and APERF/MPERF through its own msr device driver, which does not need an IPI) into a
+//		private cache-line-aligned slot.  The read plan then copies the slots into the core series.
+int use_rdpmc;
+struct core_slot {
+	uint64_t pmc[NUM_CORE_COUNTERS];
+	uint64_t fixed[3];
+	uint64_t aperf;
+	uint64_t mperf;
+} __attribute__((aligned(64)));
+struct core_slot *core_slot;		// nr_cpus entries
+pthread_t *core_helper;				// nr_cpus entries
+pthread_barrier_t core_start;		// main thread + nr_cpus helpers: start of a sample
+pthread_barrier_t core_done;		// main thread + nr_cpus helpers: end of a sample
+volatile int core_helper_exit;
+char rdpmc_saved_setting[16];		// original contents of /sys/bus/event_source/devices/cpu/rdpmc
+
+// perf_event backend (optional, enabled with the "-p" command-line option)
+int use_perf_events;
+int msr_available = 1;				// cleared if the msr device drivers cannot be opened with the perf_event backend
+int rapl_energy_width = 32;			// bits of rapl_pkg_energy and rapl_dram_energy: 64 from the perf_event power PMU
+// event selections from the .input files, kept so that they can be given to perf_event_open()
+uint64_t core_evtsel[NUM_LPROCS][NUM_CORE_COUNTERS];
+uint64_t cha_evtsel[NUM_SOCKETS][NUM_CHA_BOXES][NUM_CHA_CONTROLS];
+uint64_t pcu_evtsel[NUM_SOCKETS][4];
+uint64_t imc_evtsel[NUM_SOCKETS][NUM_IMC_CHANNELS][NUM_IMC_COUNTERS];
+void plan_add_perf_events(uint32_t socket);		// adds the perf_event groups to the read plan of a socket
+
+// Time-multiplexed core and CHA event groups (optional, enabled by "group N" lines in the .input files)
+#define MAX_MUX_GROUPS 4
+#define PMC_WIDTH_MASK 0x0000ffffffffffffUL		// core and CHA programmable counters are 48 bits wide
+int core_mux_groups = 1;			// number of event groups in core_msr_perfevtsel.input
+int cha_mux_groups = 1;				// number of event groups in cha_perfevtsel.input
+int mux_intervals = 1;				// rotate to the next group every mux_intervals samples ("-m" option)
+int mux_rotation;					// number of rotations so far -- the core group is mux_rotation % core_mux_groups, etc.
+uint64_t mux_start_tsc;				// tsc_start of the previous sample
+uint64_t core_mux_evtsel[MAX_MUX_GROUPS][NUM_LPROCS][NUM_CORE_COUNTERS];
+char core_mux_event_name[MAX_MUX_GROUPS][NUM_LPROCS][NUM_CORE_COUNTERS][80];
+uint64_t cha_mux_evtsel[MAX_MUX_GROUPS][NUM_SOCKETS][NUM_CHA_BOXES][NUM_CHA_CONTROLS];
+char cha_mux_event_name[MAX_MUX_GROUPS][NUM_SOCKETS][NUM_CHA_BOXES][NUM_CHA_CONTROLS][80];
+int core_mux_group;					// (column) core group that was counting during the interval ending at each sample
+int cha_mux_group;					// (column) CHA group that was counting during the interval ending at each sample
+int mux_active_tsc;					// (column) TSC cycles that the group was counting during the interval ending at each sample
+
+// Streaming results writer (optional, enabled with the "-w" command-line option)
+int use_results_writer;
+pthread_t results_writer;
+sem_t writer_wakeup;				// posted by the main thread after each sample
+volatile int writer_exit;
+int samples_published;				// number of complete samples -- written by the main thread with release semantics
+int samples_written;				// number of samples already written to results_file
+#define RESULTS_BUFFER_BYTES (4*1024*1024)
+#define RESULTS_FLUSH_NS (5*1000000000UL)	// the longest that written samples stay in the stdio buffer
+
+// Text output engine (see "Text output" below)
+#define TEXT_UNSIGNED 0				// value*scale, as %lu
+#define TEXT_SIGNED 1				// value, as %ld
+#define TEXT_HEX 2					// value, as 0x%lx
+#define TEXT_MUX_ADD 3				// (no output) add the delta of a multiplexed counter to the total of the active group
+#define TEXT_MUX_TOTAL 4			// a multiplexed running total, as %lu
+struct text_item {
+	char *prefix;					// everything before the sample index, e.g., core_counts[3]["INST_RETIRED.ANY"][
+	int prefix_len;
+	int kind;
+	int column;						// the series (for TEXT_MUX_ADD, the counter)
+	int scale;
+	int group_column;				// TEXT_MUX_ADD, TEXT_MUX_TOTAL: the series holding the active group
+	int group;						// TEXT_MUX_TOTAL: the group of the event
+	int total;						// TEXT_MUX_ADD: the total of group 0, TEXT_MUX_TOTAL: the total
+};
+struct text_worker {
+	pthread_t thread;
+	long first, last;				// the samples to format in this round
+	uint64_t *totals;				// the multiplexed totals before sample "first"
+	char *buf;						// room for TEXT_BLOCK_BYTES (or one sample) of text
+	size_t bytes;
+	uint64_t *scratch;				// cache for the packed chunks of the sample store (see store_unpack())
+	long *scratch_chunk;
+};
+struct text_item *text_items;		// the lines of one sample, in output order
+int num_text_items, max_text_items;
+int num_text_totals;
+uint64_t *text_totals;				// the multiplexed totals after the last sample written
+size_t text_sample_bytes;			// upper bound on the text of one sample
+long text_block_samples;			// samples formatted by a worker at a time
+#define TEXT_BLOCK_BYTES (4*1024*1024)
+#define TEXT_MAX_THREADS 16
+struct text_worker *text_workers;
+int use_table_output;				// write each series as one Lua table constructor ("-T" option)
+pthread_barrier_t text_start, text_done;
+volatile int text_exit;
+
+// Binary columnar output (optional, enabled with the "-b" command-line option)
+int use_binary_output;
+char binary_filename[120];			// <hostname>.perfcounts.pcb
+
+// NumPy output (optional, enabled with the "-N" command-line option)
+int use_npy_output;
+char npy_dirname[120];				// <hostname>.perfcounts.npy
+
+// Crash-safe store file (optional, enabled with the "-M" command-line option)
+int use_store_file;
+char store_filename[120];			// <hostname>.perfcounts.store
+
+// Online derived metrics (optional, enabled with the "-e metrics_file" command-line option)
+char *metrics_path;
+char live_filename[120];			// <hostname>.perfcounts.live
+struct pcm_source metrics_source;
+struct pcm_program online_metrics;
+double *online_values;				// [instance], for the interval ending at the latest sample
+pthread_t metrics_writer;			// writes the live file
+sem_t metrics_wakeup;				// posted by the main thread after handing over new values
+pthread_mutex_t metrics_lock = PTHREAD_MUTEX_INITIALIZER;	// protects the three values below
+double *metrics_values;				// copy of online_values for the writer
+int metrics_sample;					// sample at the end of the interval of metrics_values (-1 before the first)
+uint64_t metrics_walltime[2];
+volatile int metrics_writer_exit;
+
+// Streaming statistics (optional, enabled with the "-s N" command-line option)
+int stats_samples;					// write the statistics file every stats_samples samples (0: no statistics)
+char stats_filename[120];			// <hostname>.perfcounts.stats
+struct pst_summary *series_stats;	// [series], kind -1 for the series that are not summarized
+struct pst_summary *metric_stats;	// [online metric instance], with "-e"
+
+// Phase detection (optional, enabled with the "-P metric,metric,..." command-line option, with "-e")
+char *phase_spec;
+char phases_filename[120];			// <hostname>.perfcounts.phases
+struct pph_detector phases;
+const char *phase_signal_name[PPH_MAX_SIGNALS];
+int phase_signal_instance[PPH_MAX_SIGNALS];		// online metric instance of each signal
+
+// Live shared-memory segment (optional, enabled with the "-L N" command-line option)
+int live_samples;					// records in the ring of the segment (0: no segment)
+struct pls_header *live_segment;
+size_t live_segment_bytes;
+
+// Topology rollups (optional, enabled with the "-A" command-line option)
+struct rollup {
+	int column;
+	char *base;						// the Lua name up to the event, e.g., pcore_counts[0][3]
+	char *event;					// e.g., "Inst_Retired.Any", or NULL
+	int mux_lproc, mux_counter;		// a multiplexed core counter: the event names of the groups, else -1
+	uint64_t total;					// the sum of the member deltas since the first sample
+};
+struct rollup_term {				// one member series of a rollup
+	int rollup;
+	int member;
+	uint64_t mask;					// the counter width of the member
+	uint64_t last;
+};
+int use_rollups;
+uint64_t fixed_ctr_ctrl[NUM_LPROCS];		// IA32_FIXED_CTR_CTRL at startup (the AnyThread bit of each fixed counter)
+int snc_by_lproc[NUM_LPROCS];				// sub-NUMA cluster of each logical processor, within its socket
+int snc_clusters = 1;						// clusters per socket (1 without SNC)
+struct rollup *rollups;
+int num_rollups, max_rollups;
+struct rollup_term *rollup_terms;
+int num_rollup_terms, max_rollup_terms;
 
 int TSC_ratio;
 long nr_cpus;				// actual number of cores active -- must be less than or equal to NUM_LPROCS
@@ -145,455 +377,2940 @@ struct timezone tzp;	// required, but not used here.
 // helper functions
 
 // ==================================================================================================================
-//		Final processing & output of results
-void process_all_results()
+// Sample store
+//		The series are added (as columns) by allocate_series() once the topology and the events are known,
+//		and store_reserve() adds chunks as the run proceeds, so the memory used follows the number of
+//		samples actually collected.  Chunks never move once allocated, so a value's address is stable.
+//		With the sample-major layout, each sample is one record: the values of all of the series in column
+//		order, padded to a multiple of 64 bytes, so a sweep of the read plan writes one contiguous block
+//		(a few KB) instead of touching a different page for every counter.  The series descriptions are the
+//		schema of the record (see log_store_schema()), and the record is what writers and exporters consume.
+//		With packing ("-Z" option), each chunk is packed as soon as it is full and its raw values are released
+//		(see "Packed chunks" below), so only the chunk being filled is kept at full size.
+//
+uint64_t *store_unpacked_value(struct sample_store *store, int column, long index);
+
+static inline uint64_t *store_value(struct sample_store *store, int column, long index)
 {
-	uint64_t tsc_before, tsc_after, delta_tsc, avg_tsc;
-	uint32_t socket, imc, subchannel, channel, counter;
-	uint32_t cha;
-	uint32_t bus, device, function, offset, ctl_offset, ctr_offset, value, index;
-	uint64_t count;
-	int i,lproc;
-	float microseconds;
+	uint64_t *chunk = store->chunk[index / store->chunk_samples];
+	long i = index % store->chunk_samples;
 
-	tsc_before = rdtscp();		// measure how long it takes to write out all of the output
+	if (chunk == NULL) return (store_unpacked_value(store, column, index));
+	if (store->layout == STORE_SAMPLE_MAJOR) return (&chunk[i * store->record_len + column]);
+	return (&chunk[column * store->chunk_samples + i]);
+}
 
-	for (i=0; i<sample; i++) {
-		// every output sample starts with the TSC value and then the corresponding wall-clock seconds and microseconds
-		fprintf(results_file,"tsc[%d] = %lu\n",i, tsc_start[i]);
-		fprintf(results_file,"walltime[0][%d] = %ld\n", i, walltime[0][i]);
-		fprintf(results_file,"walltime[1][%d] = %ld\n", i, walltime[1][i]);
+// Distance (in values) between consecutive columns of the same sample
+static inline long store_column_stride(struct sample_store *store)
+{
+	return ((store->layout == STORE_SAMPLE_MAJOR) ? 1 : store->chunk_samples);
+}
 
-		// print temperature, PKG energy (unscaled), DRAM energy (unscaled), and PKG throttled time for each socket
-		for (socket=0; socket<NUM_SOCKETS; socket++) {
-			fprintf(results_file,"pkg_temperature[%u][%d] = %ld\n",socket,i,pkg_temperature[socket][i]);
-			fprintf(results_file,"rapl_pkg_energy[%u][%d] = %ld\n",socket,i,rapl_pkg_energy[socket][i]);
-			fprintf(results_file,"rapl_dram_energy[%u][%d] = %ld\n",socket,i,rapl_dram_energy[socket][i]);
-			fprintf(results_file,"rapl_pkg_throttled[%u][%d] = %ld\n",socket,i,rapl_pkg_throttled[socket][i]);
-			fprintf(results_file,"pkg_therm_status[%u][%d] = 0x%lx\n",socket,i,pkg_therm_status[socket][i]);
-			fprintf(results_file,"pkg_core_perf_limit_reasons[%u][%d] = 0x%lx\n",socket,i,pkg_core_perf_limit_reasons[socket][i]);
-			fprintf(results_file,"pkg_ring_perf_limit_reasons[%u][%d] = 0x%lx\n",socket,i,pkg_ring_perf_limit_reasons[socket][i]);
-			fprintf(results_file,"smi_count[%u][%d] = %lu\n",socket,i,smi_count[socket][i]);
-		}
+// The record of a sample (sample-major layout only): record_len values, column c at record[c]
+static inline uint64_t *store_record(struct sample_store *store, long index)
+{
+	return (&store->chunk[index / store->chunk_samples][(index % store->chunk_samples) * store->record_len]);
+}
 
-		// output the Uncore Cycle Counter in the UBox from each socket
-		for (socket=0; socket<NUM_SOCKETS; socket++) {
-			fprintf(results_file,"ubox_uclk[%u][%d] = %lu\n",socket,i,ubox_uclk[socket][i]);
-		}
-		
-		// print out fixed-function core counter results
-		for (lproc=0; lproc<nr_cpus; lproc++) {
-			count = core_fixed[lproc][0][i];
-			fprintf(results_file,"core_fixed_counts[%d][\"Inst_Retired.Any\"][%d] = %lu\n",lproc,i,count);
-			count = core_fixed[lproc][1][i];
-			fprintf(results_file,"core_fixed_counts[%d][\"CPU_CLK_Unhalted.Core\"][%d] = %lu\n",lproc,i,count);
-			count = core_fixed[lproc][2][i];
-			fprintf(results_file,"core_fixed_counts[%d][\"CPU_CLK_Unhalted.Ref\"][%d] = %lu\n",lproc,i,count);
-		}
+int store_add_series(struct sample_store *store, char *name, char *group, char *event, int scale)
+{
+	struct series_desc *desc;
 
-		// print out programmable core counter results
-		for (lproc=0; lproc<nr_cpus; lproc++) {
-			for (counter=0; counter<4; counter++) {
-				count = core_counts[lproc][counter][i];
-						fprintf(results_file,"core_counts[%d][\"%s\"][%d] = %lu\n",lproc,
-							core_event_name[lproc][counter],i,count);
-			}
+	if (store->num_series == store->max_series) {
+		store->max_series = (store->max_series == 0) ? 1024 : 2*store->max_series;
+		store->desc = realloc(store->desc, store->max_series * sizeof(struct series_desc));
+		if (store->desc == NULL) {
+			fprintf(log_file,"ERROR: unable to allocate sample store series descriptions\n");
+			exit(-1);
 		}
+	}
+	desc = &store->desc[store->num_series];
+	strncpy(desc->name,name,sizeof(desc->name)-1);
+	desc->name[sizeof(desc->name)-1] = 0;
+	desc->group = group;
+	desc->event = event;
+	desc->scale = scale;
+	desc->width = 64;
+	return (store->num_series++);
+}
 
-		// print out extra MSR-based core counter results
-		for (lproc=0; lproc<nr_cpus; lproc++) {
-			fprintf(results_file,"aperf[%d][%d] = %lu\n",lproc,i,aperf[lproc][i]);
-			fprintf(results_file,"mperf[%d][%d] = %lu\n",lproc,i,mperf[lproc][i]);
-		}
+// ------------------------------------------------------------------------------------------------------------------
+// Packed chunks
+//		A full chunk is packed one series at a time, each series into whichever of two encodings is smaller:
+//		  PACK_DOD   the first value, the first delta, and then the change of the delta from each sample to the
+//		             next (delta-of-delta), zigzag-encoded and bit-packed at the width of the largest one.  Counters
+//		             read at a fixed interval have nearly constant deltas, so this usually takes a few bits per
+//		             sample.  If all of the values fit in the counter width, the deltas are taken modulo 2^width,
+//		             so a 48-bit counter wrapping inside the chunk does not widen the whole chunk.
+//		  PACK_RLE   (value, run length) pairs -- status MSRs, temperatures, and idle counters.
+//		A packed chunk is an array of num_series+1 word offsets followed by the series, each starting with a
+//		header word: the encoding in bits 0-7, the bit-packing width in bits 8-15, the value width in bits
+//		16-23, and the number of runs (RLE) in bits 32-63.
+//		Packing is exact (the unpacked values are the raw values), so the output is the same with or without it.
+//		Reads of a released chunk unpack a whole series of the chunk at once into scratch, so reading a
+//		chunk sample by sample (the text output) or series by series (the binary output) unpacks each
+//		series of each chunk once.  Values of released chunks must not be written, and threads that read
+//		released chunks at the same time as others must use store_unpack() with a cache of their own.
+//
+#define PACK_DOD 0
+#define PACK_RLE 1
 
-		// print out CHA counter values
-		for (socket=0; socket<NUM_SOCKETS; socket++) {
-			for (cha=0; cha<NUM_CHA_BOXES; cha++) {
-				for (counter=0; counter<NUM_CHA_COUNTERS; counter++) {
-					fprintf(results_file,"cha_counts[%u][%u][\"%s\"][%d] = %lu\n", socket, cha, 
-							cha_event_name[socket][cha][counter], i,
-							cha_counts[socket][cha][counter][i]);
-				}
-			}
-		}
+static inline uint64_t pack_zigzag(int64_t d)
+{
+	return (((uint64_t)d << 1) ^ (uint64_t)(d >> 63));
+}
 
-#if 0
-		// print out HomeAgent counter results
-		for (socket=0; socket<2; socket++) {
-			for (ha=0; ha<2; ha++) {
-				for (counter=0; counter<4; counter++) {
-					fprintf(results_file,"ha_counts[%u][%u][\"%s\"][%d] = %lu\n", socket, ha, 
-							ha_event_name[socket][ha][counter], i,
-							ha_counts[socket][ha][counter][i]);
-				}
+static inline int64_t pack_unzigzag(uint64_t z)
+{
+	return ((int64_t)(z >> 1) ^ -(int64_t)(z & 1));
+}
+
+// Pack values[0..n-1] (n >= 2) of a series with counter width "width" into out, returns the number of words
+// (at most n+1)
+long pack_series(const uint64_t *values, long n, int width, uint64_t *out)
+{
+	uint64_t mask, delta, prev_delta, z, any;
+	long runs, dod_words, i, r, bit;
+	int bits, off;
+
+	mask = ~0UL;
+	if (width < 64) {
+		mask = (1UL << width) - 1;
+		for (i=0; i<n; i++) {
+			if (values[i] > mask) {
+				mask = ~0UL;
+				width = 64;
+				break;
 			}
 		}
-#endif
-		// print out IMC counter results
-		for (socket=0; socket<NUM_SOCKETS; socket++) {
-			for (channel=0; channel<NUM_IMC_CHANNELS; channel++) {
-				for (counter=0; counter<NUM_IMC_COUNTERS; counter++) {
-					fprintf(results_file,"imc_counts[%u][%u][\"%s\"][%d] = %lu\n", socket, channel, 
-						imc_event_name[socket][channel][counter], i,
-						imc_counts[socket][channel][counter][i]);
-				}
+	}
+	runs = 1;
+	any = 0;
+	prev_delta = (values[1] - values[0]) & mask;
+	for (i=1; i<n; i++) {
+		if (values[i] != values[i-1]) runs++;
+		if (i > 1) {
+			delta = (values[i] - values[i-1]) & mask;
+			any |= pack_zigzag((int64_t)(delta - prev_delta));
+			prev_delta = delta;
+		}
+	}
+	bits = (any == 0) ? 0 : 64 - __builtin_clzl(any);
+	dod_words = 3 + ((n - 2) * bits + 63) / 64;
+
+	if (1 + 2*runs <= dod_words) {
+		out[0] = PACK_RLE | ((uint64_t)runs << 32);
+		r = 0;
+		out[1] = values[0];
+		out[2] = 1;
+		for (i=1; i<n; i++) {
+			if (values[i] == values[i-1]) {
+				out[2 + 2*r]++;
+			} else {
+				r++;
+				out[1 + 2*r] = values[i];
+				out[2 + 2*r] = 1;
 			}
 		}
-	#ifdef INFINIBAND
-		// print out InfiniBand receive and transmit counts
-		//    scale by 4 to get Bytes in the output file
-		fprintf(results_file,"ib_recv_bytes[%d] = %lu\n", i, ib_recv[i]*4);
-		fprintf(results_file,"ib_xmit_bytes[%d] = %lu\n", i, ib_xmit[i]*4);
-	#endif
+		return (1 + 2*runs);
+	}
 
-		// print out Free-Running IO counter results
-		for (socket=0; socket<NUM_SOCKETS; socket++) {
-			fprintf(results_file,"iio_CBDMA_port1_in_bytes[%u][%d] = %lu\n", socket, i, iio_CBDMA_port1_in[socket][i]*4);
-			fprintf(results_file,"iio_CBDMA_port1_out_bytes[%u][%d] = %lu\n", socket, i, iio_CBDMA_port1_out[socket][i]*4);
-			fprintf(results_file,"iio_PCIe0_port1_in_bytes[%u][%d] = %lu\n", socket, i, iio_PCIe0_port1_in[socket][i]*4);
-			fprintf(results_file,"iio_PCIe0_port1_out_bytes[%u][%d] = %lu\n", socket, i, iio_PCIe0_port1_out[socket][i]*4);
-			fprintf(results_file,"iio_PCIe2_port0_in_bytes[%u][%d] = %lu\n", socket, i, iio_PCIe2_port0_in[socket][i]*4);
-			fprintf(results_file,"iio_PCIe2_port0_out_bytes[%u][%d] = %lu\n", socket, i, iio_PCIe2_port0_out[socket][i]*4);
-		}
-		// print out PCU counter results
-		for (socket=0; socket<NUM_SOCKETS; socket++) {
-			for (counter=0; counter<4; counter++) {
-				fprintf(results_file,"pcu_counts[%u][\"%s\"][%d] = %lu\n", socket, 
-					pcu_event_name[socket][counter], i,
-					pcu_counts[socket][counter][i]);
-			}
+	out[0] = PACK_DOD | ((uint64_t)bits << 8) | ((uint64_t)width << 16);
+	out[1] = values[0];
+	out[2] = (values[1] - values[0]) & mask;
+	memset(&out[3], 0, (dod_words - 3) * sizeof(uint64_t));
+	if (bits > 0) {
+		prev_delta = out[2];
+		for (i=2; i<n; i++) {
+			delta = (values[i] - values[i-1]) & mask;
+			z = pack_zigzag((int64_t)(delta - prev_delta));
+			prev_delta = delta;
+			bit = (i - 2) * bits;
+			off = bit & 63;
+			out[3 + (bit >> 6)] |= z << off;
+			if (off + bits > 64) out[4 + (bit >> 6)] |= z >> (64 - off);
 		}
 	}
-	tsc_after = rdtscp();		// measure how long it takes to write out all of the output
-	delta_tsc = tsc_after - tsc_before;
-	microseconds = (float)(delta_tsc) / TSC_ratio / 100.0;			// 100 MHz reference clock
-	fprintf(log_file,"OVERHEAD: writing all output took %lu TSC cycles %f microseconds\n",delta_tsc,microseconds);
+	return (dod_words);
+}
 
-	fflush(results_file);
-	fclose(results_file);
+// Unpack the n values of a series packed by pack_series()
+void unpack_series(const uint64_t *in, long n, uint64_t *values)
+{
+	const uint64_t *packed_bits = &in[3];
+	uint64_t mask, bits_mask, v, delta, z;
+	long runs, r, i, j, bit;
+	int bits, width, off;
+
+	if ((in[0] & 0xff) == PACK_RLE) {
+		runs = in[0] >> 32;
+		i = 0;
+		for (r=0; r<runs; r++) {
+			v = in[1 + 2*r];
+			for (j=in[2 + 2*r]; j>0; j--) values[i++] = v;
+		}
+		return;
+	}
+	bits = (in[0] >> 8) & 0xff;
+	width = (in[0] >> 16) & 0xff;
+	mask = (width >= 64) ? ~0UL : (1UL << width) - 1;
+	bits_mask = (bits >= 64) ? ~0UL : (1UL << bits) - 1;
+	v = in[1];
+	delta = in[2];
+	values[0] = v;
+	v = (v + delta) & mask;
+	values[1] = v;
+	if (bits == 0) {
+		for (i=2; i<n; i++) {
+			v = (v + delta) & mask;
+			values[i] = v;
+		}
+		return;
+	}
+	for (i=2; i<n; i++) {
+		bit = (i - 2) * bits;
+		off = bit & 63;
+		z = packed_bits[bit >> 6] >> off;
+		if (off + bits > 64) z |= packed_bits[(bit >> 6) + 1] << (64 - off);
+		delta += pack_unzigzag(z & bits_mask);
+		v = (v + delta) & mask;
+		values[i] = v;
+	}
+}
 
-	fflush(log_file);
-	fclose(log_file);
+// Pack (full) chunk c
+void store_pack_chunk(struct sample_store *store, long c)
+{
+	uint64_t *values = store->scratch;			// (the first series' slice, which is refilled below)
+	uint64_t *offset = store->pack_buf;
+	long n = store->chunk_samples;
+	long words, i;
+	int k;
+
+	words = store->num_series + 1;
+	for (k=0; k<store->num_series; k++) {
+		for (i=0; i<n; i++) values[i] = *store_value(store, k, c*n + i);
+		offset[k] = words;
+		words += pack_series(values, n, store->desc[k].width, &store->pack_buf[words]);
+	}
+	offset[store->num_series] = words;
+	store->scratch_chunk[0] = -1;
+	store->packed[c] = malloc(words * sizeof(uint64_t));
+	if (store->packed[c] == NULL) {
+		fprintf(log_file,"ERROR: unable to allocate %ld words for packed chunk %ld\n",words,c);
+		exit(-1);
+	}
+	memcpy(store->packed[c], store->pack_buf, words * sizeof(uint64_t));
+	store->packed_bytes += words * sizeof(uint64_t);
 }
 
-// Convert PCI(bus:device.function,offset) to uint32_t array index
-uint32_t PCI_cfg_index(unsigned int Bus, unsigned int Device, unsigned int Function, unsigned int Offset)
+// The value of sample "index" of a series from a released (packed) chunk, unpacked into a cache of
+// chunk_samples values per series (scratch), where scratch_chunk[column] is the chunk held for each series
+uint64_t *store_unpack(struct sample_store *store, uint64_t *scratch, long *scratch_chunk, int column, long index)
 {
-    uint32_t byteaddress;
-    uint32_t index;
-    // assert (Bus == BUS);
-    assert (Device >= 0);
-    assert (Function >= 0);
-    assert (Offset >= 0);
-    assert (Device < (1<<5));
-    assert (Function < (1<<3));
-    assert (Offset < (1<<12));
-#ifdef DEBUG
-    fprintf(log_file,"Bus,(Bus<<20)=%x\n",Bus,(Bus<<20));
-    fprintf(log_file,"Device,(Device<<15)=%x\n",Device,(Device<<15));
-    fprintf(log_file,"Function,(Function<<12)=%x\n",Function,(Function<<12));
-    fprintf(log_file,"Offset,(Offset)=%x\n",Offset,Offset);
-#endif
-    byteaddress = (Bus<<20) | (Device<<15) | (Function<<12) | Offset;
-    index = byteaddress / 4;
-    return ( index );
+	long c = index / store->chunk_samples;
+	uint64_t *values = &scratch[(size_t)column * store->chunk_samples];
+	uint64_t *packed;
+
+	if (scratch_chunk[column] != c) {
+		packed = store->packed[c];
+		unpack_series(&packed[packed[column]], store->chunk_samples, values);
+		scratch_chunk[column] = c;
+	}
+	return (&values[index % store->chunk_samples]);
 }
 
-// ==========================================================================================================
-// Read all the performance counters for this node
-//		currently contains writes to log files -- not sure if I need to kill these
-//
-void read_all_counters()
+uint64_t *store_unpacked_value(struct sample_store *store, int column, long index)
 {
-	uint32_t low, high;
-	uint32_t socket, imc, subchannel, channel, counter;
-	uint32_t cha;
-	uint32_t bus, device, function, offset, ctl_offset, ctr_offset, value, index;
-	uint64_t count;
-	uint64_t tsc_before, tsc_after, delta_tsc, avg_tsc;
-	uint64_t msr_num, msr_val;
-	ssize_t rc64;
-	char filename[100];
-	int reads_performed;
-	int core,lproc;
-	int temp_below;
-	int i;
+	return (store_unpack(store, store->scratch, store->scratch_chunk, column, index));
+}
 
-	// Grab a TSC value to use as the node-local timeline value for this set of samples
-	// Call gettimeofday() to get the wall clock time for cross-node timing alignment
-	tsc_start[sample] = rdtscp();
-    i = gettimeofday(&tp,&tzp);
-	walltime[0][sample] = tp.tv_sec;
-	walltime[1][sample] = tp.tv_usec;
-
-	// Read socket-scope MSRs in each socket.
-	// This includes temperature, pkg energy use, dram energy use, pkg power throttled time, 
-	// SMI interrupts, and uncore clock counts.
-	// NOTE: Temperature values are in degrees C
-	//  Energy and Throttle time values are unscaled 32-bit counts (to make it easier to
-    //		correct for wrap-around in post-processing).
-	fprintf(log_file,"VERBOSE: Reading Socket-Scope MSR counters....\n");
-	reads_performed = 0;
-	tsc_before = rdtscp();
-	for (socket=0; socket<NUM_SOCKETS; socket++) {
-		core = proc_in_pkg[socket];
-		msr_num = IA32_PACKAGE_THERM_STATUS;
-		rc64 = pread(msr_fd[core],&msr_val,sizeof(msr_val),msr_num);
-		if (rc64 != sizeof(msr_val)) {
-			fprintf(log_file,"ERROR: failed to read MSR %x on Logical Processor %d", msr_num, core);
-			exit(-1);
+// Pack the full chunks below chunk "limit", and release the raw values of the packed chunks that no other
+// thread will read again.  The first sample of each chunk is also read with the last one of the previous chunk
+// (the multiplexed totals), so a chunk is only released once the consumer is past the first sample of the next.
+void store_pack_full_chunks(struct sample_store *store, long limit)
+{
+	long c, consumed;
+
+	while (store->num_packed < limit) store_pack_chunk(store, store->num_packed++);
+	consumed = (store->consumer == NULL) ? store->num_packed * store->chunk_samples + 1
+			: __atomic_load_n(store->consumer, __ATOMIC_ACQUIRE);
+	while ((store->num_released < store->num_packed) && (consumed > (store->num_released + 1) * store->chunk_samples)) {
+		c = store->num_released++;
+		if (store->spare == NULL) {
+			store->spare = store->chunk[c];
+		} else {
+			free(store->chunk[c]);
 		}
-		pkg_therm_status[socket][sample] = msr_val;
-		temp_below  = (msr_val & 0x007F0000)>>16;      // 7 bit field for degrees C below PROCHOT temperature
-		pkg_temperature[socket][sample] = temp_target - temp_below;
-		reads_performed++;
+		store->chunk[c] = NULL;
+	}
+}
 
-		core = proc_in_pkg[socket];
-		msr_num = MSR_CORE_PERF_LIMIT_REASONS;
-		rc64 = pread(msr_fd[core],&msr_val,sizeof(msr_val),msr_num);
-		if (rc64 != sizeof(msr_val)) {
-			fprintf(log_file,"ERROR: failed to read MSR %x on Logical Processor %d", msr_num, core);
-			exit(-1);
+// Recycle the chunks below chunk "limit" ("-D" option): with only the statistics and the online metrics kept,
+// the samples before the previous one are never read again, so the store holds at most three chunks.
+void store_drop_chunks(struct sample_store *store, long limit)
+{
+	long c;
+
+	while (store->num_released < limit) {
+		c = store->num_released++;
+		if (store->spare == NULL) {
+			store->spare = store->chunk[c];
+		} else {
+			free(store->chunk[c]);
 		}
-		pkg_core_perf_limit_reasons[socket][sample] = msr_val;
-		reads_performed++;
+		store->chunk[c] = NULL;
+	}
+}
 
-		core = proc_in_pkg[socket];
-		msr_num = MSR_RING_PERF_LIMIT_REASONS;
-		rc64 = pread(msr_fd[core],&msr_val,sizeof(msr_val),msr_num);
-		if (rc64 != sizeof(msr_val)) {
-			fprintf(log_file,"ERROR: failed to read MSR %x on Logical Processor %d", msr_num, core);
+// Fix the record length (no series can be added after this) and allocate the packing buffers
+void store_freeze_series(struct sample_store *store)
+{
+	long k;
+
+	if (store->record_len != 0) return;
+	store->record_len = (store->num_series + 7) & ~7;
+	if (store->pack_chunks) {
+		store->pack_buf = malloc((store->num_series + 1) * (store->chunk_samples + 2) * sizeof(uint64_t));
+		store->scratch = malloc((size_t)store->num_series * store->chunk_samples * sizeof(uint64_t));
+		store->scratch_chunk = malloc(store->num_series * sizeof(long));
+		if ((store->pack_buf == NULL) || (store->scratch == NULL) || (store->scratch_chunk == NULL)) {
+			fprintf(log_file,"ERROR: unable to allocate the sample store packing buffers\n");
 			exit(-1);
 		}
-		pkg_ring_perf_limit_reasons[socket][sample] = msr_val;
-		reads_performed++;
+		for (k=0; k<store->num_series; k++) store->scratch_chunk[k] = -1;
+	}
+}
 
-		core = proc_in_pkg[socket];
-		msr_num = MSR_PKG_ENERGY_STATUS;
-		rc64 = pread(msr_fd[core],&msr_val,sizeof(msr_val),msr_num);
-		if (rc64 != sizeof(msr_val)) {
-			fprintf(log_file,"ERROR: failed to read MSR %x on Logical Processor %d", msr_num, core);
-			exit(-1);
+// Make sure that the chunk holding sample "index" exists.  New chunks are zeroed here, which also
+// faults in their pages, so this is called for the next sample right after each read (outside of the reads).
+void store_reserve(struct sample_store *store, long index)
+{
+	uint64_t **new_chunk, **new_packed;
+	size_t bytes;
+	off_t offset;
+
+	store_freeze_series(store);
+	if (store->drop_old && (index >= 2)) store_drop_chunks(store, (index - 2) / store->chunk_samples);
+	bytes = (size_t)store->record_len * store->chunk_samples * sizeof(uint64_t);
+	bytes = (bytes + 63) & ~(size_t)63;
+	if (store->map != NULL) bytes = store->map->chunk_bytes;
+	while (store->num_chunks <= index / store->chunk_samples) {
+		if (store->num_chunks == store->max_chunks) {
+			// the old arrays of chunk pointers are not freed, since the streaming writer thread may be using them
+			store->max_chunks = (store->max_chunks == 0) ? 64 : 2*store->max_chunks;
+			new_chunk = malloc(store->max_chunks * sizeof(uint64_t *));
+			new_packed = calloc(store->max_chunks, sizeof(uint64_t *));
+			if ((new_chunk == NULL) || (new_packed == NULL)) {
+				fprintf(log_file,"ERROR: unable to allocate the sample store chunk table (%ld chunks)\n",store->max_chunks);
+				exit(-1);
+			}
+			if (store->num_chunks > 0) {
+				memcpy(new_chunk, store->chunk, store->num_chunks * sizeof(uint64_t *));
+				memcpy(new_packed, store->packed, store->num_chunks * sizeof(uint64_t *));
+			}
+			__atomic_store_n(&store->packed, new_packed, __ATOMIC_RELEASE);
+			__atomic_store_n(&store->chunk, new_chunk, __ATOMIC_RELEASE);
 		}
-		rapl_pkg_energy[socket][sample] = msr_val;
-		reads_performed++;
-
-		core = proc_in_pkg[socket];
-		msr_num = MSR_DRAM_ENERGY_STATUS;
-		rc64 = pread(msr_fd[core],&msr_val,sizeof(msr_val),msr_num);
-		if (rc64 != sizeof(msr_val)) {
-			fprintf(log_file,"ERROR: failed to read MSR %x on Logical Processor %d", msr_num, core);
+		if (store->pack_chunks) store_pack_full_chunks(store, store->num_chunks);
+		if (store->map != NULL) {
+			// the blocks are allocated now, so a full disk shows up here and not as a SIGBUS during a read
+			offset = store->map->data_offset + store->num_chunks * bytes;
+			if (fallocate(store->map_fd, 0, offset, bytes) != 0) {
+				fprintf(log_file,"ERROR %s when trying to allocate sample store chunk %ld in the store file\n",strerror(errno),store->num_chunks);
+				exit(-1);
+			}
+			store->chunk[store->num_chunks] = mmap(NULL, bytes, PROT_READ|PROT_WRITE, MAP_SHARED, store->map_fd, offset);
+			if (store->chunk[store->num_chunks] == MAP_FAILED) {
+				fprintf(log_file,"ERROR %s when trying to map sample store chunk %ld\n",strerror(errno),store->num_chunks);
+				exit(-1);
+			}
+		} else if (store->spare != NULL) {
+			store->chunk[store->num_chunks] = store->spare;
+			store->spare = NULL;
+		} else if ((store->chunk[store->num_chunks] = aligned_alloc(64, bytes)) == NULL) {
+			fprintf(log_file,"ERROR: unable to allocate sample store chunk %ld (%lu bytes)\n",store->num_chunks,bytes);
 			exit(-1);
 		}
-		rapl_dram_energy[socket][sample] = msr_val;
-		reads_performed++;
+		memset(store->chunk[store->num_chunks], 0, bytes);
+		store->num_chunks++;
+	}
+	// (chunks held back for the streaming writer are released once it has moved on)
+	if (store->pack_chunks && (store->num_released < store->num_packed)) store_pack_full_chunks(store, store->num_packed);
+}
 
-		core = proc_in_pkg[socket];
-		msr_num = MSR_PKG_PERF_STATUS;
-		rc64 = pread(msr_fd[core],&msr_val,sizeof(msr_val),msr_num);
-		if (rc64 != sizeof(msr_val)) {
-			fprintf(log_file,"ERROR: failed to read MSR %x on Logical Processor %d", msr_num, core);
-			exit(-1);
-		}
-		rapl_pkg_throttled[socket][sample] = msr_val;
-		reads_performed++;
+// Record that samples 0..count-1 are complete (in the store file, if there is one)
+void store_commit(struct sample_store *store, long count)
+{
+	if (store->map != NULL) __atomic_store_n(&store->map->committed, count, __ATOMIC_RELEASE);
+}
 
-		core = proc_in_pkg[socket];
-		msr_num = MSR_SMI_COUNT;
-		rc64 = pread(msr_fd[core],&msr_val,sizeof(msr_val),msr_num);
-		if (rc64 != sizeof(msr_val)) {
-			fprintf(log_file,"ERROR: failed to read MSR %x on Logical Processor %d", msr_num, lproc);
-			exit(-1);
-		}
-		smi_count[socket][sample] = msr_val;
-		reads_performed++;
+// Write the record schema (the field order) to the log file
+void log_store_schema(struct sample_store *store)
+{
+	int k;
 
-		core = proc_in_pkg[socket];
-		msr_num = U_MSR_PMON_FIXED_CTR;
-		rc64 = pread(msr_fd[core],&msr_val,sizeof(msr_val),msr_num);
-		if (rc64 != sizeof(msr_val)) {
-			fprintf(log_file,"ERROR: failed to read performance counter number %d MSR %x on Logical Processor %d",
-						counter, msr_num, core);
+	fprintf(log_file,"SCHEMA: %s layout, record of %d fields in %d values (%lu bytes)\n",
+		(store->layout == STORE_SAMPLE_MAJOR) ? "sample-major" : "series-major",
+		store->num_series, store->record_len, store->record_len * sizeof(uint64_t));
+	for (k=0; k<store->num_series; k++) {
+		fprintf(log_file,"SCHEMA: field %d %s scale %d\n",k,store->desc[k].name,store->desc[k].scale);
+	}
+}
+
+// ==================================================================================================================
+// Text output
+//		The lines of a sample are described once, after the series are allocated, by a list of items in
+//		output order, each with its constant part (the name and the indices up to the sample index) already
+//		rendered.  Formatting a line is then a copy of the prefix and of the sample index (rendered once per
+//		sample), and a table-driven conversion of the value -- there is no format string parsing, and no
+//		stdio call per value.  The text is byte-for-byte the same as the fprintf() formatting it replaced.
+//		The multiplexed event groups are written as running totals, which are the only state carried from one
+//		sample to the next, so a range of samples can be formatted anywhere once the totals at its start are
+//		known (text_format_samples() with no buffer only updates the totals, which is cheap).
+//		At the end of the run, write_text_results() formats blocks of samples in parallel on worker threads,
+//		one block per thread per round, and writes the blocks in order.
+//
+static const char text_digit_pairs[201] =
+	"0001020304050607080910111213141516171819"
+	"2021222324252627282930313233343536373839"
+	"4041424344454647484950515253545556575859"
+	"6061626364656667686970717273747576777879"
+	"8081828384858687888990919293949596979899";
+
+static inline char *text_u64(char *p, uint64_t v)
+{
+	char digits[20];
+	char *q = &digits[20];
+	int n;
+
+	while (v >= 100) {
+		q -= 2;
+		memcpy(q, &text_digit_pairs[(v % 100) * 2], 2);
+		v /= 100;
+	}
+	if (v >= 10) {
+		q -= 2;
+		memcpy(q, &text_digit_pairs[v * 2], 2);
+	} else {
+		*--q = '0' + v;
+	}
+	n = &digits[20] - q;
+	memcpy(p, q, n);
+	return (p + n);
+}
+
+static inline char *text_hex(char *p, uint64_t v)
+{
+	int n, k;
+
+	n = (v == 0) ? 1 : (67 - __builtin_clzl(v)) / 4;
+	for (k=n-1; k>=0; k--) {
+		p[k] = "0123456789abcdef"[v & 15];
+		v >>= 4;
+	}
+	return (p + n);
+}
+
+void text_add_item(int kind, int column, int scale, char *format, ...)
+{
+	struct text_item *item;
+	char prefix[256];
+	va_list args;
+
+	if (num_text_items == max_text_items) {
+		max_text_items = (max_text_items == 0) ? 1024 : 2*max_text_items;
+		text_items = realloc(text_items, max_text_items * sizeof(struct text_item));
+		if (text_items == NULL) {
+			fprintf(log_file,"ERROR: unable to allocate the text output items\n");
 			exit(-1);
 		}
-		ubox_uclk[socket][sample] = msr_val;
-		reads_performed++;
 	}
-	tsc_after = rdtscp();
-	delta_tsc = tsc_after - tsc_before;
-	avg_tsc = delta_tsc / reads_performed;
-	fprintf(log_file,"OVERHEAD: reading %d socket-scope-MSR-counters %lu total TSC cycles, %lu average TSC cycles\n",reads_performed,delta_tsc,avg_tsc);
+	item = &text_items[num_text_items++];
+	va_start(args, format);
+	vsnprintf(prefix, sizeof(prefix), format, args);
+	va_end(args);
+	item->prefix = strdup(prefix);
+	item->prefix_len = strlen(prefix);
+	item->kind = kind;
+	item->column = column;
+	item->scale = scale;
+	item->group_column = -1;
+	item->group = -1;
+	item->total = -1;
+	// prefix, sample index, "] = 0x", value, newline
+	text_sample_bytes += item->prefix_len + 20 + 6 + 21 + 1;
+}
 
-	// Read the programmable core counters in each logical processor
-	fprintf(log_file,"VERBOSE: Reading Programmable Core counters....\n");
-	reads_performed = 0;
-	tsc_before = rdtscp();
+void rollup_text_items();
+
+// Describe the lines of one sample (in the order of the output file).
+// Called from main() after allocate_series().
+void build_text_items()
+{
+	uint32_t socket, channel, counter, cha;
+	int lproc, g;
+
+	text_add_item(TEXT_UNSIGNED, tsc_start, 1, "tsc[");
+	text_add_item(TEXT_SIGNED, walltime[0], 1, "walltime[0][");
+	text_add_item(TEXT_SIGNED, walltime[1], 1, "walltime[1][");
+
+	// temperature, PKG energy (unscaled), DRAM energy (unscaled), and PKG throttled time for each socket
+	for (socket=0; socket<NUM_SOCKETS; socket++) {
+		text_add_item(TEXT_SIGNED, pkg_temperature[socket], 1, "pkg_temperature[%u][", socket);
+		text_add_item(TEXT_SIGNED, rapl_pkg_energy[socket], 1, "rapl_pkg_energy[%u][", socket);
+		text_add_item(TEXT_SIGNED, rapl_dram_energy[socket], 1, "rapl_dram_energy[%u][", socket);
+		text_add_item(TEXT_SIGNED, rapl_pkg_throttled[socket], 1, "rapl_pkg_throttled[%u][", socket);
+		text_add_item(TEXT_HEX, pkg_therm_status[socket], 1, "pkg_therm_status[%u][", socket);
+		text_add_item(TEXT_HEX, pkg_core_perf_limit_reasons[socket], 1, "pkg_core_perf_limit_reasons[%u][", socket);
+		text_add_item(TEXT_HEX, pkg_ring_perf_limit_reasons[socket], 1, "pkg_ring_perf_limit_reasons[%u][", socket);
+		text_add_item(TEXT_UNSIGNED, smi_count[socket], 1, "smi_count[%u][", socket);
+	}
+
+	// the Uncore Cycle Counter in the UBox from each socket
+	for (socket=0; socket<NUM_SOCKETS; socket++) {
+		text_add_item(TEXT_UNSIGNED, ubox_uclk[socket], 1, "ubox_uclk[%u][", socket);
+	}
+
+	// fixed-function core counters
 	for (lproc=0; lproc<nr_cpus; lproc++) {
-		for (counter=0; counter<NUM_CORE_COUNTERS; counter++) {
-			msr_num = 0xC1 + counter;
-			rc64 = pread(msr_fd[lproc],&msr_val,sizeof(msr_val),msr_num);
-			if (rc64 != sizeof(msr_val)) {
-				fprintf(log_file,"ERROR: failed to read performance counter number %d MSR %x on Logical Processor %d",
-					counter, msr_num, lproc);
-				exit(-1);
-			}
-			core_counts[lproc][counter][sample] = msr_val;
-			reads_performed++;
-		}
+		text_add_item(TEXT_UNSIGNED, core_fixed[lproc][0], 1, "core_fixed_counts[%d][\"Inst_Retired.Any\"][", lproc);
+		text_add_item(TEXT_UNSIGNED, core_fixed[lproc][1], 1, "core_fixed_counts[%d][\"CPU_CLK_Unhalted.Core\"][", lproc);
+		text_add_item(TEXT_UNSIGNED, core_fixed[lproc][2], 1, "core_fixed_counts[%d][\"CPU_CLK_Unhalted.Ref\"][", lproc);
 	}
-	tsc_after = rdtscp();
-	delta_tsc = tsc_after - tsc_before;
-	avg_tsc = delta_tsc / reads_performed;
-	fprintf(log_file,"OVERHEAD: reading %d programmable_core_counters %lu total TSC cycles, %lu average TSC cycles\n",reads_performed,delta_tsc,avg_tsc);
 
-	// Read the fixed-function core counters in each logical processor
-	fprintf(log_file,"VERBOSE: Reading Fixed-Function Core counters....\n");
-	reads_performed = 0;
-	tsc_before = rdtscp();
+	// programmable core counters
+	//		with multiplexed groups, each event gets the accumulated count while its group was active
+	if (core_mux_groups > 1) text_add_item(TEXT_UNSIGNED, core_mux_group, 1, "core_mux_group[");
+	if ((core_mux_groups > 1) || (cha_mux_groups > 1)) text_add_item(TEXT_UNSIGNED, mux_active_tsc, 1, "mux_active_tsc[");
 	for (lproc=0; lproc<nr_cpus; lproc++) {
-		for (counter=0; counter<3; counter++) {
-			msr_num = 0x309 + counter;
-			rc64 = pread(msr_fd[lproc],&msr_val,sizeof(msr_val),msr_num);
-			if (rc64 != sizeof(msr_val)) {
-				fprintf(log_file,"ERROR: failed to read performance counter number %d MSR %x on Logical Processor %d",
-					counter, msr_num, lproc);
-				exit(-1);
+		for (counter=0; counter<4; counter++) {
+			if (core_mux_groups == 1) {
+				text_add_item(TEXT_UNSIGNED, core_counts[lproc][counter], 1, "core_counts[%d][\"%s\"][",
+					lproc, core_event_name[lproc][counter]);
+				continue;
+			}
+			text_add_item(TEXT_MUX_ADD, core_counts[lproc][counter], 1, "");
+			text_items[num_text_items-1].group_column = core_mux_group;
+			text_items[num_text_items-1].total = num_text_totals;
+			for (g=0; g<core_mux_groups; g++) {
+				text_add_item(TEXT_MUX_TOTAL, core_counts[lproc][counter], 1, "core_counts[%d][\"%s\"][",
+					lproc, core_mux_event_name[g][lproc][counter]);
+				text_items[num_text_items-1].group_column = core_mux_group;
+				text_items[num_text_items-1].group = g;
+				text_items[num_text_items-1].total = num_text_totals++;
 			}
-			core_fixed[lproc][counter][sample] = msr_val;
-			reads_performed++;
 		}
 	}
-	tsc_after = rdtscp();
-	delta_tsc = tsc_after - tsc_before;
-	avg_tsc = delta_tsc / reads_performed;
-	fprintf(log_file,"OVERHEAD: reading %d fixed-function_core_counters %lu total TSC cycles, %lu average TSC cycles\n",reads_performed,delta_tsc,avg_tsc);
 
-	// Read additional MSR-based counters in each logical processor
-	fprintf(log_file,"VERBOSE: Reading additional MSR Core counters....\n");
-	reads_performed = 0;
-	tsc_before = rdtscp();
+	// extra MSR-based core counters
 	for (lproc=0; lproc<nr_cpus; lproc++) {
-		msr_num = IA32_APERF;
-		rc64 = pread(msr_fd[lproc],&msr_val,sizeof(msr_val),msr_num);
-		if (rc64 != sizeof(msr_val)) {
-			fprintf(log_file,"ERROR: failed to read APERF MSR %x on Logical Processor %d", msr_num, lproc);
-			exit(-1);
-		}
-		aperf[lproc][sample] = msr_val;
-		reads_performed++;
-		msr_num = IA32_MPERF;
-		rc64 = pread(msr_fd[lproc],&msr_val,sizeof(msr_val),msr_num);
-		if (rc64 != sizeof(msr_val)) {
-			fprintf(log_file,"ERROR: failed to read MPERF MSR %x on Logical Processor %d", msr_num, lproc);
-			exit(-1);
-		}
-		mperf[lproc][sample] = msr_val;
-		reads_performed++;
-
+		text_add_item(TEXT_UNSIGNED, aperf[lproc], 1, "aperf[%d][", lproc);
+		text_add_item(TEXT_UNSIGNED, mperf[lproc], 1, "mperf[%d][", lproc);
 	}
-	tsc_after = rdtscp();
-	delta_tsc = tsc_after - tsc_before;
-	avg_tsc = delta_tsc / reads_performed;
-	fprintf(log_file,"OVERHEAD: reading %d extra_MSR_core_counters %lu total TSC cycles, %lu average TSC cycles\n",reads_performed,delta_tsc,avg_tsc);
 
-
-	// NEW -- read CHA counters for SKX
-	fprintf(log_file,"VERBOSE: Reading CHA counters....\n");
-	reads_performed = 0;
-	tsc_before = rdtscp();
-	for (socket=0; socket<2; socket++) {
-		core = proc_in_pkg[socket];
+	// CHA counters
+	if (cha_mux_groups > 1) text_add_item(TEXT_UNSIGNED, cha_mux_group, 1, "cha_mux_group[");
+	for (socket=0; socket<NUM_SOCKETS; socket++) {
 		for (cha=0; cha<NUM_CHA_BOXES; cha++) {
 			for (counter=0; counter<NUM_CHA_COUNTERS; counter++) {
-				msr_num = CHA_MSR_PMON_CTR_BASE + (0x10 * cha) + counter;
-				// fprintf(log_file,"DEBUG: socket %u core %u cha %u counter %u msr_num %lx msr_val %lu\n", socket, core, cha, counter, msr_num, msr_val);
-				rc64 = pread(msr_fd[core],&msr_val,sizeof(msr_val),msr_num);
-				if (rc64 != sizeof(msr_val)) {
-					fprintf(log_file,"ERROR: failed to read MSR %x on Logical Processor %d", msr_num, core);
-					exit(-1);
+				if (cha_mux_groups == 1) {
+					text_add_item(TEXT_UNSIGNED, cha_counts[socket][cha][counter], 1, "cha_counts[%u][%u][\"%s\"][",
+						socket, cha, cha_event_name[socket][cha][counter]);
+					continue;
+				}
+				text_add_item(TEXT_MUX_ADD, cha_counts[socket][cha][counter], 1, "");
+				text_items[num_text_items-1].group_column = cha_mux_group;
+				text_items[num_text_items-1].total = num_text_totals;
+				for (g=0; g<cha_mux_groups; g++) {
+					text_add_item(TEXT_MUX_TOTAL, cha_counts[socket][cha][counter], 1, "cha_counts[%u][%u][\"%s\"][",
+						socket, cha, cha_mux_event_name[g][socket][cha][counter]);
+					text_items[num_text_items-1].group_column = cha_mux_group;
+					text_items[num_text_items-1].group = g;
+					text_items[num_text_items-1].total = num_text_totals++;
 				}
-				cha_counts[socket][cha][counter][sample] = msr_val;
-				reads_performed++;
 			}
 		}
 	}
-	tsc_after = rdtscp();
-	delta_tsc = tsc_after - tsc_before;
-	avg_tsc = delta_tsc / reads_performed;
-	fprintf(log_file,"OVERHEAD: reading %d CHA_counters %lu total TSC cycles, %lu average TSC cycles\n",reads_performed,delta_tsc,avg_tsc);
-
 
-#if 0
-	fprintf(log_file,"VERBOSE: Reading HomeAgent counters....\n");
-	reads_performed = 0;
-	tsc_before = rdtscp();
-	for (socket=0; socket<2; socket++) {
-		bus = HA_BUS_Socket[socket];
-		for (ha=0; ha<2; ha++) {
-			device = HA_Device_Agent[ha];
-			function = HA_Function_Agent[ha];
-			for (counter=0; counter<4; counter++) {
-				offset = HA_PmonCtr_Offset[counter];
-				index = PCI_cfg_index(bus, device, function, offset);
-				low = mmconfig_ptr[index];
-				high = mmconfig_ptr[index+1];
-				count = ((uint64_t) high) << 32 | (uint64_t) low;
-				// fprintf(log_file,"DEBUG: low %x high %x count %lx (count %ld)\n",low,high,count,count);
-				ha_counts[socket][ha][counter][sample] = count;
-				reads_performed++;
+	// IMC counters
+	for (socket=0; socket<NUM_SOCKETS; socket++) {
+		for (channel=0; channel<NUM_IMC_CHANNELS; channel++) {
+			for (counter=0; counter<NUM_IMC_COUNTERS; counter++) {
+				text_add_item(TEXT_UNSIGNED, imc_counts[socket][channel][counter], 1, "imc_counts[%u][%u][\"%s\"][",
+					socket, channel, imc_event_name[socket][channel][counter]);
 			}
 		}
 	}
-	tsc_after = rdtscp();
-	delta_tsc = tsc_after - tsc_before;
-	avg_tsc = delta_tsc / reads_performed;
-	fprintf(log_file,"OVERHEAD: reading %d HomeAgent_counters %lu total TSC cycles, %lu average TSC cycles\n",reads_performed,delta_tsc,avg_tsc);
+#ifdef INFINIBAND
+	// InfiniBand receive and transmit counts
+	//    scale by 4 to get Bytes in the output file
+	text_add_item(TEXT_UNSIGNED, ib_recv, 4, "ib_recv_bytes[");
+	text_add_item(TEXT_UNSIGNED, ib_xmit, 4, "ib_xmit_bytes[");
 #endif
 
+	// Free-Running IO counters (scaled by 4 to get Bytes)
+	for (socket=0; socket<NUM_SOCKETS; socket++) {
+		text_add_item(TEXT_UNSIGNED, iio_CBDMA_port1_in[socket], 4, "iio_CBDMA_port1_in_bytes[%u][", socket);
+		text_add_item(TEXT_UNSIGNED, iio_CBDMA_port1_out[socket], 4, "iio_CBDMA_port1_out_bytes[%u][", socket);
+		text_add_item(TEXT_UNSIGNED, iio_PCIe0_port1_in[socket], 4, "iio_PCIe0_port1_in_bytes[%u][", socket);
+		text_add_item(TEXT_UNSIGNED, iio_PCIe0_port1_out[socket], 4, "iio_PCIe0_port1_out_bytes[%u][", socket);
+		text_add_item(TEXT_UNSIGNED, iio_PCIe2_port0_in[socket], 4, "iio_PCIe2_port0_in_bytes[%u][", socket);
+		text_add_item(TEXT_UNSIGNED, iio_PCIe2_port0_out[socket], 4, "iio_PCIe2_port0_out_bytes[%u][", socket);
+	}
+	// PCU counters
+	for (socket=0; socket<NUM_SOCKETS; socket++) {
+		for (counter=0; counter<4; counter++) {
+			text_add_item(TEXT_UNSIGNED, pcu_counts[socket][counter], 1, "pcu_counts[%u][\"%s\"][",
+				socket, pcu_event_name[socket][counter]);
+		}
+	}
+	if (use_rollups) rollup_text_items();
 
+	text_totals = calloc(num_text_totals + 1, sizeof(uint64_t));
+	text_block_samples = TEXT_BLOCK_BYTES / text_sample_bytes;
+	if (text_block_samples < 1) text_block_samples = 1;
+	if (text_totals == NULL) {
+		fprintf(log_file,"ERROR: unable to allocate the multiplexed totals\n");
+		exit(-1);
+	}
+}
+
+static inline uint64_t text_value(struct text_worker *worker, int column, long i)
+{
+	if (samples.chunk[i / samples.chunk_samples] != NULL) return (*store_value(&samples, column, i));
+	return (*store_unpack(&samples, worker->scratch, worker->scratch_chunk, column, i));
+}
+
+// Format samples first..last-1 into the worker's buffer, starting from (and updating) the multiplexed
+// totals.  With buf NULL, only the totals are updated.  Returns the number of bytes.
+size_t text_format_samples(struct text_worker *worker, long first, long last, uint64_t *totals, char *buf)
+{
+	struct text_item *item;
+	char index_text[32];
+	char *p = buf;
+	char *q;
+	uint64_t value;
+	long i;
+	int k, index_len;
+
+	for (i=first; i<last; i++) {
+		// the sample index and the " = " after it are the same on every line of the sample
+		q = text_u64(index_text, i);
+		memcpy(q, "] = ", 4);
+		index_len = q + 4 - index_text;
+		for (k=0; k<num_text_items; k++) {
+			item = &text_items[k];
+			if (item->kind == TEXT_MUX_ADD) {
+				if (i > 0) totals[item->total + text_value(worker, item->group_column, i)] +=
+					(text_value(worker, item->column, i) - text_value(worker, item->column, i-1)) & PMC_WIDTH_MASK;
+				continue;
+			}
+			if (buf == NULL) continue;
+			memcpy(p, item->prefix, item->prefix_len);
+			p += item->prefix_len;
+			memcpy(p, index_text, index_len);
+			p += index_len;
+			switch (item->kind) {
+				case TEXT_UNSIGNED:
+					p = text_u64(p, text_value(worker, item->column, i) * item->scale);
+					break;
+				case TEXT_SIGNED:
+					value = text_value(worker, item->column, i);
+					if ((int64_t)value < 0) {
+						*p++ = '-';
+						value = -value;
+					}
+					p = text_u64(p, value);
+					break;
+				case TEXT_HEX:
+					*p++ = '0';
+					*p++ = 'x';
+					p = text_hex(p, text_value(worker, item->column, i));
+					break;
+				case TEXT_MUX_TOTAL:
+					p = text_u64(p, totals[item->total]);
+					break;
+			}
+			*p++ = '\n';
+		}
+	}
+	return (p - buf);
+}
+
+void text_init_worker(struct text_worker *worker)
+{
+	long k;
+
+	memset(worker, 0, sizeof(struct text_worker));
+	worker->totals = malloc((num_text_totals + 1) * sizeof(uint64_t));
+	worker->buf = malloc(text_block_samples * text_sample_bytes);
+	if (samples.pack_chunks) {
+		worker->scratch = malloc((size_t)samples.num_series * samples.chunk_samples * sizeof(uint64_t));
+		worker->scratch_chunk = malloc(samples.num_series * sizeof(long));
+		if ((worker->scratch == NULL) || (worker->scratch_chunk == NULL)) worker->buf = NULL;
+		else for (k=0; k<samples.num_series; k++) worker->scratch_chunk[k] = -1;
+	}
+	if ((worker->totals == NULL) || (worker->buf == NULL)) {
+		fprintf(log_file,"ERROR: unable to allocate a text output buffer of %lu bytes\n",text_block_samples * text_sample_bytes);
+		exit(-1);
+	}
+}
+
+void *text_worker_thread(void *arg)
+{
+	struct text_worker *worker = (struct text_worker *)arg;
+
+	while (1) {
+		pthread_barrier_wait(&text_start);
+		if (text_exit) break;
+		worker->bytes = text_format_samples(worker, worker->first, worker->last, worker->totals, worker->buf);
+		pthread_barrier_wait(&text_done);
+	}
+	return NULL;
+}
+
+// Write samples first..last-1 to the results file, formatting them in parallel
+void write_text_results(long first, long last)
+{
+	struct text_worker main_cache;
+	long num_blocks, next;
+	int num_threads, w, rc;
+
+	if (first >= last) return;
+	num_blocks = (last - first + text_block_samples - 1) / text_block_samples;
+	num_threads = sysconf(_SC_NPROCESSORS_ONLN);
+	if (num_threads > TEXT_MAX_THREADS) num_threads = TEXT_MAX_THREADS;
+	if (num_threads > num_blocks) num_threads = num_blocks;
+	if (num_threads < 1) num_threads = 1;
+
+	// (the main thread only reads the store to advance the totals, with a cache of its own)
+	memset(&main_cache, 0, sizeof(main_cache));
+	main_cache.scratch = samples.scratch;
+	main_cache.scratch_chunk = samples.scratch_chunk;
+	text_workers = malloc(num_threads * sizeof(struct text_worker));
+	if (text_workers == NULL) {
+		fprintf(log_file,"ERROR: unable to allocate the text output workers\n");
+		exit(-1);
+	}
+	pthread_barrier_init(&text_start, NULL, num_threads+1);
+	pthread_barrier_init(&text_done, NULL, num_threads+1);
+	text_exit = 0;
+	for (w=0; w<num_threads; w++) {
+		text_init_worker(&text_workers[w]);
+		rc = pthread_create(&text_workers[w].thread, NULL, text_worker_thread, &text_workers[w]);
+		if (rc != 0) {
+			fprintf(log_file,"ERROR %s when trying to create text output thread %d\n",strerror(rc),w);
+			exit(-1);
+		}
+	}
+
+	next = first;
+	while (next < last) {
+		for (w=0; w<num_threads; w++) {
+			text_workers[w].first = next;
+			text_workers[w].last = (next + text_block_samples < last) ? next + text_block_samples : last;
+			memcpy(text_workers[w].totals, text_totals, num_text_totals * sizeof(uint64_t));
+			if (num_text_totals > 0) text_format_samples(&main_cache, next, text_workers[w].last, text_totals, NULL);
+			next = text_workers[w].last;
+		}
+		pthread_barrier_wait(&text_start);
+		pthread_barrier_wait(&text_done);
+		for (w=0; w<num_threads; w++) {
+			fwrite(text_workers[w].buf, 1, text_workers[w].bytes, results_file);
+		}
+	}
+	text_exit = 1;
+	pthread_barrier_wait(&text_start);
+	for (w=0; w<num_threads; w++) {
+		pthread_join(text_workers[w].thread, NULL);
+		free(text_workers[w].totals);
+		free(text_workers[w].buf);
+		free(text_workers[w].scratch);
+		free(text_workers[w].scratch_chunk);
+	}
+	free(text_workers);
+	pthread_barrier_destroy(&text_start);
+	pthread_barrier_destroy(&text_done);
+}
+
+// ==================================================================================================================
+// Lua table output ("-T" option)
+//		Each series is written as one table constructor holding all of its samples, indexed from 0 as in the
+//		assignment output, e.g.,   imc_counts[0][0]["CAS_COUNT.READS"] = {[0]=1234, 1240, ...}
+//		Lua limits the number of constants in a function (2^18 in Lua 5.1), so the constructors are written
+//		inside functions of at most TABLE_FUNCTION_VALUES values, each called right after its definition as
+//		Chunkify_Lua_files.sh does, and a series that does not fit in the rest of a function is continued
+//		in the next one with perfcounts_append().  The names are the same as in the assignment output, so
+//		a script that declares the tables down to the event level reads either form, and the values are
+//		formatted by the same code as the assignment output.
+//
+#define TABLE_FUNCTION_VALUES 100000
+
+// Sample i of the series of an output item, as written (scaled).  For TEXT_MUX_TOTAL, *total is the running
+// total of the series, so the samples must be taken in order from 0.
+static inline uint64_t text_item_value(struct text_item *item, long i, uint64_t *total)
+{
+	if (item->kind == TEXT_MUX_TOTAL) {
+		if ((i > 0) && (SAMPLE(item->group_column, i) == (uint64_t)item->group)) {
+			*total += (SAMPLE(item->column, i) - SAMPLE(item->column, i-1)) & PMC_WIDTH_MASK;
+		}
+		return (*total);
+	}
+	return (SAMPLE(item->column, i) * item->scale);
+}
+
+void write_table_results()
+{
+	struct text_item *item;
+	char *buf, *p;
+	uint64_t value, total;
+	long i, in_function, piece_first;
+	int k, function_num, piece_open;
+
+	if (sample == 0) return;
+	buf = malloc(TEXT_BLOCK_BYTES + 1024);
+	if (buf == NULL) {
+		fprintf(log_file,"ERROR: unable to allocate the table output buffer\n");
+		exit(-1);
+	}
+	fprintf(results_file,"function perfcounts_append(t, first, values) for i = 1, #values do t[first+i-1] = values[i] end end\n");
+	function_num = 0;
+	in_function = TABLE_FUNCTION_VALUES;		// (opens the first function)
+	p = buf;
+	for (k=0; k<num_text_items; k++) {
+		item = &text_items[k];
+		if (item->kind == TEXT_MUX_ADD) continue;
+		total = 0;
+		piece_open = 0;
+		for (i=0; i<sample; i++) {
+			if (!piece_open) {
+				if (in_function == TABLE_FUNCTION_VALUES) {
+					if (function_num > 0) p += sprintf(p, "end\nCHUNK_%d()\n", function_num);
+					function_num++;
+					p += sprintf(p, "function CHUNK_%d()\n", function_num);
+					in_function = 0;
+				}
+				// (the name is the prefix without its final "[")
+				piece_first = i;
+				if (i == 0) {
+					memcpy(p, item->prefix, item->prefix_len - 1);
+					p += item->prefix_len - 1;
+					memcpy(p, " = {[0]=", 8);
+					p += 8;
+				} else {
+					memcpy(p, "perfcounts_append(", 18);
+					p += 18;
+					memcpy(p, item->prefix, item->prefix_len - 1);
+					p += item->prefix_len - 1;
+					*p++ = ',';
+					*p++ = ' ';
+					p = text_u64(p, i);
+					memcpy(p, ", {", 3);
+					p += 3;
+				}
+				piece_open = 1;
+			} else {
+				*p++ = ',';
+				*p++ = ' ';
+			}
+			value = text_item_value(item, i, &total);
+			if (item->kind == TEXT_HEX) {
+				*p++ = '0';
+				*p++ = 'x';
+				p = text_hex(p, value);
+			} else if ((item->kind == TEXT_SIGNED) && ((int64_t)value < 0)) {
+				*p++ = '-';
+				p = text_u64(p, -value);
+			} else {
+				p = text_u64(p, value);
+			}
+			in_function++;
+			if ((in_function == TABLE_FUNCTION_VALUES) || (i == sample-1)) {
+				if (piece_first == 0) {
+					memcpy(p, "}\n", 2);
+					p += 2;
+				} else {
+					memcpy(p, "})\n", 3);
+					p += 3;
+				}
+				piece_open = 0;
+			}
+			if (p - buf > TEXT_BLOCK_BYTES) {
+				fwrite(buf, 1, p - buf, results_file);
+				p = buf;
+			}
+		}
+	}
+	p += sprintf(p, "end\nCHUNK_%d()\n", function_num);
+	fwrite(buf, 1, p - buf, results_file);
+	free(buf);
+}
+
+// ==================================================================================================================
+// NumPy output ("-N" option)
+//		Each array of the Lua output (the name up to the first "[", e.g., imc_counts) is written to the directory
+//		<hostname>.perfcounts.npy as <array>.npy, with the indices of the Lua names as its leading dimensions and
+//		the samples as the last one, so imc_counts[0][1]["CAS_COUNT.READS"][i] is imc_counts[0,1,k,i], where
+//		"CAS_COUNT.READS" is the k'th event of the box.  The values are the ones in the Lua output (scaled,
+//		multiplexed totals), as little-endian int64 (arrays with signed values) or uint64.  Arrays whose items
+//		do not fill a regular grid are written with one row per item.  perfcounts.json holds the units and, for
+//		each array, its shape, dtype, and the Lua name of each row (which holds the event names), so a whole
+//		node can be opened with numpy.load(mmap_mode='r') without parsing anything else.
+//
+struct npy_array {
+	char name[80];
+	int *items;						// the array's text items, in output order (one row each)
+	int rows;
+	int num_dims;
+	long dims[8];					// not including the samples
+	int is_signed;
+};
+
+// Find the shape of the items of an array from the indices in their names -- every numeric index position
+// is a dimension, and (at most) one position holding event names gets the rest of the items.
+// Falls back to one dimension (one row per item) if the items are not in row-major order of a full grid.
+void npy_shape(struct npy_array *array)
+{
+	char *index[8];
+	char *q;
+	long value[8], expected, rest, product;
+	int k, row, j, num_index, event_pos;
+
+	num_index = -1;
+	event_pos = -1;
+	memset(array->dims, 0, sizeof(array->dims));
+	// pass 1: the number of indices, their kind, and the largest numeric values
+	for (row=0; row<array->rows; row++) {
+		k = array->items[row];
+		j = 0;
+		for (q=strchr(text_items[k].prefix, '['); (q != NULL) && (q[1] != 0); q=strchr(q+1, '[')) {
+			if (j == 8) goto flat;
+			if (q[1] == '"') {
+				if ((event_pos >= 0) && (event_pos != j)) goto flat;
+				event_pos = j;
+			} else {
+				value[j] = atol(q+1);
+				if (value[j] + 1 > array->dims[j]) array->dims[j] = value[j] + 1;
+			}
+			j++;
+		}
+		if ((num_index >= 0) && (j != num_index)) goto flat;
+		num_index = j;
+	}
+	product = 1;
+	for (j=0; j<num_index; j++) if (j != event_pos) product *= array->dims[j];
+	rest = array->rows / product;
+	if (rest * product != array->rows) goto flat;
+	if (event_pos >= 0) array->dims[event_pos] = rest;
+	else if (rest != 1) goto flat;
+	// pass 2: the numeric indices must count through the grid in row-major order
+	for (row=0; row<array->rows; row++) {
+		k = array->items[row];
+		j = 0;
+		for (q=strchr(text_items[k].prefix, '['); (q != NULL) && (q[1] != 0); q=strchr(q+1, '[')) index[j++] = q+1;
+		expected = row;
+		for (j=num_index-1; j>=0; j--) {
+			if ((j != event_pos) && (atol(index[j]) != expected % array->dims[j])) goto flat;
+			expected /= array->dims[j];
+		}
+	}
+	array->num_dims = num_index;
+	return;
+flat:
+	array->num_dims = 1;
+	array->dims[0] = array->rows;
+}
+
+void write_npy_array(char *path, struct npy_array *array, uint64_t *values)
+{
+	FILE *file;
+	char header[512];
+	char shape[200];
+	uint16_t header_len;
+	uint64_t total;
+	int k, j, n;
+	long i;
+
+	n = 0;
+	for (j=0; j<array->num_dims; j++) n += sprintf(&shape[n], "%ld, ", array->dims[j]);
+	sprintf(&shape[n], "%d,", sample);
+	n = sprintf(header, "{'descr': '%s', 'fortran_order': False, 'shape': (%s), }",
+		array->is_signed ? "<i8" : "<u8", shape);
+	// (the data starts on a 64-byte boundary after the 10-byte preamble, and the header ends with a newline)
+	while ((10 + n + 1) % 64 != 0) header[n++] = ' ';
+	header[n++] = '\n';
+	header_len = n;
+	file = fopen(path, "w");
+	if (file == NULL) {
+		fprintf(log_file,"ERROR %s when trying to open NumPy output file %s\n",strerror(errno),path);
+		exit(-1);
+	}
+	fwrite("\x93NUMPY\x01\x00", 1, 8, file);
+	fwrite(&header_len, sizeof(header_len), 1, file);
+	fwrite(header, 1, n, file);
+	for (k=0; k<array->rows; k++) {
+		total = 0;
+		for (i=0; i<sample; i++) values[i] = text_item_value(&text_items[array->items[k]], i, &total);
+		fwrite(values, sizeof(uint64_t), sample, file);
+	}
+	if (fclose(file) != 0) {
+		fprintf(log_file,"ERROR %s when writing NumPy output file %s\n",strerror(errno),path);
+		exit(-1);
+	}
+}
+
+void write_npy_results(double package_tdp)
+{
+	struct npy_array array;
+	FILE *json;
+	char path[300];
+	uint64_t *values;
+	uint64_t tsc_before, tsc_after;
+	int *items;
+	char *in_array;
+	int k, m, j, name_len, num_arrays;
+	char *p;
+
+	tsc_before = rdtscp();
+	if ((mkdir(npy_dirname, 0755) != 0) && (errno != EEXIST)) {
+		fprintf(log_file,"ERROR %s when trying to create the NumPy output directory %s\n",strerror(errno),npy_dirname);
+		exit(-1);
+	}
+	values = malloc((sample + 1) * sizeof(uint64_t));
+	items = malloc(num_text_items * sizeof(int));
+	in_array = calloc(num_text_items, 1);
+	sprintf(path, "%s/perfcounts.json", npy_dirname);
+	json = fopen(path, "w");
+	if ((values == NULL) || (items == NULL) || (in_array == NULL) || (json == NULL)) {
+		fprintf(log_file,"ERROR: unable to write the NumPy output index %s\n",path);
+		exit(-1);
+	}
+	fprintf(json, "{\n\"num_samples\": %d,\n\"nr_cpus\": %ld,\n\"TSC_ratio\": %d,\n\"PROCHOT\": %d,\n", sample, nr_cpus, TSC_ratio, temp_target);
+	fprintf(json, "\"RAPL_POWER_UNIT\": %.9f,\n\"RAPL_PKG_ENERGY_UNIT\": %.12e,\n\"RAPL_DRAM_ENERGY_UNIT\": %.12e,\n\"RAPL_ENERGY_WIDTH\": %d,\n",
+		power_unit, pkg_energy_unit, dram_energy_unit, rapl_energy_width);
+	fprintf(json, "\"RAPL_TIME_UNIT\": %.9f,\n\"PACKAGE_TDP\": %.6f,\n\"arrays\": {", time_unit, package_tdp);
+
+	num_arrays = 0;
+	for (k=0; k<num_text_items; k++) {
+		if ((text_items[k].kind == TEXT_MUX_ADD) || (in_array[k])) continue;
+		// an array is all of the items with the same name before the first "[" (e.g., the per-socket
+		// items of several arrays are interleaved in the output)
+		name_len = strcspn(text_items[k].prefix, "[");
+		memset(&array, 0, sizeof(array));
+		snprintf(array.name, sizeof(array.name), "%.*s", name_len, text_items[k].prefix);
+		array.items = items;
+		for (m=k; m<num_text_items; m++) {
+			p = text_items[m].prefix;
+			if ((text_items[m].kind == TEXT_MUX_ADD) || (strncmp(p, array.name, name_len) != 0) || (p[name_len] != '[')) continue;
+			if (text_items[m].kind == TEXT_SIGNED) array.is_signed = 1;
+			array.items[array.rows++] = m;
+			in_array[m] = 1;
+		}
+		npy_shape(&array);
+		sprintf(path, "%s/%s.npy", npy_dirname, array.name);
+		write_npy_array(path, &array, values);
+
+		fprintf(json, "%s\n\"%s\": {\"dtype\": \"%s\", \"shape\": [", (num_arrays++ > 0) ? "," : "", array.name,
+			array.is_signed ? "<i8" : "<u8");
+		for (j=0; j<array.num_dims; j++) fprintf(json, "%ld, ", array.dims[j]);
+		fprintf(json, "%d], \"names\": [", sample);
+		for (j=0; j<array.rows; j++) {
+			m = array.items[j];
+			fprintf(json, "%s\"", (j > 0) ? ", " : "");
+			for (p=text_items[m].prefix; p<text_items[m].prefix+text_items[m].prefix_len-1; p++) {
+				if ((*p == '"') || (*p == '\\')) fputc('\\', json);
+				fputc(*p, json);
+			}
+			fputc('"', json);
+		}
+		fprintf(json, "]}");
+	}
+	fprintf(json, "\n}\n}\n");
+	fclose(json);
+	free(values);
+	free(items);
+	free(in_array);
+	tsc_after = rdtscp();
+	fprintf(log_file,"OVERHEAD: writing %d NumPy arrays to %s took %lu TSC cycles\n",num_arrays,npy_dirname,tsc_after-tsc_before);
+}
+
+// ==================================================================================================================
+// Crash-safe store file ("-M" option, see perfcounts_store.h for the layout)
+//		The chunks of the sample store are mapped from <hostname>.perfcounts.store (store_reserve() allocates
+//		and maps each one as the run grows into it), so the samples survive the process being killed.  The file
+//		also holds what perfcounts_recover needs to write the Lua results file: the lines of one sample (the text
+//		output items) and the beginning of the results file, read back from results_file (opened "w+").
+//		The only cost per sample is the store of the committed count in store_commit().
+//
+void create_store_file()
+{
+	struct pcs_header *header;
+	struct pcs_series *series;
+	struct pcs_item *items;
+	char *base, *strings;
+	size_t strings_bytes, offset, page, preamble_bytes;
+	int fd, k;
+
+	store_freeze_series(&samples);
+	page = sysconf(_SC_PAGESIZE);
+	fflush(results_file);
+	preamble_bytes = ftell(results_file);
+	strings_bytes = 0;
+	for (k=0; k<samples.num_series; k++) strings_bytes += strlen(samples.desc[k].name) + 1;
+	for (k=0; k<num_text_items; k++) strings_bytes += text_items[k].prefix_len + 1;
+
+	fd = open(store_filename, O_RDWR|O_CREAT|O_TRUNC, 0644);
+	if (fd == -1) {
+		fprintf(log_file,"ERROR %s when trying to create the store file %s\n",strerror(errno),store_filename);
+		exit(-1);
+	}
+	if (fchown(fd, getuid(), getgid()) != 0) {
+		fprintf(log_file,"WARNING: unable to change the ownership of the store file %s\n",store_filename);
+	}
+	offset = (sizeof(struct pcs_header) + 7) & ~(size_t)7;
+	offset += samples.num_series * sizeof(struct pcs_series);
+	offset += num_text_items * sizeof(struct pcs_item);
+	offset += strings_bytes + preamble_bytes;
+	offset = (offset + page - 1) & ~(page - 1);
+	if (fallocate(fd, 0, 0, offset) != 0) {
+		fprintf(log_file,"ERROR %s when trying to allocate the store file %s\n",strerror(errno),store_filename);
+		exit(-1);
+	}
+	base = mmap(NULL, offset, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+	if (base == MAP_FAILED) {
+		fprintf(log_file,"ERROR %s when trying to map the store file %s\n",strerror(errno),store_filename);
+		exit(-1);
+	}
+	header = (struct pcs_header *)base;
+	header->version = PCS_VERSION;
+	header->header_bytes = sizeof(struct pcs_header);
+	header->layout = samples.layout;
+	header->num_series = samples.num_series;
+	header->record_len = samples.record_len;
+	header->chunk_samples = samples.chunk_samples;
+	header->chunk_bytes = ((size_t)samples.record_len * samples.chunk_samples * sizeof(uint64_t) + page - 1) & ~(page - 1);
+	header->num_items = num_text_items;
+	header->num_totals = num_text_totals;
+	header->series_offset = (sizeof(struct pcs_header) + 7) & ~(size_t)7;
+	header->items_offset = header->series_offset + samples.num_series * sizeof(struct pcs_series);
+	header->strings_offset = header->items_offset + num_text_items * sizeof(struct pcs_item);
+	header->strings_bytes = strings_bytes;
+	header->preamble_offset = header->strings_offset + strings_bytes;
+	header->preamble_bytes = preamble_bytes;
+	header->data_offset = offset;
+
+	series = (struct pcs_series *)(base + header->series_offset);
+	items = (struct pcs_item *)(base + header->items_offset);
+	strings = base + header->strings_offset;
+	offset = 0;
+	for (k=0; k<samples.num_series; k++) {
+		series[k].name = offset;
+		series[k].scale = samples.desc[k].scale;
+		series[k].width = samples.desc[k].width;
+		strcpy(&strings[offset], samples.desc[k].name);
+		offset += strlen(samples.desc[k].name) + 1;
+	}
+	for (k=0; k<num_text_items; k++) {
+		items[k].prefix = offset;
+		items[k].kind = text_items[k].kind;
+		items[k].column = text_items[k].column;
+		items[k].scale = text_items[k].scale;
+		items[k].group_column = text_items[k].group_column;
+		items[k].total = text_items[k].total;
+		strcpy(&strings[offset], text_items[k].prefix);
+		offset += text_items[k].prefix_len + 1;
+	}
+	fseek(results_file, 0, SEEK_SET);
+	if (fread(base + header->preamble_offset, 1, preamble_bytes, results_file) != preamble_bytes) {
+		fprintf(log_file,"ERROR: unable to copy the beginning of the results file to the store file\n");
+		exit(-1);
+	}
+	fseek(results_file, 0, SEEK_END);
+	memcpy(header->magic, PCS_MAGIC, sizeof(header->magic));	// (last, so a file cut short here is not valid)
+	samples.map = header;
+	samples.map_fd = fd;
+	fprintf(log_file,"INFO: sample store mapped from %s, %lu bytes per chunk\n",store_filename,header->chunk_bytes);
+}
+
+// At the end of a run whose results files have been written, the store file is no longer needed
+void remove_store_file()
+{
+	samples.map->complete = 1;
+	if (unlink(store_filename) == 0) {
+		fprintf(log_file,"INFO: results written, removed the store file %s\n",store_filename);
+	} else {
+		fprintf(log_file,"WARNING: %s when trying to remove the store file %s\n",strerror(errno),store_filename);
+	}
+}
+
+// ==================================================================================================================
+// Online derived metrics ("-e" option)
+//		The metrics of a metrics file (e.g., perfcounts.metrics -- see perfcounts_metrics.h) are compiled
+//		against the series of the sample store once they are allocated, and evaluated after each sample over
+//		the interval from the previous one: wrap-corrected deltas, then per-lproc GHz and IPC, per-socket
+//		DRAM GB/s and watts, and so on, as the file defines them.  The values are written to the live file
+//		<hostname>.perfcounts.live as "name = value" lines, into a temporary file that is then renamed, so a
+//		reader always gets one whole interval.  The main thread evaluates the metrics (which the statistics
+//		and the phase detection also use), and hands a copy of the values to a writer thread, which does the
+//		file system calls.  The hand-over uses pthread_mutex_trylock(): if the writer is copying the previous
+//		values at that instant, the main thread skips the copy rather than waiting, and the live file skips
+//		that interval.  The samples are stored and written as usual.
+//
+static const char *store_series_name(void *ctx, int column)
+{
+	return (((struct sample_store *)ctx)->desc[column].name);
+}
+
+static int store_find_series(void *ctx, const char *name)
+{
+	struct sample_store *store = ctx;
+	int k;
+
+	for (k=0; k<store->num_series; k++) if (strcmp(store->desc[k].name, name) == 0) return (k);
+	return (-1);
+}
+
+static int store_series_width(void *ctx, int column)
+{
+	return (((struct sample_store *)ctx)->desc[column].width);
+}
+
+static double store_series_scale(void *ctx, int column)
+{
+	return (((struct sample_store *)ctx)->desc[column].scale);
+}
+
+static int store_constant(void *ctx, const char *name, double *value)
+{
+	(void)ctx;					// (the constants are globals of perf_counters)
+	if (strcmp(name,"TSC_ratio") == 0) *value = TSC_ratio;
+	else if (strcmp(name,"nr_cpus") == 0) *value = nr_cpus;
+	else if (strcmp(name,"RAPL_PKG_ENERGY_UNIT") == 0) *value = pkg_energy_unit;
+	else if (strcmp(name,"RAPL_DRAM_ENERGY_UNIT") == 0) *value = dram_energy_unit;
+	else if (strcmp(name,"RAPL_TIME_UNIT") == 0) *value = time_unit;
+	else return (-1);
+	return (0);
+}
+
+static const uint64_t *store_series_values(void *ctx, int column, long first, long count, uint64_t *scratch)
+{
+	long i;
+
+	for (i=0; i<=count; i++) scratch[i] = *store_value((struct sample_store *)ctx, column, first + i);
+	return (scratch);
+}
+
+void compile_online_metrics()
+{
+	metrics_source.ctx = &samples;
+	metrics_source.num_series = samples.num_series;
+	metrics_source.series_name = store_series_name;
+	metrics_source.find_series = store_find_series;
+	metrics_source.series_width = store_series_width;
+	metrics_source.series_scale = store_series_scale;
+	metrics_source.constant = store_constant;
+	metrics_source.values = store_series_values;
+	if (pcm_compile(&online_metrics, metrics_path, &metrics_source) != 0) {
+		fprintf(log_file,"ERROR: unable to compile the metrics file %s (see stderr)\n",metrics_path);
+		exit(1);
+	}
+	online_values = calloc(online_metrics.num_instances + 1, sizeof(double));
+	fprintf(log_file,"INFO: %d online metrics (%d programs of %d operations on %d series) from %s, written to %s\n",
+		online_metrics.num_metrics,online_metrics.num_instances,online_metrics.num_ops,online_metrics.num_slots,
+		metrics_path,live_filename);
+}
+
+void *metrics_writer_thread(void *arg)
+{
+	char tmp_filename[130];
+	double *values;
+	uint64_t walltime[2];
+	int m, written, current, last;
+	FILE *fp;
+
+	(void)arg;
+	values = malloc((online_metrics.num_instances + 1) * sizeof(double));
+	sprintf(tmp_filename,"%s.tmp",live_filename);
+	written = -1;
+	while (1) {
+		sem_wait(&metrics_wakeup);
+		last = metrics_writer_exit;		// (read before the values, which then include the last interval)
+		pthread_mutex_lock(&metrics_lock);
+		current = metrics_sample;
+		memcpy(values, metrics_values, online_metrics.num_instances * sizeof(double));
+		walltime[0] = metrics_walltime[0];
+		walltime[1] = metrics_walltime[1];
+		pthread_mutex_unlock(&metrics_lock);
+		if ((current > written) && ((fp = fopen(tmp_filename,"w")) != NULL)) {
+			fprintf(fp,"sample = %d\n",current);
+			fprintf(fp,"walltime = %lu.%06lu\n",walltime[0],walltime[1]);
+			for (m=0; m<online_metrics.num_instances; m++) fprintf(fp,"%s = %.6g\n",online_metrics.instance[m].name,values[m]);
+			if (fclose(fp) == 0) rename(tmp_filename, live_filename);
+			written = current;
+		}
+		if (last) break;
+	}
+	free(values);
+	return NULL;
+}
+
+void start_metrics_writer()
+{
+	sigset_t blocked, saved;
+	int rc;
+
+	metrics_values = calloc(online_metrics.num_instances + 1, sizeof(double));
+	metrics_sample = -1;
+	sem_init(&metrics_wakeup, 0, 0);
+	metrics_writer_exit = 0;
+	// SIGCONT must only be delivered to the main thread (see start_socket_readers())
+	sigemptyset(&blocked);
+	sigaddset(&blocked, SIGCONT);
+	pthread_sigmask(SIG_BLOCK, &blocked, &saved);
+	rc = pthread_create(&metrics_writer, NULL, metrics_writer_thread, NULL);
+	if (rc != 0) {
+		fprintf(log_file,"ERROR %s when trying to create the live file writer thread\n",strerror(rc));
+		exit(-1);
+	}
+	pthread_sigmask(SIG_SETMASK, &saved, NULL);
+}
+
+// copy the values of the latest interval for the writer (with metrics_lock held)
+void hand_over_metrics()
+{
+	memcpy(metrics_values, online_values, online_metrics.num_instances * sizeof(double));
+	metrics_sample = sample - 1;
+	metrics_walltime[0] = SAMPLE(walltime[0], sample-1);
+	metrics_walltime[1] = SAMPLE(walltime[1], sample-1);
+}
+
+// called by the main thread after each complete sample
+void update_online_metrics()
+{
+	if (sample < 2) return;			// (the first interval ends at the second sample)
+	pcm_eval(&online_metrics, sample - 2, 1, online_values);
+	if (pthread_mutex_trylock(&metrics_lock) != 0) return;
+	hand_over_metrics();
+	pthread_mutex_unlock(&metrics_lock);
+	sem_post(&metrics_wakeup);
+}
+
+// write the values of the last interval (waiting for the lock this time), then stop the writer thread
+void stop_metrics_writer()
+{
+	pthread_mutex_lock(&metrics_lock);
+	if (sample >= 2) hand_over_metrics();
+	pthread_mutex_unlock(&metrics_lock);
+	metrics_writer_exit = 1;
+	sem_post(&metrics_wakeup);
+	pthread_join(metrics_writer, NULL);
+	sem_destroy(&metrics_wakeup);
+}
+
+// ==================================================================================================================
+// Streaming statistics ("-s N" option)
+//		After each sample, every series adds one value for the interval from the previous sample to its
+//		summary (perfcounts_stats.c): the delta per second for counters, the value for the package temperature,
+//		and the value and its bits for the status registers (pkg_therm_status, *_limit_reasons).  With "-e",
+//		every online metric also has a summary.  The summaries have a fixed size, so with "-D" (which keeps
+//		only the last samples in the store) a run of any length uses the same memory.  They are written to
+//		<hostname>.perfcounts.stats every N samples and at the end of the run, one Lua line per series:
+//		count, mean, variance, min, max, p50/p90/p99, the non-zero count, the sketch buckets, and for the status
+//		registers the count of each bit.  "perfcounts_stats_merge" merges the files of several nodes or runs.
+//
+int stats_kind(struct series_desc *desc)
+{
+	if ((strcmp(desc->group,"time") == 0) || (strcmp(desc->group,"mux") == 0)) return (-1);
+	if (strncmp(desc->name,"pkg_temperature",15) == 0) return (PST_GAUGE);
+	if ((strncmp(desc->name,"pkg_therm_status",16) == 0) || (strstr(desc->name,"_limit_reasons") != NULL)) return (PST_STATUS);
+	return (PST_RATE);
+}
+
+void init_stats()
+{
+	int k;
+
+	series_stats = malloc(samples.num_series * sizeof(struct pst_summary));
+	for (k=0; k<samples.num_series; k++) pst_init(&series_stats[k], stats_kind(&samples.desc[k]));
+	if (metrics_path != NULL) {
+		metric_stats = malloc((online_metrics.num_instances + 1) * sizeof(struct pst_summary));
+		for (k=0; k<online_metrics.num_instances; k++) pst_init(&metric_stats[k], PST_GAUGE);
+	}
+	fprintf(log_file,"INFO: streaming statistics of %d series and %d metrics (%lu bytes), written to %s every %d samples\n",
+		samples.num_series,(metrics_path != NULL) ? online_metrics.num_instances : 0,
+		(samples.num_series + ((metrics_path != NULL) ? online_metrics.num_instances : 0)) * sizeof(struct pst_summary),
+		stats_filename,stats_samples);
+}
+
+void write_stats()
+{
+	char tmp_filename[130];
+	FILE *fp;
+	int k;
+
+	sprintf(tmp_filename,"%s.tmp",stats_filename);
+	fp = fopen(tmp_filename,"w");
+	if (fp == NULL) {
+		fprintf(log_file,"WARNING: %s when trying to write the statistics file %s\n",strerror(errno),tmp_filename);
+		return;
+	}
+	fprintf(fp,"stats_intervals = %d\n",(sample > 1) ? sample-1 : 0);
+	fprintf(fp,"stats_gamma = %g\n",PST_GAMMA);
+	fprintf(fp,"stats = {}\n");
+	for (k=0; k<samples.num_series; k++) {
+		if (series_stats[k].kind >= 0) pst_write(fp, samples.desc[k].name, &series_stats[k]);
+	}
+	if (metric_stats != NULL) {
+		for (k=0; k<online_metrics.num_instances; k++) pst_write(fp, online_metrics.instance[k].name, &metric_stats[k]);
+	}
+	if (fclose(fp) == 0) rename(tmp_filename, stats_filename);
+}
+
+// called by the main thread after each complete sample (after update_online_metrics())
+void update_stats()
+{
+	struct pst_summary *summary;
+	uint64_t before, after, delta;
+	double dt;
+	int k;
+
+	if (sample < 2) return;
+	dt = (SAMPLE(tsc_start, sample-1) - SAMPLE(tsc_start, sample-2)) / (TSC_ratio * 1.0e8);
+	for (k=0; k<samples.num_series; k++) {
+		summary = &series_stats[k];
+		if (summary->kind < 0) continue;
+		after = SAMPLE(k, sample-1);
+		if (summary->kind == PST_RATE) {
+			before = SAMPLE(k, sample-2);
+			delta = after - before;
+			if (samples.desc[k].width < 64) delta &= (1UL << samples.desc[k].width) - 1;
+			pst_add(summary, (double)delta * samples.desc[k].scale / dt);
+		} else {
+			pst_add(summary, (double)after * samples.desc[k].scale);
+			if (summary->kind == PST_STATUS) pst_add_bits(summary, after);
+		}
+	}
+	if (metric_stats != NULL) {
+		for (k=0; k<online_metrics.num_instances; k++) pst_add(&metric_stats[k], online_values[k]);
+	}
+	if ((sample - 1) % stats_samples == 0) write_stats();
+}
+
+// ==================================================================================================================
+// Phase detection ("-P metric,metric,..." option)
+//		After each sample, the values of a few online metrics (e.g., node_ipc,node_dram_GBs,node_watts) over the
+//		interval are given to a CUSUM change-point detector (perfcounts_phases.c), which splits the run into
+//		labeled phases of steady behavior.  The phases found so far are written to <hostname>.perfcounts.phases
+//		when a phase ends, and all of them at the end of the run, with their first and last sample numbers (the
+//		window for perfcounts_post or post_process.lua) and the time-weighted mean of each metric.
+//
+void init_phases()
+{
+	char *name;
+	int k, m;
+
+	pph_init(&phases, 0);
+	for (name=strtok(phase_spec, ","), k=0; name!=NULL; name=strtok(NULL, ",")) {
+		for (m=0; m<online_metrics.num_instances; m++) if (strcmp(online_metrics.instance[m].name, name) == 0) break;
+		if (m == online_metrics.num_instances) {
+			fprintf(log_file,"ERROR: -P: %s is not an online metric of %s\n",name,metrics_path);
+			exit(1);
+		}
+		if (k == PPH_MAX_SIGNALS) {
+			fprintf(log_file,"ERROR: -P: at most %d metrics can be used for phase detection\n",PPH_MAX_SIGNALS);
+			exit(1);
+		}
+		phase_signal_name[k] = online_metrics.instance[m].name;
+		phase_signal_instance[k++] = m;
+	}
+	phases.num_signals = k;
+	fprintf(log_file,"INFO: detecting phases in %d online metrics, written to %s\n",k,phases_filename);
+}
+
+void write_phases()
+{
+	char tmp_filename[130];
+	FILE *fp;
+
+	sprintf(tmp_filename,"%s.tmp",phases_filename);
+	fp = fopen(tmp_filename,"w");
+	if (fp == NULL) {
+		fprintf(log_file,"WARNING: %s when trying to write the phases file %s\n",strerror(errno),tmp_filename);
+		return;
+	}
+	pph_write(fp, &phases, phase_signal_name, 0);
+	if (fclose(fp) == 0) rename(tmp_filename, phases_filename);
+}
+
+// called by the main thread after each complete sample (after update_online_metrics())
+void update_phases()
+{
+	double value[PPH_MAX_SIGNALS], dt;
+	int k;
+
+	if (sample < 2) return;
+	dt = (SAMPLE(tsc_start, sample-1) - SAMPLE(tsc_start, sample-2)) / (TSC_ratio * 1.0e8);
+	for (k=0; k<phases.num_signals; k++) value[k] = online_values[phase_signal_instance[k]];
+	if (pph_add(&phases, value, dt)) write_phases();
+}
+
+// ==================================================================================================================
+// Live shared-memory segment ("-L N" option, see perfcounts_shm.h for the layout and the protocol)
+//		After each sample, its values are copied to the next record of a ring of N samples in the POSIX
+//		shared-memory segment PLS_NAME, with a seqlock per record, so any number of local readers can read the
+//		latest samples while the run goes on.  Publishing is a copy of one sample and a few atomic stores: it
+//		never makes a system call, and never waits for the readers (a reader that is too slow sees that the
+//		record was overwritten, and reads a later sample).
+//
+int live_kind(struct series_desc *desc)
+{
+	switch (stats_kind(desc)) {
+		case PST_RATE: return (PLS_COUNTER);
+		case PST_GAUGE: return (PLS_GAUGE);
+		case PST_STATUS: return (PLS_STATUS);
+	}
+	return (PLS_OTHER);
+}
+
+void create_live_segment(uint64_t period_ns)
+{
+	struct pls_header *header;
+	struct pls_series *series;
+	char *base, *strings;
+	size_t strings_bytes, offset;
+	int fd, k;
+
+	strings_bytes = 0;
+	for (k=0; k<samples.num_series; k++) strings_bytes += strlen(samples.desc[k].name) + 1;
+
+	// (a new segment, so the readers of a segment left by an earlier run never see it change size)
+	shm_unlink(PLS_NAME);
+	fd = shm_open(PLS_NAME, O_RDWR|O_CREAT|O_EXCL, 0644);
+	if (fd == -1) {
+		fprintf(log_file,"ERROR %s when trying to create the shared-memory segment %s\n",strerror(errno),PLS_NAME);
+		exit(-1);
+	}
+	offset = (sizeof(struct pls_header) + 7) & ~(size_t)7;
+	offset += samples.num_series * sizeof(struct pls_series);
+	offset += strings_bytes;
+	offset = (offset + 63) & ~(size_t)63;
+	live_segment_bytes = offset + (size_t)live_samples * (((1 + samples.num_series) * sizeof(uint64_t) + 63) & ~(size_t)63);
+	if (ftruncate(fd, live_segment_bytes) != 0) {
+		fprintf(log_file,"ERROR %s when trying to size the shared-memory segment %s\n",strerror(errno),PLS_NAME);
+		exit(-1);
+	}
+	base = mmap(NULL, live_segment_bytes, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+	if (base == MAP_FAILED) {
+		fprintf(log_file,"ERROR %s when trying to map the shared-memory segment %s\n",strerror(errno),PLS_NAME);
+		exit(-1);
+	}
+	close(fd);
+	header = (struct pls_header *)base;
+	header->version = PLS_VERSION;
+	header->header_bytes = sizeof(struct pls_header);
+	header->num_series = samples.num_series;
+	header->ring_samples = live_samples;
+	header->tsc_ratio = TSC_ratio;
+	header->pid = getpid();
+	header->period_ns = period_ns;
+	header->series_offset = (sizeof(struct pls_header) + 7) & ~(size_t)7;
+	header->strings_offset = header->series_offset + samples.num_series * sizeof(struct pls_series);
+	header->strings_bytes = strings_bytes;
+	header->ring_offset = offset;
+	header->record_bytes = ((1 + samples.num_series) * sizeof(uint64_t) + 63) & ~(size_t)63;
+
+	series = (struct pls_series *)(base + header->series_offset);
+	strings = base + header->strings_offset;
+	offset = 0;
+	for (k=0; k<samples.num_series; k++) {
+		series[k].name = offset;
+		series[k].scale = samples.desc[k].scale;
+		series[k].width = samples.desc[k].width;
+		series[k].kind = live_kind(&samples.desc[k]);
+		strcpy(&strings[offset], samples.desc[k].name);
+		offset += strlen(samples.desc[k].name) + 1;
+	}
+	// (last, with release semantics, so a reader that sees the magic sees the complete header)
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	memcpy(header->magic, PLS_MAGIC, sizeof(header->magic));
+	live_segment = header;
+	fprintf(log_file,"INFO: publishing the last %d samples of %d series to the shared-memory segment %s (%lu bytes)\n",
+		live_samples,samples.num_series,PLS_NAME,live_segment_bytes);
+}
+
+// called by the main thread after each complete sample
+void publish_live_sample()
+{
+	uint64_t *record, *base;
+	long index, stride;
+	int k;
+
+	index = sample - 1;
+	record = pls_record(live_segment, index);
+	__atomic_store_n(&record[0], 2 * index + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);			// (the odd sequence number before any of the values)
+	if (samples.chunk[index / samples.chunk_samples] != NULL) {
+		base = store_value(&samples, 0, index);
+		stride = store_column_stride(&samples);
+		for (k=0; k<samples.num_series; k++) __atomic_store_n(&record[1 + k], base[k * stride], __ATOMIC_RELAXED);
+	} else {
+		// (a packed chunk)
+		for (k=0; k<samples.num_series; k++) __atomic_store_n(&record[1 + k], SAMPLE(k, index), __ATOMIC_RELAXED);
+	}
+	__atomic_store_n(&record[0], 2 * index + 2, __ATOMIC_RELEASE);
+	__atomic_store_n(&live_segment->published, index + 1, __ATOMIC_RELEASE);
+}
+
+// the readers keep their mappings of the segment, and see that it is closed
+void close_live_segment()
+{
+	__atomic_store_n(&live_segment->closed, 1, __ATOMIC_RELEASE);
+	shm_unlink(PLS_NAME);
+	munmap(live_segment, live_segment_bytes);
+	live_segment = NULL;
+}
+
+// ==================================================================================================================
+//		Final processing & output of results
+void process_all_results()
+{
+	uint64_t tsc_before, tsc_after, delta_tsc;
+	float microseconds;
+
+	tsc_before = rdtscp();		// measure how long it takes to write out all of the output
+
+	// (with the streaming writer, only the samples that it has not written yet are left)
+	if (use_table_output) {
+		write_table_results();
+	} else {
+		write_text_results(samples_written, sample);
+	}
+	samples_written = sample;
+	tsc_after = rdtscp();		// measure how long it takes to write out all of the output
+	delta_tsc = tsc_after - tsc_before;
+	microseconds = (float)(delta_tsc) / TSC_ratio / 100.0;			// 100 MHz reference clock
+	fprintf(log_file,"OVERHEAD: writing all output took %lu TSC cycles %f microseconds\n",delta_tsc,microseconds);
+
+	fflush(results_file);
+	if ((fclose(results_file) == 0) && (samples.map != NULL)) remove_store_file();
+
+	fflush(log_file);
+	fclose(log_file);
+}
+
+// ==================================================================================================================
+// Binary columnar output (see perfcounts_binary.h for the format)
+//		Replaces the per-sample lines of the Lua text output (the results file then only has the unit
+//		definitions).  The counter widths let the writer store wrap-corrected deltas.
+//
+uint32_t series_width(struct series_desc *desc)
+{
+	if ((strcmp(desc->group,"core") == 0) || (strcmp(desc->group,"fixed") == 0) || (strcmp(desc->group,"cha") == 0)
+			|| (strcmp(desc->group,"imc") == 0) || (strcmp(desc->group,"pcu") == 0)) return (48);
+	if ((strcmp(desc->group,"rapl") == 0) && (strcmp(desc->name,"rapl_pkg_throttled") != 0)) return (rapl_energy_width);
+	if (strcmp(desc->group,"rapl") == 0) return (32);
+	if (strcmp(desc->group,"iio") == 0) return (36);
+	if (strncmp(desc->name,"ubox_uclk",9) == 0) return (48);
+	return (64);
+}
+
+uint64_t binary_value(void *ctx, int column, long index)
+{
+	return (*store_value((struct sample_store *)ctx, column, index));
+}
+
+void write_binary_results(double package_tdp)
+{
+	struct pcb_header header;
+	struct pcb_series_info *info;
+	int32_t package[NUM_LPROCS];
+	uint64_t tsc_before, tsc_after;
+	int k, lproc;
+
+	tsc_before = rdtscp();
+	memset(&header, 0, sizeof(header));
+	header.num_samples = sample;
+	header.num_series = samples.num_series;
+	header.num_sockets = NUM_SOCKETS;
+	header.num_lprocs = nr_cpus;
+	header.temp_target = temp_target;
+	header.tsc_hz = (uint64_t)TSC_ratio * 100000000UL;		// 100 MHz reference clock
+	header.power_unit = power_unit;
+	header.pkg_energy_unit = pkg_energy_unit;
+	header.dram_energy_unit = dram_energy_unit;
+	header.time_unit = time_unit;
+	header.package_tdp = package_tdp;
+	for (lproc=0; lproc<nr_cpus; lproc++) package[lproc] = Package_by_LProc[lproc];
+	info = malloc(samples.num_series * sizeof(struct pcb_series_info));
+	if (info == NULL) {
+		fprintf(log_file,"ERROR: unable to allocate the binary output schema\n");
+		exit(-1);
+	}
+	for (k=0; k<samples.num_series; k++) {
+		info[k].name = samples.desc[k].name;
+		info[k].scale = samples.desc[k].scale;
+		info[k].width = samples.desc[k].width;
+	}
+	if (pcb_write(binary_filename, &header, info, package, binary_value, &samples) != 0) {
+		fprintf(log_file,"ERROR: failed to write binary output file %s\n",binary_filename);
+		exit(-1);
+	}
+	free(info);
+	tsc_after = rdtscp();
+	fprintf(log_file,"OVERHEAD: writing binary output %s (%lu data bytes) took %lu TSC cycles\n",
+		binary_filename,header.data_bytes,tsc_after-tsc_before);
+}
+
+
+// ==================================================================================================================
+// Streaming results writer
+//		The sample store doubles as the queue between the main thread (the single producer) and the writer
+//		thread (the single consumer): after each sample the main thread publishes the number of complete
+//		samples with a release store and posts a semaphore, and the writer appends the text of every newly
+//		completed sample to the results file.  Nothing is locked, and the main thread never waits for the
+//		writer.  The results file gets a large stdio buffer, which is written whenever it fills up, so the
+//		writes are large even at short sampling intervals.  The writer only flushes it itself once
+//		RESULTS_FLUSH_NS have passed since the last flush, and when it stops.  If the job is killed, only the
+//		samples of the last RESULTS_FLUSH_NS (at most) are lost, and at the end of the run
+//		process_all_results() only writes the samples the writer has not reached.
+//
+void *results_writer_thread(void *arg)
+{
+	struct text_worker writer;
+	struct timespec now;
+	uint64_t now_ns, last_flush_ns;
+	long first, last;
+	int published;
+
+	(void)arg;
+	text_init_worker(&writer);
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	last_flush_ns = now.tv_sec * 1000000000UL + now.tv_nsec;
+	while (1) {
+		sem_wait(&writer_wakeup);
+		published = __atomic_load_n(&samples_published, __ATOMIC_ACQUIRE);
+		if (published > samples_written) {
+			for (first=samples_written; first<published; first=last) {
+				last = (first + text_block_samples < published) ? first + text_block_samples : published;
+				writer.bytes = text_format_samples(&writer, first, last, text_totals, writer.buf);
+				fwrite(writer.buf, 1, writer.bytes, results_file);
+			}
+			__atomic_store_n(&samples_written, published, __ATOMIC_RELEASE);
+		}
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		now_ns = now.tv_sec * 1000000000UL + now.tv_nsec;
+		if (writer_exit || (now_ns - last_flush_ns >= RESULTS_FLUSH_NS)) {
+			fflush(results_file);
+			last_flush_ns = now_ns;
+		}
+		if (writer_exit) break;
+	}
+	free(writer.totals);
+	free(writer.buf);
+	free(writer.scratch);
+	free(writer.scratch_chunk);
+	return NULL;
+}
+
+void start_results_writer()
+{
+	sigset_t blocked, saved;
+	int rc;
+
+	fflush(results_file);			// (the header lines written by main())
+	sem_init(&writer_wakeup, 0, 0);
+	writer_exit = 0;
+	// SIGCONT must only be delivered to the main thread (see start_socket_readers())
+	sigemptyset(&blocked);
+	sigaddset(&blocked, SIGCONT);
+	pthread_sigmask(SIG_BLOCK, &blocked, &saved);
+	rc = pthread_create(&results_writer, NULL, results_writer_thread, NULL);
+	if (rc != 0) {
+		fprintf(log_file,"ERROR %s when trying to create the results writer thread\n",strerror(rc));
+		exit(-1);
+	}
+	pthread_sigmask(SIG_SETMASK, &saved, NULL);
+	fprintf(log_file,"INFO: started the streaming results writer thread\n");
+}
+
+// called by the main thread after each complete sample
+void publish_samples()
+{
+	store_commit(&samples, sample);
+	if (!use_results_writer) return;
+	__atomic_store_n(&samples_published, sample, __ATOMIC_RELEASE);
+	sem_post(&writer_wakeup);
+}
+
+// write everything that has been published, then stop the writer thread
+void stop_results_writer()
+{
+	writer_exit = 1;
+	sem_post(&writer_wakeup);
+	pthread_join(results_writer, NULL);
+	sem_destroy(&writer_wakeup);
+}
+
+// Convert PCI(bus:device.function,offset) to uint32_t array index
+uint32_t PCI_cfg_index(unsigned int Bus, unsigned int Device, unsigned int Function, unsigned int Offset)
+{
+    uint32_t byteaddress;
+    uint32_t index;
+    // assert (Bus == BUS);
+    assert (Device >= 0);
+    assert (Function >= 0);
+    assert (Offset >= 0);
+    assert (Device < (1<<5));
+    assert (Function < (1<<3));
+    assert (Offset < (1<<12));
+#ifdef DEBUG
+    fprintf(log_file,"Bus,(Bus<<20)=%x\n",Bus,(Bus<<20));
+    fprintf(log_file,"Device,(Device<<15)=%x\n",Device,(Device<<15));
+    fprintf(log_file,"Function,(Function<<12)=%x\n",Function,(Function<<12));
+    fprintf(log_file,"Offset,(Offset)=%x\n",Offset,Offset);
+#endif
+    byteaddress = (Bus<<20) | (Device<<15) | (Function<<12) | Offset;
+    index = byteaddress / 4;
+    return ( index );
+}
+
+// ==========================================================================================================
+// Read plan
+//		The input files and topology are compiled once at startup (build_read_plan(), called from main()
+//		after all of the counters are programmed) into a flat array of read operations for each socket.
+//		Each entry holds the backend, the msr device file descriptor or mmconfig_ptr[] index, the register,
+//		and the destination column in the sample store.  The entries are sorted by backend, then file descriptor, then register,
+//		so each backend is executed by its own tight loop with no per-read branching on the subsystem,
+//		and consecutive MSR reads go to the same logical processor.
+//		Adding a new counter type only requires adding entries to the plan (or to socket_msr_table[]).
+//
+struct socket_msr_desc {
+	uint32_t msr;
+	int *series;							// columns, indexed by socket
+	char *name;								// name in the output file
+	char *group;							// group name for the burst-mode subset selection
+	int scale;								// multiplier applied in the output file
+};
+
+// Socket-scope MSRs: read once per socket on proc_in_pkg[socket]
+struct socket_msr_desc socket_msr_table[] = {
+	{ IA32_PACKAGE_THERM_STATUS,	pkg_therm_status,				"pkg_therm_status",				"socket",	1 },	// temperature is derived from this in read_socket_counters()
+	{ MSR_CORE_PERF_LIMIT_REASONS,	pkg_core_perf_limit_reasons,	"pkg_core_perf_limit_reasons",	"socket",	1 },
+	{ MSR_RING_PERF_LIMIT_REASONS,	pkg_ring_perf_limit_reasons,	"pkg_ring_perf_limit_reasons",	"socket",	1 },
+	{ MSR_PKG_ENERGY_STATUS,		rapl_pkg_energy,				"rapl_pkg_energy",				"rapl",		1 },
+	{ MSR_DRAM_ENERGY_STATUS,		rapl_dram_energy,				"rapl_dram_energy",				"rapl",		1 },
+	{ MSR_PKG_PERF_STATUS,			rapl_pkg_throttled,				"rapl_pkg_throttled",			"rapl",		1 },
+	{ MSR_SMI_COUNT,				smi_count,						"smi_count",					"socket",	1 },
+	{ U_MSR_PMON_FIXED_CTR,			ubox_uclk,						"ubox_uclk",					"socket",	1 },
+	{ CBDMA_p1_in,					iio_CBDMA_port1_in,				"iio_CBDMA_port1_in_bytes",		"iio",		4 },
+	{ CBDMA_p1_out,					iio_CBDMA_port1_out,			"iio_CBDMA_port1_out_bytes",	"iio",		4 },
+	{ PCIE0_p1_in,					iio_PCIe0_port1_in,				"iio_PCIe0_port1_in_bytes",		"iio",		4 },
+	{ PCIE0_p1_out,					iio_PCIe0_port1_out,			"iio_PCIe0_port1_out_bytes",	"iio",		4 },
+	{ PCIE2_p0_in,					iio_PCIe2_port0_in,				"iio_PCIe2_port0_in_bytes",		"iio",		4 },
+	{ PCIE2_p0_out,					iio_PCIe2_port0_out,			"iio_PCIe2_port0_out_bytes",	"iio",		4 },
+};
+#define NUM_SOCKET_MSRS (sizeof(socket_msr_table)/sizeof(socket_msr_table[0]))
+
+// ==================================================================================================================
+// Topology rollups ("-A" option)
+//		Series for each physical core, each socket, and (with sub-NUMA clustering) each cluster of a socket, so that
+//		a consumer does not have to rebuild the thread pairing from topology.h: pcore_fixed_counts[s][c][event],
+//		pcore_counts[s][c][event], pcore_aperf[s][c], pcore_mperf[s][c] for local core c of socket s, the same
+//		as socket_*[s] and snc_*[s][n], and the IMC and CHA counts of each socket (socket_imc_counts[s][event],
+//		socket_cha_counts[s][event]) and the IMC counts of each cluster (snc_imc_counts[s][n][event]).
+//		A rollup is the sum of the wrap-corrected deltas of its members since the first sample, as a 64-bit
+//		counter, so it never wraps and its deltas are those of the sum.  A core counter with the AnyThread bit
+//		set (bit 2 of its field of IA32_FIXED_CTR_CTRL for a fixed counter, bit 21 of IA32_PERFEVTSELx for a
+//		programmable one) already counts both threads of the core, so a core then takes the value of its first
+//		thread with the bit set instead of the sum.  The clusters are the NUMA nodes of each socket
+//		(/sys/devices/system/node), in order, and IMC channel ch belongs to cluster ch * clusters / channels.
+//		The rollups are computed in read_all_counters(), after every counter has been read.
+//
+// (the group of every rollup is "rollup", so its width is 64 bits)
+int add_rollup(char *base, char *event, int mux_lproc, int mux_counter)
+{
+	struct rollup *r;
+	char name[300];
+	int g;
+
+	if (num_rollups == max_rollups) {
+		max_rollups = (max_rollups == 0) ? 256 : 2*max_rollups;
+		rollups = realloc(rollups, max_rollups * sizeof(struct rollup));
+		if (rollups == NULL) {
+			fprintf(log_file,"ERROR: unable to allocate the rollups\n");
+			exit(-1);
+		}
+	}
+	r = &rollups[num_rollups];
+	r->base = strdup(base);
+	r->event = (event != NULL) ? strdup(event) : NULL;
+	r->mux_lproc = mux_lproc;
+	r->mux_counter = mux_counter;
+	r->total = 0;
+	if (event == NULL) {
+		sprintf(name,"%s",base);
+	} else {
+		sprintf(name,"%s[\"%s\"]",base,event);
+		for (g=1; (mux_lproc >= 0) && (g<core_mux_groups); g++) {
+			sprintf(name+strlen(name)-2,"/%s\"]",core_mux_event_name[g][mux_lproc][mux_counter]);
+		}
+	}
+	r->column = store_add_series(&samples, name, "rollup", r->event ? r->event : "", 1);
+	return (num_rollups++);
+}
+
+void add_rollup_term(int rollup, int member, int width)
+{
+	if (num_rollup_terms == max_rollup_terms) {
+		max_rollup_terms = (max_rollup_terms == 0) ? 1024 : 2*max_rollup_terms;
+		rollup_terms = realloc(rollup_terms, max_rollup_terms * sizeof(struct rollup_term));
+		if (rollup_terms == NULL) {
+			fprintf(log_file,"ERROR: unable to allocate the rollup terms\n");
+			exit(-1);
+		}
+	}
+	rollup_terms[num_rollup_terms].rollup = rollup;
+	rollup_terms[num_rollup_terms].member = member;
+	rollup_terms[num_rollup_terms].mask = (width < 64) ? (1UL << width) - 1 : ~0UL;
+	rollup_terms[num_rollup_terms].last = 0;
+	num_rollup_terms++;
+}
+
+// the clusters of each socket, from the CPU lists of the NUMA nodes
+void read_snc_topology()
+{
+	char filename[100], list[4096], *p;
+	int node, first, last, lproc, socket, cluster[NUM_SOCKETS], node_socket;
+	FILE *fp;
+
+	for (socket=0; socket<NUM_SOCKETS; socket++) cluster[socket] = 0;
+	for (node=0; node<1024; node++) {
+		sprintf(filename,"/sys/devices/system/node/node%d/cpulist",node);
+		fp = fopen(filename,"r");
+		if (fp == NULL) continue;
+		if (fgets(list, sizeof(list), fp) == NULL) list[0] = 0;
+		fclose(fp);
+		node_socket = -1;
+		for (p=list; (*p >= '0') && (*p <= '9'); ) {
+			first = last = strtol(p, &p, 10);
+			if (*p == '-') last = strtol(p+1, &p, 10);
+			for (lproc=first; (lproc<=last) && (lproc<nr_cpus); lproc++) {
+				node_socket = Package_by_LProc[lproc];
+				snc_by_lproc[lproc] = cluster[node_socket];
+			}
+			if (*p == ',') p++;
+		}
+		if (node_socket < 0) continue;			// (a node with memory and no processors)
+		cluster[node_socket]++;
+		if (cluster[node_socket] > snc_clusters) snc_clusters = cluster[node_socket];
+	}
+}
+
+// Core counter k of a logical processor: 0-2 fixed, then the programmable counters, then APERF and MPERF
+#define NUM_ROLLUP_CORE_COUNTERS (3 + NUM_CORE_COUNTERS + 2)
+int core_of_lproc[NUM_LPROCS];				// physical core number (in order of the first thread) of each logical processor
+
+int rollup_member(int lproc, int k)
+{
+	if (k < 3) return (core_fixed[lproc][k]);
+	if (k < 3 + NUM_CORE_COUNTERS) return (core_counts[lproc][k-3]);
+	return ((k == 3 + NUM_CORE_COUNTERS) ? aperf[lproc] : mperf[lproc]);
+}
+
+// the AnyThread bit of core counter k of a logical processor (0 for APERF/MPERF), which must be the same in
+// every multiplexed group (-1 if it is not)
+int rollup_anythread(int lproc, int k)
+{
+	uint64_t any;
+	int g;
+
+	if (k < 3) return ((fixed_ctr_ctrl[lproc] >> (4*k + 2)) & 1);
+	if (k >= 3 + NUM_CORE_COUNTERS) return (0);
+	any = (core_mux_evtsel[0][lproc][k-3] >> 21) & 1;
+	for (g=1; g<core_mux_groups; g++) {
+		if (((core_mux_evtsel[g][lproc][k-3] >> 21) & 1) != any) return (-1);
+	}
+	return ((int)any);
+}
+
+// adds core counter k of a physical core to a rollup: its first thread with AnyThread set, or all of its threads
+void add_core_terms(int rollup, int core, int k)
+{
+	int lproc, chosen;
+
+	chosen = -1;
+	for (lproc=0; (lproc<nr_cpus) && (chosen<0); lproc++) {
+		if ((core_of_lproc[lproc] == core) && (rollup_anythread(lproc, k) == 1)) chosen = lproc;
+	}
+	for (lproc=0; lproc<nr_cpus; lproc++) {
+		if ((core_of_lproc[lproc] != core) || ((chosen >= 0) && (lproc != chosen))) continue;
+		add_rollup_term(rollup, rollup_member(lproc, k), (k < 3 + NUM_CORE_COUNTERS) ? 48 : 64);
+	}
+}
+
+// Add the rollup series and their terms.  Called from allocate_series().
+void allocate_rollups()
+{
+	static char *fixed_name[3] = { "Inst_Retired.Any", "CPU_CLK_Unhalted.Core", "CPU_CLK_Unhalted.Ref" };
+	char base[200], *kind, *event;
+	int first[NUM_LPROCS], num_cores, lproc, core, socket, n, k, r, mux_lproc;
+	int channel, cha, counter;
+
+	read_snc_topology();
+	num_cores = 0;
+	for (lproc=0; lproc<nr_cpus; lproc++) {
+		for (core=0; core<num_cores; core++) {
+			if ((Package_by_LProc[first[core]] == Package_by_LProc[lproc])
+					&& (LocalCore_by_LProc[first[core]] == LocalCore_by_LProc[lproc])) break;
+		}
+		if (core == num_cores) first[num_cores++] = lproc;
+		core_of_lproc[lproc] = core;
+	}
+	for (k=0; k<NUM_ROLLUP_CORE_COUNTERS; k++) {
+		mux_lproc = -1;
+		if (k < 3) {
+			kind = "fixed_counts";
+			event = fixed_name[k];
+		} else if (k < 3 + NUM_CORE_COUNTERS) {
+			kind = "counts";
+			event = core_event_name[0][k-3];
+			if (core_mux_groups > 1) mux_lproc = 0;
+			// (the sums need the same event in every logical processor and the same AnyThread bit in every group)
+			for (lproc=1; lproc<nr_cpus; lproc++) if (strcmp(core_event_name[lproc][k-3], event) != 0) break;
+			for (n=0; n<nr_cpus; n++) if (rollup_anythread(n, k) < 0) break;
+			if ((lproc < nr_cpus) || (n < nr_cpus)) {
+				fprintf(log_file,"WARNING: no rollups of core counter %d, whose event or AnyThread bit is not the same everywhere\n",k-3);
+				continue;
+			}
+		} else {
+			kind = (k == 3 + NUM_CORE_COUNTERS) ? "aperf" : "mperf";
+			event = NULL;
+		}
+		for (core=0; core<num_cores; core++) {
+			sprintf(base,"pcore_%s[%d][%d]",kind,Package_by_LProc[first[core]],LocalCore_by_LProc[first[core]]);
+			add_core_terms(add_rollup(base, event, mux_lproc, k-3), core, k);
+		}
+		for (socket=0; socket<NUM_SOCKETS; socket++) {
+			sprintf(base,"socket_%s[%d]",kind,socket);
+			r = add_rollup(base, event, mux_lproc, k-3);
+			for (core=0; core<num_cores; core++) if (Package_by_LProc[first[core]] == socket) add_core_terms(r, core, k);
+			for (n=0; (n<snc_clusters) && (snc_clusters > 1); n++) {
+				sprintf(base,"snc_%s[%d][%d]",kind,socket,n);
+				r = add_rollup(base, event, mux_lproc, k-3);
+				for (core=0; core<num_cores; core++) {
+					if ((Package_by_LProc[first[core]] == socket) && (snc_by_lproc[first[core]] == n)) add_core_terms(r, core, k);
+				}
+			}
+		}
+	}
+	// the IMC counts of each socket and cluster, and the CHA counts of each socket (of the counters that have
+	// the same event in every box)
+	for (socket=0; socket<NUM_SOCKETS; socket++) {
+		for (counter=0; counter<NUM_IMC_COUNTERS; counter++) {
+			for (channel=1; channel<NUM_IMC_CHANNELS; channel++) {
+				if (strcmp(imc_event_name[socket][channel][counter], imc_event_name[socket][0][counter]) != 0) break;
+			}
+			if (channel < NUM_IMC_CHANNELS) {
+				fprintf(log_file,"WARNING: no rollups of IMC counter %d in socket %d, whose event is not the same in every channel\n",counter,socket);
+				continue;
+			}
+			sprintf(base,"socket_imc_counts[%d]",socket);
+			r = add_rollup(base, imc_event_name[socket][0][counter], -1, -1);
+			for (channel=0; channel<NUM_IMC_CHANNELS; channel++) add_rollup_term(r, imc_counts[socket][channel][counter], 48);
+			for (n=0; (n<snc_clusters) && (snc_clusters > 1); n++) {
+				sprintf(base,"snc_imc_counts[%d][%d]",socket,n);
+				r = add_rollup(base, imc_event_name[socket][0][counter], -1, -1);
+				for (channel=0; channel<NUM_IMC_CHANNELS; channel++) {
+					if (channel * snc_clusters / NUM_IMC_CHANNELS == n) add_rollup_term(r, imc_counts[socket][channel][counter], 48);
+				}
+			}
+		}
+		for (counter=0; (counter<NUM_CHA_COUNTERS) && (cha_mux_groups == 1); counter++) {
+			for (cha=1; cha<NUM_CHA_BOXES; cha++) {
+				if (strcmp(cha_event_name[socket][cha][counter], cha_event_name[socket][0][counter]) != 0) break;
+			}
+			if (cha < NUM_CHA_BOXES) {
+				fprintf(log_file,"WARNING: no rollups of CHA counter %d in socket %d, whose event is not the same in every CHA\n",counter,socket);
+				continue;
+			}
+			sprintf(base,"socket_cha_counts[%d]",socket);
+			r = add_rollup(base, cha_event_name[socket][0][counter], -1, -1);
+			for (cha=0; cha<NUM_CHA_BOXES; cha++) add_rollup_term(r, cha_counts[socket][cha][counter], 48);
+		}
+	}
+	fprintf(log_file,"INFO: %d rollup series of %d physical cores, %d sockets, and %d clusters per socket, from %d series\n",
+		num_rollups,num_cores,NUM_SOCKETS,snc_clusters,num_rollup_terms);
+}
+
+// the output lines of the rollups (called at the end of build_text_items())
+void rollup_text_items()
+{
+	struct rollup *r;
+	int k, g;
+
+	for (k=0; k<num_rollups; k++) {
+		r = &rollups[k];
+		if (r->event == NULL) {
+			text_add_item(TEXT_UNSIGNED, r->column, 1, "%s[", r->base);
+			continue;
+		}
+		if (r->mux_lproc < 0) {
+			text_add_item(TEXT_UNSIGNED, r->column, 1, "%s[\"%s\"][", r->base, r->event);
+			continue;
+		}
+		text_add_item(TEXT_MUX_ADD, r->column, 1, "");
+		text_items[num_text_items-1].group_column = core_mux_group;
+		text_items[num_text_items-1].total = num_text_totals;
+		for (g=0; g<core_mux_groups; g++) {
+			text_add_item(TEXT_MUX_TOTAL, r->column, 1, "%s[\"%s\"][", r->base, core_mux_event_name[g][r->mux_lproc][r->mux_counter]);
+			text_items[num_text_items-1].group_column = core_mux_group;
+			text_items[num_text_items-1].group = g;
+			text_items[num_text_items-1].total = num_text_totals++;
+		}
+	}
+}
+
+// called by read_all_counters() for sample "index", after all of the counters have been read
+void update_rollups(long index)
+{
+	struct rollup_term *t;
+	uint64_t value;
+	int k;
+
+	for (k=0; k<num_rollup_terms; k++) {
+		t = &rollup_terms[k];
+		value = SAMPLE(t->member, index);
+		if (index > 0) rollups[t->rollup].total += (value - t->last) & t->mask;
+		t->last = value;
+	}
+	for (k=0; k<num_rollups; k++) SAMPLE(rollups[k].column, index) = rollups[k].total;
+}
+
+// Add a column to the sample store for every series of the detected topology and the configured events.
+// Called from main() after the input files have been read (for the event names) and before build_read_plan().
+void allocate_series()
+{
+	static char *fixed_name[3] = { "Inst_Retired.Any", "CPU_CLK_Unhalted.Core", "CPU_CLK_Unhalted.Ref" };
+	char name[200];
+	uint32_t socket, channel, counter, cha;
+	int lproc, i, g;
+
+	samples.chunk_samples = samples.pack_chunks ? STORE_PACKED_CHUNK_SAMPLES : STORE_CHUNK_SAMPLES;
+	tsc_start = store_add_series(&samples, "tsc", "time", "", 1);
+	walltime[0] = store_add_series(&samples, "walltime[0]", "time", "", 1);
+	walltime[1] = store_add_series(&samples, "walltime[1]", "time", "", 1);
+	for (socket=0; socket<NUM_SOCKETS; socket++) {
+		for (i=0; i<(int)NUM_SOCKET_MSRS; i++) {
+			sprintf(name,"%s[%u]",socket_msr_table[i].name,socket);
+			socket_msr_table[i].series[socket] = store_add_series(&samples, name, socket_msr_table[i].group, "", socket_msr_table[i].scale);
+		}
+		sprintf(name,"pkg_temperature[%u]",socket);
+		pkg_temperature[socket] = store_add_series(&samples, name, "socket", "", 1);
+	}
+	for (lproc=0; lproc<nr_cpus; lproc++) {
+		for (counter=0; counter<3; counter++) {
+			sprintf(name,"core_fixed_counts[%d][\"%s\"]",lproc,fixed_name[counter]);
+			core_fixed[lproc][counter] = store_add_series(&samples, name, "fixed", fixed_name[counter], 1);
+		}
+		for (counter=0; counter<NUM_CORE_COUNTERS; counter++) {
+			sprintf(name,"core_counts[%d][\"%s\"]",lproc,core_event_name[lproc][counter]);
+			for (g=1; g<core_mux_groups; g++) {			// (a multiplexed counter is named for all of its events)
+				sprintf(name+strlen(name)-2,"/%s\"]",core_mux_event_name[g][lproc][counter]);
+			}
+			core_counts[lproc][counter] = store_add_series(&samples, name, "core", core_event_name[lproc][counter], 1);
+		}
+		sprintf(name,"aperf[%d]",lproc);
+		aperf[lproc] = store_add_series(&samples, name, "aperf", "", 1);
+		sprintf(name,"mperf[%d]",lproc);
+		mperf[lproc] = store_add_series(&samples, name, "aperf", "", 1);
+	}
+	for (socket=0; socket<NUM_SOCKETS; socket++) {
+		for (cha=0; cha<NUM_CHA_BOXES; cha++) {
+			for (counter=0; counter<NUM_CHA_COUNTERS; counter++) {
+				sprintf(name,"cha_counts[%u][%u][\"%s\"]",socket,cha,cha_event_name[socket][cha][counter]);
+				for (g=1; g<cha_mux_groups; g++) {
+					sprintf(name+strlen(name)-2,"/%s\"]",cha_mux_event_name[g][socket][cha][counter]);
+				}
+				cha_counts[socket][cha][counter] = store_add_series(&samples, name, "cha", cha_event_name[socket][cha][counter], 1);
+			}
+		}
+		for (channel=0; channel<NUM_IMC_CHANNELS; channel++) {
+			for (counter=0; counter<NUM_IMC_COUNTERS; counter++) {
+				sprintf(name,"imc_counts[%u][%u][\"%s\"]",socket,channel,imc_event_name[socket][channel][counter]);
+				imc_counts[socket][channel][counter] = store_add_series(&samples, name, "imc", imc_event_name[socket][channel][counter], 1);
+			}
+		}
+		for (counter=0; counter<4; counter++) {
+			sprintf(name,"pcu_counts[%u][\"%s\"]",socket,pcu_event_name[socket][counter]);
+			pcu_counts[socket][counter] = store_add_series(&samples, name, "pcu", pcu_event_name[socket][counter], 1);
+		}
+	}
+#ifdef INFINIBAND
+	ib_recv = store_add_series(&samples, "ib_recv_bytes", "ib", "", 4);
+	ib_xmit = store_add_series(&samples, "ib_xmit_bytes", "ib", "", 4);
+#endif
+	core_mux_group = cha_mux_group = mux_active_tsc = -1;
+	if ((core_mux_groups > 1) || (cha_mux_groups > 1)) {
+		core_mux_group = store_add_series(&samples, "core_mux_group", "mux", "", 1);
+		cha_mux_group = store_add_series(&samples, "cha_mux_group", "mux", "", 1);
+		mux_active_tsc = store_add_series(&samples, "mux_active_tsc", "mux", "", 1);
+	}
+	if (use_rollups) allocate_rollups();
+	for (i=0; i<samples.num_series; i++) samples.desc[i].width = series_width(&samples.desc[i]);
+	build_text_items();
+	if (use_store_file) create_store_file();
+	store_reserve(&samples, 0);
+	fprintf(log_file,"INFO: sample store has %d series, %lu bytes per chunk of %ld samples\n",samples.num_series,
+		samples.record_len * samples.chunk_samples * sizeof(uint64_t), samples.chunk_samples);
+	log_store_schema(&samples);
+}
+
+void plan_append(struct read_plan *plan, struct read_op *new_op)
+{
+	if (plan->num_ops == plan->max_ops) {
+		plan->max_ops = (plan->max_ops == 0) ? 256 : 2*plan->max_ops;
+		plan->ops = realloc(plan->ops, plan->max_ops * sizeof(struct read_op));
+		if (plan->ops == NULL) {
+			fprintf(log_file,"ERROR: unable to allocate read plan\n");
+			exit(-1);
+		}
+	}
+	plan->ops[plan->num_ops++] = *new_op;
+}
+
+void plan_add(uint32_t socket, int backend, int lproc, uint32_t reg, int dest)
+{
+	struct read_op new_op, *op = &new_op;
+
+	op->backend = backend;
+	op->fd = (backend == PLAN_MSR) ? msr_fd[lproc] : -1;
+	op->lproc = lproc;
+	op->reg = reg;
+	op->src = NULL;
+	op->dest = dest;
+	plan_append(&read_plan[socket], op);
+}
+
+void plan_add_slot(uint32_t socket, int lproc, uint64_t *src, int dest)
+{
+	plan_add(socket, PLAN_SLOT, lproc, 0, dest);
+	read_plan[socket].ops[read_plan[socket].num_ops-1].src = src;
+}
+
+int compare_read_ops(const void *a, const void *b)
+{
+	const struct read_op *x = a;
+	const struct read_op *y = b;
+
+	if (x->backend != y->backend) return (x->backend - y->backend);
+	if (x->fd != y->fd) return (x->fd - y->fd);
+	if (x->reg != y->reg) return (x->reg < y->reg) ? -1 : 1;
+	if (x->src != y->src) return (x->src < y->src) ? -1 : 1;
+	return 0;
+}
+
+// Sort a plan, then record where each backend's run of entries starts
+void finish_plan(struct read_plan *plan)
+{
+	int backend, i;
+
+	qsort(plan->ops, plan->num_ops, sizeof(struct read_op), compare_read_ops);
+	for (backend=0; backend<=NUM_PLAN_BACKENDS; backend++) plan->first[backend] = 0;
+	for (i=0; i<plan->num_ops; i++) plan->first[plan->ops[i].backend+1]++;
+	for (backend=0; backend<NUM_PLAN_BACKENDS; backend++) plan->first[backend+1] += plan->first[backend];
+}
+
+void build_read_plan()
+{
+	uint32_t socket, channel, counter, cha;
+	uint32_t bus, device, function, offset;
+	struct read_plan *plan;
+	int lproc, core, i;
 
-	fprintf(log_file,"VERBOSE: Reading IMC counters....\n");
-	reads_performed = 0;
-	tsc_before = rdtscp();
 	for (socket=0; socket<NUM_SOCKETS; socket++) {
+		plan = &read_plan[socket];
+		core = proc_in_pkg[socket];
+
+		// socket-scope MSRs, including the free-running IIO counters
+		for (i=0; (i<(int)NUM_SOCKET_MSRS) && msr_available; i++) {
+			plan_add(socket, PLAN_MSR, core, socket_msr_table[i].msr, socket_msr_table[i].series[socket]);
+		}
+
+		if (use_perf_events) {
+			// core, CHA, IMC, PCU (and RAPL, without the msr driver) counters are all perf_event groups
+			plan_add_perf_events(socket);
+			goto sort_plan;
+		}
+
+		// programmable, fixed-function, and APERF/MPERF core counters for each logical processor in this socket
+		for (lproc=0; lproc<nr_cpus; lproc++) {
+			if (Package_by_LProc[lproc] != (int)socket) continue;
+			if (use_rdpmc) {
+				for (counter=0; counter<NUM_CORE_COUNTERS; counter++) {
+					plan_add_slot(socket, lproc, &core_slot[lproc].pmc[counter], core_counts[lproc][counter]);
+				}
+				for (counter=0; counter<3; counter++) {
+					plan_add_slot(socket, lproc, &core_slot[lproc].fixed[counter], core_fixed[lproc][counter]);
+				}
+				plan_add_slot(socket, lproc, &core_slot[lproc].aperf, aperf[lproc]);
+				plan_add_slot(socket, lproc, &core_slot[lproc].mperf, mperf[lproc]);
+				continue;
+			}
+			for (counter=0; counter<NUM_CORE_COUNTERS; counter++) {
+				plan_add(socket, PLAN_MSR, lproc, 0xC1 + counter, core_counts[lproc][counter]);
+			}
+			for (counter=0; counter<3; counter++) {
+				plan_add(socket, PLAN_MSR, lproc, 0x309 + counter, core_fixed[lproc][counter]);
+			}
+			plan_add(socket, PLAN_MSR, lproc, IA32_APERF, aperf[lproc]);
+			plan_add(socket, PLAN_MSR, lproc, IA32_MPERF, mperf[lproc]);
+		}
+
+		// CHA counters
+		for (cha=0; cha<NUM_CHA_BOXES; cha++) {
+			for (counter=0; counter<NUM_CHA_COUNTERS; counter++) {
+				plan_add(socket, PLAN_MSR, core, CHA_MSR_PMON_CTR_BASE + (0x10 * cha) + counter, cha_counts[socket][cha][counter]);
+			}
+		}
+
+		// PCU counters
+		for (counter=0; counter<4; counter++) {
+			plan_add(socket, PLAN_MSR, core, PCU_MSR_PMON_CTR + counter, pcu_counts[socket][counter]);
+		}
+
+		// IMC counters -- 48-bit counters read as two 32-bit halves from PCI configuration space
 		bus = IMC_BUS_Socket[socket];
 		for (channel=0; channel<NUM_IMC_CHANNELS; channel++) {
 			device = IMC_Device_Channel[channel];
 			function = IMC_Function_Channel[channel];
 			for (counter=0; counter<NUM_IMC_COUNTERS; counter++) {
 				offset = IMC_PmonCtr_Offset[counter];
-				index = PCI_cfg_index(bus, device, function, offset);
-				low = mmconfig_ptr[index];
-				high = mmconfig_ptr[index+1];
-				count = ((uint64_t) high) << 32 | (uint64_t) low;
-				imc_counts[socket][channel][counter][sample] = count;
-				reads_performed++;
+				plan_add(socket, PLAN_MMCONFIG, proc_in_pkg[socket], PCI_cfg_index(bus, device, function, offset),
+					imc_counts[socket][channel][counter]);
 			}
 		}
+
+sort_plan:
+		finish_plan(plan);
+		fprintf(log_file,"INFO: read plan for socket %u has %d entries (%d MSR, %d MMCONFIG, %d PERF, %d SLOT)\n",socket,plan->num_ops,
+			plan->first[PLAN_MSR+1]-plan->first[PLAN_MSR], plan->first[PLAN_MMCONFIG+1]-plan->first[PLAN_MMCONFIG],
+			plan->first[PLAN_PERF+1]-plan->first[PLAN_PERF], plan->first[PLAN_SLOT+1]-plan->first[PLAN_SLOT]);
+	}
+}
+
+// ==========================================================================================================
+// Execute a read plan, storing every value in sample "index" of its column of the store
+//		Energy and Throttle time values are unscaled 32-bit counts (to make it easier to
+//		correct for wrap-around in post-processing).
+//
+void execute_read_plan(struct read_plan *plan, struct sample_store *store, long index)
+{
+	struct read_op *op, *end;
+	uint32_t low, high;
+	uint64_t msr_val;
+	ssize_t rc64;
+	uint64_t *base = store_value(store, 0, index);		// column c of this sample is base[c*stride]
+	long stride = store_column_stride(store);
+
+	end = &plan->ops[plan->first[PLAN_MSR+1]];
+	for (op = &plan->ops[plan->first[PLAN_MSR]]; op < end; op++) {
+		rc64 = pread(op->fd,&msr_val,sizeof(msr_val),op->reg);
+		if (rc64 != sizeof(msr_val)) {
+			fprintf(log_file,"ERROR: failed to read MSR %x on Logical Processor %d", op->reg, op->lproc);
+			exit(-1);
+		}
+		base[op->dest * stride] = msr_val;
+	}
+	end = &plan->ops[plan->first[PLAN_MMCONFIG+1]];
+	for (op = &plan->ops[plan->first[PLAN_MMCONFIG]]; op < end; op++) {
+		low = mmconfig_ptr[op->reg];
+		high = mmconfig_ptr[op->reg+1];
+		base[op->dest * stride] = ((uint64_t) high) << 32 | (uint64_t) low;
+	}
+	end = &plan->ops[plan->first[PLAN_PERF+1]];
+	for (op = &plan->ops[plan->first[PLAN_PERF]]; op < end; op++) {
+		rc64 = read(op->fd,op->src,op->reg);
+		if (rc64 != op->reg) {
+			fprintf(log_file,"ERROR: failed to read perf_event group (fd %d) on Logical Processor %d", op->fd, op->lproc);
+			exit(-1);
+		}
+	}
+	end = &plan->ops[plan->first[PLAN_SLOT+1]];
+	for (op = &plan->ops[plan->first[PLAN_SLOT]]; op < end; op++) {
+		base[op->dest * stride] = *op->src;
 	}
+}
+
+// ==========================================================================================================
+// Read all the performance counters in one socket
+//		Executes the read plan for the socket: the socket-scope MSRs, the core counters of every logical
+//		processor in the package, and the CHA, IMC, IIO, and PCU counters of the package.  Each socket is
+//		independent of the others, so this can be called either serially for each socket or concurrently
+//		from the per-socket reader threads (see socket_reader_thread() below).  It does no I/O: the read time
+//		is left in socket_read_cycles[socket], and logged by read_all_counters() once all sockets are read.
+//
+void read_socket_counters(uint32_t socket)
+{
+	struct read_plan *plan = &read_plan[socket];
+	uint64_t tsc_before, tsc_after;
+	int temp_below;
+
+	tsc_before = rdtscp();
+	execute_read_plan(plan, &samples, sample);
 	tsc_after = rdtscp();
-	delta_tsc = tsc_after - tsc_before;
-	avg_tsc = delta_tsc / reads_performed;
-	// NOTE: some quick tests on a Hikari node showed 30k-36k TSC cycles (11-14 microseconds) to read the 4 programmable IMC counters for each socket/imc/channel.
-	//   2 sockets * 4 channels/socket * 4 IMCs * 2 reads/counter = 64 reads --> 450-550 TSC cycles/read
-	// fprintf(log_file,"DEBUG: reading IMC counters took %lu TSC cycles\n",delta_tsc);
-	fprintf(log_file,"OVERHEAD: reading %d IMC_counters %lu total TSC cycles, %lu average TSC cycles\n",reads_performed,delta_tsc,avg_tsc);
 
+	// NOTE: Temperature values are in degrees C (and not available without the msr driver)
+	temp_below  = (SAMPLE(pkg_therm_status[socket], sample) & 0x007F0000)>>16;      // 7 bit field for degrees C below PROCHOT temperature
+	SAMPLE(pkg_temperature[socket], sample) = temp_target - temp_below;
+	socket_read_cycles[socket] = tsc_after - tsc_before;
+}
+
+void log_socket_reads()
+{
+	struct read_plan *plan;
+	uint32_t socket;
+
+	for (socket=0; socket<NUM_SOCKETS; socket++) {
+		plan = &read_plan[socket];
+		fprintf(log_file,"OVERHEAD: socket %u reading %d counters (%d MSR, %d MMCONFIG, %d PERF+SLOT) %lu total TSC cycles\n",socket,
+			plan->num_ops, plan->first[PLAN_MSR+1]-plan->first[PLAN_MSR], plan->first[PLAN_MMCONFIG+1]-plan->first[PLAN_MMCONFIG],
+			plan->first[PLAN_SLOT+1]-plan->first[PLAN_PERF], socket_read_cycles[socket]);
+	}
+}
+
+// ==========================================================================================================
+// Per-socket reader threads (optional, enabled with the "-S" command-line option)
+//		Each thread is pinned to the logical processor proc_in_pkg[socket], so the pread() calls on the
+//		msr device drivers only generate IPIs within the package, and the two sockets are read concurrently.
+//		The main thread takes the (single) TSC and wall-clock timestamp for the sample, releases the readers
+//		with the "start" barrier, then waits for all of them at the "done" barrier.
+//
+void *socket_reader_thread(void *arg)
+{
+	uint32_t socket = (uint32_t)(uintptr_t)arg;
+	cpu_set_t cpuset;
+	int rc;
+
+	CPU_ZERO(&cpuset);
+	CPU_SET(proc_in_pkg[socket], &cpuset);
+	rc = pthread_setaffinity_np(pthread_self(), sizeof(cpuset), &cpuset);
+	if (rc != 0) {
+		fprintf(log_file,"ERROR %s when trying to pin socket %u reader thread to Logical Processor %ld\n",strerror(rc),socket,proc_in_pkg[socket]);
+		exit(-1);
+	}
+	while (1) {
+		pthread_barrier_wait(&reader_start);
+		if (reader_exit) break;
+		read_socket_counters(socket);
+		pthread_barrier_wait(&reader_done);
+	}
+	return NULL;
+}
+
+void start_socket_readers()
+{
+	sigset_t blocked, saved;
+	uint32_t socket;
+	int rc;
+
+	pthread_barrier_init(&reader_start, NULL, NUM_SOCKETS+1);
+	pthread_barrier_init(&reader_done, NULL, NUM_SOCKETS+1);
+	reader_exit = 0;
+
+	// SIGCONT must only be delivered to the main thread, so block it while the readers are created
+	// (the new threads inherit the blocked signal mask).
+	sigemptyset(&blocked);
+	sigaddset(&blocked, SIGCONT);
+	pthread_sigmask(SIG_BLOCK, &blocked, &saved);
+	for (socket=0; socket<NUM_SOCKETS; socket++) {
+		rc = pthread_create(&socket_reader[socket], NULL, socket_reader_thread, (void *)(uintptr_t)socket);
+		if (rc != 0) {
+			fprintf(log_file,"ERROR %s when trying to create reader thread for socket %u\n",strerror(rc),socket);
+			exit(-1);
+		}
+	}
+	pthread_sigmask(SIG_SETMASK, &saved, NULL);
+	fprintf(log_file,"INFO: started %d per-socket reader threads\n",NUM_SOCKETS);
+}
+
+void stop_socket_readers()
+{
+	uint32_t socket;
+
+	reader_exit = 1;
+	pthread_barrier_wait(&reader_start);
+	for (socket=0; socket<NUM_SOCKETS; socket++) {
+		pthread_join(socket_reader[socket], NULL);
+	}
+	pthread_barrier_destroy(&reader_start);
+	pthread_barrier_destroy(&reader_done);
+}
+
+// ==========================================================================================================
+// RDPMC core counter helpers (optional, enabled with the "-r" command-line option)
+//		One helper thread is created for each logical processor and pinned to it.  For each sample the
+//		main thread releases all of the helpers with the "core_start" barrier, each helper reads the 4
+//		programmable and 3 fixed-function counters of its own logical processor with RDPMC, and
+//		APERF/MPERF (which are not accessible to RDPMC) with a pread() on its own msr device driver,
+//		which the kernel services locally without an IPI.  The values are left in core_slot[lproc]
+//		and are copied into the core series by the PLAN_SLOT entries of the read plan.
+//
+//		RDPMC from user space requires CR4.PCE, which Linux sets on all logical processors when
+//		/sys/bus/event_source/devices/cpu/rdpmc contains 2.  The original setting is restored at exit.
+//
+void *core_helper_thread(void *arg)
+{
+	int lproc = (int)(intptr_t)arg;
+	struct core_slot *slot = &core_slot[lproc];
+	uint32_t counter;
+	ssize_t rc64;
+
+	while (1) {
+		pthread_barrier_wait(&core_start);
+		if (core_helper_exit) break;
+		for (counter=0; counter<NUM_CORE_COUNTERS; counter++) {
+			slot->pmc[counter] = rdpmc(counter);
+		}
+		slot->fixed[0] = rdpmc_instructions();
+		slot->fixed[1] = rdpmc_actual_cycles();
+		slot->fixed[2] = rdpmc_reference_cycles();
+		rc64 = pread(msr_fd[lproc],&slot->aperf,sizeof(uint64_t),IA32_APERF);
+		rc64 += pread(msr_fd[lproc],&slot->mperf,sizeof(uint64_t),IA32_MPERF);
+		if (rc64 != 2*sizeof(uint64_t)) {
+			fprintf(log_file,"ERROR: failed to read APERF/MPERF on Logical Processor %d", lproc);
+			exit(-1);
+		}
+		pthread_barrier_wait(&core_done);
+	}
+	return NULL;
+}
+
+void start_core_helpers()
+{
+	char filename[100];
+	FILE *rdpmc_file;
+	pthread_attr_t attr;
+	cpu_set_t cpuset;
+	sigset_t blocked, saved;
+	int lproc, rc;
+
+	// make sure that user-space RDPMC is enabled on all logical processors
+	sprintf(filename,"/sys/bus/event_source/devices/cpu/rdpmc");
+	rdpmc_file = fopen(filename,"r+");
+	if (rdpmc_file == 0) {
+		fprintf(log_file,"ERROR %s when trying to open %s -- cannot enable user-space RDPMC\n",strerror(errno),filename);
+		exit(-1);
+	}
+	if (fscanf(rdpmc_file,"%15s",rdpmc_saved_setting) != 1) {
+		fprintf(log_file,"ERROR: unable to read %s\n",filename);
+		exit(-1);
+	}
+	if (strcmp(rdpmc_saved_setting,"2") != 0) {
+		rewind(rdpmc_file);
+		fprintf(rdpmc_file,"2\n");
+		fprintf(log_file,"INFO: changed %s from %s to 2 to allow user-space RDPMC\n",filename,rdpmc_saved_setting);
+	}
+	fclose(rdpmc_file);
+
+	core_slot = aligned_alloc(64, nr_cpus * sizeof(struct core_slot));
+	core_helper = malloc(nr_cpus * sizeof(pthread_t));
+	if ((core_slot == NULL) || (core_helper == NULL)) {
+		fprintf(log_file,"ERROR: unable to allocate RDPMC helper slots\n");
+		exit(-1);
+	}
+	memset(core_slot, 0, nr_cpus * sizeof(struct core_slot));
+	pthread_barrier_init(&core_start, NULL, nr_cpus+1);
+	pthread_barrier_init(&core_done, NULL, nr_cpus+1);
+	core_helper_exit = 0;
+
+	sigemptyset(&blocked);
+	sigaddset(&blocked, SIGCONT);
+	pthread_sigmask(SIG_BLOCK, &blocked, &saved);
+	for (lproc=0; lproc<nr_cpus; lproc++) {
+		// create each helper already bound to its logical processor, so it never runs anywhere else
+		pthread_attr_init(&attr);
+		CPU_ZERO(&cpuset);
+		CPU_SET(lproc, &cpuset);
+		pthread_attr_setaffinity_np(&attr, sizeof(cpuset), &cpuset);
+		rc = pthread_create(&core_helper[lproc], &attr, core_helper_thread, (void *)(intptr_t)lproc);
+		pthread_attr_destroy(&attr);
+		if (rc != 0) {
+			fprintf(log_file,"ERROR %s when trying to create RDPMC helper thread for Logical Processor %d\n",strerror(rc),lproc);
+			exit(-1);
+		}
+	}
+	pthread_sigmask(SIG_SETMASK, &saved, NULL);
+	fprintf(log_file,"INFO: started %ld RDPMC core counter helper threads\n",nr_cpus);
+}
+
+void stop_core_helpers()
+{
+	char filename[100];
+	FILE *rdpmc_file;
+	int lproc;
+
+	core_helper_exit = 1;
+	pthread_barrier_wait(&core_start);
+	for (lproc=0; lproc<nr_cpus; lproc++) {
+		pthread_join(core_helper[lproc], NULL);
+	}
+	pthread_barrier_destroy(&core_start);
+	pthread_barrier_destroy(&core_done);
+
+	if (strcmp(rdpmc_saved_setting,"2") != 0) {
+		sprintf(filename,"/sys/bus/event_source/devices/cpu/rdpmc");
+		rdpmc_file = fopen(filename,"w");
+		if (rdpmc_file != 0) {
+			fprintf(rdpmc_file,"%s\n",rdpmc_saved_setting);
+			fclose(rdpmc_file);
+		}
+	}
+}
+
+// ==========================================================================================================
+// perf_event backend (optional, enabled with the "-p" command-line option)
+//		Opens the events from core_msr_perfevtsel.input and the uncore .input files with perf_event_open()
+//		instead of programming the PERFEVTSEL registers through the msr driver and /dev/mem.
+//		Each logical processor and each uncore box gets one event group with PERF_FORMAT_GROUP, so a
+//		single read() returns all of the counters in the group.  The group reads are PLAN_PERF entries in
+//		the read plan, followed by PLAN_SLOT entries that copy the values into the usual series, so the
+//		output arrays and file format are unchanged.
+//
+//		Core groups:	INST_RETIRED.ANY, CPU_CLK_UNHALTED.CORE, CPU_CLK_UNHALTED.REF + the 4 programmable events,
+//						so one read() replaces 7 msr reads for each logical processor
+//		APERF/MPERF:	the "msr" PMU (a separate group, since events from different PMUs cannot be grouped)
+//		Uncore groups:	uncore_cha_<n>, uncore_imc_<channel>, and uncore_pcu, opened on proc_in_pkg[socket]
+//		RAPL:			the "power" PMU if the msr driver is not available
+//		The remaining socket-scope MSRs (temperature, limit reasons, SMI count, UBox clock, free-running
+//		IIO counters) are still read with the msr driver if it can be opened, and are left at zero otherwise.
+//
+//		CPU-wide events do not require root if /proc/sys/kernel/perf_event_paranoid is 0 or less.
+//
+#define PERF_GROUP_HEADER 3					// read buffer: nr, time_enabled, time_running, value[nr]
+#define MAX_PERF_GROUP_EVENTS 8
+struct perf_group {
+	int fd[MAX_PERF_GROUP_EVENTS];			// fd[0] is the group leader
+	int nr;
+	uint64_t buf[PERF_GROUP_HEADER+MAX_PERF_GROUP_EVENTS];
+	char label[40];
+};
+struct perf_group **perf_groups;			// (pointers, since the read plan points into each group's buffer)
+int num_perf_groups, max_perf_groups;
+
+long perf_event_open(struct perf_event_attr *attr, pid_t pid, int cpu, int group_fd, unsigned long flags)
+{
+	return syscall(__NR_perf_event_open, attr, pid, cpu, group_fd, flags);
+}
+
+// Look up the dynamic PMU type number in /sys/bus/event_source/devices/<pmu>/type -- returns -1 if there is no such PMU
+int perf_pmu_type(char *pmu)
+{
+	char filename[200];
+	FILE *type_file;
+	int type;
+
+	sprintf(filename,"/sys/bus/event_source/devices/%s/type",pmu);
+	type_file = fopen(filename,"r");
+	if (type_file == 0) return (-1);
+	if (fscanf(type_file,"%d",&type) != 1) type = -1;
+	fclose(type_file);
+	return (type);
+}
+
+// Look up a named event of a PMU -- only the "event=0x.." form used by the msr and power PMUs is supported.
+// Also returns the scale factor from the optional ".scale" file (1.0 if there is none).
+int perf_pmu_event(char *pmu, char *event, uint64_t *config, double *scale)
+{
+	char filename[200];
+	FILE *event_file;
+	int rc;
+
+	sprintf(filename,"/sys/bus/event_source/devices/%s/events/%s",pmu,event);
+	event_file = fopen(filename,"r");
+	if (event_file == 0) return (-1);
+	rc = fscanf(event_file,"event=%lx",config);
+	fclose(event_file);
+	if (rc != 1) return (-1);
+	*scale = 1.0;
+	sprintf(filename,"/sys/bus/event_source/devices/%s/events/%s.scale",pmu,event);
+	event_file = fopen(filename,"r");
+	if (event_file != 0) {
+		if (fscanf(event_file,"%lf",scale) != 1) *scale = 1.0;
+		fclose(event_file);
+	}
+	return (0);
+}
+
+// Open one event group on a logical processor.  config1[] may be NULL.
+// The exclude[] flags are only used for core events (bit 0 = exclude user, bit 1 = exclude kernel).
+struct perf_group *perf_open_group(char *label, int type, int cpu, int nr, uint64_t *config, uint64_t *config1, int *exclude)
+{
+	struct perf_event_attr attr;
+	struct perf_group *group;
+	int i;
+
+	assert (nr <= MAX_PERF_GROUP_EVENTS);
+	if (num_perf_groups == max_perf_groups) {
+		max_perf_groups = (max_perf_groups == 0) ? 128 : 2*max_perf_groups;
+		perf_groups = realloc(perf_groups, max_perf_groups * sizeof(struct perf_group *));
+	}
+	group = calloc(1, sizeof(struct perf_group));
+	if ((perf_groups == NULL) || (group == NULL)) {
+		fprintf(log_file,"ERROR: unable to allocate perf_event groups\n");
+		exit(-1);
+	}
+	perf_groups[num_perf_groups++] = group;
+	group->nr = nr;
+	strncpy(group->label,label,sizeof(group->label)-1);
+	group->label[sizeof(group->label)-1] = 0;
+
+	for (i=0; i<nr; i++) {
+		memset(&attr, 0, sizeof(attr));
+		attr.size = sizeof(attr);
+		attr.type = type;
+		attr.config = config[i];
+		if (config1 != NULL) attr.config1 = config1[i];
+		if (exclude != NULL) {
+			attr.exclude_user = exclude[i] & 1;
+			attr.exclude_kernel = (exclude[i] >> 1) & 1;
+		}
+		attr.read_format = PERF_FORMAT_GROUP | PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+		attr.disabled = (i == 0);			// the whole group is enabled at once through the leader
+		group->fd[i] = perf_event_open(&attr, -1, cpu, (i == 0) ? -1 : group->fd[0], 0);
+		if (group->fd[i] == -1) {
+			fprintf(log_file,"ERROR %s when trying to open perf_event %d (type %d config 0x%lx) of group %s on Logical Processor %d\n",
+				strerror(errno),i,type,config[i],label,cpu);
+			exit(-1);
+		}
+	}
+	if (ioctl(group->fd[0], PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP) == -1) {
+		fprintf(log_file,"ERROR %s when trying to enable perf_event group %s\n",strerror(errno),label);
+		exit(-1);
+	}
+	return (group);
+}
+
+// Add the group read and the copies of its values to the read plan of a socket
+void plan_add_perf_group(uint32_t socket, int lproc, struct perf_group *group, int *dest)
+{
+	int i;
+
+	plan_add(socket, PLAN_PERF, lproc, (PERF_GROUP_HEADER + group->nr) * sizeof(uint64_t), -1);
+	read_plan[socket].ops[read_plan[socket].num_ops-1].fd = group->fd[0];
+	read_plan[socket].ops[read_plan[socket].num_ops-1].src = group->buf;
+	for (i=0; i<group->nr; i++) {
+		plan_add_slot(socket, lproc, &group->buf[PERF_GROUP_HEADER+i], dest[i]);
+	}
+}
+
+// Convert a core IA32_PERFEVTSELx value to a raw "cpu" PMU config -- drop the USR, OS, INT, and EN bits,
+// which perf_event controls itself (USR and OS become the exclude_user and exclude_kernel flags)
+uint64_t core_evtsel_to_config(uint64_t evtsel, int *exclude)
+{
+	*exclude = ((evtsel & (1UL<<16)) ? 0 : 1) | ((evtsel & (1UL<<17)) ? 0 : 2);
+	return (evtsel & 0xffffffffUL & ~((1UL<<16) | (1UL<<17) | (1UL<<20) | (1UL<<22)));
+}
+
+// Convert an uncore PMON_CTL value to a raw uncore PMU config -- drop the reset (17) and enable (22) bits
+uint64_t uncore_evtsel_to_config(uint64_t evtsel)
+{
+	return (evtsel & 0xffffffffUL & ~((1UL<<17) | (1UL<<22)));
+}
+
+// Open all of the groups and add them to the read plan of each socket (called from build_read_plan())
+void plan_add_perf_events(uint32_t socket)
+{
+	uint64_t config[MAX_PERF_GROUP_EVENTS], config1[MAX_PERF_GROUP_EVENTS];
+	int dest[MAX_PERF_GROUP_EVENTS];
+	int exclude[MAX_PERF_GROUP_EVENTS];
+	struct perf_group *group;
+	char label[40], pmu[40];
+	uint32_t counter, cha, channel;
+	int lproc, core, type, msr_type, power_type, nr;
+	uint64_t aperf_config, mperf_config, energy_config;
+	double scale;
+
+	core = proc_in_pkg[socket];
+
+	// core counters: one group per logical processor for the fixed-function and programmable counters,
+	// plus one group for APERF/MPERF from the "msr" PMU
+	msr_type = perf_pmu_type("msr");
+	if ((msr_type == -1) || (perf_pmu_event("msr","aperf",&aperf_config,&scale) != 0)
+			|| (perf_pmu_event("msr","mperf",&mperf_config,&scale) != 0)) {
+		fprintf(log_file,"WARNING: the perf_event \"msr\" PMU does not provide aperf/mperf -- these will not be collected\n");
+		msr_type = -1;
+	}
+	for (lproc=0; lproc<nr_cpus; lproc++) {
+		if (Package_by_LProc[lproc] != (int)socket) continue;
+		// raw encodings that the kernel can only (or preferentially) schedule on the fixed-function counters
+		nr = 0;
+		config[nr] = 0x00c0;	exclude[nr] = 0; dest[nr++] = core_fixed[lproc][0];		// INST_RETIRED.ANY
+		config[nr] = 0x003c;	exclude[nr] = 0; dest[nr++] = core_fixed[lproc][1];		// CPU_CLK_UNHALTED.THREAD
+		config[nr] = 0x0300;	exclude[nr] = 0; dest[nr++] = core_fixed[lproc][2];		// CPU_CLK_UNHALTED.REF_TSC (pseudo-encoding)
+		for (counter=0; counter<NUM_CORE_COUNTERS; counter++) {
+			if (core_evtsel[lproc][counter] == 0) continue;
+			config[nr] = core_evtsel_to_config(core_evtsel[lproc][counter], &exclude[nr]);
+			dest[nr++] = core_counts[lproc][counter];
+		}
+		sprintf(label,"core[%d]",lproc);
+		group = perf_open_group(label, PERF_TYPE_RAW, lproc, nr, config, NULL, exclude);
+		plan_add_perf_group(socket, lproc, group, dest);
+
+		if (msr_type != -1) {
+			config[0] = aperf_config;	dest[0] = aperf[lproc];
+			config[1] = mperf_config;	dest[1] = mperf[lproc];
+			sprintf(label,"aperf_mperf[%d]",lproc);
+			group = perf_open_group(label, msr_type, lproc, 2, config, NULL, NULL);
+			plan_add_perf_group(socket, lproc, group, dest);
+		}
+	}
+
+	// CHA counters -- filter0 and filter1 (controls 4 and 5) are combined into config1
+	for (cha=0; cha<NUM_CHA_BOXES; cha++) {
+		sprintf(pmu,"uncore_cha_%u",cha);
+		type = perf_pmu_type(pmu);
+		if (type == -1) continue;
+		nr = 0;
+		for (counter=0; counter<NUM_CHA_COUNTERS; counter++) {
+			if (cha_evtsel[socket][cha][counter] == 0) continue;
+			config[nr] = uncore_evtsel_to_config(cha_evtsel[socket][cha][counter]);
+			config1[nr] = (cha_evtsel[socket][cha][4] & 0xffffffffUL) | (cha_evtsel[socket][cha][5] << 32);
+			dest[nr++] = cha_counts[socket][cha][counter];
+		}
+		if (nr == 0) continue;
+		sprintf(label,"cha_counts[%u][%u]",socket,cha);
+		group = perf_open_group(label, type, core, nr, config, config1, NULL);
+		plan_add_perf_group(socket, core, group, dest);
+	}
+
+	// IMC counters -- the fixed-function DCLK counter (counter 4) is event 0xff of the uncore_imc PMUs
+	for (channel=0; channel<NUM_IMC_CHANNELS; channel++) {
+		sprintf(pmu,"uncore_imc_%u",channel);
+		type = perf_pmu_type(pmu);
+		if (type == -1) continue;
+		nr = 0;
+		for (counter=0; counter<NUM_IMC_COUNTERS; counter++) {
+			if (imc_evtsel[socket][channel][counter] == 0) continue;
+			config[nr] = (counter == NUM_IMC_COUNTERS-1) ? 0xff : uncore_evtsel_to_config(imc_evtsel[socket][channel][counter]);
+			dest[nr++] = imc_counts[socket][channel][counter];
+		}
+		if (nr == 0) continue;
+		sprintf(label,"imc_counts[%u][%u]",socket,channel);
+		group = perf_open_group(label, type, core, nr, config, NULL, NULL);
+		plan_add_perf_group(socket, core, group, dest);
+	}
+
+	// PCU counters
+	type = perf_pmu_type("uncore_pcu");
+	if (type != -1) {
+		nr = 0;
+		for (counter=0; counter<4; counter++) {
+			if (pcu_evtsel[socket][counter] == 0) continue;
+			config[nr] = uncore_evtsel_to_config(pcu_evtsel[socket][counter]);
+			dest[nr++] = pcu_counts[socket][counter];
+		}
+		if (nr > 0) {
+			sprintf(label,"pcu_counts[%u]",socket);
+			group = perf_open_group(label, type, core, nr, config, NULL, NULL);
+			plan_add_perf_group(socket, core, group, dest);
+		}
+	}
+
+	// RAPL energy from the "power" PMU when the msr driver is not available.  The counts are 64-bit
+	// accumulations in units of the ".scale" file, which are written as RAPL_*_ENERGY_UNIT in main().
+	power_type = perf_pmu_type("power");
+	if ((!msr_available) && (power_type != -1)) {
+		if (perf_pmu_event("power","energy-pkg",&energy_config,&scale) == 0) {
+			config[0] = energy_config;	dest[0] = rapl_pkg_energy[socket];
+			sprintf(label,"rapl_pkg_energy[%u]",socket);
+			group = perf_open_group(label, power_type, core, 1, config, NULL, NULL);
+			plan_add_perf_group(socket, core, group, dest);
+		}
+		if (perf_pmu_event("power","energy-ram",&energy_config,&scale) == 0) {
+			config[0] = energy_config;	dest[0] = rapl_dram_energy[socket];
+			sprintf(label,"rapl_dram_energy[%u]",socket);
+			group = perf_open_group(label, power_type, core, 1, config, NULL, NULL);
+			plan_add_perf_group(socket, core, group, dest);
+		}
+	}
+}
+
+// Check that the groups are counting.  At startup (with "startup" set, before the first sample), read each group
+// once and stop if the kernel could not schedule it (e.g., because the NMI watchdog or another user of the PMU
+// took a counter), since the raw values are not scaled for multiplexing.  At the end of the run, report any groups
+// that were not counting for the whole run.
+void check_perf_groups(int startup)
+{
+	struct perf_group *group;
+	int i;
+
+	for (i=0; i<num_perf_groups; i++) {
+		group = perf_groups[i];
+		if (startup && (read(group->fd[0], group->buf, sizeof(group->buf)) <= 0)) {
+			fprintf(log_file,"ERROR %s when trying to read perf_event group %s\n",strerror(errno),group->label);
+			exit(-1);
+		}
+		if (group->buf[2] < group->buf[1]) {
+			if (startup) {
+				fprintf(log_file,"ERROR: perf_event group %s was only counting for %lu of %lu ns after it was enabled "
+					"(is the NMI watchdog holding a counter? see /proc/sys/kernel/nmi_watchdog)\n",
+					group->label, group->buf[2], group->buf[1]);
+				exit(-1);
+			}
+			fprintf(log_file,"WARNING: perf_event group %s was only counting for %lu of %lu ns\n",
+				group->label, group->buf[2], group->buf[1]);
+		}
+	}
+}
+
+// ==========================================================================================================
+// Read all the performance counters for this node
+//		currently contains writes to log files -- not sure if I need to kill these
+//
+void read_all_counters()
+{
+	uint64_t tsc_before, tsc_after, delta_tsc, avg_tsc;
+	char filename[100];
+	int reads_performed;
+	uint32_t socket;
+
+	// Grab a TSC value to use as the node-local timeline value for this set of samples
+	// Call gettimeofday() to get the wall clock time for cross-node timing alignment
+	SAMPLE(tsc_start, sample) = rdtscp();
+	gettimeofday(&tp,&tzp);
+	SAMPLE(walltime[0], sample) = tp.tv_sec;
+	SAMPLE(walltime[1], sample) = tp.tv_usec;
+
+	if (use_rdpmc) {
+		// all core counters are read at (nearly) the same time by the helpers, before any of the read plans run
+		pthread_barrier_wait(&core_start);
+		pthread_barrier_wait(&core_done);
+	}
+
+	if (use_socket_readers) {
+		pthread_barrier_wait(&reader_start);		// release the per-socket readers for this sample....
+	} else {
+		for (socket=0; socket<NUM_SOCKETS; socket++) {
+			read_socket_counters(socket);
+		}
+	}
 
 #ifdef INFINIBAND
+	// (read by the main thread while the socket readers are running)
 	fprintf(log_file,"VERBOSE: Reading InfiniBand counters....\n");
 	reads_performed = 0;
 	tsc_before = rdtscp();
 
 	sprintf(filename,"/sys/class/infiniband/hfi1_0/ports/1/hw_counters/RxWords");
 	ib_recv_file = fopen(filename,"r");
-	i = fscanf(ib_recv_file,"%ld",&ib_recv[sample]);
+	if (fscanf(ib_recv_file,"%ld",&SAMPLE(ib_recv, sample)) != 1) SAMPLE(ib_recv, sample) = 0;
 	reads_performed++;
 	fclose(ib_recv_file);
 
 	sprintf(filename,"/sys/class/infiniband/hfi1_0/ports/1/hw_counters/TxWords");
 	ib_xmit_file = fopen(filename,"r");
-	i = fscanf(ib_xmit_file,"%ld",&ib_xmit[sample]);
+	if (fscanf(ib_xmit_file,"%ld",&SAMPLE(ib_xmit, sample)) != 1) SAMPLE(ib_xmit, sample) = 0;
 	fclose(ib_xmit_file);
 	reads_performed++;
 
@@ -603,121 +3320,371 @@ void read_all_counters()
 	fprintf(log_file,"OVERHEAD: reading %d InfiniBand_Counters %lu total TSC cycles, %lu average TSC cycles\n",reads_performed,delta_tsc,avg_tsc);
 #endif
 
-	fprintf(log_file,"VERBOSE: Reading Free-running IO counters....\n");
-	reads_performed = 0;
-	tsc_before = rdtscp();
-	for (socket=0; socket<NUM_SOCKETS; socket++) {
-		core = proc_in_pkg[socket];
+	if (use_socket_readers) {
+		pthread_barrier_wait(&reader_done);		// ....and wait for all of them to finish
+		tsc_after = rdtscp();
+		fprintf(log_file,"OVERHEAD: reading all sockets in parallel %lu total TSC cycles\n",tsc_after-SAMPLE(tsc_start, sample));
+	}
+	log_socket_reads();
 
-		rc64 = pread(msr_fd[core],&msr_val,sizeof(msr_val),CBDMA_p1_in);
-		if (rc64 != sizeof(msr_val)) {
-			fprintf(log_file,"ERROR: failed to read performance counter number %d MSR %x on Logical Processor %d", counter, CBDMA_p1_in, core);
-			exit(-1);
-		}
-		iio_CBDMA_port1_in[socket][sample] = msr_val;
+	if (use_rollups) update_rollups(sample);
+	sample++;
+	store_reserve(&samples, sample);		// (a new chunk is allocated and zeroed here, not during the next read)
+}
 
-		rc64 = pread(msr_fd[core],&msr_val,sizeof(msr_val),CBDMA_p1_out);
-		if (rc64 != sizeof(msr_val)) {
-			fprintf(log_file,"ERROR: failed to read performance counter number %d MSR %x on Logical Processor %d", counter, CBDMA_p1_out, core);
-			exit(-1);
-		}
-		iio_CBDMA_port1_out[socket][sample] = msr_val;
 
-		rc64 = pread(msr_fd[core],&msr_val,sizeof(msr_val),PCIE0_p1_in);
-		if (rc64 != sizeof(msr_val)) {
-			fprintf(log_file,"ERROR: failed to read performance counter number %d MSR %x on Logical Processor %d", counter, PCIE0_p1_in, core);
-			exit(-1);
-		}
-		iio_PCIe0_port1_in[socket][sample] = msr_val;
+// ==========================================================================================================
+// Drift-free periodic scheduling
+//		The sampling loop sleeps until absolute deadlines with clock_nanosleep(TIMER_ABSTIME), so the
+//		period does not grow by the time spent reading the counters or by the wakeup latency.
+//		The deadlines are on CLOCK_REALTIME and are aligned to an integer multiple of the sample interval
+//		since the epoch, so that (NTP-synchronized) nodes started at different times sample at the same
+//		wall-clock instants.  If the sampler wakes up after one or more later deadlines have already
+//		passed, the missed deadlines are skipped (keeping the samples on the same time grid) and counted.
+//		The lateness of every wakeup is accumulated in a histogram with power-of-two microsecond buckets,
+//		which is written to the log file at exit.
+//
+#define NUM_LATENESS_BUCKETS 26			// bucket 0 is < 1 us, bucket b is [2^(b-1), 2^b) us, the last bucket is open-ended
+uint64_t lateness_histogram[NUM_LATENESS_BUCKETS];
+uint64_t lateness_max_ns, lateness_sum_ns, lateness_count;
+uint64_t missed_deadlines;
 
-		rc64 = pread(msr_fd[core],&msr_val,sizeof(msr_val),PCIE0_p1_out);
-		if (rc64 != sizeof(msr_val)) {
-			fprintf(log_file,"ERROR: failed to read performance counter number %d MSR %x on Logical Processor %d", counter, PCIE0_p1_out, core);
-			exit(-1);
-		}
-		iio_PCIe0_port1_out[socket][sample] = msr_val;
+int64_t timespec_diff_ns(struct timespec *a, struct timespec *b)		// a - b
+{
+	return ((int64_t)(a->tv_sec - b->tv_sec) * 1000000000L + (a->tv_nsec - b->tv_nsec));
+}
 
-		rc64 = pread(msr_fd[core],&msr_val,sizeof(msr_val),PCIE2_p0_in);
-		if (rc64 != sizeof(msr_val)) {
-			fprintf(log_file,"ERROR: failed to read performance counter number %d MSR %x on Logical Processor %d", counter, PCIE2_p0_in, core);
-			exit(-1);
-		}
-		iio_PCIe2_port0_in[socket][sample] = msr_val;
+void timespec_add_ns(struct timespec *t, uint64_t ns)
+{
+	t->tv_sec += ns / 1000000000UL;
+	t->tv_nsec += ns % 1000000000UL;
+	if (t->tv_nsec >= 1000000000L) {
+		t->tv_sec++;
+		t->tv_nsec -= 1000000000L;
+	}
+}
 
-		rc64 = pread(msr_fd[core],&msr_val,sizeof(msr_val),PCIE2_p0_out);
-		if (rc64 != sizeof(msr_val)) {
-			fprintf(log_file,"ERROR: failed to read performance counter number %d MSR %x on Logical Processor %d", counter, PCIE2_p0_out, core);
-			exit(-1);
-		}
-		iio_PCIe2_port0_out[socket][sample] = msr_val;
+// First deadline: the next multiple of the period (since the epoch) after the current time
+void first_deadline(struct timespec *deadline, uint64_t period_ns)
+{
+	struct timespec now;
+	uint64_t now_ns, next_ns;
+
+	clock_gettime(CLOCK_REALTIME, &now);
+	now_ns = (uint64_t)now.tv_sec * 1000000000UL + now.tv_nsec;
+	next_ns = (now_ns / period_ns + 1) * period_ns;
+	deadline->tv_sec = next_ns / 1000000000UL;
+	deadline->tv_nsec = next_ns % 1000000000UL;
+}
 
-		reads_performed += 6;
+// Sleep until the deadline, record the wakeup lateness, and advance the deadline by one period
+// (plus any periods that were missed completely).  Returns early if the sleep is interrupted by SIGCONT.
+void sleep_until_deadline(struct timespec *deadline, uint64_t period_ns)
+{
+	struct timespec now;
+	int64_t diff_ns;
+	uint64_t late_ns, missed, us;
+	int bucket, rc;
+
+	do {
+		rc = clock_nanosleep(CLOCK_REALTIME, TIMER_ABSTIME, deadline, NULL);
+	} while ((rc == EINTR) && !shutdown_requested);
+	if (shutdown_requested) return;
+
+	clock_gettime(CLOCK_REALTIME, &now);
+	diff_ns = timespec_diff_ns(&now, deadline);
+	late_ns = (diff_ns > 0) ? diff_ns : 0;		// (negative only if the clock was stepped backwards)
+	lateness_count++;
+	lateness_sum_ns += late_ns;
+	if (late_ns > lateness_max_ns) lateness_max_ns = late_ns;
+	us = late_ns / 1000;
+	for (bucket=0; (us > 0) && (bucket < NUM_LATENESS_BUCKETS-1); bucket++) us >>= 1;
+	lateness_histogram[bucket]++;
+
+	timespec_add_ns(deadline, period_ns);
+	if (late_ns >= period_ns) {
+		missed = late_ns / period_ns;
+		timespec_add_ns(deadline, missed * period_ns);
+		missed_deadlines += missed;
+		fprintf(log_file,"WARNING: woke up %lu ns late for sample %d -- skipped %lu deadline(s)\n",late_ns,sample,missed);
+	} else if (timespec_diff_ns(deadline, &now) > 2 * (int64_t)period_ns) {
+		// the clock was stepped backwards -- restart the time grid from the current time
+		first_deadline(deadline, period_ns);
+		fprintf(log_file,"WARNING: CLOCK_REALTIME moved backwards before sample %d -- deadlines re-aligned\n",sample);
 	}
-	tsc_after = rdtscp();
-	delta_tsc = tsc_after - tsc_before;
-	avg_tsc = delta_tsc / reads_performed;
-	fprintf(log_file,"OVERHEAD: reading %d Free-Running_IIO_Counters %lu total TSC cycles, %lu average TSC cycles\n",reads_performed,delta_tsc,avg_tsc);
+}
 
+void report_wakeup_lateness()
+{
+	uint64_t low, high;
+	int bucket;
+
+	fprintf(log_file,"SCHEDULE: %lu wakeups, %lu missed deadlines, mean lateness %lu ns, max lateness %lu ns\n",
+		lateness_count, missed_deadlines, (lateness_count > 0) ? lateness_sum_ns / lateness_count : 0, lateness_max_ns);
+	for (bucket=0; bucket<NUM_LATENESS_BUCKETS; bucket++) {
+		if (lateness_histogram[bucket] == 0) continue;
+		low = (bucket == 0) ? 0 : (1UL << (bucket-1));
+		high = 1UL << bucket;
+		if (bucket == NUM_LATENESS_BUCKETS-1) {
+			fprintf(log_file,"SCHEDULE: lateness >= %lu us: %lu\n",low,lateness_histogram[bucket]);
+		} else {
+			fprintf(log_file,"SCHEDULE: lateness %lu-%lu us: %lu\n",low,high,lateness_histogram[bucket]);
+		}
+	}
+}
+
+// ==========================================================================================================
+// Time-multiplexed event groups
+//		core_msr_perfevtsel.input and cha_perfevtsel.input may contain several event groups, each one
+//		starting with a "group N" line (lines before the first "group" line belong to group 0).
+//		After every mux_intervals samples the main thread reprograms the PERFEVTSEL registers (and the
+//		CHA filters) with the next group, between two calls to read_all_counters().  The counters are not
+//		cleared, so the delta between two samples is the count of the group that was programmed during
+//		that interval.  core_mux_group[] and cha_mux_group[] record that group for each sample, and
+//		mux_active_tsc[] records how long it was counting, so that post-processing can scale the counts by
+//		the fraction of the run that each group was active.  The interval starts at tsc_start of the previous
+//		sample, like the deltas of the counters: after a switch, the old group keeps counting from the reads
+//		to the reprogramming (the OVERHEAD lines in the log), and those counts land in the new group.
+//		If the two files have a different number of groups, each rotates through its own groups.
+//
+void mux_reprogram_groups()
+{
+	uint32_t socket, cha, counter;
+	uint64_t msr_val, tsc_before, tsc_after;
+	ssize_t rc64;
+	int lproc, group, writes;
 
-	// read PCU counters in each socket
-	fprintf(log_file,"VERBOSE: Reading PCU counters....\n");
-	reads_performed = 0;
 	tsc_before = rdtscp();
-	for (socket=0; socket<NUM_SOCKETS; socket++) {
-		core = proc_in_pkg[socket];
-		for (counter=0; counter<4; counter++) {
-			msr_num = PCU_MSR_PMON_CTR + counter;
-			rc64 = pread(msr_fd[core],&msr_val,sizeof(msr_val),msr_num);
-			if (rc64 != sizeof(msr_val)) {
-				fprintf(log_file,"ERROR: failed to read MSR %x on Logical Processor %d", msr_num, core);
-				exit(-1);
+	writes = 0;
+	if (core_mux_groups > 1) {
+		group = mux_rotation % core_mux_groups;
+		for (lproc=0; lproc<nr_cpus; lproc++) {
+			for (counter=0; counter<NUM_CORE_COUNTERS; counter++) {
+				msr_val = core_mux_evtsel[group][lproc][counter];
+				rc64 = pwrite(msr_fd[lproc],&msr_val,sizeof(msr_val),IA32_PERFEVTSEL0 + counter);
+				if (rc64 != sizeof(msr_val)) {
+					fprintf(log_file,"ERROR writing to MSR device on lproc %d, write %ld bytes\n",lproc,rc64);
+					exit(-1);
+				}
+				writes++;
+			}
+		}
+	}
+	if (cha_mux_groups > 1) {
+		group = mux_rotation % cha_mux_groups;
+		for (socket=0; socket<NUM_SOCKETS; socket++) {
+			for (cha=0; cha<NUM_CHA_BOXES; cha++) {
+				for (counter=0; counter<NUM_CHA_CONTROLS; counter++) {
+					msr_val = cha_mux_evtsel[group][socket][cha][counter];
+					rc64 = pwrite(msr_fd[proc_in_pkg[socket]],&msr_val,sizeof(msr_val),CHA_MSR_PMON_CTL_BASE + (0x10 * cha) + counter);
+					if (rc64 != sizeof(msr_val)) {
+						fprintf(log_file,"ERROR writing to MSR device on core %ld, write %ld bytes\n",proc_in_pkg[socket],rc64);
+						exit(-1);
+					}
+					writes++;
+				}
 			}
-			pcu_counts[socket][counter][sample] = msr_val;
-			reads_performed++;
 		}
 	}
 	tsc_after = rdtscp();
-	delta_tsc = tsc_after - tsc_before;
-	avg_tsc = delta_tsc / reads_performed;
-	fprintf(log_file,"OVERHEAD: reading %d PCU_counters %lu total TSC cycles, %lu average TSC cycles\n",reads_performed,delta_tsc,avg_tsc);
+	fprintf(log_file,"OVERHEAD: switching to event group rotation %d took %d MSR writes %lu total TSC cycles\n",
+		mux_rotation,writes,tsc_after-tsc_before);
+}
 
+// called after each read_all_counters() -- records the active group for the sample just read,
+// then rotates to the next group when it is time to do so
+void mux_after_read()
+{
+	int i = sample - 1;
+
+	if ((core_mux_groups == 1) && (cha_mux_groups == 1)) return;
+	SAMPLE(core_mux_group, i) = mux_rotation % core_mux_groups;
+	SAMPLE(cha_mux_group, i) = mux_rotation % cha_mux_groups;
+	SAMPLE(mux_active_tsc, i) = (i == 0) ? 0 : SAMPLE(tsc_start, i) - mux_start_tsc;
+	mux_start_tsc = SAMPLE(tsc_start, i);
+	if (sample % mux_intervals == 0) {
+		mux_rotation++;
+		mux_reprogram_groups();
+	}
+}
 
 
-	sample++;
+// ==========================================================================================================
+// Burst sampling mode (optional, enabled with the "-B" command-line option)
+//		-B interval_us:window_ms:cpu:subset
+//		Instead of the periodic loop, the sampler pins itself to a (housekeeping) logical processor, reads
+//		a subset of the counters every interval_us microseconds for window_ms milliseconds, spinning on
+//		rdtsc() deadlines instead of sleeping, and writes the values to the usual results file.
+//		The subset is a comma-separated list of groups -- fixed, core, aperf, cha, imc, pcu, rapl, iio,
+//		socket -- each optionally followed by "=" and a substring of the event name, e.g.,
+//		"imc=CAS_COUNT,fixed" selects the IMC CAS_COUNT.READS/WRITES counters and the fixed-function core
+//		counters.  The burst plan is a filtered copy of the socket read plans, storing each value in a
+//		sample-major buffer (one row of num_burst_series values per sample).
+//
+char *burst_spec;					// argument of the -B option
+int burst_cpu;
+uint64_t burst_interval_us, burst_window_ms;
+long num_burst_samples;
+struct read_plan burst_plan;
+struct sample_store burst_store;	// a single sample-major chunk of num_burst_samples records
+int burst_tsc;						// (column of burst_store)
+
+// Does the series belong to one of the groups in the comma-separated subset list?
+int burst_selected(char *subset, char *group, char *event)
+{
+	char list[200], *item, *pattern, *saveptr;
+
+	strncpy(list,subset,sizeof(list)-1);
+	list[sizeof(list)-1] = 0;
+	for (item = strtok_r(list,",",&saveptr); item != NULL; item = strtok_r(NULL,",",&saveptr)) {
+		pattern = strchr(item,'=');
+		if (pattern != NULL) *pattern++ = 0;
+		if (strcmp(item,group) != 0) continue;
+		if ((pattern == NULL) || (strstr(event,pattern) != NULL)) return (1);
+	}
+	return (0);
 }
 
+void build_burst_plan()
+{
+	char subset[200];
+	struct series_desc *desc;
+	struct read_op *op, *perf_op, new_op;
+	uint32_t socket;
+	int i, j, k;
+
+	if (sscanf(burst_spec,"%lu:%lu:%d:%199s",&burst_interval_us,&burst_window_ms,&burst_cpu,subset) != 4) {
+		fprintf(log_file,"ERROR: expected -B interval_us:window_ms:cpu:subset, found -B %s\n",burst_spec);
+		exit(1);
+	}
+	if ((burst_interval_us == 0) || (burst_cpu < 0) || (burst_cpu >= nr_cpus)) {
+		fprintf(log_file,"ERROR: invalid burst interval %lu us or logical processor %d\n",burst_interval_us,burst_cpu);
+		exit(1);
+	}
+	num_burst_samples = burst_window_ms * 1000 / burst_interval_us;
+	if (num_burst_samples == 0) num_burst_samples = 1;
 
+	// select the entries of the socket read plans, and point them at columns of the burst store
+	burst_tsc = store_add_series(&burst_store, "tsc", "time", "", 1);
+	for (socket=0; socket<NUM_SOCKETS; socket++) {
+		for (i=0; i<read_plan[socket].num_ops; i++) {
+			op = &read_plan[socket].ops[i];
+			if (op->dest < 0) continue;			// (perf_event group reads are added below if any of their values are selected)
+			desc = &samples.desc[op->dest];
+			if (!burst_selected(subset, desc->group, desc->event)) continue;
+			new_op = *op;
+			new_op.dest = store_add_series(&burst_store, desc->name, desc->group, desc->event, desc->scale);
+			plan_append(&burst_plan, &new_op);
+			if (op->backend != PLAN_SLOT) continue;
+			// a value copied from a perf_event group buffer also needs the group read (once)
+			for (j=read_plan[socket].first[PLAN_PERF]; j<read_plan[socket].first[PLAN_PERF+1]; j++) {
+				perf_op = &read_plan[socket].ops[j];
+				if ((op->src < perf_op->src) || (op->src >= perf_op->src + perf_op->reg/sizeof(uint64_t))) continue;
+				for (k=0; k<burst_plan.num_ops; k++) {
+					if ((burst_plan.ops[k].backend == PLAN_PERF) && (burst_plan.ops[k].src == perf_op->src)) break;
+				}
+				if (k == burst_plan.num_ops) plan_append(&burst_plan, perf_op);
+			}
+		}
+	}
+	if (burst_store.num_series == 1) {
+		fprintf(log_file,"ERROR: burst subset \"%s\" does not select any counters\n",subset);
+		exit(1);
+	}
+	if (use_rdpmc) {
+		fprintf(log_file,"ERROR: burst mode cannot use the RDPMC helpers (-r), which only read their own logical processor\n");
+		exit(1);
+	}
 
+	burst_store.layout = STORE_SAMPLE_MAJOR;
+	burst_store.chunk_samples = num_burst_samples;
+	store_reserve(&burst_store, 0);
+	finish_plan(&burst_plan);
+	fprintf(log_file,"INFO: burst mode: %ld samples of %d counters every %lu us on Logical Processor %d, subset \"%s\"\n",
+		num_burst_samples,burst_store.num_series-1,burst_interval_us,burst_cpu,subset);
+}
 
-// 		signal handler for SIGCONT (optional)
-// 			this function calls cleanup and analysis/output code
-static void catch_function(int signal) {
-	fprintf(log_file,"Caught SIGCONT. Shutting down...\n");
-	if (valid == 0) {
-		fprintf(log_file,"DEBUG: Interrupt received while counters were being read -- discarding final sample %d\n",sample);
-		sample--;
-		fprintf(log_file,"DEBUG: This leaves %d deltas to be processed\n",sample);
-	} else {
-		fprintf(log_file,"DEBUG: %d samples read after initial read, %d deltas to be processed\n",sample,sample);
+void run_burst()
+{
+	cpu_set_t cpuset;
+	uint64_t tsc_per_interval, next, now, read_cycles, max_read_cycles, sum_read_cycles;
+	long i, missed;
+
+	CPU_ZERO(&cpuset);
+	CPU_SET(burst_cpu, &cpuset);
+	if (sched_setaffinity(0, sizeof(cpuset), &cpuset) != 0) {
+		fprintf(log_file,"ERROR %s when trying to pin the burst sampler to Logical Processor %d\n",strerror(errno),burst_cpu);
+		exit(-1);
 	}
-	read_all_counters();
-	process_all_results();
-	exit(0);
+	tsc_per_interval = burst_interval_us * TSC_ratio * 100;			// 100 MHz reference clock
+	missed = 0;
+	max_read_cycles = 0;
+	sum_read_cycles = 0;
+	next = rdtsc();
+	for (i=0; (i<num_burst_samples) && !shutdown_requested; i++) {
+		while (rdtsc() < next) __asm__ volatile("pause");
+		now = rdtscp();
+		*store_value(&burst_store, burst_tsc, i) = now;
+		execute_read_plan(&burst_plan, &burst_store, i);
+		read_cycles = rdtscp() - now;
+		sum_read_cycles += read_cycles;
+		if (read_cycles > max_read_cycles) max_read_cycles = read_cycles;
+		next += tsc_per_interval;
+		now = rdtsc();
+		while (next < now) {					// stay on the original time grid
+			next += tsc_per_interval;
+			missed++;
+		}
+	}
+	num_burst_samples = i;
+	fprintf(log_file,"OVERHEAD: burst mode %ld samples, average read %lu TSC cycles, max read %lu TSC cycles, %ld missed intervals\n",
+		num_burst_samples, (i > 0) ? sum_read_cycles / i : 0, max_read_cycles, missed);
+}
+
+void write_burst_results()
+{
+	struct series_desc *desc;
+	long i;
+	int k;
+
+	fprintf(results_file,"burst_interval_us = %lu\n",burst_interval_us);
+	for (i=0; i<num_burst_samples; i++) {
+		for (k=0; k<burst_store.num_series; k++) {
+			desc = &burst_store.desc[k];
+			fprintf(results_file,"%s[%ld] = %lu\n",desc->name,i,*store_value(&burst_store, k, i) * desc->scale);
+		}
+	}
+	fflush(results_file);
+	fclose(results_file);
+	fflush(log_file);
+	fclose(log_file);
 }
 
 
 
+// 		signal handler for SIGCONT (optional)
+// 			this function only records the request -- the main loop does the final read and
+// 			calls the cleanup and analysis/output code, so the handler can never interrupt
+// 			a sample that is being collected (possibly by the per-socket reader threads).
+static void catch_function(int signal) {
+	shutdown_requested = 1;
+}
 
 // ===========================================================================================================================================================================
 int main(int argc, char *argv[])
 {
 	// local declarations
-	struct timespec duration, remainder;				// structures for nanosleep function -- remainder is not used here
+	struct timespec duration;					// sample interval
+	struct timespec deadline;					// absolute time of the next sample
+	uint64_t period_ns;
 	int cpuid_return[4];
 	int i;
 	int rc;
+	int nargs;
 	ssize_t rc64;
 	char description[100];
+	char token[32];
+	int group;
 	size_t len;
 	uint64_t msr_num, msr_val;
 	uint32_t bus, device, function, offset, ctl_offset, ctr_offset, value, index;
@@ -732,6 +3699,7 @@ int main(int argc, char *argv[])
     unsigned long mmconfig_base=0x80000000;		// DOUBLE-CHECK THIS ON NEW SYSTEMS!!!!!   grep MMCONFIG /proc/iomem | awk -F- '{print $1}'
     unsigned long mmconfig_size=0x10000000;
 	long long result;
+	double thermal_spec_power;
 
 	int pkg;
 	FILE *input_file;
@@ -807,13 +3775,183 @@ int main(int argc, char *argv[])
 	//				-- if sleeptime is not specified, output will be reported as a single interval
 	//			input counter file (optional)
 	//				-- if not specified, use a default name?
+	//
+	//		Options come first, followed by the (optional) one or two numeric sampling interval arguments:
+	//			-S		read each socket with its own reader thread, pinned to a logical processor in that socket
+	//			-r		read the core counters with RDPMC from a helper thread pinned to each logical processor
+	//			-p		use perf_event_open() instead of the msr driver and /dev/mem to program and read the counters
+	//			-B interval_us:window_ms:cpu:subset
+	//					burst mode -- read a subset of the counters at a short interval for a bounded window
+	//			-m N	rotate the multiplexed core and CHA event groups every N samples (default 1)
+	//			-R		store the samples in the sample-major (one record per sample) layout
+	//			-w		write each sample to the results file from a background thread while collecting
+	//			-b		write the samples to a compact binary file instead of the Lua results file
+	//			-Z		pack (compress) each chunk of the sample store once it is full
+	//			-T		write each series of the Lua results file as one table constructor
+	//			-N		write the samples as NumPy .npy arrays instead of the Lua results file
+	//			-M		keep the samples in a memory-mapped file, recoverable with perfcounts_recover if the run is killed
+	//			-e file	evaluate the derived metrics of a metrics file after each sample, into <hostname>.perfcounts.live
+	//			-s N	keep streaming statistics of every series, written to <hostname>.perfcounts.stats every N samples
+	//			-D		keep only the last samples (for -s, -e, and -L), so the memory does not grow with the run
+	//			-P metric,metric,...
+	//					detect phases in these online metrics (with -e), written to <hostname>.perfcounts.phases
+	//			-A		add rollup series for each physical core, socket, and sub-NUMA cluster
+	//			-L N	publish the last N samples to the shared-memory segment /perfcounts while collecting
+
+	while ((rc = getopt(argc, argv, "SrpB:m:RwbZTNMe:s:DP:AL:")) != -1) {
+		switch (rc) {
+			case 'L':
+				live_samples = atoi(optarg);
+				if (live_samples < 2) {
+					fprintf(log_file, "ERROR: -L requires a ring of at least 2 samples, found %s\n",optarg);
+					exit(1);
+				}
+				break;
+			case 'A':
+				use_rollups = 1;
+				fprintf(log_file, "INFO: adding the physical core, socket, and cluster rollups\n");
+				break;
+			case 'P':
+				phase_spec = optarg;
+				fprintf(log_file, "INFO: detecting phases in the online metrics %s\n",phase_spec);
+				break;
+			case 's':
+				stats_samples = atoi(optarg);
+				if (stats_samples < 1) {
+					fprintf(log_file, "ERROR: -s requires a positive number of samples, found %s\n",optarg);
+					exit(1);
+				}
+				break;
+			case 'D':
+				samples.drop_old = 1;
+				fprintf(log_file, "INFO: keeping only the last samples in the sample store\n");
+				break;
+			case 'e':
+				metrics_path = optarg;
+				fprintf(log_file, "INFO: evaluating the online metrics of %s after each sample\n",metrics_path);
+				break;
+			case 'M':
+				use_store_file = 1;
+				fprintf(log_file, "INFO: keeping the sample store in a memory-mapped file\n");
+				break;
+			case 'N':
+				use_npy_output = 1;
+				fprintf(log_file, "INFO: writing the samples as NumPy arrays\n");
+				break;
+			case 'T':
+				use_table_output = 1;
+				fprintf(log_file, "INFO: writing the results as Lua table constructors\n");
+				break;
+			case 'Z':
+				samples.pack_chunks = 1;
+				fprintf(log_file, "INFO: packing the full chunks of the sample store\n");
+				break;
+			case 'b':
+				use_binary_output = 1;
+				fprintf(log_file, "INFO: writing the samples to a binary output file\n");
+				break;
+			case 'w':
+				use_results_writer = 1;
+				fprintf(log_file, "INFO: streaming the results file from a writer thread\n");
+				break;
+			case 'R':
+				samples.layout = STORE_SAMPLE_MAJOR;
+				fprintf(log_file, "INFO: using the sample-major record layout\n");
+				break;
+			case 'm':
+				mux_intervals = atoi(optarg);
+				if (mux_intervals < 1) {
+					fprintf(log_file, "ERROR: -m requires a positive number of samples, found %s\n",optarg);
+					exit(1);
+				}
+				break;
+			case 'B':
+				burst_spec = optarg;
+				fprintf(log_file, "INFO: burst sampling mode %s\n",burst_spec);
+				break;
+			case 'p':
+				use_perf_events = 1;
+				fprintf(log_file, "INFO: using the perf_event backend\n");
+				break;
+			case 'r':
+				use_rdpmc = 1;
+				fprintf(log_file, "INFO: reading core counters with RDPMC helper threads\n");
+				break;
+			case 'S':
+				use_socket_readers = 1;
+				fprintf(log_file, "INFO: reading each socket with a separate pinned reader thread\n");
+				break;
+			default:
+				fprintf(log_file, "ERROR: Unrecognized command-line option\n");
+				exit(1);
+		}
+	}
+	nargs = argc - optind;
+	if (use_binary_output && use_results_writer) {
+		fprintf(log_file, "ERROR: the streaming writer (-w) only writes the Lua text output, not the binary output (-b)\n");
+		exit(1);
+	}
+	if (use_table_output && (use_results_writer || use_binary_output || use_npy_output)) {
+		fprintf(log_file, "ERROR: the table constructor output (-T) cannot be combined with -w, -b, or -N\n");
+		exit(1);
+	}
+	if (use_store_file && (burst_spec != NULL)) {
+		fprintf(log_file, "ERROR: burst mode (-B) keeps its samples in memory, and cannot be combined with -M\n");
+		exit(1);
+	}
+	if ((stats_samples > 0) && (burst_spec != NULL)) {
+		fprintf(log_file, "ERROR: the streaming statistics (-s) are updated by the periodic sampling loop, not in burst mode (-B)\n");
+		exit(1);
+	}
+	if (samples.drop_old && (stats_samples == 0) && (metrics_path == NULL) && (live_samples == 0)) {
+		fprintf(log_file, "ERROR: -D keeps no samples, so it is only useful with -s, -e, or -L\n");
+		exit(1);
+	}
+	if (samples.drop_old && (use_results_writer || use_binary_output || use_npy_output || use_table_output || use_store_file
+			|| samples.pack_chunks || (burst_spec != NULL))) {
+		fprintf(log_file, "ERROR: -D keeps no samples to write, and cannot be combined with -w, -b, -N, -T, -M, -Z, or -B\n");
+		exit(1);
+	}
+	if (use_rollups && (burst_spec != NULL)) {
+		fprintf(log_file, "ERROR: burst mode (-B) reads a subset of the counters, and cannot be combined with the rollups (-A)\n");
+		exit(1);
+	}
+	if ((live_samples > 0) && (burst_spec != NULL)) {
+		fprintf(log_file, "ERROR: the shared-memory segment (-L) is published by the periodic sampling loop, not in burst mode (-B)\n");
+		exit(1);
+	}
+	if ((phase_spec != NULL) && (metrics_path == NULL)) {
+		fprintf(log_file, "ERROR: phase detection (-P) uses the online metrics, and requires -e\n");
+		exit(1);
+	}
+	if ((metrics_path != NULL) && (burst_spec != NULL)) {
+		fprintf(log_file, "ERROR: the online metrics (-e) are evaluated by the periodic sampling loop, not in burst mode (-B)\n");
+		exit(1);
+	}
+	if (use_store_file && samples.pack_chunks) {
+		fprintf(log_file, "ERROR: the store file (-M) holds the unpacked samples, and cannot be combined with -Z\n");
+		exit(1);
+	}
+	if (use_store_file && use_table_output) {
+		fprintf(log_file, "ERROR: perfcounts_recover writes one assignment per sample, so the store file (-M) cannot be combined with -T\n");
+		exit(1);
+	}
+	if (use_npy_output && use_results_writer) {
+		fprintf(log_file, "ERROR: the streaming writer (-w) only writes the Lua text output, not the NumPy output (-N)\n");
+		exit(1);
+	}
+	if (use_results_writer) samples.consumer = &samples_written;		// (packed chunks are only released behind the writer)
+	if (use_perf_events && use_rdpmc) {
+		fprintf(log_file, "ERROR: the RDPMC helpers (-r) cannot be used with the perf_event backend (-p)\n");
+		exit(1);
+	}
 
-	if (argc == 1) {
+	if (nargs == 0) {
 		fprintf(log_file, "INFO: No command-line arguments provided -- assuming 1 second sampling rate\n");
 		duration.tv_sec = 1;
 		duration.tv_nsec = 0;
-	} else if (argc == 2) {
-		i = atoi(argv[1]);
+	} else if (nargs == 1) {
+		i = atoi(argv[optind]);
 		if (i >= 1000000000) {
 			fprintf(log_file, "ERROR: sampling interval in ns cannot exceed 1,000,000,000\n");
 			exit(1);
@@ -821,10 +3959,10 @@ int main(int argc, char *argv[])
 		duration.tv_sec = 0;
 		duration.tv_nsec = i;		// 1,000,000 ns = 1 millisecond
 		fprintf(log_file, "INFO: sampling uses %d nanosecond sleep \n",i);
-	} else if (argc == 3) {
-		i = atoi(argv[1]);
+	} else if (nargs == 2) {
+		i = atoi(argv[optind]);
 		duration.tv_sec = i;
-		i = atoi(argv[2]);
+		i = atoi(argv[optind+1]);
 		if (i >= 1000000000) {
 			fprintf(log_file, "ERROR: sampling interval in ns cannot exceed 1,000,000,000\n");
 			exit(1);
@@ -843,66 +3981,6 @@ int main(int argc, char *argv[])
 		return EXIT_FAILURE;
 	}
 
-	// initialize the dummycounter array....
-	// TEMPORARY HACK
-	for (i=0; i<MAX_SAMPLES; i++) dummycounter[i] = -1;
-
-	// initialize the tsc_start and walltime arrays
-	for (sample=0; sample < MAX_SAMPLES; sample++) {
-		tsc_start[sample] = 0;
-		walltime[0][sample] = 0;
-		walltime[1][sample] = 0;
-#ifdef INFINIBAND
-		ib_recv[sample] = 0;
-		ib_xmit[sample] = 0;
-#endif
-	}
-
-	// initialize ubox_uclk cycle count array
-	for (socket=0; socket<NUM_SOCKETS; socket++) {
-		for (sample=0; sample < MAX_SAMPLES; sample++) {
-			ubox_uclk[socket][sample] = 0;
-		}
-	}
-
-	// initialize uncore_imc performance count array
-	for (socket=0; socket<NUM_SOCKETS; socket++) {
-		for (channel=0; channel<NUM_IMC_CHANNELS; channel++) {
-			for (counter=0; counter<NUM_IMC_COUNTERS; counter++) {
-				for (sample=0; sample < MAX_SAMPLES; sample++) {
-					imc_counts[socket][channel][counter][sample] = 0;
-				}
-			}
-		}
-	}
-	// initialize array to hold core programmable counter results
-	for (lproc=0; lproc<NUM_LPROCS; lproc++) {
-		for (counter=0; counter<NUM_CORE_COUNTERS; counter++) {
-			for (sample=0; sample < MAX_SAMPLES; sample++) {
-				core_counts[lproc][counter][sample] = 0;
-			}
-		}
-	}
-	// initialize array to hold core fixed counter results
-	for (lproc=0; lproc<NUM_LPROCS; lproc++) {
-		for (counter=0; counter<3; counter++) {
-			for (sample=0; sample < MAX_SAMPLES; sample++) {
-				core_fixed[lproc][counter][sample] = 0;
-			}
-		}
-	}
-
-	// initialize PCU count array
-	for (socket=0; socket<NUM_SOCKETS; socket++) {
-		for (counter=0; counter<4; counter++) {
-			for (sample=0; sample < MAX_SAMPLES; sample++) {
-				pcu_counts[socket][counter][sample] = 0;
-			}
-		}
-	}
-
-
-
 	// For Xeon systems (max of 2 threads per core), I can check the AnyThread bit, and if it is set, then
 	// I can merge the counts for logical processors 0..N/2-1 with the corresponding logical processor in the
 	// upper half of the range (i.e., merge counts for "i" and "i + N/2").
@@ -940,6 +4018,12 @@ int main(int argc, char *argv[])
 		msr_fd[i] = open(filename, O_RDWR);
 		// printf("   open command returns %d\n",msr_fd[i]);
 		if (msr_fd[i] == -1) {
+			if (use_perf_events) {
+				// the perf_event backend does not need the msr driver for the performance counters
+				fprintf(log_file,"WARNING: %s when trying to open %s -- socket-scope MSRs will not be collected\n",strerror(errno),filename);
+				msr_available = 0;
+				break;
+			}
 			fprintf(log_file,"ERROR %s when trying to open %s\n",strerror(errno),filename);
 			exit(-1);
 		}
@@ -957,75 +4041,78 @@ int main(int argc, char *argv[])
 	// 		check VID/DID for uncore bus:device:function combinations
 	//   Note that using /dev/mem for PCI configuration space access is required for some devices on KNL.
 	//   It is not required on other systems, but it is not particularly inconvenient either.
-	sprintf(filename,"/dev/mem");
-	fprintf(log_file,"opening %s\n",filename);
-	mem_fd = open(filename, O_RDWR);
-	// fprintf(log_file,"   open command returns %d\n",mem_fd);
-	if (mem_fd == -1) {
-		fprintf(log_file,"ERROR %s when trying to open %s\n",strerror(errno),filename);
-		exit(-1);
-	}
-	int map_prot = PROT_READ | PROT_WRITE;
-	mmconfig_ptr = mmap(NULL, mmconfig_size, map_prot, MAP_SHARED, mem_fd, mmconfig_base);
-    if (mmconfig_ptr == MAP_FAILED) {
-        fprintf(log_file,"cannot mmap base of PCI configuration space from /dev/mem: address %lx\n", mmconfig_base);
-        exit(2);
-    } else {
-		fprintf(log_file,"Successful mmap of base of PCI configuration space from /dev/mem at address %lx\n", mmconfig_base);
-	}
-    close(mem_fd);      // OK to close file after mmap() -- the mapping persists until unmap() or program exit
+	// (not needed by the perf_event backend, which reads the IMC counters through the uncore_imc PMUs)
+	if (!use_perf_events) {
+		sprintf(filename,"/dev/mem");
+		fprintf(log_file,"opening %s\n",filename);
+		mem_fd = open(filename, O_RDWR);
+		// fprintf(log_file,"   open command returns %d\n",mem_fd);
+		if (mem_fd == -1) {
+			fprintf(log_file,"ERROR %s when trying to open %s\n",strerror(errno),filename);
+			exit(-1);
+		}
+		int map_prot = PROT_READ | PROT_WRITE;
+		mmconfig_ptr = mmap(NULL, mmconfig_size, map_prot, MAP_SHARED, mem_fd, mmconfig_base);
+	    if (mmconfig_ptr == MAP_FAILED) {
+	        fprintf(log_file,"cannot mmap base of PCI configuration space from /dev/mem: address %lx\n", mmconfig_base);
+	        exit(2);
+	    } else {
+			fprintf(log_file,"Successful mmap of base of PCI configuration space from /dev/mem at address %lx\n", mmconfig_base);
+		}
+	    close(mem_fd);      // OK to close file after mmap() -- the mapping persists until unmap() or program exit
 #if 0
-	// simple test -- should return "2f328086" on Haswell EP -- DID 0x2f32, VID 0x8086
-	bus = 0x7f;
-	device = 0x8;
-	function = 0x2;
-	offset = 0x0;
-	index = PCI_cfg_index(bus, device, function, offset);
-    value = mmconfig_ptr[index];
-	if (value == 0x2f328086) {
-		fprintf(log_file,"DEBUG: Well done! Bus %x device %x function %x offset %x returns expected value of %x\n",bus,device,function,offset,value);
-	} else {
-		fprintf(log_file,"DEBUG: ERROR: Bus %x device %x function %x offset %x expected %x, found %x\n",bus,device,function,offset,0x2f328086,value);
-		exit(3);
-	}
+		// simple test -- should return "2f328086" on Haswell EP -- DID 0x2f32, VID 0x8086
+		bus = 0x7f;
+		device = 0x8;
+		function = 0x2;
+		offset = 0x0;
+		index = PCI_cfg_index(bus, device, function, offset);
+	    value = mmconfig_ptr[index];
+		if (value == 0x2f328086) {
+			fprintf(log_file,"DEBUG: Well done! Bus %x device %x function %x offset %x returns expected value of %x\n",bus,device,function,offset,value);
+		} else {
+			fprintf(log_file,"DEBUG: ERROR: Bus %x device %x function %x offset %x expected %x, found %x\n",bus,device,function,offset,0x2f328086,value);
+			exit(3);
+		}
 #elif 0
-	// New simple test -- the old one failed on nodes with QPI Link Layer counters disabled.
-	// This happens on Hikari when a node with a bad CMOS batter loses power and reverts to
-	// the default.  The node needs to have its BIOS settings fixed after this, but since I
-	// am not currently using the QPI link-layer counters, I can just check a different PCIe
-	// device -- Home Agent 0 should be safe.
-	//
-	// simple test -- should return "2f308086" on Haswell EP -- DID 0x2f30, VID 0x8086
-	bus = 0x7f;
-	device = 0x12;
-	function = 0x1;
-	offset = 0x0;
-	index = PCI_cfg_index(bus, device, function, offset);
-    value = mmconfig_ptr[index];
-	if (value == 0x2f308086) {
-		fprintf(log_file,"DEBUG: Well done! Bus %x device %x function %x offset %x returns expected value of %x\n",bus,device,function,offset,value);
-	} else {
-		fprintf(log_file,"DEBUG: ERROR: Bus %x device %x function %x offset %x expected %x, found %x\n",bus,device,function,offset,0x2f308086,value);
-		exit(3);
-	}
+		// New simple test -- the old one failed on nodes with QPI Link Layer counters disabled.
+		// This happens on Hikari when a node with a bad CMOS batter loses power and reverts to
+		// the default.  The node needs to have its BIOS settings fixed after this, but since I
+		// am not currently using the QPI link-layer counters, I can just check a different PCIe
+		// device -- Home Agent 0 should be safe.
+		//
+		// simple test -- should return "2f308086" on Haswell EP -- DID 0x2f30, VID 0x8086
+		bus = 0x7f;
+		device = 0x12;
+		function = 0x1;
+		offset = 0x0;
+		index = PCI_cfg_index(bus, device, function, offset);
+	    value = mmconfig_ptr[index];
+		if (value == 0x2f308086) {
+			fprintf(log_file,"DEBUG: Well done! Bus %x device %x function %x offset %x returns expected value of %x\n",bus,device,function,offset,value);
+		} else {
+			fprintf(log_file,"DEBUG: ERROR: Bus %x device %x function %x offset %x expected %x, found %x\n",bus,device,function,offset,0x2f308086,value);
+			exit(3);
+		}
 #else 
-	// New simple test that does not need to know the uncore bus numbers here...
-	// Skylake bus 0, Function 5, offset 0 -- Sky Lake-E MM/Vt-d Configuration Registers
-	//
-	// simple test -- should return "20248086" on Skylake Xeon EP -- DID 0x2024, VID 0x8086
-	bus = 0x00;
-	device = 0x5;
-	function = 0x0;
-	offset = 0x0;
-	index = PCI_cfg_index(bus, device, function, offset);
-    value = mmconfig_ptr[index];
-	if (value == 0x20248086) {
-		fprintf(log_file,"DEBUG: Well done! Bus %x device %x function %x offset %x returns expected value of %x\n",bus,device,function,offset,value);
-	} else {
-		fprintf(log_file,"DEBUG: ERROR: Bus %x device %x function %x offset %x expected %x, found %x\n",bus,device,function,offset,0x20248086,value);
-		exit(3);
-	}
+		// New simple test that does not need to know the uncore bus numbers here...
+		// Skylake bus 0, Function 5, offset 0 -- Sky Lake-E MM/Vt-d Configuration Registers
+		//
+		// simple test -- should return "20248086" on Skylake Xeon EP -- DID 0x2024, VID 0x8086
+		bus = 0x00;
+		device = 0x5;
+		function = 0x0;
+		offset = 0x0;
+		index = PCI_cfg_index(bus, device, function, offset);
+	    value = mmconfig_ptr[index];
+		if (value == 0x20248086) {
+			fprintf(log_file,"DEBUG: Well done! Bus %x device %x function %x offset %x returns expected value of %x\n",bus,device,function,offset,value);
+		} else {
+			fprintf(log_file,"DEBUG: ERROR: Bus %x device %x function %x offset %x expected %x, found %x\n",bus,device,function,offset,0x20248086,value);
+			exit(3);
+		}
 #endif
+	}
 
 	// Open and read performance counter event files
 	//   Input Files are split by "box" to make subsequent parsing easier....
@@ -1065,6 +4152,7 @@ int main(int argc, char *argv[])
 		if (rc == EOF) break;
 		i++;
 		// fprintf(log_file,"DEBUG: Core MSR control input file contains %d %d 0x%0lx 0x%#0x %s\n",core_min, core_max, msr_num, msr_val, description);
+		if (use_perf_events) continue;		// the kernel owns the global and fixed-counter controls with perf_event
 		for (core=core_min; core<=core_max; core++) {
 			// fprintf(log_file,"pwrite(msr_fd[%d],0x%lx,%ld,0x%lx)\n",core,msr_val,sizeof(msr_val),msr_num);
 			rc64 = pwrite(msr_fd[core],&msr_val,sizeof(msr_val),msr_num);
@@ -1098,18 +4186,37 @@ int main(int argc, char *argv[])
 		fprintf(log_file,"ERROR %s when trying to open MSR input file %s\n",strerror(errno),filename);
 		exit(-1);
 	}
+	//   A line "group N" starts event group N (see mux_reprogram_groups()); the lines before it are group 0.
 	i = 0;
+	group = 0;
 	while (1) {
-		rc = fscanf(input_file,"%d %d %lx %u %lx %s",&core_min,&core_max,&msr_num,&counter,&msr_val,&description);
+		rc = fscanf(input_file,"%31s",token);
 		if (rc == EOF) break;
+		if (strcmp(token,"group") == 0) {
+			rc = fscanf(input_file,"%d",&group);
+			assert (group >= 0);
+			assert (group < MAX_MUX_GROUPS);
+			if (group >= core_mux_groups) core_mux_groups = group + 1;
+			fprintf(log_file,"DEBUG: Core MSR perfevtsel input file event group %d\n",group);
+			continue;
+		}
+		core_min = atoi(token);
+		rc = fscanf(input_file,"%d %lx %u %lx %s",&core_max,&msr_num,&counter,&msr_val,&description);
 		i++;
 		fprintf(log_file,"DEBUG: Core MSR perfevtsel input file contains %d %d 0x%lx %u 0x%lx %s\n",core_min, core_max, msr_num, counter, msr_val, description);
+		assert (counter < NUM_CORE_COUNTERS);
 		for (lproc=core_min; lproc<=core_max; lproc++) {
-			// fprintf(log_file,"pwrite(msr_fd[%d],0x%0.8x,%ld,0x%lx)\n",core,msr_val,sizeof(msr_val),msr_num);
-			rc64 = pwrite(msr_fd[lproc],&msr_val,sizeof(msr_val),msr_num);
-			if (rc64 != 8) {
-				fprintf(log_file,"ERROR writing to MSR device on lproc %d, write %ld bytes\n",lproc,rc64);
-				exit(-1);
+			core_mux_evtsel[group][lproc][counter] = msr_val;
+			strncpy(core_mux_event_name[group][lproc][counter],description,80);
+			if (group != 0) continue;		// programmed later by mux_reprogram_groups()
+			core_evtsel[lproc][counter] = msr_val;
+			if (!use_perf_events) {
+				// fprintf(log_file,"pwrite(msr_fd[%d],0x%0.8x,%ld,0x%lx)\n",core,msr_val,sizeof(msr_val),msr_num);
+				rc64 = pwrite(msr_fd[lproc],&msr_val,sizeof(msr_val),msr_num);
+				if (rc64 != 8) {
+					fprintf(log_file,"ERROR writing to MSR device on lproc %d, write %ld bytes\n",lproc,rc64);
+					exit(-1);
+				}
 			}
 			// use the lproc number to look up the socket (package) number
 			// from the arrays defined in the topology.h file
@@ -1129,7 +4236,7 @@ int main(int argc, char *argv[])
 	fprintf(log_file,"------------------- Input File #3 --- Uncore MSR Control --- TBD -------------\n");
 	fprintf(log_file,"------------------- Uncore MSR Control currently done in Setup_SKX_Node.sh script  -------------\n");
 	fprintf(log_file,"-------------------    Repeat enabling UBOX Fixed Counter here on each socket -------------\n");
-	for (socket=0; socket<NUM_SOCKETS; socket++) {
+	for (socket=0; (socket<NUM_SOCKETS) && msr_available; socket++) {
 		core = proc_in_pkg[socket];
 		msr_num = U_MSR_PMON_FIXED_CTL;
 		msr_val = 0x00400000UL;
@@ -1161,12 +4268,15 @@ int main(int argc, char *argv[])
 		assert (socket < 2);
 		assert (counter >= 0); 
 		assert (counter < 4); 
+		pcu_evtsel[socket][counter] = msr_val;
 		core = proc_in_pkg[socket];
 		msr_num = PCU_MSR_PMON_CTL + counter;
-		rc64 = pwrite(msr_fd[core],&msr_val,sizeof(msr_val),msr_num);
-		if (rc64 != 8) {
-			fprintf(log_file,"ERROR writing to MSR device on core %d, write %ld bytes\n",core,rc64);
-			exit(-1);
+		if (!use_perf_events) {
+			rc64 = pwrite(msr_fd[core],&msr_val,sizeof(msr_val),msr_num);
+			if (rc64 != 8) {
+				fprintf(log_file,"ERROR writing to MSR device on core %d, write %ld bytes\n",core,rc64);
+				exit(-1);
+			}
 		}
 		strncpy(pcu_event_name[socket][counter],description,80);
 	}
@@ -1184,9 +4294,20 @@ int main(int argc, char *argv[])
 	// ugly hack here -- allow input to define 6 counters control inputs -- 0-3 are performance counters, 4-5 are filters.
 	// But I only read 4 counters laters, since the filters are input-only.
 	// TO DO:  make sure that the output file contains the filter data as well as the counter data.
+	group = 0;
 	while (1) {
-		rc = fscanf(input_file,"%d %d %d %lx %s",&socket,&cha,&counter,&msr_val,&description);
+		rc = fscanf(input_file,"%31s",token);
 		if (rc == EOF) break;
+		if (strcmp(token,"group") == 0) {
+			rc = fscanf(input_file,"%d",&group);
+			assert (group >= 0);
+			assert (group < MAX_MUX_GROUPS);
+			if (group >= cha_mux_groups) cha_mux_groups = group + 1;
+			fprintf(log_file,"DEBUG: CHA MSR perfevtsel input file event group %d\n",group);
+			continue;
+		}
+		socket = atoi(token);
+		rc = fscanf(input_file,"%d %d %lx %s",&cha,&counter,&msr_val,&description);
 		i++;
 		fprintf(log_file,"DEBUG: CHA MSR perfevtsel input file contains %d %d %d 0x%lx %s\n",socket, cha, counter, msr_val, description);
 		assert (socket >= 0);
@@ -1195,12 +4316,18 @@ int main(int argc, char *argv[])
 		assert (cha < NUM_CHA_BOXES);
 		assert (counter >= 0); 
 		assert (counter < NUM_CHA_CONTROLS); 		// address filter0 and filter1 as counters 4-5
+		cha_mux_evtsel[group][socket][cha][counter] = msr_val;
+		strncpy(cha_mux_event_name[group][socket][cha][counter],description,80);
+		if (group != 0) continue;			// programmed later by mux_reprogram_groups()
+		cha_evtsel[socket][cha][counter] = msr_val;
 		core = proc_in_pkg[socket];
 		msr_num = CHA_MSR_PMON_CTL_BASE + (0x10 * cha) + counter;
-		rc64 = pwrite(msr_fd[core],&msr_val,sizeof(msr_val),msr_num);
-		if (rc64 != 8) {
-			fprintf(log_file,"ERROR writing to MSR device on core %d, write %ld bytes\n",core,rc64);
-			exit(-1);
+		if (!use_perf_events) {
+			rc64 = pwrite(msr_fd[core],&msr_val,sizeof(msr_val),msr_num);
+			if (rc64 != 8) {
+				fprintf(log_file,"ERROR writing to MSR device on core %d, write %ld bytes\n",core,rc64);
+				exit(-1);
+			}
 		}
 		strncpy(cha_event_name[socket][cha][counter],description,80);
 	}
@@ -1316,7 +4443,8 @@ int main(int argc, char *argv[])
 		offset = IMC_PmonCtl_Offset[counter];
 		// fprintf(log_file,"DEBUG: translated bus/device/function/offset values %#x %#x %#x %#x\n",bus,device,function,offset);
 		index = PCI_cfg_index(bus, device, function, offset);
-		mmconfig_ptr[index] = value;
+		imc_evtsel[socket][channel][counter] = value;
+		if (!use_perf_events) mmconfig_ptr[index] = value;
 		strncpy(imc_event_name[socket][channel][counter],description,32);
 	}
 	fprintf(log_file,"DEBUG: Uncore PCI PerfEvtSel input file contained %d values\n",i);
@@ -1340,11 +4468,21 @@ int main(int argc, char *argv[])
 	// NOTE that root (or setuid root) will not be able to write to filesystems with "root-squashing" enabled.
 
 	sprintf(filename,"%s.perfcounts.lua",description);
+	sprintf(binary_filename,"%s.perfcounts.pcb",description);
+	sprintf(npy_dirname,"%s.perfcounts.npy",description);
+	sprintf(store_filename,"%s.perfcounts.store",description);
+	sprintf(live_filename,"%s.perfcounts.live",description);
+	sprintf(stats_filename,"%s.perfcounts.stats",description);
+	sprintf(phases_filename,"%s.perfcounts.phases",description);
 	results_file = fopen(filename,"w+");
 	if (results_file == 0) {
 		fprintf(log_file,"ERROR %s when trying to open output file %s\n",strerror(errno),filename);
 		exit(-1);
 	}
+	// (the buffer must be set before the first write -- the streaming writer makes large writes from it)
+	if (use_results_writer && (setvbuf(results_file, NULL, _IOFBF, RESULTS_BUFFER_BYTES) != 0)) {
+		fprintf(log_file,"WARNING: unable to set a %d byte buffer for the results file\n",RESULTS_BUFFER_BYTES);
+	}
 	rc = chown(filename,my_uid,my_gid);
 	if (rc == 0) {
 		fprintf(log_file,"DEBUG: Successfully changed ownership of output file to uid %d gid %d\n",my_uid,my_gid);
@@ -1352,10 +4490,16 @@ int main(int argc, char *argv[])
 		fprintf(stderr,"ERROR: Attempt to change ownership of output file to uid %d gid %d failed -- bailing out\n",my_uid,my_gid);
 		exit(-1);
 	}
+	// (Chunkify_Lua_files.sh looks for CHUNK on the first line, and leaves the file alone)
+	if (use_table_output) fprintf(results_file,"-- CHUNKED: one table constructor per series, in functions CHUNK_1, CHUNK_2, ...\n");
 	// put the TSC ratio at the top of the output file -- this won't need to be repeated
 	// for each sample
-	rc64 = pread(msr_fd[0],&msr_val,sizeof(msr_val),MSR_PLATFORM_INFO);
-	TSC_ratio = (msr_val & 0x000000000000ff00L) >> 8;
+	if (msr_available) {
+		rc64 = pread(msr_fd[0],&msr_val,sizeof(msr_val),MSR_PLATFORM_INFO);
+		TSC_ratio = (msr_val & 0x000000000000ff00L) >> 8;
+	} else {
+		TSC_ratio = (int)(get_TSC_frequency() / 100.0e6 + 0.5);		// 100 MHz reference clock
+	}
 	fprintf(results_file,"TSC_ratio = %d\n", TSC_ratio);
 
 	// include the number of active cores
@@ -1372,9 +4516,10 @@ int main(int argc, char *argv[])
 
 	// for reference, write the initial contents of IA32_FIXED_CTR_CTRL to see if the
 	// external environment has set the AnyThread bit for the Core Fixed-Function Counters
-	for (lproc=0; lproc<nr_cpus; lproc++) {
+	for (lproc=0; (lproc<nr_cpus) && msr_available; lproc++) {
 		rc64 = pread(msr_fd[lproc],&msr_val,sizeof(msr_val),IA32_FIXED_CTR_CTRL);
 		fprintf(results_file,"IA32_FIXED_CTR_CTRL[%d] = 0x%lx\n", lproc, msr_val);
+		fixed_ctr_ctrl[lproc] = msr_val;			// (the AnyThread bits, for the rollups)
 	}
 
 	// --------------------- SETUP CODE FOR TEMPERATURE, POWER, and THROTTLING ------------------------------------
@@ -1390,55 +4535,77 @@ int main(int argc, char *argv[])
     // 2. Read the one-time values needed for calculations
     // 2a. Read the "unique" (global) MSR_TEMPERATURE_TARGET
 	// assume both sockets are the same, so just read on socket 0
-	msr_num = MSR_TEMPERATURE_TARGET;
-	if (pread(msr_fd[proc_in_pkg[0]], &msr_val, sizeof msr_val, msr_num) != sizeof (msr_val)) {
-		fprintf(log_file,"ERROR: Failed to read MSR_TEMPERATURE_TARGET for core %d\n",proc_in_pkg[socket]);
-		exit(-3);
-	}
-	temp_target = (msr_val & 0x00FF0000)>>16;     // 8 bit field for PROCHOT in degrees C
-	fprintf(log_file,"INFO: Package 0 PROCHOT Temperature = %d\n",temp_target);
-	// Write the PROCHOT value to the lua file for use in post-processing
-    fprintf(results_file,"PROCHOT = %d\n",temp_target);
-
-    // 2b.  Read the RAPL configuration MSRs
-    /* Calculate the units used -- safe to assume both sockets are the same!! */
-	msr_num = MSR_RAPL_POWER_UNIT;
-    if (pread(msr_fd[proc_in_pkg[0]],&result, sizeof(result), msr_num) != sizeof(result)) {
-		fprintf(log_file,"ERROR: Failed to read MSR_TEMPERATURE_TARGET for core %d\n",proc_in_pkg[socket]);
-		exit(-3);
-	}
-	// fprintf(log_file,"DEBUG_RAPL: MSR_RAPL_POWER_UNIT (MSR %lx) contains %lx\n",msr_num,result);
-
-    power_unit=pow((double)0.5,(double)(result&0xf));
-    pkg_energy_unit=pow((double)0.5,(double)((result>>8)&0x1f));
-    time_unit=pow((double)0.5,(double)((result>>16)&0xf));
-	dram_energy_unit = 1.0/65536.0;		// This is a constant, not necessarily a particular ratio to the pkg_energy unit
-	
+	if (msr_available) {
+		msr_num = MSR_TEMPERATURE_TARGET;
+		if (pread(msr_fd[proc_in_pkg[0]], &msr_val, sizeof msr_val, msr_num) != sizeof (msr_val)) {
+			fprintf(log_file,"ERROR: Failed to read MSR_TEMPERATURE_TARGET for core %d\n",proc_in_pkg[socket]);
+			exit(-3);
+		}
+		temp_target = (msr_val & 0x00FF0000)>>16;     // 8 bit field for PROCHOT in degrees C
+		fprintf(log_file,"INFO: Package 0 PROCHOT Temperature = %d\n",temp_target);
+		// Write the PROCHOT value to the lua file for use in post-processing
+	    fprintf(results_file,"PROCHOT = %d\n",temp_target);
+
+	    // 2b.  Read the RAPL configuration MSRs
+	    /* Calculate the units used -- safe to assume both sockets are the same!! */
+		msr_num = MSR_RAPL_POWER_UNIT;
+	    if (pread(msr_fd[proc_in_pkg[0]],&result, sizeof(result), msr_num) != sizeof(result)) {
+			fprintf(log_file,"ERROR: Failed to read MSR_TEMPERATURE_TARGET for core %d\n",proc_in_pkg[socket]);
+			exit(-3);
+		}
+		// fprintf(log_file,"DEBUG_RAPL: MSR_RAPL_POWER_UNIT (MSR %lx) contains %lx\n",msr_num,result);
 
-    fprintf(log_file,"==================================\n");
-    fprintf(log_file,"RAPL: Power unit = %.9fW\n",power_unit);
-    fprintf(log_file,"RAPL: Energy unit = %.9fJ\n",pkg_energy_unit);
-    tmp = pkg_energy_unit * 4294967296.0;
-    fprintf(log_file,"RAPL:    Energy values wrap at %g Joules\n",tmp);
-    fprintf(log_file,"RAPL: Time unit = %.9fs\n",time_unit);
-    tmp = time_unit * 4294967296.0;
-    fprintf(log_file,"RAPL:    Time values wrap at %g seconds\n",tmp);
-    fprintf(log_file,"RAPL: NOTE: DRAM Energy Unit manually overridden to 15.3 uJ (1/65536 J)\n");
+	    power_unit=pow((double)0.5,(double)(result&0xf));
+	    pkg_energy_unit=pow((double)0.5,(double)((result>>8)&0x1f));
+	    time_unit=pow((double)0.5,(double)((result>>16)&0xf));
+		dram_energy_unit = 1.0/65536.0;		// This is a constant, not necessarily a particular ratio to the pkg_energy unit
+	
 
-	msr_num = MSR_PKG_POWER_INFO;
-    if (pread(msr_fd[proc_in_pkg[0]],&msr_val, sizeof(msr_val), msr_num) != sizeof(msr_val)) {
-		fprintf(log_file,"ERROR: Failed to read PKG_POWER_INFO for core %d\n",proc_in_pkg[socket]);
-		exit(-3);
+	    fprintf(log_file,"==================================\n");
+	    fprintf(log_file,"RAPL: Power unit = %.9fW\n",power_unit);
+	    fprintf(log_file,"RAPL: Energy unit = %.9fJ\n",pkg_energy_unit);
+	    tmp = pkg_energy_unit * 4294967296.0;
+	    fprintf(log_file,"RAPL:    Energy values wrap at %g Joules\n",tmp);
+	    fprintf(log_file,"RAPL: Time unit = %.9fs\n",time_unit);
+	    tmp = time_unit * 4294967296.0;
+	    fprintf(log_file,"RAPL:    Time values wrap at %g seconds\n",tmp);
+	    fprintf(log_file,"RAPL: NOTE: DRAM Energy Unit manually overridden to 15.3 uJ (1/65536 J)\n");
+
+		msr_num = MSR_PKG_POWER_INFO;
+	    if (pread(msr_fd[proc_in_pkg[0]],&msr_val, sizeof(msr_val), msr_num) != sizeof(msr_val)) {
+			fprintf(log_file,"ERROR: Failed to read PKG_POWER_INFO for core %d\n",proc_in_pkg[socket]);
+			exit(-3);
+		}
+		// fprintf(log_file,"DEBUG_RAPL: MSR_PKG_POWER_INFO (MSR %lx) contains %lx\n",msr_num,msr_val);
+	    thermal_spec_power=power_unit*(double)(msr_val&0x7fff);
+	} else {
+		// perf_event backend without the msr driver -- no temperature, and the RAPL energy counts come from
+		// the "power" PMU, in the units given by its ".scale" files
+		temp_target = 0;
+		fprintf(log_file,"INFO: msr driver not available -- PROCHOT temperature unknown\n");
+		fprintf(results_file,"PROCHOT = %d\n",temp_target);
+		power_unit = 0.0;
+		time_unit = 0.0;
+		thermal_spec_power = 0.0;
+		rapl_energy_width = 64;
+		if (perf_pmu_event("power","energy-pkg",&msr_val,&pkg_energy_unit) != 0) pkg_energy_unit = 0.0;
+		if (perf_pmu_event("power","energy-ram",&msr_val,&dram_energy_unit) != 0) dram_energy_unit = 0.0;
+		fprintf(log_file,"RAPL: perf_event power PMU energy units: pkg %g J, dram %g J\n",pkg_energy_unit,dram_energy_unit);
 	}
-	// fprintf(log_file,"DEBUG_RAPL: MSR_PKG_POWER_INFO (MSR %lx) contains %lx\n",msr_num,msr_val);
-    double thermal_spec_power=power_unit*(double)(msr_val&0x7fff);
 
 	// For energy use, I can write out either the low-level counts or the scaled values to the lua
 	// results_file.  Handling wrapping is easier if I write out the unmodified counts, so the
 	// results_file needs to get the units defined.
     fprintf(results_file,"RAPL_POWER_UNIT = %.9f\n",power_unit);
-    fprintf(results_file,"RAPL_PKG_ENERGY_UNIT = %.9f\n",pkg_energy_unit);
-    fprintf(results_file,"RAPL_DRAM_ENERGY_UNIT = %.9f\n",dram_energy_unit);
+	if (msr_available) {
+		fprintf(results_file,"RAPL_PKG_ENERGY_UNIT = %.9f\n",pkg_energy_unit);
+		fprintf(results_file,"RAPL_DRAM_ENERGY_UNIT = %.9f\n",dram_energy_unit);
+	} else {
+		// (the perf_event power PMU units are too small for %.9f, and its counts do not wrap at 32 bits)
+		fprintf(results_file,"RAPL_PKG_ENERGY_UNIT = %.12e\n",pkg_energy_unit);
+		fprintf(results_file,"RAPL_DRAM_ENERGY_UNIT = %.12e\n",dram_energy_unit);
+		fprintf(results_file,"RAPL_ENERGY_WIDTH = %d\n",rapl_energy_width);
+	}
     fprintf(results_file,"RAPL_TIME_UNIT = %.9f\n",time_unit);
     fprintf(results_file,"PACKAGE_TDP = %.6f\n",thermal_spec_power);
 
@@ -1448,21 +4615,109 @@ int main(int argc, char *argv[])
 	// Duration is now set earlier in main using command-line parameters if present
 	//duration.tv_sec = 0;
 	//duration.tv_nsec = 100*1000*1000;		// 1,000,000 ns = 1 millisecond
-	remainder.tv_sec = 0;				// not used
-	remainder.tv_nsec = 0;				// not used
-	// fprintf(log_file,"DEBUG: About to call nanosleep with duration of %ld seconds plus %ld nanoseconds\n",duration.tv_sec,duration.tv_nsec);
+	// The duration is the period of the absolute-deadline schedule (see sleep_until_deadline())
+	period_ns = (uint64_t)duration.tv_sec * 1000000000UL + duration.tv_nsec;
+	if (period_ns == 0) {
+		fprintf(log_file, "ERROR: sampling interval must be greater than zero\n");
+		exit(1);
+	}
+
+	allocate_series();
+	if (metrics_path != NULL) compile_online_metrics();
+	if (stats_samples > 0) init_stats();
+	if (phase_spec != NULL) init_phases();
+	if (use_rdpmc) start_core_helpers();
+	build_read_plan();
+	if (use_perf_events) check_perf_groups(1);
+
+	if (burst_spec != NULL) {
+		// burst mode replaces the periodic sampling loop
+		build_burst_plan();
+		run_burst();
+		if (use_rdpmc) stop_core_helpers();
+		write_burst_results();
+		exit(0);
+	}
+
+	if (use_socket_readers) start_socket_readers();
+	if (use_results_writer) start_results_writer();
+	if (metrics_path != NULL) start_metrics_writer();
+	if (live_samples > 0) create_live_segment(period_ns);
+
+	if ((core_mux_groups > 1) || (cha_mux_groups > 1)) {
+		if (use_perf_events) {
+			fprintf(log_file,"ERROR: multiplexed event groups require the msr backend (the kernel multiplexes perf_event groups itself)\n");
+			exit(1);
+		}
+		fprintf(log_file,"INFO: multiplexing %d core and %d CHA event groups, rotating every %d samples\n",
+			core_mux_groups,cha_mux_groups,mux_intervals);
+	}
 
 	sample = 0;
 	read_all_counters();
-	while (sample < MAX_SAMPLES) {
-		nanosleep(&duration,&remainder);
-		dummycounter[sample]=dummycounter[sample-1]+10;
+	mux_after_read();
+	publish_samples();
+	if (live_samples > 0) publish_live_sample();
+	first_deadline(&deadline, period_ns);
+	while (!shutdown_requested) {
+		sleep_until_deadline(&deadline, period_ns);
+		if (shutdown_requested) break;
 		valid=0;				// try to catch cases where the interrupt happens in the middle of the counter reads
 		read_all_counters();
+		mux_after_read();
+		publish_samples();
+		if (live_samples > 0) publish_live_sample();
+		if (metrics_path != NULL) update_online_metrics();
+		if (stats_samples > 0) update_stats();
+		if (phase_spec != NULL) update_phases();
 		valid=1;
 	}
-	// Fall-through -- maximum number of samples reached 
+	if (shutdown_requested) {
+		fprintf(log_file,"Caught SIGCONT. Shutting down...\n");
+		fprintf(log_file,"DEBUG: %d samples read after initial read, %d deltas to be processed\n",sample,sample);
+	}
+	// Take the final sample (after SIGCONT)
+	read_all_counters();
+	mux_after_read();
+	publish_samples();
+	if (live_samples > 0) {
+		publish_live_sample();
+		close_live_segment();
+	}
+	if (metrics_path != NULL) {
+		update_online_metrics();
+		stop_metrics_writer();
+	}
+	if (stats_samples > 0) {
+		update_stats();
+		write_stats();
+	}
+	if (phase_spec != NULL) {
+		update_phases();
+		pph_finish(&phases);
+		write_phases();
+		fprintf(log_file,"INFO: %d phases with %d labels written to %s\n",phases.num_phases,phases.num_labels,phases_filename);
+	}
+	if (use_socket_readers) stop_socket_readers();
+	if (use_rdpmc) stop_core_helpers();
+	if (use_perf_events) check_perf_groups(0);
+	report_wakeup_lateness();
+	if (samples.pack_chunks) {
+		fprintf(log_file,"INFO: sample store packed %ld chunks of %ld samples into %lu bytes (%lu bytes unpacked)\n",
+			samples.num_packed,samples.chunk_samples,samples.packed_bytes,
+			samples.num_packed * samples.record_len * samples.chunk_samples * sizeof(uint64_t));
+	}
 	// Process and output all results
+	if (use_results_writer) stop_results_writer();
+	if (use_binary_output) {
+		write_binary_results(thermal_spec_power);
+		samples_written = sample;			// (so the Lua results file only gets the unit definitions)
+	}
+	if (use_npy_output) {
+		write_npy_results(thermal_spec_power);
+		samples_written = sample;
+	}
+	if (samples.drop_old) samples_written = sample;		// (the samples are gone: the results file only gets the units)
 	process_all_results();
 	exit(0);
-}
+}
\ No newline at end of file
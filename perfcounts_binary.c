@@ -0,0 +1,284 @@
+// Compact binary columnar output format for perf_counters -- see perfcounts_binary.h for the file layout
+//
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "perfcounts_binary.h"
+
+#define PCB_DEFAULT_BLOCK_SAMPLES 1024
+#define PCB_MAX_VARINT_BYTES 10
+
+static uint64_t width_mask(uint32_t width)
+{
+	return ((width >= 64) ? ~0UL : ((1UL << width) - 1));
+}
+
+static size_t align8(size_t n)
+{
+	return ((n + 7) & ~(size_t)7);
+}
+
+static uint8_t *put_varint(uint8_t *p, uint64_t v)
+{
+	while (v >= 0x80) {
+		*p++ = (uint8_t)(v | 0x80);
+		v >>= 7;
+	}
+	*p++ = (uint8_t)v;
+	return (p);
+}
+
+static const uint8_t *get_varint(const uint8_t *p, uint64_t *v)
+{
+	uint64_t result = 0;
+	int shift = 0;
+
+	while (*p & 0x80) {
+		result |= (uint64_t)(*p++ & 0x7f) << shift;
+		shift += 7;
+	}
+	result |= (uint64_t)(*p++) << shift;
+	*v = result;
+	return (p);
+}
+
+static uint64_t zigzag(int64_t d)
+{
+	return (((uint64_t)d << 1) ^ (uint64_t)(d >> 63));
+}
+
+static int64_t unzigzag(uint64_t z)
+{
+	return ((int64_t)(z >> 1) ^ -(int64_t)(z & 1));
+}
+
+// Encode values[0..n-1] of one block into buf, returns the number of bytes
+static size_t encode_block(const uint64_t *values, long n, uint32_t width, uint8_t *buf, uint32_t *encoding)
+{
+	uint64_t mask = width_mask(width);
+	uint8_t *p = buf;
+	long i;
+
+	*encoding = PCB_ENC_MASKED;
+	if (width >= 64) {
+		*encoding = PCB_ENC_ZIGZAG;
+	} else {
+		for (i=0; i<n; i++) {
+			if (values[i] > mask) {
+				*encoding = PCB_ENC_ZIGZAG;
+				break;
+			}
+		}
+	}
+	p = put_varint(p, values[0]);
+	for (i=1; i<n; i++) {
+		if (*encoding == PCB_ENC_MASKED) {
+			p = put_varint(p, (values[i] - values[i-1]) & mask);
+		} else {
+			p = put_varint(p, zigzag((int64_t)(values[i] - values[i-1])));
+		}
+	}
+	return (p - buf);
+}
+
+int pcb_write(const char *path, struct pcb_header *header, const struct pcb_series_info *series,
+	const int32_t *package_by_lproc, pcb_value_fn value, void *ctx)
+{
+	FILE *file;
+	struct pcb_series *schema;
+	struct pcb_block *index;
+	uint64_t *values;
+	uint8_t *buf;
+	char *strings;
+	size_t strings_bytes, offset, bytes;
+	uint64_t data_bytes;
+	long first, n, i;
+	uint32_t s, b;
+	static const uint8_t zeros[8];
+
+	if (header->block_samples == 0) header->block_samples = PCB_DEFAULT_BLOCK_SAMPLES;
+	memcpy(header->magic, PCB_MAGIC, sizeof(header->magic));
+	header->version = PCB_VERSION;
+	header->header_bytes = sizeof(struct pcb_header);
+	header->num_blocks = (header->num_samples + header->block_samples - 1) / header->block_samples;
+
+	// schema and string table
+	schema = calloc(header->num_series, sizeof(struct pcb_series));
+	strings_bytes = 0;
+	for (s=0; s<header->num_series; s++) strings_bytes += strlen(series[s].name) + 1;
+	strings = malloc(strings_bytes + 1);
+	index = calloc((size_t)header->num_series * header->num_blocks + 1, sizeof(struct pcb_block));
+	values = malloc(header->block_samples * sizeof(uint64_t));
+	buf = malloc(header->block_samples * PCB_MAX_VARINT_BYTES);
+	if ((schema == NULL) || (strings == NULL) || (index == NULL) || (values == NULL) || (buf == NULL)) {
+		fprintf(stderr,"ERROR: unable to allocate buffers to write %s\n",path);
+		return (-1);
+	}
+	offset = 0;
+	for (s=0; s<header->num_series; s++) {
+		schema[s].name = offset;
+		schema[s].scale = series[s].scale;
+		schema[s].width = series[s].width;
+		strcpy(&strings[offset], series[s].name);
+		offset += strlen(series[s].name) + 1;
+	}
+
+	// section offsets -- everything except the data size is known up front
+	header->topology_offset = align8(sizeof(struct pcb_header));
+	header->schema_offset = align8(header->topology_offset + header->num_lprocs * sizeof(int32_t));
+	header->strings_offset = align8(header->schema_offset + header->num_series * sizeof(struct pcb_series));
+	header->strings_bytes = strings_bytes;
+	header->index_offset = align8(header->strings_offset + strings_bytes);
+	header->data_offset = align8(header->index_offset + (uint64_t)header->num_series * header->num_blocks * sizeof(struct pcb_block));
+
+	file = fopen(path,"w");
+	if (file == NULL) {
+		fprintf(stderr,"ERROR %s when trying to open binary output file %s\n",strerror(errno),path);
+		return (-1);
+	}
+	// (the header and index are written again once the data sizes are known)
+	fwrite(header, sizeof(struct pcb_header), 1, file);
+	fwrite(zeros, header->topology_offset - sizeof(struct pcb_header), 1, file);
+	fwrite(package_by_lproc, sizeof(int32_t), header->num_lprocs, file);
+	fwrite(zeros, header->schema_offset - (header->topology_offset + header->num_lprocs * sizeof(int32_t)), 1, file);
+	fwrite(schema, sizeof(struct pcb_series), header->num_series, file);
+	fwrite(zeros, header->strings_offset - (header->schema_offset + header->num_series * sizeof(struct pcb_series)), 1, file);
+	fwrite(strings, 1, strings_bytes, file);
+	fwrite(zeros, header->index_offset - (header->strings_offset + strings_bytes), 1, file);
+	fseek(file, header->data_offset, SEEK_SET);
+
+	// data -- one column at a time
+	data_bytes = 0;
+	for (s=0; s<header->num_series; s++) {
+		for (b=0; b<header->num_blocks; b++) {
+			first = (long)b * header->block_samples;
+			n = header->num_samples - first;
+			if (n > header->block_samples) n = header->block_samples;
+			for (i=0; i<n; i++) values[i] = value(ctx, s, first + i);
+			bytes = encode_block(values, n, series[s].width, buf, &index[(size_t)s*header->num_blocks + b].encoding);
+			index[(size_t)s*header->num_blocks + b].offset = data_bytes;
+			index[(size_t)s*header->num_blocks + b].bytes = bytes;
+			if (fwrite(buf, 1, bytes, file) != bytes) {
+				fprintf(stderr,"ERROR %s when writing binary output file %s\n",strerror(errno),path);
+				fclose(file);
+				return (-1);
+			}
+			data_bytes += bytes;
+		}
+	}
+	header->data_bytes = data_bytes;
+
+	fseek(file, header->index_offset, SEEK_SET);
+	fwrite(index, sizeof(struct pcb_block), (size_t)header->num_series * header->num_blocks, file);
+	fseek(file, 0, SEEK_SET);
+	fwrite(header, sizeof(struct pcb_header), 1, file);
+	if (fclose(file) != 0) {
+		fprintf(stderr,"ERROR %s when closing binary output file %s\n",strerror(errno),path);
+		return (-1);
+	}
+	free(schema);
+	free(strings);
+	free(index);
+	free(values);
+	free(buf);
+	return (0);
+}
+
+int pcb_open(struct pcb_file *file, const char *path)
+{
+	struct stat st;
+	const struct pcb_header *header;
+
+	memset(file, 0, sizeof(struct pcb_file));
+	file->fd = open(path, O_RDONLY);
+	if (file->fd == -1) {
+		fprintf(stderr,"ERROR %s when trying to open %s\n",strerror(errno),path);
+		return (-1);
+	}
+	if ((fstat(file->fd, &st) != 0) || (st.st_size < (off_t)sizeof(struct pcb_header))) {
+		fprintf(stderr,"ERROR: %s is too short to be a binary perf_counters file\n",path);
+		close(file->fd);
+		return (-1);
+	}
+	file->bytes = st.st_size;
+	file->base = mmap(NULL, file->bytes, PROT_READ, MAP_SHARED, file->fd, 0);
+	if (file->base == MAP_FAILED) {
+		fprintf(stderr,"ERROR %s when trying to mmap %s\n",strerror(errno),path);
+		close(file->fd);
+		return (-1);
+	}
+	header = (const struct pcb_header *)file->base;
+	if ((memcmp(header->magic, PCB_MAGIC, sizeof(header->magic)) != 0) || (header->version != PCB_VERSION)
+			|| (header->data_offset + header->data_bytes > file->bytes)) {
+		fprintf(stderr,"ERROR: %s is not a (complete) version %d binary perf_counters file\n",path,PCB_VERSION);
+		pcb_close(file);
+		return (-1);
+	}
+	file->header = header;
+	file->package = (const int32_t *)(file->base + header->topology_offset);
+	file->series = (const struct pcb_series *)(file->base + header->schema_offset);
+	file->strings = (const char *)(file->base + header->strings_offset);
+	file->index = (const struct pcb_block *)(file->base + header->index_offset);
+	file->data = file->base + header->data_offset;
+	return (0);
+}
+
+void pcb_close(struct pcb_file *file)
+{
+	if ((file->base != NULL) && (file->base != MAP_FAILED)) munmap((void *)file->base, file->bytes);
+	close(file->fd);
+	memset(file, 0, sizeof(struct pcb_file));
+}
+
+const char *pcb_series_name(const struct pcb_file *file, int series)
+{
+	return (file->strings + file->series[series].name);
+}
+
+int pcb_find_series(const struct pcb_file *file, const char *name)
+{
+	uint32_t s;
+
+	for (s=0; s<file->header->num_series; s++) {
+		if (strcmp(pcb_series_name(file, s), name) == 0) return (s);
+	}
+	return (-1);
+}
+
+long pcb_read_series(const struct pcb_file *file, int series, long first, long count, uint64_t *out)
+{
+	const struct pcb_header *header = file->header;
+	const struct pcb_block *block;
+	const uint8_t *p;
+	uint64_t mask = width_mask(file->series[series].width);
+	uint64_t v, d;
+	long b, i, n, start, done;
+
+	if (first < 0) first = 0;
+	if (first + count > (long)header->num_samples) count = header->num_samples - first;
+	if (count <= 0) return (0);
+
+	done = 0;
+	for (b = first / header->block_samples; done < count; b++) {
+		block = &file->index[(size_t)series * header->num_blocks + b];
+		p = file->data + block->offset;
+		start = b * header->block_samples;
+		n = header->num_samples - start;
+		if (n > header->block_samples) n = header->block_samples;
+		p = get_varint(p, &v);
+		for (i=0; (i<n) && (done<count); i++) {
+			if (i > 0) {
+				p = get_varint(p, &d);
+				v = (block->encoding == PCB_ENC_MASKED) ? (v + d) & mask : v + (uint64_t)unzigzag(d);
+			}
+			if (start + i >= first) out[done++] = v;
+		}
+	}
+	return (done);
+}
@@ -0,0 +1,104 @@
+// Compact binary columnar output format for perf_counters (".pcb" files)
+//
+// A file contains, in order (all integers little-endian, every section 8-byte aligned):
+//   struct pcb_header       magic, counts, RAPL/thermal units, TSC frequency, and the offsets of the other sections
+//   topology                num_lprocs int32_t values: the socket (package) of each logical processor
+//   schema                  num_series struct pcb_series: name (offset into the string table), scale, counter width
+//   string table            NUL-terminated series names, e.g., core_counts[12]["INST_RETIRED.KERNEL"]
+//   block index             num_series*num_blocks struct pcb_block, series-major: index[series*num_blocks + block]
+//   data                    for each series, its blocks of block_samples samples (the last block may be shorter)
+//
+// Each block is self-contained: the first value of the block as a varint, then one varint per following
+// sample holding the delta from the previous value, either
+//   PCB_ENC_MASKED   (value - previous) modulo 2^width -- wrap-corrected, used when all of the block's values
+//                    fit in the counter width, decoded as (previous + delta) modulo 2^width
+//   PCB_ENC_ZIGZAG   the 64-bit signed difference, zigzag-encoded (for status registers, gauges, and anything
+//                    that does not fit the counter width)
+// The values are the raw (unscaled) counts kept by perf_counters -- multiply by the series scale to get the
+// value written in the Lua text output.
+//
+// pcb_write() writes a file from a callback that returns any value of any series.
+// pcb_open() maps a file, and pcb_read_series() decodes one series over a range of samples by touching only
+// the blocks of that range.
+//
+#include <stdint.h>
+#include <stddef.h>
+
+#define PCB_MAGIC "PCBIN\0\0\001"		// 8 bytes
+#define PCB_VERSION 1
+#define PCB_ENC_MASKED 0
+#define PCB_ENC_ZIGZAG 1
+
+struct pcb_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t header_bytes;			// sizeof(struct pcb_header)
+	uint64_t num_samples;
+	uint32_t num_series;
+	uint32_t block_samples;
+	uint32_t num_blocks;
+	uint32_t num_sockets;
+	uint32_t num_lprocs;
+	int32_t temp_target;			// degrees C (PROCHOT)
+	uint64_t tsc_hz;				// nominal TSC frequency
+	double power_unit;				// RAPL_POWER_UNIT, etc., as in the Lua text output
+	double pkg_energy_unit;
+	double dram_energy_unit;
+	double time_unit;
+	double package_tdp;
+	uint64_t topology_offset;
+	uint64_t schema_offset;
+	uint64_t strings_offset;
+	uint64_t strings_bytes;
+	uint64_t index_offset;
+	uint64_t data_offset;
+	uint64_t data_bytes;
+};
+
+struct pcb_series {
+	uint32_t name;					// offset in the string table
+	uint32_t scale;					// multiplier applied in the Lua text output
+	uint32_t width;					// counter width in bits (64 for non-counters)
+	uint32_t flags;					// reserved
+};
+
+struct pcb_block {
+	uint64_t offset;				// relative to data_offset
+	uint32_t bytes;
+	uint32_t encoding;				// PCB_ENC_MASKED or PCB_ENC_ZIGZAG
+};
+
+// description of a series for pcb_write()
+struct pcb_series_info {
+	const char *name;
+	uint32_t scale;
+	uint32_t width;
+};
+
+// returns sample "index" of series "series"
+typedef uint64_t (*pcb_value_fn)(void *ctx, int series, long index);
+
+// a mapped file
+struct pcb_file {
+	int fd;
+	size_t bytes;
+	const uint8_t *base;
+	const struct pcb_header *header;
+	const int32_t *package;
+	const struct pcb_series *series;
+	const char *strings;
+	const struct pcb_block *index;
+	const uint8_t *data;
+};
+
+// header must have num_samples, num_series, num_sockets, num_lprocs, and the units filled in;
+// block_samples may be 0 for the default.  Returns 0 on success, -1 (with a message on stderr) on failure.
+int pcb_write(const char *path, struct pcb_header *header, const struct pcb_series_info *series,
+	const int32_t *package_by_lproc, pcb_value_fn value, void *ctx);
+
+int pcb_open(struct pcb_file *file, const char *path);
+void pcb_close(struct pcb_file *file);
+const char *pcb_series_name(const struct pcb_file *file, int series);
+int pcb_find_series(const struct pcb_file *file, const char *name);		// -1 if not found
+// decodes samples first .. first+count-1 (clipped to the file) into out[], returns the number of samples decoded
+long pcb_read_series(const struct pcb_file *file, int series, long first, long count, uint64_t *out);
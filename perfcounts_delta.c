@@ -0,0 +1,207 @@
+// Wrap-corrected deltas of counter series -- see perfcounts_delta.h
+//
+// Each kernel subtracts the vector of values[i] from the vector of values[i+1] (two unaligned loads of the same
+// array, one element apart) and masks the result to the counter width.  The AVX2 and AVX-512 kernels are
+// compiled with target attributes, so the rest of the tools still run on any x86-64 processor.
+//
+#include <string.h>
+#include <immintrin.h>
+
+#include "perfcounts_delta.h"
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__INTEL_COMPILER))
+#define PCD_HAVE_SIMD 1
+#endif
+
+static inline uint64_t width_mask(int width)
+{
+	return ((width >= 64) ? ~0UL : (1UL << width) - 1);
+}
+
+// ---------------------------------------------------------------------------------------------------------------
+// scalar
+
+static void deltas_scalar(const uint64_t *values, long n, uint64_t mask, uint64_t *deltas)
+{
+	long i;
+
+	for (i=0; i<n-1; i++) deltas[i] = (values[i+1] - values[i]) & mask;
+}
+
+static uint64_t delta_sum_scalar(const uint64_t *values, long n, uint64_t mask)
+{
+	uint64_t sum = 0;
+	long i;
+
+	for (i=0; i<n-1; i++) sum += (values[i+1] - values[i]) & mask;
+	return (sum);
+}
+
+#ifdef PCD_HAVE_SIMD
+// ---------------------------------------------------------------------------------------------------------------
+// AVX2: 4 deltas per instruction
+
+__attribute__((target("avx2")))
+static void deltas_avx2(const uint64_t *values, long n, uint64_t mask, uint64_t *deltas)
+{
+	__m256i vmask = _mm256_set1_epi64x(mask);
+	__m256i before, after;
+	long i;
+
+	for (i=0; i+4<n; i+=4) {
+		before = _mm256_loadu_si256((const __m256i *)(values + i));
+		after = _mm256_loadu_si256((const __m256i *)(values + i + 1));
+		_mm256_storeu_si256((__m256i *)(deltas + i), _mm256_and_si256(_mm256_sub_epi64(after, before), vmask));
+	}
+	for (; i<n-1; i++) deltas[i] = (values[i+1] - values[i]) & mask;
+}
+
+__attribute__((target("avx2")))
+static uint64_t delta_sum_avx2(const uint64_t *values, long n, uint64_t mask)
+{
+	__m256i vmask = _mm256_set1_epi64x(mask);
+	__m256i sum0 = _mm256_setzero_si256(), sum1 = _mm256_setzero_si256();
+	__m256i before, after;
+	uint64_t lanes[4], sum;
+	long i;
+
+	// (two accumulators, to overlap the loads of one pair with the adds of the other)
+	for (i=0; i+8<n; i+=8) {
+		before = _mm256_loadu_si256((const __m256i *)(values + i));
+		after = _mm256_loadu_si256((const __m256i *)(values + i + 1));
+		sum0 = _mm256_add_epi64(sum0, _mm256_and_si256(_mm256_sub_epi64(after, before), vmask));
+		before = _mm256_loadu_si256((const __m256i *)(values + i + 4));
+		after = _mm256_loadu_si256((const __m256i *)(values + i + 5));
+		sum1 = _mm256_add_epi64(sum1, _mm256_and_si256(_mm256_sub_epi64(after, before), vmask));
+	}
+	_mm256_storeu_si256((__m256i *)lanes, _mm256_add_epi64(sum0, sum1));
+	sum = lanes[0] + lanes[1] + lanes[2] + lanes[3];
+	for (; i<n-1; i++) sum += (values[i+1] - values[i]) & mask;
+	return (sum);
+}
+
+// ---------------------------------------------------------------------------------------------------------------
+// AVX-512: 8 deltas per instruction, the tail done with a masked load/store
+
+__attribute__((target("avx512f")))
+static void deltas_avx512(const uint64_t *values, long n, uint64_t mask, uint64_t *deltas)
+{
+	__m512i vmask = _mm512_set1_epi64(mask);
+	__m512i before, after;
+	__mmask8 tail;
+	long i;
+
+	for (i=0; i+8<n; i+=8) {
+		before = _mm512_loadu_si512(values + i);
+		after = _mm512_loadu_si512(values + i + 1);
+		_mm512_storeu_si512(deltas + i, _mm512_and_si512(_mm512_sub_epi64(after, before), vmask));
+	}
+	if (i < n-1) {
+		tail = (__mmask8)((1U << (n - 1 - i)) - 1);
+		before = _mm512_maskz_loadu_epi64(tail, values + i);
+		after = _mm512_maskz_loadu_epi64(tail, values + i + 1);
+		_mm512_mask_storeu_epi64(deltas + i, tail, _mm512_and_si512(_mm512_sub_epi64(after, before), vmask));
+	}
+}
+
+__attribute__((target("avx512f")))
+static uint64_t delta_sum_avx512(const uint64_t *values, long n, uint64_t mask)
+{
+	__m512i vmask = _mm512_set1_epi64(mask);
+	__m512i sum0 = _mm512_setzero_si512(), sum1 = _mm512_setzero_si512();
+	__m512i before, after;
+	__mmask8 tail;
+	long i;
+
+	for (i=0; i+16<n; i+=16) {
+		before = _mm512_loadu_si512(values + i);
+		after = _mm512_loadu_si512(values + i + 1);
+		sum0 = _mm512_add_epi64(sum0, _mm512_and_si512(_mm512_sub_epi64(after, before), vmask));
+		before = _mm512_loadu_si512(values + i + 8);
+		after = _mm512_loadu_si512(values + i + 9);
+		sum1 = _mm512_add_epi64(sum1, _mm512_and_si512(_mm512_sub_epi64(after, before), vmask));
+	}
+	for (; i+8<n; i+=8) {
+		before = _mm512_loadu_si512(values + i);
+		after = _mm512_loadu_si512(values + i + 1);
+		sum0 = _mm512_add_epi64(sum0, _mm512_and_si512(_mm512_sub_epi64(after, before), vmask));
+	}
+	if (i < n-1) {
+		tail = (__mmask8)((1U << (n - 1 - i)) - 1);
+		before = _mm512_maskz_loadu_epi64(tail, values + i);
+		after = _mm512_maskz_loadu_epi64(tail, values + i + 1);
+		sum1 = _mm512_add_epi64(sum1, _mm512_and_si512(_mm512_sub_epi64(after, before), vmask));
+	}
+	return (_mm512_reduce_add_epi64(_mm512_add_epi64(sum0, sum1)));
+}
+#endif
+
+// ---------------------------------------------------------------------------------------------------------------
+// runtime selection
+
+struct pcd_kernel {
+	const char *name;
+	void (*deltas)(const uint64_t *values, long n, uint64_t mask, uint64_t *deltas);
+	uint64_t (*delta_sum)(const uint64_t *values, long n, uint64_t mask);
+};
+
+static const struct pcd_kernel kernels[] = {
+#ifdef PCD_HAVE_SIMD
+	{ "avx512", deltas_avx512, delta_sum_avx512 },
+	{ "avx2", deltas_avx2, delta_sum_avx2 },
+#endif
+	{ "scalar", deltas_scalar, delta_sum_scalar },
+};
+#define NUM_KERNELS (int)(sizeof(kernels) / sizeof(kernels[0]))
+
+static const struct pcd_kernel *kernel;
+
+static int kernel_supported(const struct pcd_kernel *k)
+{
+#ifdef PCD_HAVE_SIMD
+	if (strcmp(k->name, "avx512") == 0) return (__builtin_cpu_supports("avx512f"));
+	if (strcmp(k->name, "avx2") == 0) return (__builtin_cpu_supports("avx2"));
+#endif
+	return (1);
+}
+
+// the first supported kernel of the list (every thread that gets here picks the same one)
+static const struct pcd_kernel *select_kernel()
+{
+	int k;
+
+	if (kernel == NULL) {
+		for (k=0; !kernel_supported(&kernels[k]); k++) ;
+		kernel = &kernels[k];
+	}
+	return (kernel);
+}
+
+int pcd_set_kernel(const char *name)
+{
+	int k;
+
+	for (k=0; k<NUM_KERNELS; k++) {
+		if ((strcmp(kernels[k].name, name) == 0) && kernel_supported(&kernels[k])) {
+			kernel = &kernels[k];
+			return (0);
+		}
+	}
+	return (-1);
+}
+
+const char *pcd_kernel_name()
+{
+	return (select_kernel()->name);
+}
+
+void pcd_deltas(const uint64_t *values, long n, int width, uint64_t *deltas)
+{
+	select_kernel()->deltas(values, n, width_mask(width), deltas);
+}
+
+uint64_t pcd_delta_sum(const uint64_t *values, long n, int width)
+{
+	if (n < 2) return (0);
+	return (select_kernel()->delta_sum(values, n, width_mask(width)));
+}
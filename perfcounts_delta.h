@@ -0,0 +1,21 @@
+// Wrap-corrected deltas of counter series (perfcounts_delta.c)
+//
+// A counter of "width" bits (32 for the RAPL energy/throttle counters, 36 for IIO, 48 for the core and uncore
+// PMCs, 64 for TSC/APERF/MPERF) wraps to 0 after 2^width - 1, so the delta between two of its values is
+// (after - before) modulo 2^width.  That is the same as corrected_pmc_delta() (add 2^width when after < before)
+// whenever both values fit in the width, but needs no branch, so it is computed 4 (AVX2) or 8 (AVX-512) values
+// at a time.
+//
+// pcd_deltas()     deltas[i] = (values[i+1] - values[i]) mod 2^width, for i = 0 .. n-2 (n-1 deltas)
+// pcd_delta_sum()  the sum of the same n-1 deltas (the total count over the series, with any number of wraps)
+//
+// The kernel (scalar, avx2, or avx512) is selected on the first call from the instruction sets of the processor.
+// pcd_set_kernel() forces one ("scalar", "avx2", "avx512"), returning -1 if the processor (or the compiler)
+// does not support it, and pcd_kernel_name() returns the one in use.  width must be 1 .. 64.
+//
+#include <stdint.h>
+
+void pcd_deltas(const uint64_t *values, long n, int width, uint64_t *deltas);
+uint64_t pcd_delta_sum(const uint64_t *values, long n, int width);
+int pcd_set_kernel(const char *name);
+const char *pcd_kernel_name();
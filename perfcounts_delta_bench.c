@@ -0,0 +1,98 @@
+// perfcounts_delta_bench -- compare the delta kernels of perfcounts_delta.c with corrected_pmc_delta()
+//
+//   perfcounts_delta_bench [num_series [num_samples]]        (default 1100 series of 10000 samples)
+//
+// For counters of 32 (RAPL), 36 (IIO), 48 (PMC), and 64 (APERF/MPERF) bits, fills num_series series with
+// increasing counts that wrap around several times, then times the deltas of every series computed
+// value-by-value with corrected_pmc_delta() and with each kernel supported by this processor (pcd_deltas()
+// into an array, and pcd_delta_sum()).  Every result is checked against corrected_pmc_delta().
+//
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "low_overhead_timers.h"
+#include "perfcounts_delta.h"
+
+static const int widths[] = { 32, 36, 48, 64 };
+static const char *kernel_names[] = { "scalar", "avx2", "avx512" };
+
+double seconds_now()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (ts.tv_sec + 1.0e-9 * ts.tv_nsec);
+}
+
+int main(int argc, char *argv[])
+{
+	uint64_t *values, *deltas, *expected, *expected_sum, mask, sum, value;
+	double t0, t_reference, t_deltas, t_sum;
+	long num_series, num_samples, num_values, s, i, bad;
+	int w, k;
+
+	num_series = (argc > 1) ? atol(argv[1]) : 1100;
+	num_samples = (argc > 2) ? atol(argv[2]) : 10000;
+	num_values = num_series * num_samples;
+	values = malloc(num_values * sizeof(uint64_t));
+	deltas = malloc(num_values * sizeof(uint64_t));
+	expected = malloc(num_values * sizeof(uint64_t));
+	expected_sum = malloc(num_series * sizeof(uint64_t));
+	if ((values == NULL) || (deltas == NULL) || (expected == NULL) || (expected_sum == NULL)) {
+		fprintf(stderr,"ERROR: unable to allocate %ld values\n",num_values);
+		exit(1);
+	}
+	memset(deltas, 0, num_values * sizeof(uint64_t));			// (page faults out of the timings)
+	memset(expected, 0, num_values * sizeof(uint64_t));
+	printf("%ld series of %ld samples, default kernel %s\n",num_series,num_samples,pcd_kernel_name());
+	printf("width  kernel   deltas ns/value  speedup    sum ns/value  speedup\n");
+	srandom(12345);
+	for (w=0; w<(int)(sizeof(widths)/sizeof(widths[0])); w++) {
+		mask = (widths[w] == 64) ? ~0UL : (1UL << widths[w]) - 1;
+		// increments of up to 2^(width-3), so a series wraps several times
+		for (s=0; s<num_series; s++) {
+			value = ((uint64_t)random() << 32 | random()) & mask;
+			for (i=0; i<num_samples; i++) {
+				values[s*num_samples + i] = value;
+				value = (value + (((uint64_t)random() << 31 | random()) & (mask >> 3))) & mask;
+			}
+		}
+
+		t0 = seconds_now();
+		for (s=0; s<num_series; s++) {
+			sum = 0;
+			for (i=0; i<num_samples-1; i++) {
+				expected[s*num_samples + i] = corrected_pmc_delta(values[s*num_samples + i + 1], values[s*num_samples + i], widths[w]);
+				sum += expected[s*num_samples + i];
+			}
+			expected_sum[s] = sum;
+		}
+		t_reference = seconds_now() - t0;
+		printf("%5d  %-8s %10.3f                  %10.3f\n",widths[w],"pmc_delta",1.0e9*t_reference/num_values,
+			1.0e9*t_reference/num_values);
+
+		for (k=0; k<(int)(sizeof(kernel_names)/sizeof(kernel_names[0])); k++) {
+			if (pcd_set_kernel(kernel_names[k]) != 0) continue;
+			t0 = seconds_now();
+			for (s=0; s<num_series; s++) pcd_deltas(values + s*num_samples, num_samples, widths[w], deltas + s*num_samples);
+			t_deltas = seconds_now() - t0;
+			bad = 0;
+			for (s=0; s<num_series; s++) {
+				for (i=0; i<num_samples-1; i++) bad += (deltas[s*num_samples + i] != expected[s*num_samples + i]);
+			}
+			t0 = seconds_now();
+			for (s=0; s<num_series; s++) bad += (pcd_delta_sum(values + s*num_samples, num_samples, widths[w]) != expected_sum[s]);
+			t_sum = seconds_now() - t0;
+			printf("%5d  %-8s %10.3f %10.1fx      %10.3f %7.1fx%s\n",widths[w],kernel_names[k],
+				1.0e9*t_deltas/num_values,t_reference/t_deltas,1.0e9*t_sum/num_values,t_reference/t_sum,
+				bad ? "  MISMATCH" : "");
+			if (bad) {
+				fprintf(stderr,"ERROR: %ld results of the %s kernel differ from corrected_pmc_delta()\n",bad,kernel_names[k]);
+				exit(1);
+			}
+		}
+	}
+	return (0);
+}
@@ -0,0 +1,503 @@
+// Loading a perf_counters results file for post-processing -- see perfcounts_load.h
+//
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "perfcounts_load.h"
+#include "perfcounts_delta.h"
+#include "topology.h"
+
+#define NUM_TOPOLOGY_LPROCS (sizeof(Package_by_LProc) / sizeof(Package_by_LProc[0]))
+
+struct pcl_worker {
+	struct pcl_file *file;
+	pthread_t thread;
+	int id;
+};
+
+// counter widths of the Lua text output, by series name (the same groups as series_width() in perf_counters.c)
+static int text_series_width(const struct pcl_file *file, const char *name)
+{
+	if ((strncmp(name,"core_",5) == 0) || (strncmp(name,"cha_counts",10) == 0) || (strncmp(name,"imc_counts",10) == 0)
+			|| (strncmp(name,"pcu_counts",10) == 0) || (strncmp(name,"ubox_uclk",9) == 0)) return (48);
+	if ((strncmp(name,"rapl_pkg_energy",15) == 0) || (strncmp(name,"rapl_dram_energy",16) == 0)) return (file->rapl_energy_width);
+	if (strncmp(name,"rapl_",5) == 0) return (32);
+	if (strncmp(name,"iio_",4) == 0) return (38);		// 36-bit counters, written in units of 4 bytes
+	return (64);
+}
+
+static uint64_t hash_name(const char *name, int len)
+{
+	uint64_t h = 14695981039346656037UL;
+	int k;
+
+	for (k=0; k<len; k++) h = (h ^ (uint8_t)name[k]) * 1099511628211UL;
+	return (h);
+}
+
+static int add_series(struct pcl_file *file, const char *name, int len, int width, uint64_t scale)
+{
+	struct pcl_series *series;
+
+	if (file->num_series == file->max_series) {
+		file->max_series = file->max_series ? 2*file->max_series : 4096;
+		series = realloc(file->series, file->max_series * sizeof(struct pcl_series));
+		if (series == NULL) {
+			fprintf(stderr,"ERROR: unable to allocate %d series for %s\n",file->max_series,file->path);
+			return (-1);
+		}
+		file->series = series;
+	}
+	series = &file->series[file->num_series++];
+	series->name = strndup(name, len);
+	series->name_len = len;
+	series->width = width;
+	series->scale = scale;
+	series->values = NULL;
+	series->total = 0;
+	return (0);
+}
+
+// index of the series named name[0..len-1], or -1
+static int find_series(const struct pcl_file *file, const char *name, int len)
+{
+	const struct pcl_series *series;
+	uint64_t h;
+
+	for (h = hash_name(name, len) & file->hash_mask; file->hash_table[h] != 0; h = (h + 1) & file->hash_mask) {
+		series = &file->series[file->hash_table[h] - 1];
+		if ((series->name_len == len) && (memcmp(series->name, name, len) == 0)) return (file->hash_table[h] - 1);
+	}
+	return (-1);
+}
+
+int pcl_find_series(const struct pcl_file *file, const char *name)
+{
+	return (find_series(file, name, strlen(name)));
+}
+
+static int build_hash_table(struct pcl_file *file)
+{
+	uint64_t size, h;
+	int s;
+
+	for (size=1; size < 2*(uint64_t)file->num_series; size *= 2) ;
+	file->hash_table = calloc(size, sizeof(int));
+	if (file->hash_table == NULL) return (-1);
+	file->hash_mask = size - 1;
+	for (s=0; s<file->num_series; s++) {
+		for (h = hash_name(file->series[s].name, file->series[s].name_len) & file->hash_mask; file->hash_table[h] != 0;
+				h = (h + 1) & file->hash_mask) ;
+		file->hash_table[h] = s + 1;
+	}
+	return (0);
+}
+
+// runs fn on file->num_threads threads
+static void run_threads(struct pcl_file *file, void *(*fn)(void *))
+{
+	struct pcl_worker worker[PCL_MAX_THREADS];
+	int t;
+
+	for (t=0; t<file->num_threads; t++) {
+		worker[t].file = file;
+		worker[t].id = t;
+		if ((t > 0) && (pthread_create(&worker[t].thread, NULL, fn, &worker[t]) != 0)) {
+			fprintf(stderr,"ERROR %s when trying to start a thread\n",strerror(errno));
+			exit(1);
+		}
+	}
+	fn(&worker[0]);
+	for (t=1; t<file->num_threads; t++) pthread_join(worker[t].thread, NULL);
+}
+
+// sets the window (first or last < 0 for the first/last sample of the file) and allocates the values of the
+// kept series
+static int set_window(struct pcl_file *file, long first, long last, long max_index, pcl_keep_fn keep)
+{
+	long kept;
+	int s;
+
+	file->first_sample = (first < 0) ? 0 : first;
+	file->last_sample = ((last < 0) || (last > max_index)) ? max_index : last;
+	if (file->first_sample >= file->last_sample) {
+		fprintf(stderr,"ERROR: the window %ld to %ld of %s (%ld samples) has less than two samples\n",
+			file->first_sample,file->last_sample,file->path,max_index+1);
+		return (-1);
+	}
+	file->window_samples = file->last_sample - file->first_sample + 1;
+	kept = 0;
+	for (s=0; s<file->num_series; s++) if ((keep == NULL) || keep(file->series[s].name)) kept++;
+	file->values = calloc((size_t)kept * file->window_samples, sizeof(uint64_t));
+	if ((file->values == NULL) && (kept > 0)) {
+		fprintf(stderr,"ERROR: unable to allocate %ld samples of %ld series for %s\n",file->window_samples,kept,file->path);
+		return (-1);
+	}
+	kept = 0;
+	for (s=0; s<file->num_series; s++) {
+		if ((keep == NULL) || keep(file->series[s].name)) file->series[s].values = file->values + (size_t)(kept++) * file->window_samples;
+	}
+	return (0);
+}
+
+// ==================================================================================================================
+// Lua text output
+//		The file is the preamble (units, etc.), then, for each sample, one line "<series>[<sample>] = <value>" for
+//		each series, always in the same order, starting with tsc.  The series are the lines of the first sample.
+
+// start of the line after p (or end)
+static inline const char *next_line(const char *p, const char *end)
+{
+	const char *nl = memchr(p, '\n', end - p);
+
+	return (nl ? nl + 1 : end);
+}
+
+static inline int is_tsc_line(const char *p, const char *end)
+{
+	return ((end - p > 4) && (memcmp(p, "tsc[", 4) == 0));
+}
+
+// splits a sample line into the series name (name_len characters), the sample index, and the value,
+// returns 0 if it is not a sample line
+static inline int parse_sample_line(const char *p, const char *end, int *name_len, long *index, uint64_t *value)
+{
+	const char *eq, *q;
+	uint64_t v;
+	int negative;
+
+	eq = memchr(p, '=', end - p);
+	if ((eq == NULL) || (eq - p < 4) || (eq[-1] != ' ') || (eq[-2] != ']')) return (0);
+	for (q = eq - 3; (q > p) && (*q >= '0') && (*q <= '9'); q--) ;
+	if ((*q != '[') || (q == eq - 3)) return (0);
+	*name_len = q - p;
+	*index = 0;
+	for (q++; *q != ']'; q++) *index = *index * 10 + (*q - '0');
+	q = eq + 1;
+	while ((q < end) && (*q == ' ')) q++;
+	negative = (q < end) && (*q == '-');
+	if (negative) q++;
+	v = 0;
+	if ((end - q > 2) && (q[0] == '0') && (q[1] == 'x')) {
+		for (q+=2; q < end; q++) {
+			if ((*q >= '0') && (*q <= '9')) v = v*16 + (*q - '0');
+			else if ((*q >= 'a') && (*q <= 'f')) v = v*16 + (*q - 'a' + 10);
+			else break;
+		}
+	} else {
+		for (; (q < end) && (*q >= '0') && (*q <= '9'); q++) v = v*10 + (*q - '0');
+	}
+	*value = negative ? -v : v;
+	return (1);
+}
+
+// parses the lines of one thread's range, keeping the samples of the window
+static void *parse_text_thread(void *arg)
+{
+	struct pcl_worker *worker = arg;
+	struct pcl_file *file = worker->file;
+	struct pcl_series *series = file->series;
+	const char *p, *line_end, *end;
+	uint64_t value;
+	long index;
+	int name_len, s, guess;
+
+	guess = -1;
+	end = file->thread_end[worker->id];
+	for (p = file->thread_begin[worker->id]; p < end; p = line_end) {
+		line_end = next_line(p, end);
+		if (!parse_sample_line(p, line_end, &name_len, &index, &value)) continue;
+		if ((index < file->first_sample) || (index > file->last_sample)) continue;
+		// the lines of a sample come in the order of the series, so the next series is nearly always the right one
+		s = guess + 1;
+		if ((s >= file->num_series) || (series[s].name_len != name_len) || (memcmp(series[s].name, p, name_len) != 0)) {
+			s = find_series(file, p, name_len);
+			if (s < 0) continue;			// e.g., the burst samples (-B) at the end of the file
+		}
+		if (series[s].values != NULL) series[s].values[index - file->first_sample] = value;
+		guess = s;
+	}
+	return (NULL);
+}
+
+// value of a "NAME = value" line of the preamble
+static void parse_preamble_line(struct pcl_file *file, const char *p, const char *end)
+{
+	char line[256];
+	int len = end - p;
+
+	if (len >= (int)sizeof(line)) return;
+	memcpy(line, p, len);
+	line[len] = '\0';
+	if (strncmp(line,"TSC_ratio = ",12) == 0) file->tsc_ghz = 0.1 * atoi(line+12);
+	else if (strncmp(line,"nr_cpus = ",10) == 0) file->nr_cpus = atoi(line+10);
+	else if (strncmp(line,"Reference_TSC = ",16) == 0) file->reference_tsc = strtoul(line+16, NULL, 10);
+	else if (strncmp(line,"Reference_WallTime = ",21) == 0) file->reference_walltime = strtod(line+21, NULL);
+	else if (strncmp(line,"RAPL_PKG_ENERGY_UNIT = ",23) == 0) file->pkg_energy_unit = strtod(line+23, NULL);
+	else if (strncmp(line,"RAPL_DRAM_ENERGY_UNIT = ",24) == 0) file->dram_energy_unit = strtod(line+24, NULL);
+	else if (strncmp(line,"RAPL_TIME_UNIT = ",17) == 0) file->time_unit = strtod(line+17, NULL);
+	else if (strncmp(line,"RAPL_ENERGY_WIDTH = ",20) == 0) file->rapl_energy_width = atoi(line+20);
+}
+
+static int load_text(struct pcl_file *file, int fd, size_t bytes, long first, long last, pcl_keep_fn keep)
+{
+	const char *end, *data, *p, *line_end, *q;
+	uint64_t value;
+	long index, max_index;
+	int name_len, t;
+
+	file->text = mmap(NULL, bytes, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (file->text == MAP_FAILED) {
+		fprintf(stderr,"ERROR %s when trying to mmap %s\n",strerror(errno),file->path);
+		file->text = NULL;
+		return (-1);
+	}
+	madvise((void *)file->text, bytes, MADV_SEQUENTIAL | MADV_WILLNEED);
+	file->text_bytes = bytes;
+	end = file->text + bytes;
+	if ((bytes > 10) && (strncmp(file->text, "-- CHUNKED", 10) == 0)) {
+		fprintf(stderr,"ERROR: %s was written with -T (table constructors); use the default output or -b\n",file->path);
+		return (-1);
+	}
+
+	// preamble, up to the first sample (which starts with tsc)
+	file->rapl_energy_width = 32;
+	for (data = file->text; data < end; data = next_line(data, end)) {
+		if (is_tsc_line(data, end)) break;
+		parse_preamble_line(file, data, next_line(data, end) - 1);
+	}
+	if (data == end) {
+		fprintf(stderr,"ERROR: %s has no samples (written with -b?)\n",file->path);
+		return (-1);
+	}
+
+	// the series are the lines of the first sample
+	for (p = data; p < end; p = line_end) {
+		line_end = next_line(p, end);
+		if ((p > data) && is_tsc_line(p, end)) break;
+		if (parse_sample_line(p, line_end, &name_len, &index, &value)) {
+			if (add_series(file, p, name_len, text_series_width(file, p), 1) != 0) return (-1);
+		}
+	}
+	if (build_hash_table(file) != 0) return (-1);
+
+	// the last sample is the index of the last tsc line
+	max_index = -1;
+	for (q = end; q > data; q = p) {
+		for (p = q - 1; (p > data) && (p[-1] != '\n'); p--) ;
+		if (is_tsc_line(p, q) && parse_sample_line(p, q, &name_len, &index, &value)) {
+			max_index = index;
+			break;
+		}
+	}
+	if (set_window(file, first, last, max_index, keep) != 0) return (-1);
+
+	for (t=0; t<file->num_threads; t++) {
+		file->thread_begin[t] = (t == 0) ? data : file->thread_end[t-1];
+		file->thread_end[t] = (t == file->num_threads - 1) ? end : data + (end - data) / file->num_threads * (t + 1);
+		if (file->thread_end[t] < file->thread_begin[t]) file->thread_end[t] = file->thread_begin[t];
+		if (file->thread_end[t] < end) file->thread_end[t] = next_line(file->thread_end[t], end);
+	}
+	run_threads(file, parse_text_thread);
+	return (0);
+}
+
+// ==================================================================================================================
+// Binary output (-b), see perfcounts_binary.h
+
+static void *decode_pcb_thread(void *arg)
+{
+	struct pcl_worker *worker = arg;
+	struct pcl_file *file = worker->file;
+	int s;
+
+	for (s = worker->id; s < file->num_series; s += file->num_threads) {
+		if (file->series[s].values == NULL) continue;
+		pcb_read_series(&file->pcb, s, file->first_sample, file->window_samples, file->series[s].values);
+	}
+	return (NULL);
+}
+
+static int load_pcb(struct pcl_file *file, long first, long last, pcl_keep_fn keep)
+{
+	const struct pcb_header *header;
+	const char *name;
+	int s;
+
+	if (pcb_open(&file->pcb, file->path) != 0) return (-1);
+	header = file->pcb.header;
+	file->is_pcb = 1;
+	file->nr_cpus = header->num_lprocs;
+	file->tsc_ghz = 1.0e-9 * header->tsc_hz;
+	file->pkg_energy_unit = header->pkg_energy_unit;
+	file->dram_energy_unit = header->dram_energy_unit;
+	file->time_unit = header->time_unit;
+	for (s=0; s<(int)header->num_series; s++) {
+		name = pcb_series_name(&file->pcb, s);
+		if (add_series(file, name, strlen(name), file->pcb.series[s].width, file->pcb.series[s].scale) != 0) return (-1);
+	}
+	if (build_hash_table(file) != 0) return (-1);
+	if (set_window(file, first, last, (long)header->num_samples - 1, keep) != 0) return (-1);
+	run_threads(file, decode_pcb_thread);
+	return (0);
+}
+
+// ==================================================================================================================
+
+int pcl_load(struct pcl_file *file, const char *path, long first, long last, int num_threads, pcl_keep_fn keep)
+{
+	char magic[8];
+	struct stat st;
+	int fd, status;
+
+	memset(file, 0, sizeof(*file));
+	file->path = path;
+	file->num_threads = (num_threads < 1) ? 1 : (num_threads > PCL_MAX_THREADS) ? PCL_MAX_THREADS : num_threads;
+	fd = open(path, O_RDONLY);
+	if ((fd == -1) || (fstat(fd, &st) != 0)) {
+		fprintf(stderr,"ERROR %s when trying to open %s\n",strerror(errno),path);
+		if (fd != -1) close(fd);
+		return (-1);
+	}
+	if ((st.st_size >= (off_t)sizeof(magic)) && (pread(fd, magic, sizeof(magic), 0) == sizeof(magic))
+			&& (memcmp(magic, PCB_MAGIC, sizeof(magic)) == 0)) {
+		close(fd);
+		status = load_pcb(file, first, last, keep);
+	} else {
+		status = load_text(file, fd, st.st_size, first, last, keep);
+		close(fd);
+	}
+	if (status != 0) pcl_free(file);
+	return (status);
+}
+
+void pcl_free(struct pcl_file *file)
+{
+	int s;
+
+	if (file->text != NULL) munmap((void *)file->text, file->text_bytes);
+	if (file->is_pcb) pcb_close(&file->pcb);
+	for (s=0; s<file->num_series; s++) free((void *)file->series[s].name);
+	free(file->series);
+	free(file->hash_table);
+	free(file->values);
+	memset(file, 0, sizeof(*file));
+}
+
+static void *totals_thread(void *arg)
+{
+	struct pcl_worker *worker = arg;
+	struct pcl_file *file = worker->file;
+	struct pcl_series *series;
+	int s;
+
+	for (s = worker->id; s < file->num_series; s += file->num_threads) {
+		series = &file->series[s];
+		if (series->values == NULL) continue;
+		series->total = pcd_delta_sum(series->values, file->window_samples, series->width) * series->scale;
+	}
+	return (NULL);
+}
+
+void pcl_totals(struct pcl_file *file)
+{
+	run_threads(file, totals_thread);
+}
+
+// the number of sockets or threads per core of topology.h
+static int topology_count(const int *by_lproc)
+{
+	int lproc, count = 1;
+
+	for (lproc=0; lproc<(int)NUM_TOPOLOGY_LPROCS; lproc++) if (by_lproc[lproc] >= count) count = by_lproc[lproc] + 1;
+	return (count);
+}
+
+// With "interleaved", the logical processors are numbered as in Example/post_process.lua,
+// lproc = sockets*localcore + socket + (nr_cpus/threads)*thread, with the socket and thread counts of topology.h.
+int pcl_lproc_socket(const struct pcl_file *file, int lproc)
+{
+	if (file->is_pcb) return (file->pcb.package[lproc]);
+	if (file->interleaved) return (lproc % topology_count(Package_by_LProc));
+	return ((lproc < (int)NUM_TOPOLOGY_LPROCS) ? Package_by_LProc[lproc] : 0);
+}
+
+int pcl_lproc_thread(const struct pcl_file *file, int lproc)
+{
+	int nr_cpus;
+
+	if (file->interleaved) {
+		nr_cpus = (file->nr_cpus > 0) ? file->nr_cpus : (int)NUM_TOPOLOGY_LPROCS;
+		return (lproc / ((nr_cpus + topology_count(Thread_by_LProc) - 1) / topology_count(Thread_by_LProc)));
+	}
+	return ((lproc < (int)NUM_TOPOLOGY_LPROCS) ? Thread_by_LProc[lproc] : 0);
+}
+
+// ==================================================================================================================
+// The series of a loaded file as the source of derived metrics (perfcounts_metrics.c): the series that were
+// not kept are not visible, and the values of the window are used in place.
+
+static const char *metrics_series_name(void *ctx, int s)
+{
+	struct pcl_file *file = ctx;
+
+	return ((file->series[s].values != NULL) ? file->series[s].name : NULL);
+}
+
+static int metrics_find_series(void *ctx, const char *name)
+{
+	struct pcl_file *file = ctx;
+	int s = pcl_find_series(file, name);
+
+	return (((s >= 0) && (file->series[s].values != NULL)) ? s : -1);
+}
+
+static int metrics_series_width(void *ctx, int s)
+{
+	return (((struct pcl_file *)ctx)->series[s].width);
+}
+
+static double metrics_series_scale(void *ctx, int s)
+{
+	return (((struct pcl_file *)ctx)->series[s].scale);
+}
+
+static int metrics_constant(void *ctx, const char *name, double *value)
+{
+	struct pcl_file *file = ctx;
+
+	if (strcmp(name,"TSC_ratio") == 0) *value = 10.0 * file->tsc_ghz;
+	else if (strcmp(name,"nr_cpus") == 0) *value = file->nr_cpus;
+	else if (strcmp(name,"RAPL_PKG_ENERGY_UNIT") == 0) *value = file->pkg_energy_unit;
+	else if (strcmp(name,"RAPL_DRAM_ENERGY_UNIT") == 0) *value = file->dram_energy_unit;
+	else if (strcmp(name,"RAPL_TIME_UNIT") == 0) *value = file->time_unit;
+	else return (-1);
+	return ((*value != 0.0) ? 0 : -1);
+}
+
+// (first is the index in the window)
+static const uint64_t *metrics_values(void *ctx, int s, long first, long count, uint64_t *scratch)
+{
+	(void)count;				// (the window holds every value, so nothing is copied)
+	(void)scratch;
+	return (((struct pcl_file *)ctx)->series[s].values + first);
+}
+
+void pcl_metrics_source(struct pcl_file *file, struct pcm_source *source)
+{
+	source->ctx = file;
+	source->num_series = file->num_series;
+	source->series_name = metrics_series_name;
+	source->find_series = metrics_find_series;
+	source->series_width = metrics_series_width;
+	source->series_scale = metrics_series_scale;
+	source->constant = metrics_constant;
+	source->values = metrics_values;
+}
@@ -0,0 +1,75 @@
+// Loading a perf_counters results file for post-processing (perfcounts_load.c)
+//
+// pcl_load() reads a window of samples of a results file, either the Lua text output (one assignment per sample,
+// mapped and parsed by num_threads threads) or a .pcb file (-b, decoded with pcb_read_series()).  The series are
+// the lines of the first sample (or the schema of the .pcb file).  Only the series for which keep(name) returns
+// non-zero (all of them if keep is NULL) get their values, so a caller that needs a few counters of many files
+// only holds those.  Returns 0 on success, -1 (with a message on stderr) on failure.
+//
+// pcl_totals() sets the total of every loaded series: the sum of its wrap-corrected deltas over the window
+// (perfcounts_delta.c), times its scale.  pcl_delta() is the delta of one series from sample i-1 to sample i
+// of the window.  pcl_metrics_source() makes the kept series of the window the source of derived metrics
+// (perfcounts_metrics.h), with sample 0 the first sample of the window.
+//
+#include <stdint.h>
+
+#include "perfcounts_binary.h"
+#include "perfcounts_metrics.h"
+
+#define PCL_MAX_THREADS 256
+
+struct pcl_series {
+	const char *name;			// e.g., core_fixed_counts[12]["Inst_Retired.Any"]
+	int name_len;
+	int width;					// counter width in bits
+	uint64_t scale;				// multiplier of the stored values (1 for the Lua text output, which is already scaled)
+	uint64_t *values;			// samples first_sample..last_sample (NULL if not kept)
+	uint64_t total;				// set by pcl_totals()
+};
+
+struct pcl_file {
+	const char *path;
+	struct pcl_series *series;
+	int num_series;
+	int max_series;
+	int *hash_table;			// series index + 1, 0 for an empty slot
+	uint64_t hash_mask;
+	uint64_t *values;			// the values of all of the kept series
+	long first_sample, last_sample, window_samples;
+	int num_threads;
+
+	// from the beginning of the Lua results file or the .pcb header (0 if the file does not have them)
+	int nr_cpus;
+	double tsc_ghz;
+	double pkg_energy_unit, dram_energy_unit, time_unit;
+	int rapl_energy_width;		// RAPL_ENERGY_WIDTH: 64 for the perf_event power PMU, 32 (the default) for the MSRs
+	uint64_t reference_tsc;		// Reference_TSC and Reference_WallTime: the TSC and the time of day at the same
+	double reference_walltime;	// instant, at the start of the run (Lua results file only)
+
+	int interleaved;			// the lproc numbering of Example/post_process.lua instead of topology.h (set after loading)
+
+	int is_pcb;
+	struct pcb_file pcb;
+	const char *text;			// the mapped Lua results file
+	size_t text_bytes;
+	const char *thread_begin[PCL_MAX_THREADS], *thread_end[PCL_MAX_THREADS];
+};
+
+typedef int (*pcl_keep_fn)(const char *name);
+
+int pcl_load(struct pcl_file *file, const char *path, long first, long last, int num_threads, pcl_keep_fn keep);
+void pcl_free(struct pcl_file *file);
+int pcl_find_series(const struct pcl_file *file, const char *name);		// -1 if not found
+void pcl_totals(struct pcl_file *file);
+int pcl_lproc_socket(const struct pcl_file *file, int lproc);		// from the .pcb file or topology.h (or interleaved)
+int pcl_lproc_thread(const struct pcl_file *file, int lproc);		// from topology.h (or interleaved)
+void pcl_metrics_source(struct pcl_file *file, struct pcm_source *source);
+
+static inline uint64_t pcl_delta(const struct pcl_file *file, int s, long i)
+{
+	const struct pcl_series *series = &file->series[s];
+	uint64_t delta = series->values[i] - series->values[i-1];
+
+	if (series->width < 64) delta &= (1UL << series->width) - 1;
+	return (delta * series->scale);
+}
@@ -0,0 +1,378 @@
+// perfcounts_merge -- job-wide view of the results files of many nodes, aligned on wall-clock time
+//
+//   perfcounts_merge [-t threads] [-s bin_seconds] [-x straggler_fraction] node1.perfcounts.lua node2.perfcounts.lua ...
+//
+// Each node's file (Lua text output or .pcb) is loaded by one of "threads" threads (default: one per online CPU),
+// keeping only the series needed here: tsc, walltime, the fixed-function core counters, the IMC CAS counts, and
+// the RAPL energy counters.  The time of each sample is Reference_WallTime + (tsc - Reference_TSC) / TSC frequency
+// (the per-sample walltime when the file has no reference, e.g., a .pcb file), with the TSC frequency measured
+// against the per-sample walltime of the node, so the nodes are aligned on the wall clock with the resolution of
+// the TSC.  A counter delta of more than 16 per TSC cycle is taken as a reset of the counter and left out.  The
+// counts of each sample interval are spread over bins of bin_seconds (default 1) of wall-clock time, in proportion
+// to the overlap, and the samples are freed before the next file is loaded: the memory is proportional to the
+// number of nodes times the number of bins, not to the number of series or samples.
+//
+// Output (stdout):
+//   per-node summary   samples, start time, duration, the largest difference between the per-sample walltime and
+//                      the TSC-derived time, the number of counter resets, average frequency, utilization, IPC,
+//                      instruction rate (and relative to the median node), memory bandwidth, and package/DRAM
+//                      power.  A node whose instruction rate is below (1 - straggler_fraction) of the median
+//                      (default 0.1) is flagged STRAGGLER.
+//   job time series    for each bin: the number of nodes, total memory read/write bandwidth, total package and DRAM
+//                      power, the distribution of the nodes' IPC (min, quartiles, max), and the node with the lowest
+//                      instruction rate with its rate relative to the median of the bin.
+//
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "perfcounts_load.h"
+#include "perfcounts_delta.h"
+
+#define MAX_THREADS 256
+
+// quantities accumulated for each node and bin
+#define F_SECONDS 0				// seconds of the bin covered by the node's samples
+#define F_READ_BYTES 1
+#define F_WRITE_BYTES 2
+#define F_PKG_JOULES 3
+#define F_DRAM_JOULES 4
+#define F_INSTRUCTIONS 5		// summed over the logical processors
+#define F_CORE_CYCLES 6
+#define F_REF_CYCLES 7
+#define F_LPROC_TSC 8			// TSC cycles times the number of logical processors (for the utilization)
+#define NUM_FIELDS 9
+
+struct node {
+	const char *path;
+	char host[64];
+	int loaded;
+	int nr_cpus;
+	double tsc_ghz;
+	long samples;
+	double start, end;				// wall-clock time of the first and last sample
+	double max_skew;				// largest |walltime - TSC-derived time| (seconds)
+	long resets;					// counter deltas left out as resets
+	long first_bin;
+	int num_bins;
+	double (*bin)[NUM_FIELDS];
+	double total[NUM_FIELDS];
+};
+
+struct node *nodes;
+int num_nodes;
+int next_node;
+pthread_mutex_t next_node_lock = PTHREAD_MUTEX_INITIALIZER;
+int num_threads;
+double bin_seconds = 1.0;
+double straggler_fraction = 0.1;
+
+// the series needed from each file
+int keep_series(const char *name)
+{
+	return ((strcmp(name, "tsc") == 0) || (strncmp(name, "walltime[", 9) == 0)
+		|| (strncmp(name, "core_fixed_counts[", 18) == 0)
+		|| ((strncmp(name, "imc_counts[", 11) == 0) && (strstr(name, "\"CAS_COUNT.") != NULL))
+		|| (strncmp(name, "rapl_pkg_energy[", 16) == 0) || (strncmp(name, "rapl_dram_energy[", 17) == 0));
+}
+
+// the field that the deltas of a kept series add to (-1 for none), and their multiplier
+int series_field(const struct pcl_file *file, const char *name, double *multiplier)
+{
+	*multiplier = 1.0;
+	if (strncmp(name, "core_fixed_counts[", 18) == 0) {
+		if (strstr(name, "\"Inst_Retired.Any\"")) return (F_INSTRUCTIONS);
+		if (strstr(name, "\"CPU_CLK_Unhalted.Core\"")) return (F_CORE_CYCLES);
+		if (strstr(name, "\"CPU_CLK_Unhalted.Ref\"")) return (F_REF_CYCLES);
+	} else if (strncmp(name, "imc_counts[", 11) == 0) {
+		*multiplier = 64.0;						// bytes per CAS
+		if (strstr(name, "\"CAS_COUNT.READS\"")) return (F_READ_BYTES);
+		if (strstr(name, "\"CAS_COUNT.WRITES\"")) return (F_WRITE_BYTES);
+	} else if (strncmp(name, "rapl_pkg_energy[", 16) == 0) {
+		*multiplier = file->pkg_energy_unit;
+		return (F_PKG_JOULES);
+	} else if (strncmp(name, "rapl_dram_energy[", 17) == 0) {
+		*multiplier = file->dram_energy_unit;
+		return (F_DRAM_JOULES);
+	}
+	return (-1);
+}
+
+// node name from the file name: the part before ".perfcounts"
+void set_host(struct node *node)
+{
+	const char *base, *dot;
+	int len;
+
+	base = strrchr(node->path, '/');
+	base = base ? base + 1 : node->path;
+	dot = strstr(base, ".perfcounts");
+	len = dot ? (int)(dot - base) : (int)strlen(base);
+	if (len >= (int)sizeof(node->host)) len = sizeof(node->host) - 1;
+	memcpy(node->host, base, len);
+	node->host[len] = '\0';
+}
+
+// loads one node's file and accumulates its sample intervals into its bins
+void merge_node(struct node *node)
+{
+	struct pcl_file file;
+	double *interval[NUM_FIELDS], *time, multiplier, walltime, tsc_hz, a, b, overlap;
+	uint64_t *deltas, *tsc_deltas;
+	char name[80];
+	long n, i, k, last_bin;
+	int s, f, lproc, wall_sec, wall_usec, tsc;
+
+	set_host(node);
+	if (pcl_load(&file, node->path, -1, -1, 1, keep_series) != 0) return;
+	n = file.window_samples;
+	tsc = pcl_find_series(&file, "tsc");
+	wall_sec = pcl_find_series(&file, "walltime[0]");
+	wall_usec = pcl_find_series(&file, "walltime[1]");
+	if ((tsc < 0) || (file.tsc_ghz == 0.0) || (((wall_sec < 0) || (wall_usec < 0)) && (file.reference_tsc == 0))) {
+		fprintf(stderr,"ERROR: %s has no TSC or wall-clock time, skipped\n",node->path);
+		pcl_free(&file);
+		return;
+	}
+	node->nr_cpus = file.nr_cpus;
+	node->samples = n;
+
+	// wall-clock time of each sample, from the TSC and the reference pair; the TSC frequency is measured against
+	// the per-sample walltime, as the nominal frequency (TSC_ratio) may differ from the real one by a few 0.1%
+	time = malloc(n * sizeof(double));
+	for (i=0; i<n; i++) {
+		time[i] = ((wall_sec >= 0) && (wall_usec >= 0))
+			? (int64_t)file.series[wall_sec].values[i] + 1.0e-6 * (int64_t)file.series[wall_usec].values[i] : 0.0;
+	}
+	tsc_hz = file.tsc_ghz * 1.0e9;
+	if ((time[0] > 0.0) && (time[n-1] - time[0] >= 1.0)) {
+		tsc_hz = ((double)file.series[tsc].values[n-1] - (double)file.series[tsc].values[0]) / (time[n-1] - time[0]);
+	}
+	if (file.reference_tsc != 0) {
+		for (i=0; i<n; i++) {
+			walltime = time[i];
+			time[i] = file.reference_walltime + ((double)file.series[tsc].values[i] - (double)file.reference_tsc) / tsc_hz;
+			if ((walltime != 0.0) && (fabs(walltime - time[i]) > node->max_skew)) node->max_skew = fabs(walltime - time[i]);
+		}
+	}
+	node->tsc_ghz = file.tsc_ghz;			// (nominal: the rate of CPU_CLK_Unhalted.Ref)
+	node->start = time[0];
+	node->end = time[n-1];
+	if ((node->start <= 0.0) || ((node->end - node->start) / bin_seconds > 1.0e8)) {
+		fprintf(stderr,"ERROR: %s has wall-clock times %.6f to %.6f, skipped\n",node->path,node->start,node->end);
+		free(time);
+		pcl_free(&file);
+		return;
+	}
+
+	// the quantities of each sample interval (interval[f][i] is the interval from sample i to sample i+1).
+	// A delta of more than 16 per TSC cycle is a counter that was reset (e.g., by another tool), not a wraparound,
+	// and is left out.
+	deltas = malloc(n * sizeof(uint64_t));
+	tsc_deltas = malloc(n * sizeof(uint64_t));
+	for (f=0; f<NUM_FIELDS; f++) interval[f] = calloc(n, sizeof(double));
+	pcd_deltas(file.series[tsc].values, n, 64, tsc_deltas);
+	for (i=0; i<n-1; i++) interval[F_SECONDS][i] = tsc_deltas[i] / tsc_hz;
+	for (lproc=0; lproc<file.nr_cpus; lproc++) {
+		// (only the logical processors with fixed counters in the file count for the utilization)
+		sprintf(name, "core_fixed_counts[%d][\"CPU_CLK_Unhalted.Ref\"]", lproc);
+		if (pcl_find_series(&file, name) < 0) continue;
+		for (i=0; i<n-1; i++) interval[F_LPROC_TSC][i] += tsc_deltas[i];
+	}
+	for (s=0; s<file.num_series; s++) {
+		if (file.series[s].values == NULL) continue;
+		f = series_field(&file, file.series[s].name, &multiplier);
+		if (f < 0) continue;
+		pcd_deltas(file.series[s].values, n, file.series[s].width, deltas);
+		for (i=0; i<n-1; i++) {
+			if (deltas[i] > 16 * tsc_deltas[i]) {
+				node->resets++;
+				continue;
+			}
+			interval[f][i] += deltas[i] * file.series[s].scale * multiplier;
+		}
+	}
+
+	// spread each interval over the bins it overlaps
+	node->first_bin = floor(time[0] / bin_seconds);
+	last_bin = floor(time[n-1] / bin_seconds);
+	node->num_bins = last_bin - node->first_bin + 1;
+	node->bin = calloc(node->num_bins, sizeof(*node->bin));
+	for (i=0; i<n-1; i++) {
+		a = time[i];
+		b = time[i+1];
+		if (b <= a) continue;
+		for (k = floor(a / bin_seconds); (k <= last_bin) && (k * bin_seconds < b); k++) {
+			overlap = fmin(b, (k + 1) * bin_seconds) - fmax(a, k * bin_seconds);
+			if (overlap <= 0.0) continue;
+			for (f=0; f<NUM_FIELDS; f++) {
+				if (f == F_SECONDS) node->bin[k - node->first_bin][f] += overlap;
+				else node->bin[k - node->first_bin][f] += interval[f][i] * overlap / (b - a);
+			}
+		}
+		for (f=0; f<NUM_FIELDS; f++) node->total[f] += interval[f][i];
+	}
+	node->loaded = 1;
+	for (f=0; f<NUM_FIELDS; f++) free(interval[f]);
+	free(deltas);
+	free(tsc_deltas);
+	free(time);
+	pcl_free(&file);
+}
+
+void *merge_thread(void *arg)
+{
+	int k;
+
+	(void)arg;
+	while (1) {
+		pthread_mutex_lock(&next_node_lock);
+		k = next_node++;
+		pthread_mutex_unlock(&next_node_lock);
+		if (k >= num_nodes) break;
+		merge_node(&nodes[k]);
+	}
+	return (NULL);
+}
+
+int compare_doubles(const void *a, const void *b)
+{
+	double x = *(const double *)a, y = *(const double *)b;
+
+	return ((x > y) - (x < y));
+}
+
+// value at fraction q of the sorted array x[0..n-1]
+double quantile(const double *x, int n, double q)
+{
+	return (x[(int)(q * (n - 1) + 0.5)]);
+}
+
+int main(int argc, char *argv[])
+{
+	pthread_t thread[MAX_THREADS];
+	struct node *node;
+	double *rate, *ipc, median_rate, job_start, job_end, seconds, total[NUM_FIELDS], slowest_rate;
+	long first_bin, last_bin, k;
+	int loaded, t, c, m, n, f, slowest, stragglers;
+
+	num_threads = sysconf(_SC_NPROCESSORS_ONLN);
+	while ((c = getopt(argc, argv, "t:s:x:")) != -1) {
+		switch (c) {
+			case 't':
+				num_threads = atoi(optarg);
+				break;
+			case 's':
+				bin_seconds = atof(optarg);
+				break;
+			case 'x':
+				straggler_fraction = atof(optarg);
+				break;
+			default:
+				fprintf(stderr,"Usage: %s [-t threads] [-s bin_seconds] [-x straggler_fraction] results_file ...\n",argv[0]);
+				exit(1);
+		}
+	}
+	if ((optind >= argc) || (bin_seconds <= 0.0)) {
+		fprintf(stderr,"Usage: %s [-t threads] [-s bin_seconds] [-x straggler_fraction] results_file ...\n",argv[0]);
+		exit(1);
+	}
+	num_nodes = argc - optind;
+	nodes = calloc(num_nodes, sizeof(struct node));
+	for (n=0; n<num_nodes; n++) nodes[n].path = argv[optind + n];
+	if (num_threads < 1) num_threads = 1;
+	if (num_threads > MAX_THREADS) num_threads = MAX_THREADS;
+	if (num_threads > num_nodes) num_threads = num_nodes;
+
+	for (t=1; t<num_threads; t++) pthread_create(&thread[t], NULL, merge_thread, NULL);
+	merge_thread(NULL);
+	for (t=1; t<num_threads; t++) pthread_join(thread[t], NULL);
+
+	loaded = 0;
+	job_start = INFINITY;
+	job_end = -INFINITY;
+	first_bin = last_bin = 0;
+	for (n=0; n<num_nodes; n++) {
+		node = &nodes[n];
+		if (!node->loaded) continue;
+		if (loaded == 0 || node->first_bin < first_bin) first_bin = node->first_bin;
+		if (loaded == 0 || node->first_bin + node->num_bins - 1 > last_bin) last_bin = node->first_bin + node->num_bins - 1;
+		job_start = fmin(job_start, node->start);
+		job_end = fmax(job_end, node->end);
+		loaded++;
+	}
+	if (loaded == 0) {
+		fprintf(stderr,"ERROR: none of the %d files could be loaded\n",num_nodes);
+		exit(1);
+	}
+
+	// per-node summary, with the instruction rate relative to the median node
+	rate = malloc(num_nodes * sizeof(double));
+	ipc = malloc(num_nodes * sizeof(double));
+	m = 0;
+	for (n=0; n<num_nodes; n++) {
+		if (nodes[n].loaded) rate[m++] = nodes[n].total[F_INSTRUCTIONS] / nodes[n].total[F_SECONDS];
+	}
+	qsort(rate, m, sizeof(double), compare_doubles);
+	median_rate = quantile(rate, m, 0.5);
+	printf("-- %d nodes (%d not loaded), %.3f seconds from %.6f (Unix time), bins of %g seconds\n",loaded,num_nodes-loaded,
+		job_end-job_start,job_start,bin_seconds);
+	printf("-- per-node summary (start relative to the first node; skew = largest |walltime - TSC-derived time|)\n");
+	printf("host              samples   start(s)   seconds  skew(ms) resets    GHz   util    IPC   Ginst/s    rel  mem_GB/s   pkg_W  dram_W\n");
+	stragglers = 0;
+	for (n=0; n<num_nodes; n++) {
+		node = &nodes[n];
+		if (!node->loaded) {
+			printf("%-16s  not loaded\n",node->host);
+			continue;
+		}
+		seconds = node->total[F_SECONDS];
+		printf("%-16s %8ld %10.3f %9.3f %9.3f %6ld %6.3f %6.3f %6.3f %9.2f %6.3f %9.2f %7.1f %7.1f%s\n",node->host,node->samples,
+			node->start-job_start,seconds,1.0e3*node->max_skew,node->resets,
+			node->total[F_CORE_CYCLES]/node->total[F_REF_CYCLES]*node->tsc_ghz,node->total[F_REF_CYCLES]/node->total[F_LPROC_TSC],
+			node->total[F_INSTRUCTIONS]/node->total[F_CORE_CYCLES],1.0e-9*node->total[F_INSTRUCTIONS]/seconds,
+			node->total[F_INSTRUCTIONS]/seconds/median_rate,
+			1.0e-9*(node->total[F_READ_BYTES]+node->total[F_WRITE_BYTES])/seconds,node->total[F_PKG_JOULES]/seconds,
+			node->total[F_DRAM_JOULES]/seconds,
+			(node->total[F_INSTRUCTIONS]/seconds < (1.0 - straggler_fraction)*median_rate) ? "  STRAGGLER" : "");
+		if (node->total[F_INSTRUCTIONS]/seconds < (1.0 - straggler_fraction)*median_rate) stragglers++;
+	}
+	printf("-- %d stragglers (instruction rate below %.0f%% of the median node, %.2f Ginst/s)\n",stragglers,
+		100.0*(1.0 - straggler_fraction),1.0e-9*median_rate);
+
+	// job time series: a node counts in a bin if its samples cover at least half of it
+	printf("-- job time series (time of the start of the bin, relative to the first node)\n");
+	printf("   time(s) nodes  read_GB/s write_GB/s     pkg_W    dram_W  IPC_min  IPC_p25  IPC_med  IPC_p75  IPC_max  slowest          rel\n");
+	for (k=first_bin; k<=last_bin; k++) {
+		memset(total, 0, sizeof(total));
+		m = 0;
+		slowest = -1;
+		slowest_rate = INFINITY;
+		for (n=0; n<num_nodes; n++) {
+			node = &nodes[n];
+			if (!node->loaded || (k < node->first_bin) || (k >= node->first_bin + node->num_bins)) continue;
+			for (f=0; f<NUM_FIELDS; f++) total[f] += node->bin[k - node->first_bin][f];
+			if (node->bin[k - node->first_bin][F_SECONDS] < 0.5 * bin_seconds) continue;
+			if (node->bin[k - node->first_bin][F_CORE_CYCLES] <= 0.0) continue;
+			ipc[m] = node->bin[k - node->first_bin][F_INSTRUCTIONS] / node->bin[k - node->first_bin][F_CORE_CYCLES];
+			rate[m] = node->bin[k - node->first_bin][F_INSTRUCTIONS] / node->bin[k - node->first_bin][F_SECONDS];
+			if (rate[m] < slowest_rate) {
+				slowest_rate = rate[m];
+				slowest = n;
+			}
+			m++;
+		}
+		if (m == 0) continue;
+		qsort(ipc, m, sizeof(double), compare_doubles);
+		qsort(rate, m, sizeof(double), compare_doubles);
+		printf("%10.3f %5d %10.2f %10.2f %9.1f %9.1f %8.3f %8.3f %8.3f %8.3f %8.3f  %-16s %6.3f\n",
+			k*bin_seconds-job_start,m,1.0e-9*total[F_READ_BYTES]/bin_seconds,1.0e-9*total[F_WRITE_BYTES]/bin_seconds,
+			total[F_PKG_JOULES]/bin_seconds,total[F_DRAM_JOULES]/bin_seconds,quantile(ipc,m,0.0),quantile(ipc,m,0.25),
+			quantile(ipc,m,0.5),quantile(ipc,m,0.75),quantile(ipc,m,1.0),nodes[slowest].host,slowest_rate/quantile(rate,m,0.5));
+	}
+	return (0);
+}
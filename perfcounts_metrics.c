@@ -0,0 +1,771 @@
+// Derived metrics: formulas over the counter series, compiled once and evaluated over sample intervals
+// (see perfcounts_metrics.h for the language)
+//
+// Each line of the metrics file is parsed to a small expression tree, then compiled once for each value of its
+// index variables: the names are resolved (series, earlier metric instances, dt, constants) and the tree is
+// flattened to a stack program.  The inputs of all of the programs are "slots" (a series as a delta or as its
+// last value), each loaded once per block, so a series used by many metrics costs one pcd_deltas() call.
+//
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <math.h>
+
+#include "perfcounts_metrics.h"
+#include "perfcounts_delta.h"
+
+#define MAX_LINE 4096
+#define MAX_SUBSCRIPTS 8
+#define MAX_NAME 512
+
+enum { N_NUMBER, N_NAME, N_CALL, N_BINARY, N_NEG };
+enum { S_NUMBER, S_STRING, S_VAR, S_STAR };
+enum { F_SUM, F_AVG, F_COUNT, F_LAST, F_MIN, F_MAX, NUM_FUNCTIONS };
+static const char *function_name[NUM_FUNCTIONS] = { "sum", "avg", "count", "last", "min", "max" };
+static const int function_args[NUM_FUNCTIONS] = { 1, 1, 1, 1, 2, 2 };
+
+struct subscript {
+	int kind;
+	long number;
+	char text[MAX_NAME];		// S_STRING
+	int var;					// S_VAR
+};
+
+struct node {
+	int kind;
+	double number;				// N_NUMBER
+	char name[MAX_NAME];		// N_NAME (the part before the subscripts)
+	int num_subscripts;
+	struct subscript subscript[MAX_SUBSCRIPTS];
+	int op;						// N_BINARY: + - * /, N_CALL: F_*
+	struct node *a, *b;
+};
+
+struct compiler {
+	struct pcm_program *prog;
+	const char *path;
+	int line;
+	const char *p;				// parse position
+	int aggregate;				// parsing the argument of sum(), avg(), or count()
+	char var_name[PCM_MAX_VARS][MAX_NAME];
+	int num_vars;
+	int declared;				// the left side declares the index variables
+	long value[PCM_MAX_VARS];	// index variable values of the instance being compiled
+	int depth;
+	char missing[MAX_NAME];		// the first name that did not resolve
+};
+
+// ==================================================================================================================
+// Parsing
+
+static void parse_error(struct compiler *c, const char *message, const char *detail)
+{
+	fprintf(stderr,"ERROR: %s line %d: %s%s\n",c->path,c->line,message,detail);
+}
+
+static void skip_space(struct compiler *c)
+{
+	while ((*c->p == ' ') || (*c->p == '\t') || (*c->p == '\r')) c->p++;
+}
+
+static int parse_identifier(struct compiler *c, char *name)
+{
+	int len = 0;
+
+	skip_space(c);
+	if (!isalpha((unsigned char)*c->p) && (*c->p != '_')) return (-1);
+	while ((isalnum((unsigned char)*c->p) || (*c->p == '_')) && (len < MAX_NAME - 1)) name[len++] = *c->p++;
+	name[len] = '\0';
+	return (0);
+}
+
+static int find_var(struct compiler *c, const char *name)
+{
+	int v;
+
+	for (v=0; v<c->num_vars; v++) if (strcmp(c->var_name[v], name) == 0) return (v);
+	return (-1);
+}
+
+static void free_node(struct node *node)
+{
+	if (node == NULL) return;
+	free_node(node->a);
+	free_node(node->b);
+	free(node);
+}
+
+static struct node *parse_expression(struct compiler *c);
+
+// 1 if index variable "var" is a subscript somewhere in the expression
+static int uses_var(struct node *node, int var)
+{
+	int k;
+
+	if (node == NULL) return (0);
+	for (k=0; k<node->num_subscripts; k++) if ((node->subscript[k].kind == S_VAR) && (node->subscript[k].var == var)) return (1);
+	return (uses_var(node->a, var) || uses_var(node->b, var));
+}
+
+// subscripts of a name: [12], ["CAS_COUNT.READS"], [*], or [s]; "lhs" for the left side of a definition, where
+// each subscript declares an index variable
+static int parse_subscripts(struct compiler *c, struct node *node, int lhs)
+{
+	struct subscript *sub;
+	char *end;
+	int len;
+
+	while (skip_space(c), *c->p == '[') {
+		c->p++;
+		if (node->num_subscripts == MAX_SUBSCRIPTS) {
+			parse_error(c, "too many subscripts of ", node->name);
+			return (-1);
+		}
+		sub = &node->subscript[node->num_subscripts++];
+		skip_space(c);
+		if (lhs) {
+			if ((parse_identifier(c, sub->text) != 0) || (find_var(c, sub->text) >= 0) || (c->num_vars == PCM_MAX_VARS)) {
+				parse_error(c, "expected a new index variable in the subscript of ", node->name);
+				return (-1);
+			}
+			sub->kind = S_VAR;
+			sub->var = c->num_vars;
+			strcpy(c->var_name[c->num_vars++], sub->text);
+		} else if (*c->p == '*') {
+			if (!c->aggregate) {
+				parse_error(c, "\"*\" outside of sum(), avg(), or count() in ", node->name);
+				return (-1);
+			}
+			sub->kind = S_STAR;
+			c->p++;
+		} else if (*c->p == '"') {
+			end = strchr(c->p + 1, '"');
+			len = (end == NULL) ? 0 : end - c->p - 1;
+			if ((end == NULL) || (len >= MAX_NAME)) {
+				parse_error(c, "bad string subscript of ", node->name);
+				return (-1);
+			}
+			sub->kind = S_STRING;
+			memcpy(sub->text, c->p + 1, len);
+			sub->text[len] = '\0';
+			c->p = end + 1;
+		} else if (isdigit((unsigned char)*c->p)) {
+			sub->kind = S_NUMBER;
+			sub->number = strtol(c->p, &end, 10);
+			c->p = end;
+		} else if (parse_identifier(c, sub->text) == 0) {
+			sub->kind = S_VAR;
+			sub->var = find_var(c, sub->text);
+			if (sub->var < 0) {
+				if (c->declared || (c->num_vars == PCM_MAX_VARS)) {
+					parse_error(c, "index variable not on the left side: ", sub->text);
+					return (-1);
+				}
+				sub->var = c->num_vars;
+				strcpy(c->var_name[c->num_vars++], sub->text);
+			}
+		} else {
+			parse_error(c, "bad subscript of ", node->name);
+			return (-1);
+		}
+		skip_space(c);
+		if (*c->p != ']') {
+			parse_error(c, "expected \"]\" after a subscript of ", node->name);
+			return (-1);
+		}
+		c->p++;
+	}
+	return (0);
+}
+
+static struct node *parse_primary(struct compiler *c)
+{
+	struct node *node;
+	char *end;
+	int f, aggregate;
+
+	skip_space(c);
+	node = calloc(1, sizeof(struct node));
+	if (isdigit((unsigned char)*c->p) || (*c->p == '.')) {
+		node->kind = N_NUMBER;
+		node->number = strtod(c->p, &end);
+		c->p = end;
+		return (node);
+	}
+	if (*c->p == '(') {
+		c->p++;
+		free(node);
+		node = parse_expression(c);
+		skip_space(c);
+		if ((node != NULL) && (*c->p != ')')) {
+			parse_error(c, "expected \")\"", "");
+			free_node(node);
+			return (NULL);
+		}
+		c->p++;
+		return (node);
+	}
+	if (parse_identifier(c, node->name) != 0) {
+		parse_error(c, "expected a number, a name, or \"(\" at: ", (*c->p != '\0') ? c->p : "end of line");
+		free(node);
+		return (NULL);
+	}
+	skip_space(c);
+	if (*c->p == '(') {
+		for (f=0; f<NUM_FUNCTIONS; f++) if (strcmp(node->name, function_name[f]) == 0) break;
+		if (f == NUM_FUNCTIONS) {
+			parse_error(c, "unknown function ", node->name);
+			free(node);
+			return (NULL);
+		}
+		c->p++;
+		node->kind = N_CALL;
+		node->op = f;
+		aggregate = c->aggregate;
+		c->aggregate = (f == F_SUM) || (f == F_AVG) || (f == F_COUNT);
+		node->a = parse_expression(c);
+		if ((node->a != NULL) && (function_args[f] == 2)) {
+			skip_space(c);
+			if (*c->p == ',') {
+				c->p++;
+				node->b = parse_expression(c);
+			} else {
+				parse_error(c, "expected two arguments of ", node->name);
+			}
+		}
+		c->aggregate = aggregate;
+		skip_space(c);
+		if ((node->a == NULL) || ((function_args[f] == 2) && (node->b == NULL)) || (*c->p != ')')) {
+			if ((node->a != NULL) && ((function_args[f] == 1) || (node->b != NULL))) parse_error(c, "expected \")\" after the arguments of ", node->name);
+			free_node(node);
+			return (NULL);
+		}
+		c->p++;
+		if ((f != F_MIN) && (f != F_MAX) && (node->a->kind != N_NAME)) {
+			parse_error(c, "the argument must be a series or metric name: ", node->name);
+			free_node(node);
+			return (NULL);
+		}
+		return (node);
+	}
+	node->kind = N_NAME;
+	if (parse_subscripts(c, node, 0) != 0) {
+		free(node);
+		return (NULL);
+	}
+	return (node);
+}
+
+static struct node *parse_unary(struct compiler *c)
+{
+	struct node *node;
+
+	skip_space(c);
+	if (*c->p == '-') {
+		c->p++;
+		node = calloc(1, sizeof(struct node));
+		node->kind = N_NEG;
+		node->a = parse_unary(c);
+		if (node->a == NULL) {
+			free(node);
+			return (NULL);
+		}
+		return (node);
+	}
+	return (parse_primary(c));
+}
+
+static struct node *parse_binary(struct compiler *c, int level)
+{
+	struct node *node, *left;
+	const char *ops = (level == 0) ? "+-" : "*/";
+
+	left = (level == 0) ? parse_binary(c, 1) : parse_unary(c);
+	while (left != NULL) {
+		skip_space(c);
+		if ((*c->p == '\0') || (strchr(ops, *c->p) == NULL)) break;
+		node = calloc(1, sizeof(struct node));
+		node->kind = N_BINARY;
+		node->op = *c->p++;
+		node->a = left;
+		node->b = (level == 0) ? parse_binary(c, 1) : parse_unary(c);
+		if (node->b == NULL) {
+			free_node(node);
+			return (NULL);
+		}
+		left = node;
+	}
+	return (left);
+}
+
+static struct node *parse_expression(struct compiler *c)
+{
+	return (parse_binary(c, 0));
+}
+
+// ==================================================================================================================
+// Compiling
+
+static void add_op(struct compiler *c, int code, int arg, double value)
+{
+	struct pcm_program *prog = c->prog;
+
+	if (prog->num_ops == prog->max_ops) {
+		prog->max_ops = prog->max_ops ? 2 * prog->max_ops : 256;
+		prog->ops = realloc(prog->ops, prog->max_ops * sizeof(struct pcm_op));
+	}
+	prog->ops[prog->num_ops].code = code;
+	prog->ops[prog->num_ops].arg = arg;
+	prog->ops[prog->num_ops].value = value;
+	prog->num_ops++;
+	if ((code == PCM_DELTA) || (code == PCM_LAST) || (code == PCM_CONST) || (code == PCM_METRIC)) {
+		c->depth++;
+		if (c->depth > prog->max_depth) prog->max_depth = c->depth;
+	} else if ((code != PCM_NEG)) {
+		c->depth--;
+	}
+}
+
+static int slot(struct compiler *c, int series, int last)
+{
+	struct pcm_program *prog = c->prog;
+	struct pcm_source *source = prog->source;
+	int *k = &prog->slot_of_series[2 * series + last];
+
+	if (*k < 0) {
+		if (prog->num_slots == prog->max_slots) {
+			prog->max_slots = prog->max_slots ? 2 * prog->max_slots : 64;
+			prog->slot = realloc(prog->slot, prog->max_slots * sizeof(struct pcm_slot));
+		}
+		*k = prog->num_slots++;
+		prog->slot[*k].series = series;
+		prog->slot[*k].last = last;
+		prog->slot[*k].width = source->series_width(source->ctx, series);
+		prog->slot[*k].scale = source->series_scale(source->ctx, series);
+	}
+	return (*k);
+}
+
+static int find_instance(struct pcm_program *prog, const char *name)
+{
+	int m;
+
+	for (m=0; m<prog->num_instances; m++) {
+		if ((prog->instance[m].metric < prog->num_metrics) && (strcmp(prog->instance[m].name, name) == 0)) return (m);
+	}
+	return (-1);
+}
+
+// "name" with "[*]" matching any one subscript
+static int name_matches(const char *pattern, const char *name)
+{
+	while (*pattern) {
+		if (strncmp(pattern, "[*]", 3) == 0) {
+			if (*name != '[') return (0);
+			name = strchr(name, ']');
+			if (name == NULL) return (0);
+			name++;
+			pattern += 3;
+		} else if (*pattern++ != *name++) {
+			return (0);
+		}
+	}
+	return (*name == '\0');
+}
+
+// the name of a reference with the values of the index variables substituted
+static void reference_name(struct compiler *c, struct node *node, char *name)
+{
+	struct subscript *sub;
+	int i, len;
+
+	len = snprintf(name, MAX_NAME, "%s", node->name);
+	for (i=0; (i<node->num_subscripts) && (len < MAX_NAME); i++) {
+		sub = &node->subscript[i];
+		if (sub->kind == S_NUMBER) len += snprintf(name+len, MAX_NAME-len, "[%ld]", sub->number);
+		else if (sub->kind == S_STRING) len += snprintf(name+len, MAX_NAME-len, "[\"%s\"]", sub->text);
+		else if (sub->kind == S_VAR) len += snprintf(name+len, MAX_NAME-len, "[%ld]", c->value[sub->var]);
+		else len += snprintf(name+len, MAX_NAME-len, "[*]");
+	}
+}
+
+static int emit(struct compiler *c, struct node *node);
+
+// sum(), avg(), count(): every series, or instance of an earlier metric, matching the name
+static int emit_aggregate(struct compiler *c, struct node *node)
+{
+	struct pcm_program *prog = c->prog;
+	struct pcm_source *source = prog->source;
+	const char *series_name;
+	char pattern[MAX_NAME];
+	int s, m, count;
+
+	reference_name(c, node->a, pattern);
+	count = 0;
+	for (s=0; s<source->num_series; s++) {
+		series_name = source->series_name(source->ctx, s);
+		if ((series_name == NULL) || !name_matches(pattern, series_name)) continue;
+		if (node->op != F_COUNT) add_op(c, PCM_DELTA, slot(c, s, 0), 0.0);
+		if ((node->op != F_COUNT) && (count > 0)) add_op(c, PCM_ADD, 0, 0.0);
+		count++;
+	}
+	for (m=0; m<prog->num_instances; m++) {
+		if ((prog->instance[m].metric == prog->num_metrics) || !name_matches(pattern, prog->instance[m].name)) continue;
+		if (node->op != F_COUNT) add_op(c, PCM_METRIC, m, 0.0);
+		if ((node->op != F_COUNT) && (count > 0)) add_op(c, PCM_ADD, 0, 0.0);
+		count++;
+	}
+	if (count == 0) {
+		strcpy(c->missing, pattern);
+		return (-1);
+	}
+	if (node->op == F_COUNT) add_op(c, PCM_CONST, 0, count);
+	if (node->op == F_AVG) {
+		add_op(c, PCM_CONST, 0, count);
+		add_op(c, PCM_DIV, 0, 0.0);
+	}
+	return (0);
+}
+
+static int emit(struct compiler *c, struct node *node)
+{
+	struct pcm_program *prog = c->prog;
+	struct pcm_source *source = prog->source;
+	char name[MAX_NAME];
+	double value;
+	int s, m;
+
+	switch (node->kind) {
+		case N_NUMBER:
+			add_op(c, PCM_CONST, 0, node->number);
+			return (0);
+		case N_NEG:
+			if (emit(c, node->a) != 0) return (-1);
+			add_op(c, PCM_NEG, 0, 0.0);
+			return (0);
+		case N_BINARY:
+			if ((emit(c, node->a) != 0) || (emit(c, node->b) != 0)) return (-1);
+			add_op(c, (node->op == '+') ? PCM_ADD : (node->op == '-') ? PCM_SUB : (node->op == '*') ? PCM_MUL : PCM_DIV, 0, 0.0);
+			return (0);
+		case N_CALL:
+			if ((node->op == F_MIN) || (node->op == F_MAX)) {
+				if ((emit(c, node->a) != 0) || (emit(c, node->b) != 0)) return (-1);
+				add_op(c, (node->op == F_MIN) ? PCM_MIN : PCM_MAX, 0, 0.0);
+				return (0);
+			}
+			if (node->op != F_LAST) return (emit_aggregate(c, node));
+			reference_name(c, node->a, name);
+			s = source->find_series(source->ctx, name);
+			if (s < 0) {
+				strcpy(c->missing, name);
+				return (-1);
+			}
+			add_op(c, PCM_LAST, slot(c, s, 1), 0.0);
+			return (0);
+		case N_NAME:
+			reference_name(c, node, name);
+			if ((m = find_instance(prog, name)) >= 0) {
+				add_op(c, PCM_METRIC, m, 0.0);
+				return (0);
+			}
+			if ((s = source->find_series(source->ctx, name)) >= 0) {
+				add_op(c, PCM_DELTA, slot(c, s, 0), 0.0);
+				return (0);
+			}
+			if ((node->num_subscripts == 0) && (strcmp(name, "dt") == 0) && (prog->tsc_hz > 0.0)
+				&& ((s = source->find_series(source->ctx, "tsc")) >= 0)) {
+				add_op(c, PCM_DELTA, slot(c, s, 0), 0.0);
+				add_op(c, PCM_CONST, 0, 1.0 / prog->tsc_hz);
+				add_op(c, PCM_MUL, 0, 0.0);
+				return (0);
+			}
+			if ((node->num_subscripts == 0) && (source->constant(source->ctx, name, &value) == 0)) {
+				add_op(c, PCM_CONST, 0, value);
+				return (0);
+			}
+			strcpy(c->missing, name);
+			return (-1);
+	}
+	return (-1);
+}
+
+// compiles the instances for the index variables from "var" on, in order; returns the number of instances
+static int instantiate(struct compiler *c, struct node *expr, const char *metric_name, int var)
+{
+	struct pcm_program *prog = c->prog;
+	struct pcm_instance *instance;
+	char name[MAX_NAME];
+	int num_ops, num_slots, k, n, total, len;
+	long v;
+
+	if (var < c->num_vars) {
+		total = 0;
+		for (v=0; v<PCM_MAX_INDEX; v++) {
+			c->value[var] = v;
+			n = instantiate(c, expr, metric_name, var + 1);
+			if (n == 0) break;
+			total += n;
+		}
+		return (total);
+	}
+	num_ops = prog->num_ops;
+	num_slots = prog->num_slots;
+	c->depth = 0;
+	if (emit(c, expr) != 0) {
+		for (k=num_slots; k<prog->num_slots; k++) prog->slot_of_series[2 * prog->slot[k].series + prog->slot[k].last] = -1;
+		prog->num_slots = num_slots;
+		prog->num_ops = num_ops;
+		return (0);
+	}
+	len = snprintf(name, MAX_NAME, "%s", metric_name);
+	for (k=0; k<c->num_vars; k++) len += snprintf(name+len, MAX_NAME-len, "[%ld]", c->value[k]);
+	if (prog->num_instances == prog->max_instances) {
+		prog->max_instances = prog->max_instances ? 2 * prog->max_instances : 64;
+		prog->instance = realloc(prog->instance, prog->max_instances * sizeof(struct pcm_instance));
+	}
+	instance = &prog->instance[prog->num_instances++];
+	instance->name = strdup(name);
+	instance->metric = prog->num_metrics;
+	instance->first_op = num_ops;
+	instance->num_ops = prog->num_ops - num_ops;
+	return (1);
+}
+
+static int compile_line(struct compiler *c, char *line)
+{
+	struct pcm_program *prog = c->prog;
+	struct node lhs, *expr;
+	char *comment;
+	int m, n;
+
+	comment = strpbrk(line, "#\n");
+	if (comment != NULL) *comment = '\0';
+	c->p = line;
+	skip_space(c);
+	if (*c->p == '\0') return (0);
+
+	memset(&lhs, 0, sizeof(lhs));
+	c->num_vars = 0;
+	c->aggregate = 0;
+	if (parse_identifier(c, lhs.name) != 0) {
+		parse_error(c, "expected a metric name at: ", c->p);
+		return (-1);
+	}
+	if (parse_subscripts(c, &lhs, 1) != 0) return (-1);
+	for (m=0; m<prog->num_instances; m++) {
+		if (strncmp(prog->instance[m].name, lhs.name, strlen(lhs.name)) != 0) continue;
+		n = prog->instance[m].name[strlen(lhs.name)];
+		if ((n == '\0') || (n == '[')) {
+			parse_error(c, "metric defined twice: ", lhs.name);
+			return (-1);
+		}
+	}
+	skip_space(c);
+	if (*c->p != '=') {
+		parse_error(c, "expected \"=\" after ", lhs.name);
+		return (-1);
+	}
+	c->p++;
+	c->declared = (lhs.num_subscripts > 0);
+	expr = parse_expression(c);
+	if (expr == NULL) return (-1);
+	skip_space(c);
+	if (*c->p != '\0') {
+		parse_error(c, "unexpected text at: ", c->p);
+		free_node(expr);
+		return (-1);
+	}
+	// (an index variable that the right side does not use would make PCM_MAX_INDEX copies of the same value)
+	for (n=0; n<lhs.num_subscripts; n++) {
+		if (!uses_var(expr, n)) {
+			parse_error(c, "index variable not used on the right side: ", c->var_name[n]);
+			free_node(expr);
+			return (-1);
+		}
+	}
+
+	c->missing[0] = '\0';
+	if (instantiate(c, expr, lhs.name, 0) == 0) {
+		fprintf(stderr,"WARNING: %s line %d: metric %s skipped, no %s\n",c->path,c->line,lhs.name,c->missing);
+	}
+	prog->num_metrics++;
+	free_node(expr);
+	return (0);
+}
+
+int pcm_compile(struct pcm_program *prog, const char *path, struct pcm_source *source)
+{
+	struct compiler c;
+	char line[MAX_LINE];
+	double tsc_ratio;
+	FILE *fp;
+	int k;
+
+	memset(prog, 0, sizeof(*prog));
+	prog->source = source;
+	prog->slot_of_series = malloc(2 * source->num_series * sizeof(int));
+	for (k=0; k<2*source->num_series; k++) prog->slot_of_series[k] = -1;
+	if (source->constant(source->ctx, "TSC_ratio", &tsc_ratio) == 0) prog->tsc_hz = tsc_ratio * 1.0e8;
+
+	fp = fopen(path, "r");
+	if (fp == NULL) {
+		fprintf(stderr,"ERROR: unable to open metrics file %s\n",path);
+		return (-1);
+	}
+	memset(&c, 0, sizeof(c));
+	c.prog = prog;
+	c.path = path;
+	while (fgets(line, MAX_LINE, fp) != NULL) {
+		c.line++;
+		if (compile_line(&c, line) != 0) {
+			fclose(fp);
+			return (-1);
+		}
+	}
+	fclose(fp);
+
+	prog->slot_data = malloc((prog->num_slots + 1) * PCM_BLOCK * sizeof(double));
+	prog->stack = malloc((prog->max_depth + 1) * PCM_BLOCK * sizeof(double));
+	return (0);
+}
+
+// ==================================================================================================================
+// Evaluation
+
+static void reserve_scratch(struct pcm_program *prog, long len)
+{
+	if (len <= prog->scratch_len) return;
+	free(prog->scratch);
+	free(prog->deltas);
+	prog->scratch = malloc(len * sizeof(uint64_t));
+	prog->deltas = malloc(len * sizeof(uint64_t));
+	prog->scratch_len = len;
+}
+
+// loads every slot for "len" intervals from sample "first", or (window) for the sum over them
+static void load_slots(struct pcm_program *prog, long first, long len, int window)
+{
+	struct pcm_source *source = prog->source;
+	struct pcm_slot *slot;
+	const uint64_t *values;
+	double *data;
+	long i;
+	int k;
+
+	reserve_scratch(prog, len + 1);
+	for (k=0; k<prog->num_slots; k++) {
+		slot = &prog->slot[k];
+		data = prog->slot_data + (long)k * PCM_BLOCK;
+		values = source->values(source->ctx, slot->series, first, len, prog->scratch);
+		if (slot->last) {
+			if (window) data[0] = values[len] * slot->scale;
+			else for (i=0; i<len; i++) data[i] = values[i+1] * slot->scale;
+		} else if (window) {
+			data[0] = pcd_delta_sum(values, len + 1, slot->width) * slot->scale;
+		} else {
+			pcd_deltas(values, len + 1, slot->width, prog->deltas);
+			for (i=0; i<len; i++) data[i] = prog->deltas[i] * slot->scale;
+		}
+	}
+}
+
+// runs the program of every instance over "len" values of the slots, into out[instance * stride + offset ...]
+static void run_block(struct pcm_program *prog, long len, double *out, long stride, long offset)
+{
+	struct pcm_op *op, *end;
+	double *x, *y;
+	long i;
+	int m, sp;
+
+	for (m=0; m<prog->num_instances; m++) {
+		sp = 0;
+		end = prog->ops + prog->instance[m].first_op + prog->instance[m].num_ops;
+		for (op = prog->ops + prog->instance[m].first_op; op < end; op++) {
+			y = prog->stack + (long)sp * PCM_BLOCK;			// (the next free entry)
+			x = y - 2 * PCM_BLOCK;							// (the operands of a binary operation, x and x + PCM_BLOCK)
+			switch (op->code) {
+				case PCM_DELTA:
+				case PCM_LAST:
+					memcpy(y, prog->slot_data + (long)op->arg * PCM_BLOCK, len * sizeof(double));
+					sp++;
+					break;
+				case PCM_CONST:
+					for (i=0; i<len; i++) y[i] = op->value;
+					sp++;
+					break;
+				case PCM_METRIC:
+					memcpy(y, out + op->arg * stride + offset, len * sizeof(double));
+					sp++;
+					break;
+				case PCM_NEG:
+					for (i=0; i<len; i++) y[i - PCM_BLOCK] = -y[i - PCM_BLOCK];
+					break;
+				case PCM_ADD:
+					for (i=0; i<len; i++) x[i] += x[i + PCM_BLOCK];
+					sp--;
+					break;
+				case PCM_SUB:
+					for (i=0; i<len; i++) x[i] -= x[i + PCM_BLOCK];
+					sp--;
+					break;
+				case PCM_MUL:
+					for (i=0; i<len; i++) x[i] *= x[i + PCM_BLOCK];
+					sp--;
+					break;
+				case PCM_DIV:
+					for (i=0; i<len; i++) x[i] /= x[i + PCM_BLOCK];
+					sp--;
+					break;
+				case PCM_MIN:
+					for (i=0; i<len; i++) x[i] = fmin(x[i], x[i + PCM_BLOCK]);
+					sp--;
+					break;
+				case PCM_MAX:
+					for (i=0; i<len; i++) x[i] = fmax(x[i], x[i + PCM_BLOCK]);
+					sp--;
+					break;
+			}
+		}
+		memcpy(out + m * stride + offset, prog->stack, len * sizeof(double));
+	}
+}
+
+void pcm_eval(struct pcm_program *prog, long first, long n, double *out)
+{
+	long b, len;
+
+	for (b=0; b<n; b+=PCM_BLOCK) {
+		len = (n - b < PCM_BLOCK) ? n - b : PCM_BLOCK;
+		load_slots(prog, first + b, len, 0);
+		run_block(prog, len, out, n, b);
+	}
+}
+
+void pcm_eval_window(struct pcm_program *prog, long first, long n, double *out)
+{
+	int m;
+
+	if (n < 1) {
+		for (m=0; m<prog->num_instances; m++) out[m] = NAN;
+		return;
+	}
+	load_slots(prog, first, n, 1);
+	run_block(prog, 1, out, 1, 0);
+}
+
+void pcm_free(struct pcm_program *prog)
+{
+	int m;
+
+	for (m=0; m<prog->num_instances; m++) free(prog->instance[m].name);
+	free(prog->instance);
+	free(prog->ops);
+	free(prog->slot);
+	free(prog->slot_of_series);
+	free(prog->slot_data);
+	free(prog->stack);
+	free(prog->scratch);
+	free(prog->deltas);
+	memset(prog, 0, sizeof(*prog));
+}
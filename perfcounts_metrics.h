@@ -0,0 +1,92 @@
+// Derived metrics: formulas over the counter series, compiled once and evaluated over sample intervals
+// (perfcounts_metrics.c)
+//
+// A metrics file (e.g., perfcounts.metrics) defines one metric per line, "name = expression", with "#" starting
+// a comment:
+//
+//   ghz[l] = aperf[l] / mperf[l] * TSC_ratio / 10
+//   dram_rd_GBs[s] = sum(imc_counts[s][*]["CAS_COUNT.READS"]) * 64 / dt / 1e9
+//
+// A series name, as written in the Lua output (core_fixed_counts[12]["Inst_Retired.Any"]), stands for the
+// wrap-corrected delta of the series over the interval, times its scale; last(series) is its value at the end of
+// the interval (for gauges such as pkg_temperature).  A subscript is a number, a string, "*" (every value,
+// inside sum(), avg(), or count()), or an index variable.  A metric has one instance for each value of its index
+// variables (0, 1, ... up to the first value with no instance) for which all of its names resolve, named e.g.
+// dram_rd_GBs[1]; each index variable of the left side must be used on the right side.  A name without
+// subscripts is a metric defined above, a series (tsc), "dt" (the seconds of the interval, from tsc and
+// TSC_ratio), or a constant of the results file (TSC_ratio, nr_cpus, RAPL_PKG_ENERGY_UNIT,
+// RAPL_DRAM_ENERGY_UNIT, RAPL_TIME_UNIT).  Earlier metrics are referenced like series, e.g.,
+// sum(dram_rd_GBs[*]).  The operators are + - * / and min(a,b), max(a,b), in IEEE double (so a ratio of two zero
+// deltas is nan).
+//
+// pcm_compile() resolves the names against a pcm_source -- the series of a results file (pcl_metrics_source()
+// in perfcounts_load.c) or the sample store of perf_counters -- and compiles each instance to a stack program.
+// A metric whose names do not resolve for any value of its index variables is skipped with a warning, so one
+// file serves systems with different events.  pcm_eval() evaluates every instance over "n" intervals from
+// sample "first" (into out[instance * n + interval]), PCM_BLOCK intervals at a time: the deltas of each series
+// are computed by perfcounts_delta.c, and each operation is one loop over the block.  pcm_eval_window()
+// evaluates them once over the whole window (the deltas summed over the n intervals), which is the average
+// that is meaningful for ratios such as IPC.
+//
+#include <stdint.h>
+
+#define PCM_BLOCK 256
+#define PCM_MAX_VARS 4
+#define PCM_MAX_INDEX 4096
+
+struct pcm_source {
+	void *ctx;
+	int num_series;
+	const char *(*series_name)(void *ctx, int series);
+	int (*find_series)(void *ctx, const char *name);				// -1 if not found
+	int (*series_width)(void *ctx, int series);
+	double (*series_scale)(void *ctx, int series);
+	int (*constant)(void *ctx, const char *name, double *value);	// 0 if the constant is defined
+	// count+1 consecutive values of a series from sample "first": a pointer to the caller's data, or to
+	// "scratch" (room for count+1 values) filled by the callback
+	const uint64_t *(*values)(void *ctx, int series, long first, long count, uint64_t *scratch);
+};
+
+enum pcm_opcode { PCM_DELTA, PCM_LAST, PCM_CONST, PCM_METRIC, PCM_ADD, PCM_SUB, PCM_MUL, PCM_DIV, PCM_NEG, PCM_MIN, PCM_MAX };
+
+struct pcm_op {
+	int code;
+	int arg;					// input slot (PCM_DELTA, PCM_LAST) or instance (PCM_METRIC)
+	double value;				// PCM_CONST
+};
+
+struct pcm_slot {				// an input of the programs: one series, as a delta or as its last value
+	int series;
+	int last;					// 1: the value at the end of the interval, 0: the delta over the interval
+	int width;
+	double scale;
+};
+
+struct pcm_instance {
+	char *name;					// e.g., dram_rd_GBs[1]
+	int metric;					// index of the definition (the line order of the file)
+	int first_op, num_ops;
+};
+
+struct pcm_program {
+	struct pcm_source *source;
+	struct pcm_instance *instance;
+	int num_instances, max_instances;
+	int num_metrics;
+	struct pcm_op *ops;
+	int num_ops, max_ops;
+	struct pcm_slot *slot;
+	int num_slots, max_slots;
+	int *slot_of_series;		// [2 * series + last]: slot, or -1
+	int max_depth;
+	double tsc_hz;
+	double *slot_data;			// [slot][PCM_BLOCK]
+	double *stack;				// [max_depth][PCM_BLOCK]
+	uint64_t *scratch, *deltas;
+	long scratch_len;
+};
+
+int pcm_compile(struct pcm_program *prog, const char *path, struct pcm_source *source);	// 0, or -1 (message on stderr)
+void pcm_eval(struct pcm_program *prog, long first, long n, double *out);
+void pcm_eval_window(struct pcm_program *prog, long first, long n, double *out);		// out[instance]
+void pcm_free(struct pcm_program *prog);
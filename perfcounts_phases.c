@@ -0,0 +1,283 @@
+// Phase detection: change points in a few derived rates, found incrementally -- see perfcounts_phases.h
+//
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "perfcounts_phases.h"
+
+// the mean absolute difference of consecutive values is 2/sqrt(pi) = 1.128 times the standard deviation
+#define ABS_DIFF_PER_SIGMA 1.128
+
+void pph_init(struct pph_detector *d, int num_signals)
+{
+	memset(d, 0, sizeof(*d));
+	if (num_signals > PPH_MAX_SIGNALS) num_signals = PPH_MAX_SIGNALS;
+	d->num_signals = num_signals;
+	d->threshold = PPH_THRESHOLD;
+	d->drift = PPH_DRIFT;
+	d->min_change = PPH_MIN_CHANGE;
+	d->min_intervals = PPH_MIN_INTERVALS;
+}
+
+void pph_free(struct pph_detector *d)
+{
+	free(d->phase);
+	d->phase = NULL;
+	d->num_phases = d->max_phases = 0;
+}
+
+const char *pph_label(int label, char *buf)
+{
+	char tmp[8];
+	int n = 0, k = 0;
+
+	do {
+		tmp[n++] = 'A' + label % 26;
+		label = label / 26 - 1;
+	} while ((label >= 0) && (n < 7));
+	while (n > 0) buf[k++] = tmp[--n];
+	buf[k] = '\0';
+	return (buf);
+}
+
+// the noise of signal s in the current phase, at least min_change/3 of its level
+static double scale(const struct pph_detector *d, int s)
+{
+	double level, sigma;
+
+	level = fmax(fabs(d->mean[s]), 0.01 * d->peak[s]);
+	sigma = d->noise[s] / ABS_DIFF_PER_SIGMA;
+	return (fmax(fmax(sigma, d->min_change * level / 3.0), 1.0e-300));
+}
+
+// starts an empty phase at interval "start"
+static void start_phase(struct pph_detector *d, long start)
+{
+	int s;
+
+	d->start = start;
+	d->n = 0;
+	d->seconds = 0.0;
+	for (s=0; s<d->num_signals; s++) {
+		d->sum[s] = d->weight[s] = d->mean[s] = d->noise[s] = 0.0;
+		d->count[s] = d->noise_count[s] = 0;
+		d->up[s] = d->down[s] = 0.0;
+		d->up_start[s] = d->down_start[s] = start;
+	}
+}
+
+// adds one interval to the current phase
+static void add_interval(struct pph_detector *d, const double *value, double dt)
+{
+	double x, diff;
+	int s;
+
+	d->n++;
+	d->seconds += dt;
+	for (s=0; s<d->num_signals; s++) {
+		x = value[s];
+		if (!isfinite(x)) continue;
+		d->sum[s] += x * dt;
+		d->weight[s] += dt;
+		if (d->count[s] > 0) {
+			// (winsorized, so a jump does not count as noise)
+			diff = fmin(fabs(x - d->previous[s]), 4.0 * ABS_DIFF_PER_SIGMA * scale(d, s));
+			d->noise_count[s]++;
+			d->noise[s] += (diff - d->noise[s]) / d->noise_count[s];
+		}
+		d->previous[s] = x;
+		d->count[s]++;
+		if (d->count[s] > d->min_intervals) {
+			// (winsorized, so a single outlier does not move the baseline of the CUSUMs)
+			x = fmax(fmin(x, d->mean[s] + 4.0 * scale(d, s)), d->mean[s] - 4.0 * scale(d, s));
+		}
+		d->mean[s] += (x - d->mean[s]) / d->count[s];
+	}
+}
+
+static int similar(const struct pph_detector *d, const double *a, const double *b)
+{
+	int s;
+
+	for (s=0; s<d->num_signals; s++) {
+		if (isnan(a[s]) && isnan(b[s])) continue;
+		if (isnan(a[s]) || isnan(b[s])) return (0);
+		if (fabs(a[s] - b[s]) > d->min_change * fmax(fmax(fabs(a[s]), fabs(b[s])), 0.01 * d->peak[s])) return (0);
+	}
+	return (1);
+}
+
+// closes the current phase at interval "last", without the intervals after it (which are in the history)
+static void close_phase(struct pph_detector *d, long last)
+{
+	struct pph_phase *p;
+	double x, dt;
+	long i;
+	int s, j;
+
+	for (i=last+1; i<d->next; i++) {
+		dt = d->history_dt[i % PPH_HISTORY];
+		d->seconds -= dt;
+		for (s=0; s<d->num_signals; s++) {
+			x = d->history[i % PPH_HISTORY][s];
+			if (!isfinite(x)) continue;
+			d->sum[s] -= x * dt;
+			d->weight[s] -= dt;
+		}
+	}
+	if (d->num_phases == d->max_phases) {
+		d->max_phases = d->max_phases ? 2 * d->max_phases : 64;
+		d->phase = realloc(d->phase, d->max_phases * sizeof(struct pph_phase));
+		if (d->phase == NULL) {
+			fprintf(stderr,"ERROR: unable to allocate %d phases\n",d->max_phases);
+			exit(1);
+		}
+	}
+	p = &d->phase[d->num_phases];
+	p->first = d->start;
+	p->last = last;
+	p->seconds = d->seconds;
+	for (s=0; s<d->num_signals; s++) p->mean[s] = (d->weight[s] > 0.0) ? d->sum[s] / d->weight[s] : NAN;
+	for (s=d->num_signals; s<PPH_MAX_SIGNALS; s++) p->mean[s] = NAN;
+	for (j=0; j<d->num_phases; j++) if (similar(d, d->phase[j].mean, p->mean)) break;
+	p->label = (j < d->num_phases) ? d->phase[j].label : d->num_labels++;
+	d->num_phases++;
+}
+
+// The run of a CUSUM can start a few intervals before the change, with noise that happened to go the same way.
+// Moves the change point forward while its first interval is closer to the mean of the phase before it than to
+// the mean of the intervals after it (in the noise units of each signal).
+static long refine_change(struct pph_detector *d, long change)
+{
+	double before_sum[PPH_MAX_SIGNALS], before_weight[PPH_MAX_SIGNALS], after_sum[PPH_MAX_SIGNALS];
+	double after_weight[PPH_MAX_SIGNALS], x, dt, sigma, to_before, to_after;
+	long i;
+	int s;
+
+	for (s=0; s<d->num_signals; s++) {
+		before_sum[s] = d->sum[s];
+		before_weight[s] = d->weight[s];
+		after_sum[s] = after_weight[s] = 0.0;
+	}
+	for (i=change; i<d->next; i++) {
+		dt = d->history_dt[i % PPH_HISTORY];
+		for (s=0; s<d->num_signals; s++) {
+			x = d->history[i % PPH_HISTORY][s];
+			if (!isfinite(x)) continue;
+			before_sum[s] -= x * dt;
+			before_weight[s] -= dt;
+			after_sum[s] += x * dt;
+			after_weight[s] += dt;
+		}
+	}
+	for (; change<d->next-1; change++) {
+		dt = d->history_dt[change % PPH_HISTORY];
+		to_before = to_after = 0.0;
+		for (s=0; s<d->num_signals; s++) {
+			x = d->history[change % PPH_HISTORY][s];
+			if (!isfinite(x)) continue;
+			after_sum[s] -= x * dt;
+			after_weight[s] -= dt;
+			if ((before_weight[s] <= 0.0) || (after_weight[s] <= 0.0)) continue;
+			sigma = scale(d, s);
+			to_before += pow((x - before_sum[s] / before_weight[s]) / sigma, 2);
+			to_after += pow((x - after_sum[s] / after_weight[s]) / sigma, 2);
+		}
+		if (to_after <= to_before) break;
+		for (s=0; s<d->num_signals; s++) {
+			x = d->history[change % PPH_HISTORY][s];
+			if (!isfinite(x)) continue;
+			before_sum[s] += x * dt;
+			before_weight[s] += dt;
+		}
+	}
+	return (change);
+}
+
+int pph_add(struct pph_detector *d, const double *value, double dt)
+{
+	double x, z, limit, best;
+	long i, change;
+	int s;
+
+	i = d->next++;
+	memcpy(d->history[i % PPH_HISTORY], value, d->num_signals * sizeof(double));
+	d->history_dt[i % PPH_HISTORY] = dt;
+	for (s=0; s<d->num_signals; s++) if (isfinite(value[s])) d->peak[s] = fmax(d->peak[s], fabs(value[s]));
+
+	// the CUSUMs, against the phase before this interval (a single outlier adds at most threshold/2 - drift, so
+	// a change has to last at least 3 intervals)
+	change = -1;
+	best = d->threshold;
+	limit = 0.5 * d->threshold;
+	for (s=0; s<d->num_signals; s++) {
+		x = value[s];
+		if ((d->n < d->min_intervals) || !isfinite(x)) {
+			if (d->up[s] == 0.0) d->up_start[s] = i + 1;
+			if (d->down[s] == 0.0) d->down_start[s] = i + 1;
+			continue;
+		}
+		z = fmax(fmin((x - d->mean[s]) / scale(d, s), limit), -limit);
+		d->up[s] = fmax(0.0, d->up[s] + z - d->drift);
+		d->down[s] = fmax(0.0, d->down[s] - z - d->drift);
+		if (d->up[s] == 0.0) d->up_start[s] = i + 1;
+		if (d->down[s] == 0.0) d->down_start[s] = i + 1;
+		if (d->up[s] > best) {
+			best = d->up[s];
+			change = d->up_start[s];
+		}
+		if (d->down[s] > best) {
+			best = d->down[s];
+			change = d->down_start[s];
+		}
+	}
+	add_interval(d, value, dt);
+	if (change < 0) return (0);
+
+	// the next phase starts at the change point, with the intervals since then
+	if (change <= d->start) change = d->start + 1;
+	if (change < d->next - PPH_HISTORY) change = d->next - PPH_HISTORY;
+	change = refine_change(d, change);
+	close_phase(d, change - 1);
+	start_phase(d, change);
+	for (i=change; i<d->next; i++) add_interval(d, d->history[i % PPH_HISTORY], d->history_dt[i % PPH_HISTORY]);
+	return (1);
+}
+
+void pph_finish(struct pph_detector *d)
+{
+	if (d->n == 0) return;
+	close_phase(d, d->next - 1);
+	start_phase(d, d->next);
+}
+
+static void put_number(FILE *fp, double x)
+{
+	if (isfinite(x)) fprintf(fp,"%.6g",x);
+	else fprintf(fp,"0/0");
+}
+
+// the closed phases as Lua, with the sample numbers of a results file whose interval 0 starts at "first_sample"
+void pph_write(FILE *fp, const struct pph_detector *d, const char **signal_name, long first_sample)
+{
+	const struct pph_phase *p;
+	char label[8];
+	int k, s;
+
+	fprintf(fp,"phase_signals = {");
+	for (s=0; s<d->num_signals; s++) fprintf(fp,"%s\"%s\"",(s > 0) ? ", " : "",signal_name[s]);
+	fprintf(fp,"}\n");
+	fprintf(fp,"phases = {}\n");
+	for (k=0; k<d->num_phases; k++) {
+		p = &d->phase[k];
+		fprintf(fp,"phases[%d] = { label = \"%s\", first_sample = %ld, last_sample = %ld, seconds = %.3f, mean = {",
+			k+1,pph_label(p->label, label),first_sample+p->first,first_sample+p->last+1,p->seconds);
+		for (s=0; s<d->num_signals; s++) {
+			if (s > 0) fprintf(fp,", ");
+			put_number(fp, p->mean[s]);
+		}
+		fprintf(fp,"} }\n");
+	}
+}
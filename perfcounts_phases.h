@@ -0,0 +1,67 @@
+// Phase detection: change points in a few derived rates, found incrementally (perfcounts_phases.c)
+//
+// A pph_detector is given one vector of signal values per sample interval (e.g., node_ipc, node_dram_GBs,
+// node_watts from a metrics file) and splits the run into phases of steady behavior.  Each signal has a two-sided
+// CUSUM of its deviation from the mean of the current phase, in units of its noise: the mean absolute difference
+// of consecutive values (winsorized, so the jump at a change point does not inflate it), but at least
+// "min_change" / 3 of the phase's level.  With the default drift and threshold, a change of min_change (10%) of
+// the level is found after 4 intervals, a change of a third of that is never found, and stationary noise gives
+// no false changes in practice.  Each step of a CUSUM is limited to threshold/2, so a single outlier is not a
+// change.  When a CUSUM passes "threshold", the change point is the last interval where it was zero, moved
+// forward past the intervals that are closer to the old phase, and the intervals since then (kept in a ring of
+// PPH_HISTORY intervals) start the next phase.  No change is detected in the first "min_intervals" intervals of
+// a phase.
+//
+// A phase closed by pph_add() or pph_finish() gets the time-weighted mean of each signal, and a label: the label
+// of the first earlier phase whose means are all within min_change of its own, or a new one (A, B, ..., Z, AA,
+// AB, ...).  So the iterations of an application that alternate between compute and communication show up as
+// A B A B ...  Each update is O(number of signals), and the memory is fixed apart from the list of phases.
+//
+#include <stdio.h>
+
+#define PPH_MAX_SIGNALS 8
+#define PPH_HISTORY 64
+#define PPH_THRESHOLD 8.0
+#define PPH_DRIFT 1.0
+#define PPH_MIN_CHANGE 0.1
+#define PPH_MIN_INTERVALS 3
+
+struct pph_phase {
+	long first, last;			// intervals: interval i is from sample i to sample i+1
+	double seconds;
+	int label;
+	double mean[PPH_MAX_SIGNALS];
+};
+
+struct pph_detector {
+	int num_signals;
+	double threshold, drift, min_change;
+	int min_intervals;
+	long next;					// the interval of the next pph_add()
+	double peak[PPH_MAX_SIGNALS];	// the largest |value| so far (the level of a signal near zero)
+	// the current phase
+	long start;
+	long n;
+	double seconds;
+	double sum[PPH_MAX_SIGNALS], weight[PPH_MAX_SIGNALS];	// time-weighted, without NaN values
+	double mean[PPH_MAX_SIGNALS];							// unweighted, the CUSUM baseline
+	long count[PPH_MAX_SIGNALS];
+	double noise[PPH_MAX_SIGNALS], previous[PPH_MAX_SIGNALS];
+	long noise_count[PPH_MAX_SIGNALS];
+	double up[PPH_MAX_SIGNALS], down[PPH_MAX_SIGNALS];
+	long up_start[PPH_MAX_SIGNALS], down_start[PPH_MAX_SIGNALS];
+	// the last PPH_HISTORY intervals
+	double history[PPH_HISTORY][PPH_MAX_SIGNALS];
+	double history_dt[PPH_HISTORY];
+	// the closed phases
+	struct pph_phase *phase;
+	int num_phases, max_phases;
+	int num_labels;
+};
+
+void pph_init(struct pph_detector *d, int num_signals);		// with the PPH_* defaults, which may then be changed
+int pph_add(struct pph_detector *d, const double *value, double dt);	// 1 if a phase was closed
+void pph_finish(struct pph_detector *d);		// closes the current phase (at the end of the run)
+void pph_free(struct pph_detector *d);
+const char *pph_label(int label, char *buf);	// "A", "B", ... (buf: 8 bytes)
+void pph_write(FILE *fp, const struct pph_detector *d, const char **signal_name, long first_sample);
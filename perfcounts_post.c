@@ -0,0 +1,451 @@
+// perfcounts_post -- summarize a perf_counters results file over a window of samples
+//
+//   perfcounts_post [-t threads] [-i] [-p] [-m metrics_file [-P metric,...]] host.perfcounts.lua [first_sample [last_sample]]
+//   perfcounts_post [-t threads] [-i] [-p] [-m metrics_file [-P metric,...]] host.perfcounts.pcb [first_sample [last_sample]]
+//
+// Computes the reports of Example/post_process.lua from the samples first_sample..last_sample (default: all):
+// the average frequency, fraction of time stalled (halted), and IPC of each logical processor, the cumulative
+// deltas of the fixed-function and programmable core counters, the RAPL package/DRAM power and throttling of
+// each socket, the cumulative CHA counts, and the DRAM bandwidth and page hit/miss/conflict rates of each socket.
+// "-p" adds the per-sample power and memory bandwidth tables (report_power and showbandwidth in the Lua script).
+// "-m" adds the derived metrics of a metrics file (e.g., perfcounts.metrics, see perfcounts_metrics.h) over the
+// window, and with "-p" for each sample.  "-P" splits the window into phases by the change points of some of these
+// metrics (e.g., -P node_ipc,node_dram_GBs,node_watts), with the detector of perf_counters -P (perfcounts_phases.c),
+// and prints each phase: its label, first and last sample, length, and each metric over the phase (from the
+// deltas summed over the phase, as for the window).
+//
+// The file is loaded by pcl_load() (perfcounts_load.c) with "threads" threads (default: one per online CPU),
+// keeping only the samples of the window.  Every delta is wrap-corrected for the width of its counter (as in
+// perf_counters), and the totals of the window are computed by the vector kernels of perfcounts_delta.c.
+// The socket and thread context of each logical processor come from the .pcb file or from topology.h, which has
+// block numbering (the second socket after all of the cores of the first).  "-i" uses the interleaved numbering
+// of Example/post_process.lua instead, lproc = 2*localcore + socket + 48*thread on the example system, for the
+// files of nodes numbered that way, e.g., Example/c591-803.perfcounts.lua.
+//
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+
+#include "perfcounts_load.h"
+#include "perfcounts_phases.h"
+
+#define MAX_SOCKETS 8
+#define MAX_IMC_CHANNELS 16
+
+struct pcl_file file;
+int num_threads;
+int interleaved;
+int per_sample_tables;
+char *metrics_path;
+char *phase_spec;
+int num_sockets;
+
+// series of the reports, -1 where the results file does not have them
+int tsc_series;
+int (*fixed_series)[3];						// [lproc][Inst_Retired.Any, CPU_CLK_Unhalted.Core, CPU_CLK_Unhalted.Ref]
+int rapl_series[MAX_SOCKETS][3];			// rapl_pkg_energy, rapl_dram_energy, rapl_pkg_throttled
+int pkg_temperature_series[MAX_SOCKETS];
+int imc_series[MAX_SOCKETS][MAX_IMC_CHANNELS][4];	// CAS_COUNT.READS, CAS_COUNT.WRITES, ACT.ALL, PRE_COUNT.MISS
+static const char *fixed_event[3] = { "Inst_Retired.Any", "CPU_CLK_Unhalted.Core", "CPU_CLK_Unhalted.Ref" };
+static const char *imc_event[4] = { "CAS_COUNT.READS", "CAS_COUNT.WRITES", "ACT.ALL", "PRE_COUNT.MISS" };
+
+double seconds_now()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (ts.tv_sec + 1.0e-9 * ts.tv_nsec);
+}
+
+// ==================================================================================================================
+// Reports
+
+// finds the series used by the reports
+void classify_series()
+{
+	char event[256];
+	unsigned a, b;
+	int s, k, n, lproc;
+
+	fixed_series = malloc(file.nr_cpus * sizeof(*fixed_series));
+	memset(fixed_series, -1, file.nr_cpus * sizeof(*fixed_series));
+	memset(rapl_series, -1, sizeof(rapl_series));
+	memset(pkg_temperature_series, -1, sizeof(pkg_temperature_series));
+	memset(imc_series, -1, sizeof(imc_series));
+	tsc_series = -1;
+	num_sockets = 1;
+	for (lproc=0; lproc<file.nr_cpus; lproc++) {
+		if (pcl_lproc_socket(&file, lproc) >= num_sockets) num_sockets = pcl_lproc_socket(&file, lproc) + 1;
+	}
+	for (s=0; s<file.num_series; s++) {
+		n = 0;
+		if (strcmp(file.series[s].name, "tsc") == 0) {
+			tsc_series = s;
+		} else if ((sscanf(file.series[s].name, "core_fixed_counts[%u][\"%255[^\"]\"]%n", &a, event, &n) == 2) && n && (a < (unsigned)file.nr_cpus)) {
+			for (k=0; k<3; k++) if (strcmp(event, fixed_event[k]) == 0) fixed_series[a][k] = s;
+		} else if ((sscanf(file.series[s].name, "imc_counts[%u][%u][\"%255[^\"]\"]%n", &a, &b, event, &n) == 3) && n
+				&& (a < MAX_SOCKETS) && (b < MAX_IMC_CHANNELS)) {
+			for (k=0; k<4; k++) if (strcmp(event, imc_event[k]) == 0) imc_series[a][b][k] = s;
+			if ((int)a >= num_sockets) num_sockets = a + 1;
+		} else if ((sscanf(file.series[s].name, "rapl_pkg_energy[%u]%n", &a, &n) == 1) && n && (a < MAX_SOCKETS)) {
+			rapl_series[a][0] = s;
+		} else if ((sscanf(file.series[s].name, "rapl_dram_energy[%u]%n", &a, &n) == 1) && n && (a < MAX_SOCKETS)) {
+			rapl_series[a][1] = s;
+		} else if ((sscanf(file.series[s].name, "rapl_pkg_throttled[%u]%n", &a, &n) == 1) && n && (a < MAX_SOCKETS)) {
+			rapl_series[a][2] = s;
+		} else if ((sscanf(file.series[s].name, "pkg_temperature[%u]%n", &a, &n) == 1) && n && (a < MAX_SOCKETS)) {
+			pkg_temperature_series[a] = s;
+		}
+	}
+	if (num_sockets > MAX_SOCKETS) num_sockets = MAX_SOCKETS;
+	if (tsc_series < 0) {
+		fprintf(stderr,"ERROR: the results file has no tsc series\n");
+		exit(1);
+	}
+	if (file.tsc_ghz == 0.0) {
+		fprintf(stderr,"ERROR: the results file has no TSC frequency (TSC_ratio)\n");
+		exit(1);
+	}
+}
+
+// frequency, fraction of the time halted, and IPC of each logical processor, as in post_process.lua
+void report_lprocs()
+{
+	uint64_t delta_tsc, delta_inst, delta_core, delta_ref, sum;
+	double avg_ghz, fraction_stalled, ipc;
+	int socket, thread, lproc, k, max_thread;
+
+	delta_tsc = file.series[tsc_series].total;
+	max_thread = 0;
+	for (lproc=0; lproc<file.nr_cpus; lproc++) if (pcl_lproc_thread(&file, lproc) > max_thread) max_thread = pcl_lproc_thread(&file, lproc);
+	printf("======================================================\n");
+	printf("Total Fixed Function Counts by LPROC from sample %ld to sample %ld\n",file.first_sample,file.last_sample);
+	printf("socket thread lproc AvgGHz FracStalled IPC\n");
+	for (socket=0; socket<num_sockets; socket++) {
+		for (thread=0; thread<=max_thread; thread++) {
+			for (lproc=0; lproc<file.nr_cpus; lproc++) {
+				if ((pcl_lproc_socket(&file, lproc) != socket) || (pcl_lproc_thread(&file, lproc) != thread)) continue;
+				if ((fixed_series[lproc][0] < 0) || (fixed_series[lproc][1] < 0) || (fixed_series[lproc][2] < 0)) continue;
+				delta_inst = file.series[fixed_series[lproc][0]].total;
+				delta_core = file.series[fixed_series[lproc][1]].total;
+				delta_ref = file.series[fixed_series[lproc][2]].total;
+				avg_ghz = (double)delta_core / delta_ref * file.tsc_ghz;
+				fraction_stalled = 1.0 - (double)delta_ref / delta_tsc;
+				ipc = (double)delta_inst / delta_core;
+				if (fraction_stalled < 0.0) fraction_stalled = 0.0;
+				printf("%d %d %d %.3f %.3f %.3f\n",socket,thread,lproc,avg_ghz,fraction_stalled,ipc);
+			}
+		}
+	}
+	printf("======================================================\n");
+	printf("=========== Fixed-Function Core Counter Cumulative Deltas for samples %ld to %ld =============\n",
+		file.first_sample,file.last_sample);
+	for (lproc=0; lproc<file.nr_cpus; lproc++) {
+		for (k=0; k<3; k++) {
+			if (fixed_series[lproc][k] < 0) continue;
+			printf("Lproc %d Elapsed_TSC %lu Event %s TotalDelta %lu\n",lproc,delta_tsc,fixed_event[k],
+				file.series[fixed_series[lproc][k]].total);
+		}
+	}
+	printf("=========== Fixed-Function Core Counter Per Socket Cumulative Deltas =============\n");
+	for (k=0; k<3; k++) {
+		sum = 0;
+		for (lproc=0; lproc<file.nr_cpus; lproc++) if (fixed_series[lproc][k] >= 0) sum += file.series[fixed_series[lproc][k]].total;
+		printf("Elapsed_TSC %lu Event %s AllCoreDelta %lu\n",delta_tsc,fixed_event[k],sum);
+	}
+}
+
+// cumulative deltas of the programmable core counters and of the CHA counters
+void report_counters()
+{
+	char event[256];
+	unsigned a, b;
+	int s, n;
+
+	printf("=========== Programmable Core Counter Cumulative Deltas =============\n");
+	for (s=0; s<file.num_series; s++) {
+		n = 0;
+		if ((sscanf(file.series[s].name, "core_counts[%u][\"%255[^\"]\"]%n", &a, event, &n) == 2) && n) {
+			printf("LogicalProcessor %u Elapsed_TSC %lu Event %s TotalDelta %lu\n",a,file.series[tsc_series].total,event,file.series[s].total);
+		}
+	}
+	printf("Cumulative CHA counts from sample %ld to sample %ld\n",file.first_sample,file.last_sample);
+	for (s=0; s<file.num_series; s++) {
+		n = 0;
+		if ((sscanf(file.series[s].name, "cha_counts[%u][%u][\"%255[^\"]\"]%n", &a, &b, event, &n) == 3) && n) {
+			printf("Socket %u cha %u Event %s TotalDelta %lu\n",a,b,event,file.series[s].total);
+		}
+	}
+}
+
+// RAPL package and DRAM energy/power and package throttling of each socket over the window
+void report_power()
+{
+	double seconds, pkg_joules, dram_joules, throttled_seconds;
+	int socket;
+
+	seconds = file.series[tsc_series].total / (file.tsc_ghz * 1.0e9);
+	printf("======================================================\n");
+	printf("Power and Throttling by socket from sample %ld to sample %ld (%.3f seconds)\n",file.first_sample,file.last_sample,seconds);
+	printf("Socket  Package  Package    DRAM    DRAM   Throttled  Fraction\n");
+	printf("number  Joules   Watts     Joules  Watts    seconds   Throttled\n");
+	for (socket=0; socket<num_sockets; socket++) {
+		if ((rapl_series[socket][0] < 0) || (rapl_series[socket][1] < 0) || (rapl_series[socket][2] < 0)) continue;
+		pkg_joules = file.series[rapl_series[socket][0]].total * file.pkg_energy_unit;
+		dram_joules = file.series[rapl_series[socket][1]].total * file.dram_energy_unit;
+		throttled_seconds = file.series[rapl_series[socket][2]].total * file.time_unit;
+		printf("%5d   %7.1f %7.1f   %7.1f %7.1f   %8.3f %8.3f\n",socket,pkg_joules,pkg_joules/seconds,
+			dram_joules,dram_joules/seconds,throttled_seconds,throttled_seconds/seconds);
+	}
+}
+
+// DRAM page hit/miss/conflict rates, CAS counts, and bandwidth of each socket over the window
+void report_dram()
+{
+	uint64_t socket_count[MAX_SOCKETS][4], global_count[4];
+	double cas, conflict_rate, miss_rate, seconds;
+	int socket, channel, k;
+
+	memset(socket_count, 0, sizeof(socket_count));
+	memset(global_count, 0, sizeof(global_count));
+	for (socket=0; socket<num_sockets; socket++) {
+		for (channel=0; channel<MAX_IMC_CHANNELS; channel++) {
+			for (k=0; k<4; k++) {
+				if (imc_series[socket][channel][k] < 0) continue;
+				socket_count[socket][k] += file.series[imc_series[socket][channel][k]].total;
+				global_count[k] += file.series[imc_series[socket][channel][k]].total;
+			}
+		}
+	}
+	printf("======================================================\n");
+	printf("Cumulative DRAM Stats from sample %ld to sample %ld\n",file.first_sample,file.last_sample);
+	printf("      Global        ");
+	for (socket=0; socket<num_sockets; socket++) printf("         Socket %d       ",socket);
+	printf("\n Hits  Misses Conflicts");
+	for (socket=0; socket<num_sockets; socket++) printf("   Hits Misses Conflicts");
+	printf("\n");
+	for (socket=-1; socket<num_sockets; socket++) {
+		uint64_t *count = (socket < 0) ? global_count : socket_count[socket];
+		cas = (double)(count[0] + count[1]);
+		conflict_rate = count[3] / cas;
+		miss_rate = ((double)count[2] - (double)count[3]) / cas;
+		printf("%6.3f %6.3f %6.3f    ",1.0 - miss_rate - conflict_rate,miss_rate,conflict_rate);
+		if (socket < 0) printf(" ");
+	}
+	printf("\n");
+	printf("======================================================\n");
+	for (socket=0; socket<num_sockets; socket++) printf("Socket %d IMC reads       %lu\n",socket,socket_count[socket][0]);
+	printf("Global IMC Reads %lu\n",global_count[0]);
+	for (socket=0; socket<num_sockets; socket++) printf("Socket %d IMC writes       %lu\n",socket,socket_count[socket][1]);
+	printf("Global IMC writes %lu\n",global_count[1]);
+	seconds = file.series[tsc_series].total / (file.tsc_ghz * 1.0e9);
+	for (socket=0; socket<num_sockets; socket++) {
+		printf("Socket %d IMC GB/s read %7.2f write %7.2f\n",socket,socket_count[socket][0]*64.0/seconds/1.0e9,
+			socket_count[socket][1]*64.0/seconds/1.0e9);
+	}
+	printf("Global IMC GB/s read %7.2f write %7.2f\n",global_count[0]*64.0/seconds/1.0e9,global_count[1]*64.0/seconds/1.0e9);
+}
+
+// per-sample power and memory bandwidth tables (report_power and showbandwidth in post_process.lua),
+// with the time from the first sample of the window
+void report_samples()
+{
+	uint64_t delta[4];
+	double time, delta_time, pkg_joules, dram_joules, throttled_seconds, cas;
+	long i;
+	int socket, channel, k;
+
+	printf("----------- Temperature, Power, Throttling by sample --------\n");
+	printf("Sample  Time    Socket  Package  Package  Package    DRAM    DRAM   Throttled  Fraction\n");
+	printf("number  (sec)   number  Temp(C)  Joules   Watts     Joules  Watts    seconds   Throttled\n");
+	for (i=1; i<file.window_samples; i++) {
+		time = (file.series[tsc_series].values[i] - file.series[tsc_series].values[0]) / (file.tsc_ghz * 1.0e9);
+		delta_time = pcl_delta(&file, tsc_series, i) / (file.tsc_ghz * 1.0e9);
+		for (socket=0; socket<num_sockets; socket++) {
+			if ((rapl_series[socket][0] < 0) || (rapl_series[socket][1] < 0) || (rapl_series[socket][2] < 0)) continue;
+			pkg_joules = pcl_delta(&file, rapl_series[socket][0], i) * file.pkg_energy_unit;
+			dram_joules = pcl_delta(&file, rapl_series[socket][1], i) * file.dram_energy_unit;
+			throttled_seconds = pcl_delta(&file, rapl_series[socket][2], i) * file.time_unit;
+			printf("%4ld %8.3f %5d  %7ld   %7.1f %7.1f   %7.1f %7.1f   %8.3f %8.3f\n",file.first_sample+i,time,socket,
+				(pkg_temperature_series[socket] >= 0) ? (long)file.series[pkg_temperature_series[socket]].values[i] : 0L,
+				pkg_joules,pkg_joules/delta_time,dram_joules,dram_joules/delta_time,throttled_seconds,throttled_seconds/delta_time);
+		}
+	}
+	printf("======================================================\n");
+	printf("Time Series of Memory BW (GB/s) from IMC units.\n");
+	for (socket=0; socket<num_sockets; socket++) {
+		printf("--- Socket %d:\n",socket);
+		printf("#   Time(s)        IMC RD/WR GB/s  (%%Hit/%%Miss/%%Conf)\n");
+		for (i=1; i<file.window_samples; i++) {
+			time = (file.series[tsc_series].values[i] - file.series[tsc_series].values[0]) / (file.tsc_ghz * 1.0e9);
+			delta_time = pcl_delta(&file, tsc_series, i) / (file.tsc_ghz * 1.0e9);
+			memset(delta, 0, sizeof(delta));
+			for (channel=0; channel<MAX_IMC_CHANNELS; channel++) {
+				for (k=0; k<4; k++) if (imc_series[socket][channel][k] >= 0) delta[k] += pcl_delta(&file, imc_series[socket][channel][k], i);
+			}
+			cas = (double)(delta[0] + delta[1]);
+			printf("%ld %8.3f       %7.2f %7.2f   (%5.1f/%5.1f/%5.1f)\n",file.first_sample+i,time,
+				delta[0]*64.0/delta_time/1.0e9,delta[1]*64.0/delta_time/1.0e9,
+				100.0*(1.0 - ((double)delta[2] - (double)delta[3])/cas - delta[3]/cas),
+				100.0*((double)delta[2] - (double)delta[3])/cas,100.0*delta[3]/cas);
+		}
+	}
+	printf("======================================================\n");
+}
+
+// derived metrics over the window (the deltas summed over the window), and with -p for each sample
+void report_metrics()
+{
+	struct pcm_source source;
+	struct pcm_program prog;
+	double *value;
+	long n, i;
+	int m;
+
+	pcl_metrics_source(&file, &source);
+	if (pcm_compile(&prog, metrics_path, &source) != 0) exit(1);
+	n = file.window_samples - 1;
+	value = malloc(prog.num_instances * ((n > 1) ? n : 1) * sizeof(double));
+	pcm_eval_window(&prog, 0, n, value);
+	printf("Derived metrics of %s from sample %ld to sample %ld\n",metrics_path,file.first_sample,file.last_sample);
+	for (m=0; m<prog.num_instances; m++) printf("%-40s %14.4f\n",prog.instance[m].name,value[m]);
+	printf("======================================================\n");
+	if (per_sample_tables && (n > 0)) {
+		pcm_eval(&prog, 0, n, value);
+		printf("Derived metrics by sample\n");
+		printf("sample");
+		for (m=0; m<prog.num_instances; m++) printf(" %s",prog.instance[m].name);
+		printf("\n");
+		for (i=0; i<n; i++) {
+			printf("%ld",file.first_sample+i+1);
+			for (m=0; m<prog.num_instances; m++) printf(" %.4f",value[m*n + i]);
+			printf("\n");
+		}
+		printf("======================================================\n");
+	}
+	free(value);
+	pcm_free(&prog);
+}
+
+// the phases of the window, by the change points of the metrics of phase_spec
+void report_phases()
+{
+	struct pcm_source source;
+	struct pcm_program prog;
+	struct pph_detector phases;
+	struct pph_phase *p;
+	const char *signal_name[PPH_MAX_SIGNALS];
+	char *name, label[8];
+	double *value, *window, x[PPH_MAX_SIGNALS];
+	int signal_instance[PPH_MAX_SIGNALS], k, m;
+	long n, i;
+
+	pcl_metrics_source(&file, &source);
+	if (pcm_compile(&prog, metrics_path, &source) != 0) exit(1);
+	pph_init(&phases, 0);
+	for (name=strtok(phase_spec, ","), k=0; name!=NULL; name=strtok(NULL, ",")) {
+		for (m=0; m<prog.num_instances; m++) if (strcmp(prog.instance[m].name, name) == 0) break;
+		if ((m == prog.num_instances) || (k == PPH_MAX_SIGNALS)) {
+			fprintf(stderr,"ERROR: -P: %s is not a metric of %s, or more than %d metrics\n",name,metrics_path,PPH_MAX_SIGNALS);
+			exit(1);
+		}
+		signal_name[k] = prog.instance[m].name;
+		signal_instance[k++] = m;
+	}
+	phases.num_signals = k;
+	n = file.window_samples - 1;
+	if ((n < 1) || (tsc_series < 0)) {
+		pcm_free(&prog);
+		return;
+	}
+	value = malloc(prog.num_instances * n * sizeof(double));
+	window = malloc(prog.num_instances * sizeof(double));
+	pcm_eval(&prog, 0, n, value);
+	for (i=0; i<n; i++) {
+		for (k=0; k<phases.num_signals; k++) x[k] = value[signal_instance[k]*n + i];
+		pph_add(&phases, x, pcl_delta(&file, tsc_series, i+1) / (file.tsc_ghz * 1.0e9));
+	}
+	pph_finish(&phases);
+
+	printf("Phases from sample %ld to sample %ld (%d phases, %d labels)\n",file.first_sample,file.last_sample,
+		phases.num_phases,phases.num_labels);
+	printf("label  first   last   seconds");
+	for (k=0; k<phases.num_signals; k++) printf(" %14s",signal_name[k]);
+	printf("\n");
+	for (i=0; i<phases.num_phases; i++) {
+		p = &phases.phase[i];
+		printf("%-5s %6ld %6ld %9.3f",pph_label(p->label, label),file.first_sample+p->first,file.first_sample+p->last+1,p->seconds);
+		pcm_eval_window(&prog, p->first, p->last - p->first + 1, window);
+		for (k=0; k<phases.num_signals; k++) printf(" %14.4f",window[signal_instance[k]]);
+		printf("\n");
+	}
+	printf("======================================================\n");
+	free(value);
+	free(window);
+	pph_free(&phases);
+	pcm_free(&prog);
+}
+
+int main(int argc, char *argv[])
+{
+	double t_start, t_loaded;
+	long first, last;
+	int c;
+
+	num_threads = sysconf(_SC_NPROCESSORS_ONLN);
+	while ((c = getopt(argc, argv, "t:ipm:P:")) != -1) {
+		switch (c) {
+			case 't':
+				num_threads = atoi(optarg);
+				break;
+			case 'i':
+				interleaved = 1;
+				break;
+			case 'p':
+				per_sample_tables = 1;
+				break;
+			case 'm':
+				metrics_path = optarg;
+				break;
+			case 'P':
+				phase_spec = optarg;
+				break;
+			default:
+				fprintf(stderr,"Usage: %s [-t threads] [-i] [-p] [-m metrics_file [-P metric,...]] results_file [first_sample [last_sample]]\n",argv[0]);
+				exit(1);
+		}
+	}
+	if ((argc - optind < 1) || (argc - optind > 3)) {
+		fprintf(stderr,"Usage: %s [-t threads] [-i] [-p] [-m metrics_file [-P metric,...]] results_file [first_sample [last_sample]]\n",argv[0]);
+		exit(1);
+	}
+	if ((phase_spec != NULL) && (metrics_path == NULL)) {
+		fprintf(stderr,"ERROR: -P detects phases in the metrics of -m metrics_file\n");
+		exit(1);
+	}
+	if (num_threads < 1) num_threads = 1;
+	if (num_threads > PCL_MAX_THREADS) num_threads = PCL_MAX_THREADS;
+	first = (argc - optind > 1) ? atol(argv[optind+1]) : -1;
+	last = (argc - optind > 2) ? atol(argv[optind+2]) : -1;
+
+	t_start = seconds_now();
+	if (pcl_load(&file, argv[optind], first, last, num_threads, NULL) != 0) exit(1);
+	file.interleaved = interleaved;
+	classify_series();
+	pcl_totals(&file);
+	t_loaded = seconds_now();
+
+	printf("Sample range is %ld to %ld\n",file.first_sample,file.last_sample);
+	report_lprocs();
+	report_counters();
+	report_power();
+	report_dram();
+	if (per_sample_tables) report_samples();
+	if (metrics_path != NULL) report_metrics();
+	if (phase_spec != NULL) report_phases();
+	fprintf(stderr,"INFO: %d series, samples %ld to %ld of %s, loaded in %.3f seconds with %d threads, total %.3f seconds\n",
+		file.num_series,file.first_sample,file.last_sample,argv[optind],t_loaded-t_start,num_threads,seconds_now()-t_start);
+	return (0);
+}
@@ -0,0 +1,123 @@
+// perfcounts_recover -- write the Lua results file of a perf_counters store file (see perfcounts_store.h)
+//
+//   perfcounts_recover host.perfcounts.store > host.perfcounts.lua
+//
+// Writes the beginning of the results file (units, etc.) and the lines of every committed sample, exactly as
+// perf_counters would have written them at the end of the run.  Used when the run was killed before writing
+// its results (the store file is removed at the end of a normal run).
+//
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "perfcounts_store.h"
+
+#define PMC_WIDTH_MASK ((1UL << 48) - 1)
+#define OUTPUT_BUFFER_BYTES (4*1024*1024)
+
+const uint8_t *base;
+size_t file_bytes;
+const struct pcs_header *header;
+
+// value of series "column" in sample i, or 0 if the file is too short
+uint64_t store_value(int column, long i)
+{
+	long chunk = i / header->chunk_samples;
+	long k = i % header->chunk_samples;
+	size_t offset;
+
+	if (header->layout == 1) {
+		offset = header->data_offset + chunk * header->chunk_bytes + (k * header->record_len + column) * sizeof(uint64_t);
+	} else {
+		offset = header->data_offset + chunk * header->chunk_bytes + ((long)column * header->chunk_samples + k) * sizeof(uint64_t);
+	}
+	if (offset + sizeof(uint64_t) > file_bytes) return (0);
+	return (*(const uint64_t *)(base + offset));
+}
+
+int main(int argc, char *argv[])
+{
+	const struct pcs_item *items, *item;
+	const char *strings;
+	struct stat st;
+	uint64_t *total;
+	uint64_t value;
+	long committed, available, i;
+	int fd, k;
+
+	if (argc != 2) {
+		fprintf(stderr,"Usage: %s host.perfcounts.store > host.perfcounts.lua\n",argv[0]);
+		exit(1);
+	}
+	fd = open(argv[1], O_RDONLY);
+	if ((fd == -1) || (fstat(fd, &st) != 0)) {
+		fprintf(stderr,"ERROR %s when trying to open %s\n",strerror(errno),argv[1]);
+		exit(1);
+	}
+	file_bytes = st.st_size;
+	if (file_bytes < sizeof(struct pcs_header)) {
+		fprintf(stderr,"ERROR: %s is too short to be a perf_counters store file\n",argv[1]);
+		exit(1);
+	}
+	base = mmap(NULL, file_bytes, PROT_READ, MAP_SHARED, fd, 0);
+	if (base == MAP_FAILED) {
+		fprintf(stderr,"ERROR %s when trying to mmap %s\n",strerror(errno),argv[1]);
+		exit(1);
+	}
+	header = (const struct pcs_header *)base;
+	if ((memcmp(header->magic, PCS_MAGIC, sizeof(header->magic)) != 0) || (header->version != PCS_VERSION)
+			|| (header->data_offset > file_bytes)) {
+		fprintf(stderr,"ERROR: %s is not a version %d perf_counters store file\n",argv[1],PCS_VERSION);
+		exit(1);
+	}
+	items = (const struct pcs_item *)(base + header->items_offset);
+	strings = (const char *)(base + header->strings_offset);
+	committed = header->committed;
+	// (only whole chunks can be in the file, but a chunk may have been cut short by a full disk)
+	available = (file_bytes - header->data_offset) / header->chunk_bytes * header->chunk_samples;
+	if (committed > available) {
+		fprintf(stderr,"WARNING: %ld samples were committed, but the file only holds %ld\n",committed,available);
+		committed = available;
+	}
+	total = calloc(header->num_totals + 1, sizeof(uint64_t));
+	if (total == NULL) exit(1);
+	setvbuf(stdout, NULL, _IOFBF, OUTPUT_BUFFER_BYTES);
+
+	fwrite(base + header->preamble_offset, 1, header->preamble_bytes, stdout);
+	for (i=0; i<committed; i++) {
+		for (k=0; k<(int)header->num_items; k++) {
+			item = &items[k];
+			switch (item->kind) {
+				case PCS_UNSIGNED:
+					printf("%s%ld] = %lu\n",strings+item->prefix,i,store_value(item->column,i)*item->scale);
+					break;
+				case PCS_SIGNED:
+					printf("%s%ld] = %ld\n",strings+item->prefix,i,store_value(item->column,i));
+					break;
+				case PCS_HEX:
+					printf("%s%ld] = 0x%lx\n",strings+item->prefix,i,store_value(item->column,i));
+					break;
+				case PCS_MUX_ADD:
+					value = item->total + store_value(item->group_column,i);
+					if ((i > 0) && (value < header->num_totals)) {
+						total[value] += (store_value(item->column,i) - store_value(item->column,i-1)) & PMC_WIDTH_MASK;
+					}
+					break;
+				case PCS_MUX_TOTAL:
+					printf("%s%ld] = %lu\n",strings+item->prefix,i,total[item->total]);
+					break;
+			}
+		}
+	}
+	fflush(stdout);
+	fprintf(stderr,"INFO: recovered %ld samples of %u series from %s%s\n",committed,header->num_series,argv[1],
+		header->complete ? " (the run completed normally)" : "");
+	munmap((void *)base, file_bytes);
+	close(fd);
+	return (0);
+}
@@ -0,0 +1,104 @@
+// Live shared-memory segment of perf_counters (POSIX shared memory "/perfcounts", "-L N" option)
+//
+// With -L N, perf_counters publishes each sample to a ring of the last N samples in a shared-memory segment,
+// so node health agents, job monitors and tools (perfcounts_top) can read the latest samples of a running
+// collection without polling the MSRs themselves.  A reader maps /dev/shm/perfcounts read-only and reads the
+// values in place: no system calls and no copies after the mmap().  The sampler never waits for the readers.
+//
+// The segment contains, in order (all integers little-endian):
+//   struct pls_header       magic, the ring geometry, section offsets, and the number of published samples
+//   series                  num_series struct pls_series: name (offset into the string table), scale, width, kind
+//   string table            NUL-terminated series names
+//   ring                    (cache-line aligned) sample i in record i%ring_samples at ring_offset + (i%ring_samples)*record_bytes:
+//                           a sequence number, then num_series raw values (the values of the sample store)
+//
+// Each record is a seqlock.  Before writing sample i into its record, perf_counters stores the odd sequence
+// number 2*i+1, and after writing it, the even sequence number 2*i+2 (with release semantics), then "published"
+// = i+1.  A reader of sample i loads the sequence number (pls_read_begin()), reads the values (pls_value()),
+// and loads the sequence number again (pls_read_end()): the values are consistent if it is 2*i+2 both times.
+// Sample i is only overwritten by sample i+ring_samples, so a reader of the latest sample (published-1) has
+// ring_samples-1 sampling intervals to finish, and in practice never retries.  A counter rate needs two samples
+// (e.g., published-2 and published-1) and the width of the counter (it wraps at 2^width).
+//
+// The segment is created when the sampling starts (replacing a segment left by an earlier run, which its
+// readers keep until they unmap it), "closed" is set when the sampling stops, and the name is then removed.
+//
+#include <stdint.h>
+
+#define PLS_NAME "/perfcounts"
+#define PLS_MAGIC "PCLIVE\000\001"		// 8 bytes
+#define PLS_VERSION 1
+
+// series kinds
+#define PLS_COUNTER 0				// a counter: the delta per second is its rate
+#define PLS_GAUGE 1					// a value, e.g., pkg_temperature
+#define PLS_STATUS 2				// a status register, e.g., pkg_therm_status
+#define PLS_OTHER 3					// time stamps and multiplexed group numbers
+
+struct pls_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t header_bytes;			// sizeof(struct pls_header)
+	uint32_t num_series;
+	uint32_t ring_samples;
+	uint32_t tsc_ratio;				// TSC frequency / 100 MHz (TSC_ratio in the results file)
+	int32_t pid;					// of perf_counters
+	uint64_t period_ns;				// sampling interval
+	uint64_t series_offset;
+	uint64_t strings_offset;
+	uint64_t strings_bytes;
+	uint64_t ring_offset;
+	uint64_t record_bytes;			// a multiple of 64
+	uint64_t published;				// number of samples published
+	uint64_t closed;				// 1 once perf_counters has stopped sampling
+};
+
+struct pls_series {
+	uint32_t name;					// offset in the string table
+	int32_t scale;					// multiplier applied in the output file
+	uint32_t width;					// counter width in bits (64 for non-counters)
+	uint32_t kind;					// PLS_COUNTER, etc.
+};
+
+static inline const struct pls_series *pls_series(const struct pls_header *h, int k)
+{
+	return ((const struct pls_series *)((const char *)h + h->series_offset) + k);
+}
+
+static inline const char *pls_series_name(const struct pls_header *h, int k)
+{
+	return ((const char *)h + h->strings_offset + pls_series(h, k)->name);
+}
+
+// the record of sample "index": the sequence number, then the values
+static inline uint64_t *pls_record(const struct pls_header *h, uint64_t index)
+{
+	return ((uint64_t *)((char *)h + h->ring_offset + (index % h->ring_samples) * h->record_bytes));
+}
+
+// the number of samples published so far (the latest sample is published-1)
+static inline uint64_t pls_published(const struct pls_header *h)
+{
+	return (__atomic_load_n(&h->published, __ATOMIC_ACQUIRE));
+}
+
+// the start of a read of sample "index": its sequence number, or 0 if its record does not hold it (not yet
+// published, being written, or overwritten by a later sample)
+static inline uint64_t pls_read_begin(const struct pls_header *h, uint64_t index)
+{
+	uint64_t seq = __atomic_load_n(pls_record(h, index), __ATOMIC_ACQUIRE);
+
+	return ((seq == 2 * index + 2) ? seq : 0);
+}
+
+static inline uint64_t pls_value(const struct pls_header *h, uint64_t index, int column)
+{
+	return (__atomic_load_n(pls_record(h, index) + 1 + column, __ATOMIC_RELAXED));
+}
+
+// 1 if the values of sample "index" read since pls_read_begin() (which returned "seq") are consistent
+static inline int pls_read_end(const struct pls_header *h, uint64_t index, uint64_t seq)
+{
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	return (__atomic_load_n(pls_record(h, index), __ATOMIC_RELAXED) == seq);
+}
@@ -0,0 +1,254 @@
+// Constant-memory streaming statistics of a series of values -- see perfcounts_stats.h
+//
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "perfcounts_stats.h"
+
+const char *pst_kind_name[NUM_PST_KINDS] = { "rate", "gauge", "status" };
+
+void pst_init(struct pst_summary *s, int kind)
+{
+	memset(s, 0, sizeof(*s));
+	s->kind = kind;
+}
+
+// ==================================================================================================================
+// Sketch: a sliding window of PST_BUCKETS logarithmic buckets
+
+static inline int bucket_index(double x)
+{
+	return ((int)ceil(log(x) / log(PST_GAMMA)));
+}
+
+static inline double bucket_value(int k)
+{
+	return (2.0 * pow(PST_GAMMA, k) / (PST_GAMMA + 1.0));		// (the point of least relative error in the bucket)
+}
+
+// moves the window up by "shift" buckets, counting the buckets that fall off the bottom in the new lowest one
+static void slide_up(struct pst_summary *s, int shift)
+{
+	uint64_t low = 0;
+	int i;
+
+	if (shift >= PST_BUCKETS) {
+		for (i=0; i<PST_BUCKETS; i++) low += s->bucket[i];
+		memset(s->bucket, 0, sizeof(s->bucket));
+	} else {
+		for (i=0; i<=shift; i++) low += s->bucket[i];
+		memmove(s->bucket, s->bucket + shift, (PST_BUCKETS - shift) * sizeof(uint32_t));
+		memset(s->bucket + PST_BUCKETS - shift, 0, shift * sizeof(uint32_t));
+	}
+	s->bucket[0] = low;
+	s->offset += shift;
+}
+
+static void add_bucket(struct pst_summary *s, int k, uint32_t n)
+{
+	int top, room;
+
+	if (!s->used) {
+		s->offset = k - PST_BUCKETS/2;
+		s->used = 1;
+	}
+	if (k >= s->offset + PST_BUCKETS) slide_up(s, k - (s->offset + PST_BUCKETS - 1));
+	if (k < s->offset) {
+		// slide down as far as the empty buckets at the top allow, then count the rest in the lowest bucket
+		for (top=PST_BUCKETS-1; (top >= 0) && (s->bucket[top] == 0); top--) ;
+		room = PST_BUCKETS - 1 - top;
+		if (room > s->offset - k) room = s->offset - k;
+		if (room > 0) {
+			memmove(s->bucket + room, s->bucket, (PST_BUCKETS - room) * sizeof(uint32_t));
+			memset(s->bucket, 0, room * sizeof(uint32_t));
+			s->offset -= room;
+		}
+		if (k < s->offset) k = s->offset;
+	}
+	s->bucket[k - s->offset] += n;
+}
+
+// ==================================================================================================================
+
+void pst_add(struct pst_summary *s, double x)
+{
+	double delta;
+
+	if (!isfinite(x)) {
+		s->nans++;
+		return;
+	}
+	if (s->count == 0) {
+		s->min = s->max = x;
+	} else {
+		if (x < s->min) s->min = x;
+		if (x > s->max) s->max = x;
+	}
+	s->count++;
+	delta = x - s->mean;
+	s->mean += delta / s->count;
+	s->m2 += delta * (x - s->mean);
+	if (x != 0.0) s->nonzero++;
+	if (x > 0.0) add_bucket(s, bucket_index(x), 1);
+	else s->zero++;
+}
+
+void pst_add_bits(struct pst_summary *s, uint64_t value)
+{
+	int b;
+
+	for (b=0; value!=0; b++, value>>=1) s->bit_count[b] += (value & 1);
+}
+
+void pst_merge(struct pst_summary *s, const struct pst_summary *t)
+{
+	double delta;
+	uint64_t n;
+	int i;
+
+	if (t->count > 0) {
+		n = s->count + t->count;
+		delta = t->mean - s->mean;
+		s->m2 += t->m2 + delta * delta * ((double)s->count * t->count / n);
+		s->mean += delta * t->count / n;
+		if ((s->count == 0) || (t->min < s->min)) s->min = t->min;
+		if ((s->count == 0) || (t->max > s->max)) s->max = t->max;
+		s->count = n;
+	}
+	s->nans += t->nans;
+	s->nonzero += t->nonzero;
+	s->zero += t->zero;
+	for (i=0; i<64; i++) s->bit_count[i] += t->bit_count[i];
+	// (the highest buckets first, so the window slides up at most once)
+	for (i=PST_BUCKETS-1; i>=0; i--) if (t->bucket[i] != 0) add_bucket(s, t->offset + i, t->bucket[i]);
+}
+
+double pst_quantile(const struct pst_summary *s, double q)
+{
+	double rank, cumulative, value;
+	int i;
+
+	if (s->count == 0) return (NAN);
+	rank = q * (s->count - 1);
+	cumulative = s->zero;
+	value = 0.0;
+	if (cumulative <= rank) {
+		for (i=0; i<PST_BUCKETS; i++) {
+			cumulative += s->bucket[i];
+			if (cumulative > rank) break;
+		}
+		value = bucket_value(s->offset + ((i < PST_BUCKETS) ? i : PST_BUCKETS - 1));
+	}
+	return (fmin(fmax(value, s->min), s->max));
+}
+
+// ==================================================================================================================
+// One line of Lua per summary
+
+static void put_number(FILE *fp, const char *key, double x)
+{
+	if (isfinite(x)) fprintf(fp,", %s = %.12g",key,x);
+	else fprintf(fp,", %s = 0/0",key);
+}
+
+void pst_write(FILE *fp, const char *name, const struct pst_summary *s)
+{
+	int i, first, last;
+
+	fprintf(fp,"stats['%s'] = { kind = \"%s\", count = %lu, nans = %lu",name,pst_kind_name[s->kind],s->count,s->nans);
+	put_number(fp, "mean", s->mean);
+	put_number(fp, "variance", (s->count > 0) ? s->m2 / s->count : 0.0);
+	put_number(fp, "min", s->min);
+	put_number(fp, "max", s->max);
+	put_number(fp, "p50", pst_quantile(s, 0.50));
+	put_number(fp, "p90", pst_quantile(s, 0.90));
+	put_number(fp, "p99", pst_quantile(s, 0.99));
+	fprintf(fp,", nonzero = %lu, zero = %lu",s->nonzero,s->zero);
+	for (first=0; (first < PST_BUCKETS) && (s->bucket[first] == 0); first++) ;
+	for (last=PST_BUCKETS-1; (last >= first) && (s->bucket[last] == 0); last--) ;
+	fprintf(fp,", offset = %d, buckets = {",(first <= last) ? s->offset + first : 0);
+	for (i=first; i<=last; i++) fprintf(fp,"%s%u",(i > first) ? "," : "",s->bucket[i]);
+	fprintf(fp,"}");
+	if (s->kind == PST_STATUS) {
+		fprintf(fp,", bits = {");
+		for (i=0, first=1; i<64; i++) {
+			if (s->bit_count[i] == 0) continue;
+			fprintf(fp,"%s[%d]=%u",first ? "" : ",",i,s->bit_count[i]);
+			first = 0;
+		}
+		fprintf(fp,"}");
+	}
+	fprintf(fp," }\n");
+}
+
+static const char *field(const char *line, const char *key)
+{
+	char pattern[40];
+	const char *p;
+
+	sprintf(pattern, " %s = ", key);
+	p = strstr(line, pattern);
+	return ((p != NULL) ? p + strlen(pattern) : NULL);
+}
+
+static double number_field(const char *line, const char *key)
+{
+	const char *p = field(line, key);
+
+	if ((p == NULL) || (strncmp(p, "0/0", 3) == 0)) return (NAN);
+	return (strtod(p, NULL));
+}
+
+int pst_parse(const char *line, char *name, int name_len, struct pst_summary *s)
+{
+	const char *p, *end;
+	char *next;
+	int k, len;
+	double variance;
+
+	if (strncmp(line, "stats['", 7) != 0) return (-1);
+	end = strstr(line + 7, "'] = {");
+	if ((end == NULL) || ((p = field(end, "kind")) == NULL)) return (-1);
+	len = end - (line + 7);
+	if (len >= name_len) len = name_len - 1;
+	memcpy(name, line + 7, len);
+	name[len] = '\0';
+	for (k=0; k<NUM_PST_KINDS; k++) {
+		if ((strncmp(p + 1, pst_kind_name[k], strlen(pst_kind_name[k])) == 0) && (p[1 + strlen(pst_kind_name[k])] == '"')) break;
+	}
+	if (k == NUM_PST_KINDS) return (-1);
+	pst_init(s, k);
+	s->count = strtoul(field(end, "count") ? field(end, "count") : "0", NULL, 10);
+	s->nans = strtoul(field(end, "nans") ? field(end, "nans") : "0", NULL, 10);
+	s->nonzero = strtoul(field(end, "nonzero") ? field(end, "nonzero") : "0", NULL, 10);
+	s->zero = strtoul(field(end, "zero") ? field(end, "zero") : "0", NULL, 10);
+	s->mean = number_field(end, "mean");
+	variance = number_field(end, "variance");
+	s->min = number_field(end, "min");
+	s->max = number_field(end, "max");
+	if (s->count == 0) s->mean = s->min = s->max = variance = 0.0;
+	if (!isfinite(s->mean) || !isfinite(variance) || !isfinite(s->min) || !isfinite(s->max)) return (-1);
+	s->m2 = variance * s->count;
+	p = field(end, "offset");
+	s->offset = (p != NULL) ? atoi(p) : 0;
+	p = field(end, "buckets");
+	if ((p == NULL) || (*p != '{')) return (-1);
+	for (k=0, p++; (k < PST_BUCKETS) && (*p != '}'); k++) {
+		s->bucket[k] = strtoul(p, &next, 10);
+		if (next == p) return (-1);
+		p = (*next == ',') ? next + 1 : next;
+	}
+	s->used = (k > 0);
+	p = field(end, "bits");
+	if ((p != NULL) && (*p == '{')) {
+		for (p++; *p == '['; ) {
+			k = strtol(p + 1, &next, 10);
+			if ((k < 0) || (k > 63) || (strncmp(next, "]=", 2) != 0)) return (-1);
+			s->bit_count[k] = strtoul(next + 2, &next, 10);
+			p = (*next == ',') ? next + 1 : next;
+		}
+	}
+	return (0);
+}
@@ -0,0 +1,45 @@
+// Constant-memory streaming statistics of a series of values (perfcounts_stats.c)
+//
+// A pst_summary holds the count, mean and variance (Welford), minimum, maximum, the number of non-zero values,
+// for status registers the number of values with each bit set, and a quantile sketch, in a fixed ~2.4 KB however
+// many values are added.  The sketch is a histogram of logarithmic buckets: bucket k counts the positive values
+// in (gamma^(k-1), gamma^k], so a quantile is within (gamma-1)/(gamma+1) = 2% of the true value.  It keeps a
+// window of PST_BUCKETS consecutive buckets (a range of 1.04^512 = 5 x 10^8), which slides up to follow the
+// largest values: the values below the window are counted in its lowest bucket, so the high quantiles stay
+// accurate.  Values <= 0 are counted separately, and NaN or infinite values (e.g., a ratio of zero deltas) only
+// in "nans".
+//
+// Summaries with the same gamma merge exactly (pst_merge()), so the summaries of many nodes, or of several
+// periods of one node, combine into the summary of all of their values.  pst_write() writes a summary as one
+// line of Lua, stats['name'] = { ... }, and pst_parse() reads it back (perfcounts_stats_merge merges such files).
+//
+#include <stdio.h>
+#include <stdint.h>
+
+#define PST_BUCKETS 512
+#define PST_GAMMA 1.04
+
+enum pst_kind { PST_RATE, PST_GAUGE, PST_STATUS, NUM_PST_KINDS };
+extern const char *pst_kind_name[NUM_PST_KINDS];	// "rate" (the delta per second of a counter), "gauge", "status"
+
+struct pst_summary {
+	int kind;
+	uint64_t count;				// values added (not counting NaN)
+	uint64_t nans;
+	double mean, m2;			// running mean and sum of squared deviations
+	double min, max;
+	uint64_t nonzero;
+	uint32_t bit_count[64];		// PST_STATUS: the number of values with each bit set
+	int used;					// the sketch window is placed (by the first positive value)
+	int32_t offset;				// bucket[i] is bucket offset+i
+	uint64_t zero;				// values <= 0
+	uint32_t bucket[PST_BUCKETS];
+};
+
+void pst_init(struct pst_summary *s, int kind);
+void pst_add(struct pst_summary *s, double x);
+void pst_add_bits(struct pst_summary *s, uint64_t value);		// a status register value (also added as a value)
+void pst_merge(struct pst_summary *s, const struct pst_summary *t);
+double pst_quantile(const struct pst_summary *s, double q);		// NaN if empty
+void pst_write(FILE *fp, const char *name, const struct pst_summary *s);
+int pst_parse(const char *line, char *name, int name_len, struct pst_summary *s);	// 0, or -1 if not a summary line
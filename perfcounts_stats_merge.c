@@ -0,0 +1,171 @@
+// perfcounts_stats_merge -- merge and summarize the streaming statistics files of perf_counters -s
+//
+//   perfcounts_stats_merge [-o merged.perfcounts.stats] [-p pattern] node1.perfcounts.stats node2.perfcounts.stats ...
+//
+// Merges the summaries of the same series (or metric) from all of the files -- several nodes of a job, or
+// several runs of one node -- with pst_merge(), and prints one line per series: the kind, the number of
+// intervals, mean, standard deviation, min, p50, p90, p99, max, and the percentage of non-zero intervals (for
+// the status registers, e.g., pkg_core_perf_limit_reasons, the fraction of intervals with any bit set, and the
+// bits that were set with their percentages).  "-p" only prints the series whose names contain "pattern".
+// "-o" writes the merged summaries as a statistics file, which can be merged again.
+//
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <unistd.h>
+
+#include "perfcounts_stats.h"
+
+#define MAX_LINE 16384
+#define MAX_NAME 512
+
+struct entry {
+	char *name;
+	struct pst_summary summary;
+};
+
+struct entry *entries;
+int num_entries, max_entries;
+int *hash_table;				// entry index + 1, 0 for an empty slot
+uint64_t hash_mask;
+
+static uint64_t hash_name(const char *name)
+{
+	uint64_t h = 14695981039346656037UL;		// FNV-1a
+
+	while (*name) h = (h ^ (uint8_t)*name++) * 1099511628211UL;
+	return (h);
+}
+
+static void rehash()
+{
+	uint64_t h;
+	int k;
+
+	free(hash_table);
+	hash_mask = 1023;
+	while (hash_mask < 2 * (uint64_t)max_entries) hash_mask = 2 * hash_mask + 1;
+	hash_table = calloc(hash_mask + 1, sizeof(int));
+	for (k=0; k<num_entries; k++) {
+		for (h = hash_name(entries[k].name) & hash_mask; hash_table[h] != 0; h = (h + 1) & hash_mask) ;
+		hash_table[h] = k + 1;
+	}
+}
+
+// the entry of "name", added (empty, of "kind") if it is new
+static struct entry *find_entry(const char *name, int kind)
+{
+	uint64_t h;
+	int k;
+
+	for (h = hash_name(name) & hash_mask; hash_table[h] != 0; h = (h + 1) & hash_mask) {
+		if (strcmp(entries[hash_table[h] - 1].name, name) == 0) return (&entries[hash_table[h] - 1]);
+	}
+	if (num_entries == max_entries) {
+		max_entries = max_entries ? 2 * max_entries : 1024;
+		entries = realloc(entries, max_entries * sizeof(struct entry));
+		if (entries == NULL) {
+			fprintf(stderr,"ERROR: unable to allocate %d summaries\n",max_entries);
+			exit(1);
+		}
+	}
+	k = num_entries++;
+	entries[k].name = strdup(name);
+	pst_init(&entries[k].summary, kind);
+	if (2 * (uint64_t)num_entries > hash_mask) {
+		rehash();
+	} else {
+		hash_table[h] = k + 1;
+	}
+	return (&entries[k]);
+}
+
+int main(int argc, char *argv[])
+{
+	struct pst_summary summary, *s;
+	struct entry *entry;
+	char *line, name[MAX_NAME], *output_path, *pattern;
+	FILE *fp;
+	long intervals;
+	int c, f, k, b, num_files, first;
+
+	output_path = pattern = NULL;
+	while ((c = getopt(argc, argv, "o:p:")) != -1) {
+		switch (c) {
+			case 'o':
+				output_path = optarg;
+				break;
+			case 'p':
+				pattern = optarg;
+				break;
+			default:
+				fprintf(stderr,"Usage: %s [-o merged.perfcounts.stats] [-p pattern] files.perfcounts.stats ...\n",argv[0]);
+				exit(1);
+		}
+	}
+	if (optind >= argc) {
+		fprintf(stderr,"Usage: %s [-o merged.perfcounts.stats] [-p pattern] files.perfcounts.stats ...\n",argv[0]);
+		exit(1);
+	}
+
+	line = malloc(MAX_LINE);
+	hash_mask = 1023;
+	hash_table = calloc(hash_mask + 1, sizeof(int));
+	intervals = 0;
+	num_files = 0;
+	for (f=optind; f<argc; f++) {
+		fp = fopen(argv[f], "r");
+		if (fp == NULL) {
+			fprintf(stderr,"ERROR: unable to open %s, skipped\n",argv[f]);
+			continue;
+		}
+		while (fgets(line, MAX_LINE, fp) != NULL) {
+			if (strncmp(line, "stats_intervals = ", 18) == 0) intervals += atol(line + 18);
+			if (strncmp(line, "stats_gamma = ", 14) == 0) {
+				if (strtod(line + 14, NULL) != PST_GAMMA) {
+					fprintf(stderr,"ERROR: %s has sketches of gamma %s, not %g\n",argv[f],line+14,PST_GAMMA);
+					exit(1);
+				}
+			}
+			if (pst_parse(line, name, MAX_NAME, &summary) != 0) continue;
+			entry = find_entry(name, summary.kind);
+			pst_merge(&entry->summary, &summary);
+		}
+		fclose(fp);
+		num_files++;
+	}
+
+	printf("-- %d files, %ld intervals, %d series\n",num_files,intervals,num_entries);
+	printf("%-56s %-6s %10s %12s %12s %12s %12s %12s %12s %12s %8s\n","series","kind","count","mean","stddev","min","p50",
+		"p90","p99","max","nonzero%");
+	for (k=0; k<num_entries; k++) {
+		s = &entries[k].summary;
+		if ((pattern != NULL) && (strstr(entries[k].name, pattern) == NULL)) continue;
+		printf("%-56s %-6s %10lu %12.5g %12.5g %12.5g %12.5g %12.5g %12.5g %12.5g %8.3f",entries[k].name,pst_kind_name[s->kind],
+			s->count,s->mean,(s->count > 0) ? sqrt(s->m2 / s->count) : 0.0,s->min,pst_quantile(s, 0.50),pst_quantile(s, 0.90),
+			pst_quantile(s, 0.99),s->max,(s->count > 0) ? 100.0 * s->nonzero / s->count : 0.0);
+		if (s->kind == PST_STATUS) {
+			for (b=0, first=1; b<64; b++) {
+				if (s->bit_count[b] == 0) continue;
+				printf("%s bit%d:%.3f%%",first ? "  " : "",b,100.0 * s->bit_count[b] / s->count);
+				first = 0;
+			}
+		}
+		printf("\n");
+	}
+
+	if (output_path != NULL) {
+		fp = fopen(output_path, "w");
+		if (fp == NULL) {
+			fprintf(stderr,"ERROR: unable to create %s\n",output_path);
+			exit(1);
+		}
+		fprintf(fp,"stats_intervals = %ld\n",intervals);
+		fprintf(fp,"stats_gamma = %g\n",PST_GAMMA);
+		fprintf(fp,"stats = {}\n");
+		for (k=0; k<num_entries; k++) pst_write(fp, entries[k].name, &entries[k].summary);
+		fclose(fp);
+	}
+	return (0);
+}
@@ -0,0 +1,72 @@
+// Crash-safe sample store file for perf_counters (".perfcounts.store" files, "-M" option)
+//
+// With -M, the chunks of the sample store are MAP_SHARED mappings of a file instead of anonymous memory, so
+// the samples are in the page cache as soon as they are read, and survive the perf_counters process being
+// killed (OOM killer, scheduler SIGKILL, a crash).  They reach the disk with the normal writeback of dirty
+// pages, so a node crash only loses the last few seconds of writeback.
+//
+// The file contains, in order (all integers little-endian):
+//   struct pcs_header       magic, layout of the store, section offsets, and the number of committed samples
+//   series                  num_series struct pcs_series: name (offset into the string table), scale, width
+//   output items            num_items struct pcs_item: the lines of one sample of the Lua results file
+//   string table            NUL-terminated series names and output line prefixes
+//   preamble                the beginning of the Lua results file (units, TSC_ratio, etc.), preamble_bytes long
+//   data                    (page-aligned) chunk k of the store at data_offset + k*chunk_bytes, in the layout
+//                           of the store: series-major  value(c,i) at ((c*chunk_samples) + i%chunk_samples)*8
+//                                         sample-major  value(c,i) at ((i%chunk_samples)*record_len + c)*8
+//                           Each chunk is allocated (fallocate) and mapped when the store grows into it.
+//
+// "committed" is the number of complete samples, stored (with release semantics) after each sample, so
+// samples 0..committed-1 are always consistent.  "complete" is set once the results files have been written.
+// perfcounts_recover writes the Lua results file of the committed samples of a store file.
+//
+#include <stdint.h>
+
+#define PCS_MAGIC "PCSTORE\001"		// 8 bytes
+#define PCS_VERSION 1
+
+// output item kinds -- the same values as TEXT_UNSIGNED, etc., in perf_counters.c
+#define PCS_UNSIGNED 0				// value*scale, as %lu
+#define PCS_SIGNED 1				// value, as %ld
+#define PCS_HEX 2					// value, as 0x%lx
+#define PCS_MUX_ADD 3				// (no output) add the 48-bit delta of column to total[total + value of group_column]
+#define PCS_MUX_TOTAL 4				// total[total], as %lu
+
+struct pcs_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t header_bytes;			// sizeof(struct pcs_header)
+	uint32_t layout;				// 0 series-major, 1 sample-major
+	uint32_t num_series;
+	uint32_t record_len;			// values per record (sample-major layout)
+	uint32_t chunk_samples;
+	uint64_t chunk_bytes;			// a multiple of the page size
+	uint32_t num_items;
+	uint32_t num_totals;			// number of multiplexed totals
+	uint64_t series_offset;
+	uint64_t items_offset;
+	uint64_t strings_offset;
+	uint64_t strings_bytes;
+	uint64_t preamble_offset;
+	uint64_t preamble_bytes;
+	uint64_t data_offset;
+	uint64_t committed;				// number of complete samples
+	uint64_t complete;				// 1 once perf_counters has written its results files
+};
+
+struct pcs_series {
+	uint32_t name;					// offset in the string table
+	int32_t scale;					// multiplier applied in the output file
+	uint32_t width;					// counter width in bits (64 for non-counters)
+	uint32_t reserved;
+};
+
+// a line of the Lua results file is the prefix, the sample index, "] = ", and the value
+struct pcs_item {
+	uint32_t prefix;				// offset in the string table, e.g., core_counts[3]["INST_RETIRED.ANY"][
+	int32_t kind;					// PCS_UNSIGNED, etc.
+	int32_t column;
+	int32_t scale;
+	int32_t group_column;			// PCS_MUX_ADD: the series holding the active group
+	int32_t total;					// PCS_MUX_ADD: the total of group 0, PCS_MUX_TOTAL: the total
+};
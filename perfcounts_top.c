@@ -0,0 +1,142 @@
+// perfcounts_top -- print the latest interval of a running perf_counters -L, from its shared-memory segment
+//
+//   perfcounts_top [-i seconds] [-n count] [pattern ...]
+//
+// Maps the segment published by "perf_counters -L N" (see perfcounts_shm.h) read-only, and prints the series
+// whose names contain one of the patterns (all of them without a pattern) over the interval between the last two
+// samples: the delta per second of a counter (wrap-corrected for its width, times its scale), and the value of a
+// gauge or a status register.  "-i" prints them again every "seconds" (default: once), until perf_counters stops
+// or "-n" updates have been printed.  The samples are read in place with the seqlock of their records, so the
+// readers cost perf_counters nothing.
+//
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "perfcounts_shm.h"
+
+// sample "index" into value[], 0 if consistent, -1 if it is no longer in the ring
+static int read_sample(const struct pls_header *h, uint64_t index, uint64_t *value)
+{
+	uint64_t seq;
+	int k;
+
+	do {
+		seq = pls_read_begin(h, index);
+		if (seq == 0) return (-1);
+		for (k=0; k<(int)h->num_series; k++) value[k] = pls_value(h, index, k);
+	} while (!pls_read_end(h, index, seq));
+	return (0);
+}
+
+int main(int argc, char *argv[])
+{
+	const struct pls_header *h;
+	const struct pls_series *s;
+	struct stat st;
+	uint64_t *before, *after, published, delta;
+	double interval, dt;
+	long updates, max_updates;
+	char *selected;
+	int c, fd, k, p, tsc;
+
+	interval = 0.0;
+	max_updates = 0;
+	while ((c = getopt(argc, argv, "i:n:")) != -1) {
+		switch (c) {
+			case 'i':
+				interval = atof(optarg);
+				break;
+			case 'n':
+				max_updates = atol(optarg);
+				break;
+			default:
+				fprintf(stderr,"Usage: %s [-i seconds] [-n count] [pattern ...]\n",argv[0]);
+				exit(1);
+		}
+	}
+
+	fd = shm_open(PLS_NAME, O_RDONLY, 0);
+	if (fd == -1) {
+		fprintf(stderr,"ERROR %s when trying to open the shared-memory segment %s (is perf_counters running with -L?)\n",
+			strerror(errno),PLS_NAME);
+		exit(1);
+	}
+	if (fstat(fd, &st) != 0) {
+		fprintf(stderr,"ERROR %s when trying to get the size of %s\n",strerror(errno),PLS_NAME);
+		exit(1);
+	}
+	h = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	if (h == MAP_FAILED) {
+		fprintf(stderr,"ERROR %s when trying to map %s\n",strerror(errno),PLS_NAME);
+		exit(1);
+	}
+	close(fd);
+	if ((st.st_size < (off_t)sizeof(struct pls_header)) || (memcmp(h->magic, PLS_MAGIC, sizeof(h->magic)) != 0)) {
+		fprintf(stderr,"ERROR: %s is not (yet) a perf_counters segment\n",PLS_NAME);
+		exit(1);
+	}
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);			// (the header is complete once the magic is set)
+	if ((h->version != PLS_VERSION) || (h->header_bytes != sizeof(struct pls_header))) {
+		fprintf(stderr,"ERROR: %s has version %u, expected %d\n",PLS_NAME,h->version,PLS_VERSION);
+		exit(1);
+	}
+
+	tsc = -1;
+	selected = malloc(h->num_series);
+	for (k=0; k<(int)h->num_series; k++) {
+		if (strcmp(pls_series_name(h, k), "tsc") == 0) tsc = k;
+		selected[k] = (optind == argc);
+		for (p=optind; p<argc; p++) if (strstr(pls_series_name(h, k), argv[p]) != NULL) selected[k] = 1;
+	}
+	if (tsc < 0) {
+		fprintf(stderr,"ERROR: %s has no tsc series\n",PLS_NAME);
+		exit(1);
+	}
+	before = malloc(h->num_series * sizeof(uint64_t));
+	after = malloc(h->num_series * sizeof(uint64_t));
+
+	for (updates=0; ; updates++) {
+		// the last two samples (read again if perf_counters has overwritten them in the meantime)
+		for (;;) {
+			published = pls_published(h);
+			if ((published >= 2) && (read_sample(h, published-2, before) == 0) && (read_sample(h, published-1, after) == 0)) break;
+			if (__atomic_load_n(&h->closed, __ATOMIC_ACQUIRE) && (pls_published(h) == published)) {
+				fprintf(stderr,"ERROR: perf_counters (pid %d) stopped before publishing two samples\n",h->pid);
+				exit(1);
+			}
+			usleep(1000);
+		}
+		dt = (after[tsc] - before[tsc]) / (h->tsc_ratio * 1.0e8);
+		printf("-- sample %lu, interval %.6f s, pid %d%s\n",published-1,dt,h->pid,
+			__atomic_load_n(&h->closed, __ATOMIC_ACQUIRE) ? " (stopped)" : "");
+		for (k=0; k<(int)h->num_series; k++) {
+			if (!selected[k]) continue;
+			s = pls_series(h, k);
+			switch (s->kind) {
+				case PLS_COUNTER:
+					delta = after[k] - before[k];
+					if (s->width < 64) delta &= (1UL << s->width) - 1;
+					printf("%-56s %16.6g /s\n",pls_series_name(h, k),(double)delta * s->scale / dt);
+					break;
+				case PLS_GAUGE:
+					printf("%-56s %16.6g\n",pls_series_name(h, k),(double)after[k] * s->scale);
+					break;
+				case PLS_STATUS:
+					printf("%-56s %#16lx\n",pls_series_name(h, k),after[k]);
+					break;
+				default:
+					printf("%-56s %16lu\n",pls_series_name(h, k),after[k]);
+			}
+		}
+		fflush(stdout);
+		if ((interval <= 0.0) || (updates + 1 == max_updates) || __atomic_load_n(&h->closed, __ATOMIC_ACQUIRE)) break;
+		usleep((useconds_t)(interval * 1.0e6));
+	}
+	return (0);
+}